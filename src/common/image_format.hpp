@@ -0,0 +1,46 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#pragma once
+
+#include "common/common_types.hpp"
+
+// Layout of a MINA executable image as produced by smasm.
+//
+// An ImageHeader is followed by segment_count SegmentHeaders. Segment contents
+// are stored at page-aligned file offsets. Segments with mem_size > file_size
+// are zero-filled past the end of their file contents.
+
+namespace stamina::image {
+
+inline constexpr char magic[4] = {'M', 'I', 'N', 'A'};
+inline constexpr u32 version = 1;
+inline constexpr u32 page_size = 0x1000;
+
+enum SegmentFlags : u32 {
+    Read = 1 << 0,
+    Write = 1 << 1,
+    Execute = 1 << 2,
+};
+
+struct ImageHeader {
+    char magic[4];
+    u32 version;
+    u32 entry;
+    u32 segment_count;
+};
+static_assert(sizeof(ImageHeader) == 16);
+
+struct SegmentHeader {
+    char name[16];
+    u32 vaddr;
+    u32 file_offset;
+    u32 file_size;
+    u32 mem_size;
+    u32 flags;
+    u32 reserved[3];
+};
+static_assert(sizeof(SegmentHeader) == 48);
+
+}
@@ -0,0 +1,205 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#include <fmt/format.h>
+#include "common/assert.hpp"
+#include "common/instruction.hpp"
+#include "common/string_util.hpp"
+
+namespace stamina {
+
+namespace {
+
+constexpr s32 sign_extend16(u32 value) {
+    return static_cast<s32>(static_cast<s16>(static_cast<u16>(value)));
+}
+
+}
+
+RegisterEffects register_effects(const Instruction& inst) {
+    const u16 rd = u16(1) << inst.rd;
+    const u16 rs = u16(1) << inst.rs;
+    const u16 rt = u16(1) << inst.rt;
+    const u16 lr = u16(1) << reg_lr;
+    const u16 sp = u16(1) << reg_sp;
+
+    switch (inst.opcode) {
+    case Opcode::NOP:
+        return {};
+    case Opcode::PCADDI:
+    case Opcode::MOVI:
+    case Opcode::MFRC:
+    case Opcode::MFRU:
+        return {0, rd};
+    case Opcode::MOVL:
+    case Opcode::MOVU:
+        return {rd, rd};
+    case Opcode::MTI:
+    case Opcode::MFT:
+        return {rd, rd, true, false};
+    case Opcode::MT:
+    case Opcode::MF:
+        return {u16(rd | rs), rd, true, false};
+    case Opcode::MTOC:
+    case Opcode::MTOU:
+        return {rs, 0};
+    case Opcode::RBRA:
+        return {rd, 0};
+    case Opcode::RCALL:
+        return {rd, lr};
+    case Opcode::RET:
+        return {lr, 0};
+    case Opcode::ROBRA:
+        return {u16(rd | rs), 0};
+    case Opcode::ROCALL:
+        return {u16(rd | rs), lr};
+    case Opcode::ST:
+    case Opcode::STH:
+    case Opcode::STB:
+        return {u16(rd | rs), 0};
+    case Opcode::STC:
+        return {u16(rd | rs), 0, false, true};
+    case Opcode::RST:
+    case Opcode::RSTH:
+    case Opcode::RSTB:
+        return {u16(rd | rs | rt), 0};
+    case Opcode::POP:
+        return {sp, u16(rd | sp)};
+    case Opcode::PUSH:
+        return {u16(rd | sp), sp};
+    default:
+        break;
+    }
+
+    const auto& i = info(inst.opcode);
+    if (i.category == Category::Compare) {
+        return {i.format == Format::I ? rd : u16(rd | rs), 0, false, true};
+    }
+
+    switch (operand_shape(inst.opcode)) {
+    case OperandShape::RR:
+    case OperandShape::RRI:
+        return {rs, rd};
+    case OperandShape::RRR:
+    case OperandShape::RRRI:
+        return {u16(rs | rt), rd};
+    default:
+        break;
+    }
+    UNREACHABLE();
+}
+
+Opcode compare_immediate_form(Opcode op) {
+    const auto& i = info(op);
+    ASSERT(i.category == Category::Compare);
+    return static_cast<Opcode>(opcode_decode_table[(i.major << 4) | (i.minor & 0b0111)]);
+}
+
+std::optional<Opcode> opcode_from_name(std::string_view name) {
+    for (size_t i = 0; i < num_opcodes; i++) {
+        if (iequal(opcode_info[i].name, name)) {
+            return static_cast<Opcode>(i);
+        }
+    }
+    return std::nullopt;
+}
+
+std::optional<u8> register_from_name(std::string_view name) {
+    if (iequal(name, "sp")) {
+        return reg_sp;
+    }
+    if (iequal(name, "lr")) {
+        return reg_lr;
+    }
+    if (name.size() < 2 || name.size() > 3 || (name[0] != 'r' && name[0] != 'R')) {
+        return std::nullopt;
+    }
+
+    unsigned value = 0;
+    for (const char c : name.substr(1)) {
+        if (c < '0' || c > '9') {
+            return std::nullopt;
+        }
+        value = value * 10 + (c - '0');
+    }
+    if (value >= num_gprs || (name.size() == 3 && name[1] == '0')) {
+        return std::nullopt;
+    }
+    return static_cast<u8>(value);
+}
+
+u32 encode(const Instruction& inst) {
+    const auto& i = info(inst.opcode);
+    u32 word = (u32{i.major} << 28) | (u32{i.minor} << 24) | (u32{inst.rd} << 20);
+
+    switch (i.format) {
+    case Format::I:
+        word |= (u32{inst.rs} << 16) | (static_cast<u32>(inst.imm) & 0xFFFF);
+        break;
+    case Format::S:
+        word |= (u32{inst.rs} << 16) | (u32{inst.rt} << 12);
+        break;
+    case Format::M:
+        word |= static_cast<u32>(inst.imm) & 0xFFFF;
+        break;
+    case Format::F:
+        word |= (u32{inst.rs} << 16) | (u32{inst.rt} << 12) | (static_cast<u32>(inst.imm) & 0x1F);
+        break;
+    }
+    return word;
+}
+
+std::optional<Instruction> decode(u32 word) {
+    const u8 index = opcode_decode_table[word >> 24];
+    if (index == invalid_opcode_index) {
+        return std::nullopt;
+    }
+
+    Instruction inst;
+    inst.opcode = static_cast<Opcode>(index);
+    inst.rd = (word >> 20) & 0xF;
+
+    switch (info(inst.opcode).format) {
+    case Format::I:
+        inst.rs = (word >> 16) & 0xF;
+        inst.imm = has_signed_immediate(inst.opcode) ? sign_extend16(word) : static_cast<s32>(word & 0xFFFF);
+        break;
+    case Format::S:
+        inst.rs = (word >> 16) & 0xF;
+        inst.rt = (word >> 12) & 0xF;
+        break;
+    case Format::M:
+        inst.imm = static_cast<s32>(word & 0xFFFF);
+        break;
+    case Format::F:
+        inst.rs = (word >> 16) & 0xF;
+        inst.rt = (word >> 12) & 0xF;
+        inst.imm = static_cast<s32>(word & 0x1F);
+        break;
+    }
+    return inst;
+}
+
+std::string disassemble(const Instruction& inst) {
+    const auto name = info(inst.opcode).name;
+    switch (operand_shape(inst.opcode)) {
+    case OperandShape::None:
+        return std::string{name};
+    case OperandShape::R:
+        return fmt::format("{} r{}", name, inst.rd);
+    case OperandShape::RI:
+        return fmt::format("{} r{}, {}", name, inst.rd, inst.imm);
+    case OperandShape::RR:
+        return fmt::format("{} r{}, r{}", name, inst.rd, inst.rs);
+    case OperandShape::RRI:
+        return fmt::format("{} r{}, r{}, {}", name, inst.rd, inst.rs, inst.imm);
+    case OperandShape::RRR:
+        return fmt::format("{} r{}, r{}, r{}", name, inst.rd, inst.rs, inst.rt);
+    case OperandShape::RRRI:
+        return fmt::format("{} r{}, r{}, r{}, {}", name, inst.rd, inst.rs, inst.rt, inst.imm);
+    }
+    UNREACHABLE();
+}
+
+}
@@ -0,0 +1,201 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#pragma once
+
+#include <array>
+#include <optional>
+#include <string>
+#include <string_view>
+#include "common/common_types.hpp"
+
+// MINA instructions are 32-bit little-endian words.
+//
+//   31    28 27    24 23  20 19  16 15  12 11         5 4     0
+//  +--------+--------+------+------+------+------------+-------+
+//  | major  | minor  |  rd  |  rs  |           imm16           |  I
+//  | major  | minor  |  rd  |  rs  |  rt  |      (zero)        |  S
+//  | major  | minor  |  rd  |(zero)|           imm16           |  M
+//  | major  | minor  |  rd  |  rs  |  rt  |   (zero)   | imm5  |  F
+//  +--------+--------+------+------+------+------------+-------+
+//
+// I-format immediates are sign-extended, except for the Logical and Shift
+// categories where they are zero-extended. M-format immediates are zero-extended.
+// Instructions with fewer register operands fill the register fields from rd onwards.
+
+namespace stamina {
+
+enum class Category : u8 {
+    Arithmetic,
+    Logical,
+    Compare,
+    BranchReg,
+    Memory,
+    Move,
+    Shift,
+};
+
+enum class Format : u8 {
+    I,
+    S,
+    M,
+    F,
+};
+
+enum class Opcode : u8 {
+#define INSTRUCTION(mnemonic, ...) mnemonic,
+#define COMPAREINST(mnemonic, cond, ...) mnemonic##_##cond,
+#include "common/instructions.inc"
+#undef INSTRUCTION
+#undef COMPAREINST
+};
+
+// Assembly operand layout of an instruction.
+enum class OperandShape : u8 {
+    None,   // NOP
+    R,      // PUSH rd
+    RI,     // MOVI rd, imm
+    RR,     // MOV rd, rs
+    RRI,    // ADDI rd, rs, imm
+    RRR,    // ADD rd, rs, rt
+    RRRI,   // FLSL rd, rs, rt, imm
+};
+
+struct OpcodeInfo {
+    std::string_view name;
+    Category category;
+    Format format;
+    u8 major;
+    u8 minor;
+};
+
+inline constexpr std::array opcode_info{
+#define INSTRUCTION(mnemonic, category, format, major, minor) OpcodeInfo{#mnemonic, Category::category, Format::format, 0b##major, 0b##minor},
+#define COMPAREINST(mnemonic, cond, category, format, major, minor) OpcodeInfo{#mnemonic "/" #cond, Category::category, Format::format, 0b##major, 0b##minor},
+#include "common/instructions.inc"
+#undef INSTRUCTION
+#undef COMPAREINST
+};
+
+inline constexpr size_t num_opcodes = opcode_info.size();
+
+// Maps the top byte of an instruction word (major and minor opcode) to an Opcode index.
+inline constexpr u8 invalid_opcode_index = 0xFF;
+inline constexpr std::array<u8, 256> opcode_decode_table = []{
+    std::array<u8, 256> table{};
+    table.fill(invalid_opcode_index);
+    for (size_t i = 0; i < num_opcodes; i++) {
+        table[(opcode_info[i].major << 4) | opcode_info[i].minor] = static_cast<u8>(i);
+    }
+    return table;
+}();
+
+constexpr const OpcodeInfo& info(Opcode op) {
+    return opcode_info[static_cast<size_t>(op)];
+}
+
+constexpr bool has_signed_immediate(Opcode op) {
+    const auto& i = info(op);
+    return i.format == Format::I && i.category != Category::Logical && i.category != Category::Shift;
+}
+
+constexpr bool writes_memory(Opcode op) {
+    switch (op) {
+    case Opcode::ST:
+    case Opcode::STH:
+    case Opcode::STB:
+    case Opcode::STC:
+    case Opcode::RST:
+    case Opcode::RSTH:
+    case Opcode::RSTB:
+    case Opcode::PUSH:
+        return true;
+    default:
+        return false;
+    }
+}
+
+constexpr OperandShape operand_shape(Opcode op) {
+    switch (op) {
+    case Opcode::NOP:
+    case Opcode::RET:
+        return OperandShape::None;
+    case Opcode::PUSH:
+    case Opcode::POP:
+        return OperandShape::R;
+    case Opcode::PCADDI:
+    case Opcode::RBRA:
+    case Opcode::RCALL:
+    case Opcode::MOVI:
+    case Opcode::MTI:
+    case Opcode::MFT:
+    case Opcode::MOVL:
+    case Opcode::MOVU:
+        return OperandShape::RI;
+    case Opcode::PCADD:
+    case Opcode::POPCNT:
+    case Opcode::CLO:
+    case Opcode::PLO:
+    case Opcode::ROBRA:
+    case Opcode::ROCALL:
+    case Opcode::MOV:
+    case Opcode::MT:
+    case Opcode::MF:
+    case Opcode::MTOC:
+    case Opcode::MFRC:
+    case Opcode::MTOU:
+    case Opcode::MFRU:
+        return OperandShape::RR;
+    default:
+        break;
+    }
+
+    switch (info(op).format) {
+    case Format::I:
+        return info(op).category == Category::Compare ? OperandShape::RI : OperandShape::RRI;
+    case Format::S:
+        return info(op).category == Category::Compare ? OperandShape::RR : OperandShape::RRR;
+    case Format::M:
+        return OperandShape::RI;
+    case Format::F:
+        return OperandShape::RRRI;
+    }
+    return OperandShape::None;
+}
+
+inline constexpr size_t num_gprs = 16;
+inline constexpr u8 reg_lr = 14;
+inline constexpr u8 reg_sp = 15;
+
+struct Instruction {
+    Opcode opcode = Opcode::NOP;
+    u8 rd = 0;
+    u8 rs = 0;
+    u8 rt = 0;
+    s32 imm = 0;
+
+    friend bool operator==(const Instruction&, const Instruction&) = default;
+};
+
+// Architectural registers read and written by an instruction. T is the compare flag.
+struct RegisterEffects {
+    u16 reads = 0;
+    u16 writes = 0;
+    bool reads_t = false;
+    bool writes_t = false;
+};
+
+RegisterEffects register_effects(const Instruction& inst);
+
+// Returns the CMPI form of a CMP instruction with the same condition.
+Opcode compare_immediate_form(Opcode op);
+
+std::optional<Opcode> opcode_from_name(std::string_view name);
+std::optional<u8> register_from_name(std::string_view name);
+
+u32 encode(const Instruction& inst);
+std::optional<Instruction> decode(u32 word);
+std::string disassemble(const Instruction& inst);
+
+}
@@ -0,0 +1,16 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#pragma once
+
+#if defined(__GNUC__) || defined(__clang__)
+    #define FORCE_INLINE [[gnu::always_inline]] inline
+    #define NOINLINE [[gnu::noinline]]
+#elif defined(_MSC_VER)
+    #define FORCE_INLINE __forceinline
+    #define NOINLINE __declspec(noinline)
+#else
+    #define FORCE_INLINE inline
+    #define NOINLINE
+#endif
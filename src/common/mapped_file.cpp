@@ -0,0 +1,100 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#include <fstream>
+#include <iterator>
+#include <utility>
+#include "common/mapped_file.hpp"
+
+#if defined(__unix__) || defined(__APPLE__)
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+    #define STAMINA_HAS_MMAP 1
+#endif
+
+namespace stamina {
+
+std::optional<MappedFile> MappedFile::open(const std::filesystem::path& path) {
+    MappedFile result;
+
+#if defined(STAMINA_HAS_MMAP)
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return std::nullopt;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return std::nullopt;
+    }
+
+    if (st.st_size == 0) {
+        // mmap cannot map zero bytes
+        close(fd);
+        return result;
+    }
+
+    void* const addr = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+        close(fd);
+        return std::nullopt;
+    }
+
+    result.ptr = static_cast<const u8*>(addr);
+    result.length = static_cast<size_t>(st.st_size);
+    result.is_mapped = true;
+    result.file = fd;
+#else
+    std::ifstream file{path, std::ios::binary};
+    if (!file) {
+        return std::nullopt;
+    }
+    result.fallback.assign(std::istreambuf_iterator<char>{file}, std::istreambuf_iterator<char>{});
+    result.ptr = result.fallback.data();
+    result.length = result.fallback.size();
+#endif
+
+    return result;
+}
+
+MappedFile::MappedFile(MappedFile&& other) noexcept {
+    *this = std::move(other);
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) noexcept {
+    if (this != &other) {
+        reset();
+        ptr = std::exchange(other.ptr, nullptr);
+        length = std::exchange(other.length, 0);
+        is_mapped = std::exchange(other.is_mapped, false);
+        file = std::exchange(other.file, -1);
+        fallback = std::move(other.fallback);
+    }
+    return *this;
+}
+
+MappedFile::~MappedFile() {
+    reset();
+}
+
+void MappedFile::reset() {
+#if defined(STAMINA_HAS_MMAP)
+    if (is_mapped) {
+        munmap(const_cast<u8*>(ptr), length);
+    }
+    if (file >= 0) {
+        close(file);
+    }
+#endif
+    ptr = nullptr;
+    length = 0;
+    is_mapped = false;
+    file = -1;
+    fallback.clear();
+}
+
+}
@@ -0,0 +1,46 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#pragma once
+
+#include <filesystem>
+#include <optional>
+#include <span>
+#include <vector>
+#include "common/common_types.hpp"
+
+namespace stamina {
+
+// Read-only view of the contents of a file.
+// Backed by a private mmap on POSIX hosts, and by a heap copy elsewhere. The file stays open on
+// POSIX hosts so that parts of it can be mapped again elsewhere.
+struct MappedFile final {
+public:
+    static std::optional<MappedFile> open(const std::filesystem::path& path);
+
+    MappedFile(MappedFile&& other) noexcept;
+    MappedFile& operator=(MappedFile&& other) noexcept;
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const u8* data() const { return ptr; }
+    size_t size() const { return length; }
+    std::span<const u8> bytes() const { return {ptr, length}; }
+    // Descriptor of the open file, or -1 where the contents were copied.
+    int fd() const { return file; }
+
+private:
+    MappedFile() = default;
+    void reset();
+
+    const u8* ptr = nullptr;
+    size_t length = 0;
+    bool is_mapped = false;
+    int file = -1;
+    std::vector<u8> fallback;
+};
+
+}
@@ -2,8 +2,11 @@
 // Copyright (c) 2020 MerryMage
 // SPDX-License-Identifier: 0BSD
 
+#pragma once
+
 #include <algorithm>
 #include <cctype>
+#include <string>
 #include <string_view>
 
 namespace stamina {
@@ -0,0 +1,413 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#include <algorithm>
+#include <fmt/format.h>
+#include "common/assert.hpp"
+#include "common/image_format.hpp"
+#include "common/overloaded.hpp"
+#include "smasm/assembler.hpp"
+
+namespace stamina {
+
+namespace {
+
+constexpr u64 align_up(u64 value, u64 alignment) {
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+bool starts_with(const std::string& str, std::string_view prefix) {
+    return str.compare(0, prefix.size(), prefix) == 0;
+}
+
+u32 section_flags(const std::string& name) {
+    if (starts_with(name, ".text")) {
+        return image::Read | image::Execute;
+    }
+    if (starts_with(name, ".rodata")) {
+        return image::Read;
+    }
+    return image::Read | image::Write;
+}
+
+u64 statement_size(const StatementBody& body, u64 offset, u32 relaxed_size) {
+    return std::visit(overloaded{
+        [](const InstructionStmt&) -> u64 { return 4; },
+        [relaxed_size](const LoadImmStmt&) -> u64 { return relaxed_size; },
+        [](const DataStmt& s) -> u64 { return u64{s.width} * s.values.size(); },
+        [](const BytesStmt& s) -> u64 { return s.bytes.size(); },
+        [offset](const AlignStmt& s) -> u64 { return align_up(offset, s.alignment) - offset; },
+        [](const SpaceStmt& s) -> u64 { return s.size; },
+        [](const IncbinStmt& s) -> u64 { return s.length; },
+        [](const LabelStmt&) -> u64 { return 0; },
+    }, body);
+}
+
+bool immediate_in_range(Opcode opcode, s64 value) {
+    const auto& i = info(opcode);
+    switch (i.format) {
+    case Format::I:
+        if (i.category == Category::Shift) {
+            return value >= 0 && value <= 31;
+        }
+        if (has_signed_immediate(opcode)) {
+            return value >= -0x8000 && value <= 0x7FFF;
+        }
+        return value >= 0 && value <= 0xFFFF;
+    case Format::M:
+        return value >= 0 && value <= 0xFFFF;
+    case Format::F:
+        return value >= 0 && value <= 31;
+    case Format::S:
+        return value == 0;
+    }
+    UNREACHABLE();
+}
+
+bool data_in_range(u8 width, s64 value) {
+    const s64 lo = -(s64{1} << (width * 8 - 1));
+    const s64 hi = (s64{1} << (width * 8)) - 1;
+    return value >= lo && value <= hi;
+}
+
+// Instruction sequences that LI can be expanded into.
+enum class LoadForm {
+    Movi,       // MOVI rd, value
+    Pcaddi,     // PCADDI rd, value - pc
+    MovlMovu,   // MOVL rd, value & 0xFFFF; MOVU rd, value >> 16
+};
+
+constexpr u32 load_form_size(LoadForm form) {
+    return form == LoadForm::MovlMovu ? 8 : 4;
+}
+
+std::optional<LoadForm> choose_load_form(s64 value, u32 address, bool symbolic) {
+    if (value < INT32_MIN || value > UINT32_MAX) {
+        return std::nullopt;
+    }
+
+    const s32 v = static_cast<s32>(static_cast<u32>(value));
+    if (v >= -0x8000 && v <= 0x7FFF) {
+        return LoadForm::Movi;
+    }
+
+    // Addresses may be reached relative to the PC; plain constants are kept position-independent
+    const s32 delta = static_cast<s32>(static_cast<u32>(v) - address);
+    if (symbolic && delta >= -0x8000 && delta <= 0x7FFF) {
+        return LoadForm::Pcaddi;
+    }
+
+    return LoadForm::MovlMovu;
+}
+
+void emit_word(std::vector<u8>& bytes, u32 word) {
+    for (int b = 0; b < 4; b++) {
+        bytes.push_back(static_cast<u8>(word >> (b * 8)));
+    }
+}
+
+// Relaxation initially lets LI sequences both grow and shrink, so that it finds the
+// smallest layout in the common case. It then only allows growth to guarantee convergence.
+constexpr size_t exact_relaxation_passes = 8;
+
+struct Assembler {
+    explicit Assembler(const Program& program) : program(program) {}
+
+    const Program& program;
+    AssemblyResult result;
+    std::vector<std::vector<u32>> offsets;
+    std::vector<std::vector<u32>> relaxed_sizes;
+
+    void error(const Position& pos, std::string message) {
+        result.diagnostics.push_back(Diagnostic{pos, std::move(message)});
+    }
+
+    std::optional<s64> evaluate_at(ExprId id, u32 address, std::string& message) const;
+
+    void layout();
+    void compute_layout();
+    bool relax(bool grow_only);
+    void encode();
+    void encode_section(size_t index);
+};
+
+std::optional<s64> Assembler::evaluate_at(ExprId id, u32 address, std::string& message) const {
+    const auto resolve = [this, address](std::string_view name) -> std::optional<s64> {
+        if (name == ".") {
+            return address;
+        }
+        if (const auto iter = result.symbols.find(std::string{name}); iter != result.symbols.end()) {
+            return iter->second;
+        }
+        return std::nullopt;
+    };
+    return evaluate(program.exprs, id, resolve, message);
+}
+
+void Assembler::layout() {
+    relaxed_sizes.clear();
+    for (const SectionDecl& decl : program.sections) {
+        relaxed_sizes.emplace_back(decl.statements.size(), 4);
+    }
+
+    const auto diagnostics = result.diagnostics;
+    for (size_t pass = 0;; pass++) {
+        result.diagnostics = diagnostics;
+        compute_layout();
+        if (!relax(pass >= exact_relaxation_passes)) {
+            break;
+        }
+    }
+}
+
+bool Assembler::relax(bool grow_only) {
+    bool changed = false;
+    for (size_t s = 0; s < program.sections.size() && s < result.sections.size(); s++) {
+        const SectionDecl& decl = program.sections[s];
+        for (size_t i = 0; i < decl.statements.size(); i++) {
+            const auto* li = std::get_if<LoadImmStmt>(&decl.statements[i].body);
+            if (!li) {
+                continue;
+            }
+
+            const u32 address = result.sections[s].base + offsets[s][i];
+            std::string message;
+            const auto value = evaluate_at(li->value, address, message);
+            const auto form = value ? choose_load_form(*value, address, is_symbolic(program.exprs, li->value)) : std::nullopt;
+
+            u32 size = form ? load_form_size(*form) : load_form_size(LoadForm::MovlMovu);
+            if (grow_only) {
+                size = std::max(size, relaxed_sizes[s][i]);
+            }
+            if (size != relaxed_sizes[s][i]) {
+                relaxed_sizes[s][i] = size;
+                changed = true;
+            }
+        }
+    }
+    return changed;
+}
+
+void Assembler::compute_layout() {
+    result.sections.clear();
+    result.symbols.clear();
+    offsets.clear();
+
+    u64 next_base = 0;
+    for (const SectionDecl& decl : program.sections) {
+        Section section;
+        section.name = decl.name;
+        section.flags = section_flags(decl.name);
+        section.has_contents = !starts_with(decl.name, ".bss");
+
+        const u64 base = decl.base ? *decl.base : align_up(next_base, image::page_size);
+
+        std::vector<u32> stmt_offsets;
+        stmt_offsets.reserve(decl.statements.size());
+        u64 offset = 0;
+        for (size_t i = 0; i < decl.statements.size(); i++) {
+            const Statement& stmt = decl.statements[i];
+            stmt_offsets.push_back(static_cast<u32>(offset));
+            offset += statement_size(stmt.body, offset, relaxed_sizes[result.sections.size()][i]);
+            if (base + offset > u64{UINT32_MAX} + 1) {
+                error(stmt.pos, fmt::format("section {} exceeds the 32-bit address space", decl.name));
+                return;
+            }
+        }
+
+        section.base = static_cast<u32>(base);
+        section.size = static_cast<u32>(offset);
+        next_base = base + offset;
+
+        for (size_t i = 0; i < decl.statements.size(); i++) {
+            if (const auto* label = std::get_if<LabelStmt>(&decl.statements[i].body)) {
+                const auto [iter, inserted] = result.symbols.emplace(label->name, section.base + stmt_offsets[i]);
+                if (!inserted) {
+                    error(decl.statements[i].pos, fmt::format("redefinition of label {}", label->name));
+                }
+            }
+        }
+
+        result.sections.push_back(std::move(section));
+        offsets.push_back(std::move(stmt_offsets));
+    }
+
+    for (size_t i = 0; i < result.sections.size(); i++) {
+        for (size_t j = i + 1; j < result.sections.size(); j++) {
+            const Section& a = result.sections[i];
+            const Section& b = result.sections[j];
+            if (a.size != 0 && b.size != 0 && u64{a.base} < u64{b.base} + b.size && u64{b.base} < u64{a.base} + a.size) {
+                error(Position{}, fmt::format("sections {} and {} overlap", a.name, b.name));
+            }
+        }
+    }
+}
+
+void Assembler::encode() {
+    for (size_t i = 0; i < program.sections.size(); i++) {
+        encode_section(i);
+    }
+
+    if (const auto iter = result.symbols.find("_start"); iter != result.symbols.end()) {
+        result.entry = iter->second;
+    } else {
+        for (const Section& section : result.sections) {
+            if (section.size != 0 && (section.flags & image::Execute)) {
+                result.entry = section.base;
+                break;
+            }
+        }
+    }
+}
+
+void Assembler::encode_section(size_t index) {
+    const SectionDecl& decl = program.sections[index];
+    Section& section = result.sections[index];
+    const std::vector<u32>& stmt_offsets = offsets[index];
+    std::vector<u8> bytes;
+
+    const auto flush = [&] {
+        if (!bytes.empty()) {
+            section.chunks.emplace_back(std::move(bytes));
+            bytes = {};
+        }
+    };
+
+    for (size_t i = 0; i < decl.statements.size(); i++) {
+        const Statement& stmt = decl.statements[i];
+        const u32 address = section.base + stmt_offsets[i];
+
+        const auto eval = [&](ExprId id) -> std::optional<s64> {
+            std::string message;
+            const auto value = evaluate_at(id, address, message);
+            if (!value) {
+                error(stmt.pos, message);
+            }
+            return value;
+        };
+
+        if (!section.has_contents) {
+            if (!std::holds_alternative<LabelStmt>(stmt.body) && !std::holds_alternative<AlignStmt>(stmt.body) && !std::holds_alternative<SpaceStmt>(stmt.body)) {
+                error(stmt.pos, fmt::format("section {} cannot contain initialized data", decl.name));
+            }
+            continue;
+        }
+
+        std::visit(overloaded{
+            [&](const InstructionStmt& s) {
+                if (address % 4 != 0) {
+                    error(stmt.pos, "instruction is not word-aligned");
+                }
+
+                Instruction inst{s.opcode, s.rd, s.rs, s.rt, 0};
+                if (s.imm) {
+                    const auto value = eval(*s.imm);
+                    if (!value) {
+                        return;
+                    }
+                    if (!immediate_in_range(s.opcode, *value)) {
+                        error(stmt.pos, fmt::format("immediate {} out of range for {}", *value, info(s.opcode).name));
+                        return;
+                    }
+                    inst.imm = static_cast<s32>(*value);
+                }
+
+                emit_word(bytes, stamina::encode(inst));
+            },
+            [&](const LoadImmStmt& s) {
+                const auto value = eval(s.value);
+                if (!value) {
+                    return;
+                }
+                auto form = choose_load_form(*value, address, is_symbolic(program.exprs, s.value));
+                if (!form) {
+                    error(stmt.pos, fmt::format("value {} does not fit in 32 bits", *value));
+                    return;
+                }
+                if (load_form_size(*form) != relaxed_sizes[index][i]) {
+                    // Only reachable when relaxation had to stop shrinking sequences
+                    form = LoadForm::MovlMovu;
+                }
+
+                const u32 v = static_cast<u32>(*value);
+                switch (*form) {
+                case LoadForm::Movi:
+                    emit_word(bytes, stamina::encode(Instruction{Opcode::MOVI, s.rd, 0, 0, static_cast<s32>(v)}));
+                    break;
+                case LoadForm::Pcaddi:
+                    emit_word(bytes, stamina::encode(Instruction{Opcode::PCADDI, s.rd, 0, 0, static_cast<s32>(v - address)}));
+                    break;
+                case LoadForm::MovlMovu:
+                    emit_word(bytes, stamina::encode(Instruction{Opcode::MOVL, s.rd, 0, 0, static_cast<s32>(v & 0xFFFF)}));
+                    emit_word(bytes, stamina::encode(Instruction{Opcode::MOVU, s.rd, 0, 0, static_cast<s32>(v >> 16)}));
+                    break;
+                }
+            },
+            [&](const DataStmt& s) {
+                for (const ExprId id : s.values) {
+                    const auto value = eval(id).value_or(0);
+                    if (!data_in_range(s.width, value)) {
+                        error(stmt.pos, fmt::format("value {} does not fit in {} bytes", value, s.width));
+                    }
+                    for (int b = 0; b < s.width; b++) {
+                        bytes.push_back(static_cast<u8>(static_cast<u64>(value) >> (b * 8)));
+                    }
+                }
+            },
+            [&](const BytesStmt& s) {
+                bytes.insert(bytes.end(), s.bytes.begin(), s.bytes.end());
+            },
+            [&](const AlignStmt&) {
+                bytes.resize(bytes.size() + statement_size(stmt.body, stmt_offsets[i], 0));
+            },
+            [&](const SpaceStmt& s) {
+                bytes.resize(bytes.size() + s.size);
+            },
+            [&](const IncbinStmt& s) {
+                flush();
+                section.chunks.emplace_back(FileChunk{s.file, s.offset, s.length});
+            },
+            [&](const LabelStmt&) {},
+        }, stmt.body);
+    }
+
+    flush();
+}
+
+}
+
+std::vector<u8> Section::contents() const {
+    std::vector<u8> result;
+    if (!has_contents) {
+        result.resize(size);
+        return result;
+    }
+
+    result.reserve(size);
+    for (const Chunk& chunk : chunks) {
+        std::visit(overloaded{
+            [&](const std::vector<u8>& bytes) {
+                result.insert(result.end(), bytes.begin(), bytes.end());
+            },
+            [&](const FileChunk& file) {
+                const u8* begin = file.file->data() + file.offset;
+                result.insert(result.end(), begin, begin + file.length);
+            },
+        }, chunk);
+    }
+    return result;
+}
+
+AssemblyResult assemble(const Program& program) {
+    Assembler assembler{program};
+    assembler.result.diagnostics = program.diagnostics;
+
+    assembler.layout();
+    if (assembler.result.ok()) {
+        assembler.encode();
+    }
+    return std::move(assembler.result);
+}
+
+}
@@ -0,0 +1,50 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#pragma once
+
+#include <map>
+#include <memory>
+#include <string>
+#include <variant>
+#include <vector>
+#include "common/common_types.hpp"
+#include "common/mapped_file.hpp"
+#include "smasm/diagnostic.hpp"
+#include "smasm/program.hpp"
+
+namespace stamina {
+
+// A range of an external file that forms part of a section's contents.
+struct FileChunk {
+    std::shared_ptr<const MappedFile> file;
+    u64 offset;
+    u64 length;
+};
+
+using Chunk = std::variant<std::vector<u8>, FileChunk>;
+
+struct Section {
+    std::string name;
+    u32 base = 0;
+    u32 size = 0;
+    u32 flags = 0;
+    bool has_contents = true;
+    std::vector<Chunk> chunks;
+
+    std::vector<u8> contents() const;
+};
+
+struct AssemblyResult {
+    std::vector<Section> sections;
+    std::map<std::string, u32> symbols;
+    u32 entry = 0;
+    std::vector<Diagnostic> diagnostics;
+
+    bool ok() const { return diagnostics.empty(); }
+};
+
+AssemblyResult assemble(const Program& program);
+
+}
@@ -0,0 +1,252 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <catch.hpp>
+#include "common/common_types.hpp"
+#include "common/image_format.hpp"
+#include "common/instruction.hpp"
+#include "common/mapped_file.hpp"
+#include "smasm/assembler.hpp"
+#include "smasm/image_writer.hpp"
+#include "smasm/include_cache.hpp"
+#include "smasm/parser.hpp"
+#include "smasm/peephole.hpp"
+#include "smasm/snippet_assembler.hpp"
+#include "smasm/token_reader.hpp"
+
+using namespace stamina;
+
+namespace {
+
+AssemblyResult assemble_string(std::string source, std::string filename = "test.s") {
+    IncludeCache cache;
+    TokenReader reader{cache};
+    reader.push_string(std::move(source), std::move(filename));
+    Program program;
+    Parser{reader, program}.parse();
+    return assemble(program);
+}
+
+std::vector<u32> words_of(const Section& section) {
+    const auto bytes = section.contents();
+    std::vector<u32> words(bytes.size() / 4);
+    std::memcpy(words.data(), bytes.data(), words.size() * 4);
+    return words;
+}
+
+}
+
+TEST_CASE("instruction: encode/decode round trip", "[common]") {
+    for (size_t i = 0; i < num_opcodes; i++) {
+        const auto opcode = static_cast<Opcode>(i);
+        Instruction inst{opcode, 3, 0, 0, 0};
+        switch (operand_shape(opcode)) {
+        case OperandShape::None:
+            inst.rd = 0;
+            break;
+        case OperandShape::R:
+            break;
+        case OperandShape::RI:
+            inst.imm = has_signed_immediate(opcode) ? -5 : 5;
+            break;
+        case OperandShape::RR:
+            inst.rs = 7;
+            break;
+        case OperandShape::RRI:
+            inst.rs = 7;
+            inst.imm = has_signed_immediate(opcode) ? -5 : 5;
+            break;
+        case OperandShape::RRR:
+            inst.rs = 7;
+            inst.rt = 15;
+            break;
+        case OperandShape::RRRI:
+            inst.rs = 7;
+            inst.rt = 15;
+            inst.imm = 17;
+            break;
+        }
+        const auto decoded = decode(encode(inst));
+        REQUIRE(decoded);
+        REQUIRE(*decoded == inst);
+    }
+}
+
+TEST_CASE("assembler: instructions and labels", "[smasm]") {
+    const auto result = assemble_string(
+        "@def three 3\n"
+        "start:\n"
+        "    movi r1, three\n"
+        "loop: addi r1, r1, -1\n"
+        "    cmpi/eq r1, 0\n"
+        "    movl r2, loop & 0xFFFF\n"
+        "    rbra r2\n"
+        "    @word loop, . - start\n");
+    REQUIRE(result.ok());
+    REQUIRE(result.symbols.at("loop") == 4);
+
+    const auto words = words_of(result.sections[0]);
+    REQUIRE(words.size() == 7);
+    REQUIRE(*decode(words[0]) == Instruction{Opcode::MOVI, 1, 0, 0, 3});
+    REQUIRE(*decode(words[1]) == Instruction{Opcode::ADDI, 1, 1, 0, -1});
+    REQUIRE(*decode(words[2]) == Instruction{Opcode::CMPI_EQ, 1, 0, 0, 0});
+    REQUIRE(*decode(words[3]) == Instruction{Opcode::MOVL, 2, 0, 0, 4});
+    REQUIRE(*decode(words[4]) == Instruction{Opcode::RBRA, 2, 0, 0, 0});
+    REQUIRE(words[5] == 4);
+    REQUIRE(words[6] == 20);
+}
+
+TEST_CASE("assembler: diagnostics", "[smasm]") {
+    REQUIRE(!assemble_string("movi r1, 0x10000\n").ok());
+    REQUIRE(!assemble_string("movi r1, undefined\n").ok());
+    REQUIRE(!assemble_string("add r1, r2\n").ok());
+    REQUIRE(!assemble_string("a:\na:\n").ok());
+    REQUIRE(!assemble_string("@section .bss\n@word 1\n").ok());
+}
+
+TEST_CASE("assembler: incbin", "[smasm]") {
+    const auto dir = std::filesystem::temp_directory_path() / "stamina-incbin-test";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+
+    std::vector<u8> blob(3 * image::page_size + 5);
+    for (size_t i = 0; i < blob.size(); i++) {
+        blob[i] = static_cast<u8>(i * 7);
+    }
+    std::ofstream{dir / "blob.bin", std::ios::binary}.write(reinterpret_cast<const char*>(blob.data()), static_cast<std::streamsize>(blob.size()));
+
+    const auto result = assemble_string(
+        "nop\n"
+        "@section .rodata\n"
+        "table: @incbin \"blob.bin\"\n"
+        "table_end:\n"
+        "@section .bss\n"
+        "@space 64\n", (dir / "main.s").string());
+    REQUIRE(result.ok());
+    REQUIRE(result.symbols.at("table") == image::page_size);
+    REQUIRE(result.symbols.at("table_end") - result.symbols.at("table") == blob.size());
+    REQUIRE(std::holds_alternative<FileChunk>(result.sections[1].chunks[0]));
+    REQUIRE(result.sections[1].contents() == blob);
+
+    // Replacing the file after assembly does not change the image
+    std::ofstream{dir / "new.bin", std::ios::binary} << "replaced";
+    std::filesystem::rename(dir / "new.bin", dir / "blob.bin");
+
+    std::string error;
+    REQUIRE(write_image(result, dir / "out.mina", error));
+
+    const auto out = MappedFile::open(dir / "out.mina");
+    REQUIRE(out);
+    image::ImageHeader header;
+    std::memcpy(&header, out->data(), sizeof(header));
+    REQUIRE(header.segment_count == 3);
+    image::SegmentHeader segments[3];
+    std::memcpy(segments, out->data() + sizeof(header), sizeof(segments));
+    REQUIRE(segments[1].file_size == blob.size());
+    REQUIRE(std::memcmp(out->data() + segments[1].file_offset, blob.data(), blob.size()) == 0);
+    REQUIRE(segments[2].file_size == 0);
+    REQUIRE(segments[2].mem_size == 64);
+
+    std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("assembler: LI relaxation", "[smasm]") {
+    const auto result = assemble_string(
+        "li r1, 0x1234\n"
+        "li r2, -1\n"
+        "li r3, 0x12345678\n"
+        "li r4, near\n"
+        "li r5, far\n"
+        "near: nop\n"
+        "@section .data, 0x40000\n"
+        "far: @word 0\n");
+    REQUIRE(result.ok());
+    REQUIRE(result.symbols.at("near") == 28);
+
+    const auto words = words_of(result.sections[0]);
+    REQUIRE(words.size() == 8);
+    REQUIRE(*decode(words[0]) == Instruction{Opcode::MOVI, 1, 0, 0, 0x1234});
+    REQUIRE(*decode(words[1]) == Instruction{Opcode::MOVI, 2, 0, 0, -1});
+    REQUIRE(*decode(words[2]) == Instruction{Opcode::MOVL, 3, 0, 0, 0x5678});
+    REQUIRE(*decode(words[3]) == Instruction{Opcode::MOVU, 3, 0, 0, 0x1234});
+    REQUIRE(*decode(words[4]) == Instruction{Opcode::MOVI, 4, 0, 0, 28});
+    REQUIRE(*decode(words[5]) == Instruction{Opcode::MOVL, 5, 0, 0, 0});
+    REQUIRE(*decode(words[6]) == Instruction{Opcode::MOVU, 5, 0, 0, 4});
+}
+
+TEST_CASE("assembler: LI uses PC-relative form for nearby high addresses", "[smasm]") {
+    const auto result = assemble_string(
+        "@section .text, 0x80000000\n"
+        "li r1, target\n"
+        "@space 0x100\n"
+        "target: nop\n");
+    REQUIRE(result.ok());
+
+    const auto words = words_of(result.sections[0]);
+    REQUIRE(*decode(words[0]) == Instruction{Opcode::PCADDI, 1, 0, 0, 0x104});
+    REQUIRE(result.symbols.at("target") == 0x80000104);
+}
+
+TEST_CASE("assembler: peephole optimizer", "[smasm]") {
+    IncludeCache cache;
+    TokenReader reader{cache};
+    reader.push_string(
+        "start:\n"
+        "    mov r1, r1\n"
+        "    addi r2, r2, 0\n"
+        "    addi r3, r4, 0\n"
+        "    push r5\n"
+        "    pop r5\n"
+        "    mov r6, r7\n"
+        "    mov r7, r6\n"
+        "    movi r8, 42\n"
+        "    cmp/lt r9, r8\n"
+        "    movi r8, 0\n"
+        "    movi r10, 1\n"
+        "    cmp/lt r9, r10\n"
+        "    rbra r10\n"
+        "end:\n"
+        "    @word end - start\n");
+    Program program;
+    Parser{reader, program}.parse();
+    const auto stats = optimize_peephole(program);
+    const auto result = assemble(program);
+    REQUIRE(result.ok());
+    REQUIRE(stats.removed == 6);
+    REQUIRE(stats.rewritten == 2);
+
+    const auto words = words_of(result.sections[0]);
+    REQUIRE(words.size() == 8);
+    REQUIRE(*decode(words[0]) == Instruction{Opcode::MOV, 3, 4, 0, 0});
+    REQUIRE(*decode(words[1]) == Instruction{Opcode::MOV, 6, 7, 0, 0});
+    REQUIRE(*decode(words[2]) == Instruction{Opcode::CMPI_LT, 9, 0, 0, 42});
+    REQUIRE(*decode(words[3]) == Instruction{Opcode::MOVI, 8, 0, 0, 0});
+    REQUIRE(*decode(words[4]) == Instruction{Opcode::MOVI, 10, 0, 0, 1});
+    REQUIRE(*decode(words[5]) == Instruction{Opcode::CMP_LT, 9, 10, 0, 0});
+    REQUIRE(words[7] == 28);
+}
+
+TEST_CASE("snippet assembler: reuse between calls", "[smasm]") {
+    SnippetAssembler assembler{SnippetOptions{0x2000, false, "(snippet)"}};
+
+    for (int i = 0; i < 1000; i++) {
+        const auto& result = assembler.assemble(fmt::format("entry: movi r1, {}\nli r2, entry\nret\n", i));
+        REQUIRE(result.ok());
+        REQUIRE(result.base == 0x2000);
+        REQUIRE(result.symbols.at("entry") == 0x2000);
+        REQUIRE(result.words.size() == 3);
+        REQUIRE(*decode(result.words[0]) == Instruction{Opcode::MOVI, 1, 0, 0, i});
+        REQUIRE(*decode(result.words[1]) == Instruction{Opcode::MOVI, 2, 0, 0, 0x2000});
+    }
+
+    const auto& bad = assembler.assemble("movi r1, nowhere\n");
+    REQUIRE(!bad.ok());
+    REQUIRE(bad.words.empty());
+    REQUIRE(bad.diagnostics[0].pos.line == 1);
+}
@@ -0,0 +1,32 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#pragma once
+
+#include <string>
+#include <fmt/format.h>
+#include "smasm/position.hpp"
+
+namespace stamina {
+
+struct Diagnostic final {
+    Position pos;
+    std::string message;
+
+    friend auto operator<=>(const Diagnostic&, const Diagnostic&) = default;
+};
+
+}
+
+template <>
+struct fmt::formatter<stamina::Diagnostic> {
+    constexpr auto parse(format_parse_context& ctx) {
+        return ctx.end();
+    }
+
+    template <typename FormatContext>
+    auto format(const stamina::Diagnostic& d, FormatContext& ctx) {
+        return format_to(ctx.out(), "{}: error: {}", d.pos, d.message);
+    }
+};
@@ -0,0 +1,158 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#include <utility>
+#include "common/assert.hpp"
+#include "smasm/expression.hpp"
+
+namespace stamina {
+
+ExprId ExprArena::push(ExprNode node) {
+    nodes.push_back(std::move(node));
+    return static_cast<ExprId>(nodes.size() - 1);
+}
+
+ExprId ExprArena::constant(s64 value) {
+    return push(ExprNode{ExprNode::Kind::Constant, Token::Type::Error, 0, 0, value, {}});
+}
+
+ExprId ExprArena::symbol(std::string name) {
+    return push(ExprNode{ExprNode::Kind::Symbol, Token::Type::Error, 0, 0, 0, std::move(name)});
+}
+
+ExprId ExprArena::unary(Token::Type op, ExprId operand) {
+    return push(ExprNode{ExprNode::Kind::Unary, op, operand, 0, 0, {}});
+}
+
+ExprId ExprArena::binary(Token::Type op, ExprId lhs, ExprId rhs) {
+    return push(ExprNode{ExprNode::Kind::Binary, op, lhs, rhs, 0, {}});
+}
+
+std::optional<s64> evaluate(const ExprArena& arena, ExprId id, const SymbolResolver& resolve, std::string& error) {
+    const ExprNode& node = arena[id];
+
+    switch (node.kind) {
+    case ExprNode::Kind::Constant:
+        return node.value;
+    case ExprNode::Kind::Symbol:
+        if (const auto value = resolve(node.symbol)) {
+            return value;
+        }
+        error = "undefined symbol " + node.symbol;
+        return std::nullopt;
+    case ExprNode::Kind::Unary: {
+        const auto operand = evaluate(arena, node.lhs, resolve, error);
+        if (!operand) {
+            return std::nullopt;
+        }
+        switch (node.op) {
+        case Token::Type::Plus:
+            return *operand;
+        case Token::Type::Minus:
+            return -*operand;
+        case Token::Type::BitNot:
+            return ~*operand;
+        case Token::Type::LogicNot:
+            return !*operand;
+        default:
+            UNREACHABLE();
+        }
+    }
+    case ExprNode::Kind::Binary: {
+        const auto lhs = evaluate(arena, node.lhs, resolve, error);
+        if (!lhs) {
+            return std::nullopt;
+        }
+        const auto rhs = evaluate(arena, node.rhs, resolve, error);
+        if (!rhs) {
+            return std::nullopt;
+        }
+        const s64 a = *lhs;
+        const s64 b = *rhs;
+        switch (node.op) {
+        case Token::Type::Plus:
+            return static_cast<s64>(static_cast<u64>(a) + static_cast<u64>(b));
+        case Token::Type::Minus:
+            return static_cast<s64>(static_cast<u64>(a) - static_cast<u64>(b));
+        case Token::Type::Mul:
+            return static_cast<s64>(static_cast<u64>(a) * static_cast<u64>(b));
+        case Token::Type::Div:
+        case Token::Type::Mod:
+            if (b == 0) {
+                error = "division by zero";
+                return std::nullopt;
+            }
+            if (a == INT64_MIN && b == -1) {
+                return node.op == Token::Type::Div ? a : 0;
+            }
+            return node.op == Token::Type::Div ? a / b : a % b;
+        case Token::Type::ShLeft:
+            return b < 0 || b >= 64 ? 0 : static_cast<s64>(static_cast<u64>(a) << b);
+        case Token::Type::ShRight:
+            return b < 0 || b >= 64 ? (a < 0 ? -1 : 0) : a >> b;
+        case Token::Type::BitAnd:
+            return a & b;
+        case Token::Type::BitOr:
+            return a | b;
+        case Token::Type::Xor:
+            return a ^ b;
+        case Token::Type::LogicAnd:
+            return a && b;
+        case Token::Type::LogicOr:
+            return a || b;
+        case Token::Type::Equal:
+            return a == b;
+        case Token::Type::NotEqual:
+            return a != b;
+        case Token::Type::Less:
+            return a < b;
+        case Token::Type::LessEqual:
+            return a <= b;
+        case Token::Type::Greater:
+            return a > b;
+        case Token::Type::GreaterEqual:
+            return a >= b;
+        default:
+            UNREACHABLE();
+        }
+    }
+    }
+    UNREACHABLE();
+}
+
+bool is_symbolic(const ExprArena& arena, ExprId id) {
+    const ExprNode& node = arena[id];
+    switch (node.kind) {
+    case ExprNode::Kind::Constant:
+        return false;
+    case ExprNode::Kind::Symbol:
+        return true;
+    case ExprNode::Kind::Unary:
+        return is_symbolic(arena, node.lhs);
+    case ExprNode::Kind::Binary:
+        return is_symbolic(arena, node.lhs) || is_symbolic(arena, node.rhs);
+    }
+    UNREACHABLE();
+}
+
+void collect_symbols(const ExprArena& arena, ExprId id, std::vector<std::string_view>& symbols) {
+    const ExprNode& node = arena[id];
+    switch (node.kind) {
+    case ExprNode::Kind::Constant:
+        return;
+    case ExprNode::Kind::Symbol:
+        symbols.push_back(node.symbol);
+        return;
+    case ExprNode::Kind::Unary:
+        collect_symbols(arena, node.lhs, symbols);
+        return;
+    case ExprNode::Kind::Binary:
+        collect_symbols(arena, node.lhs, symbols);
+        collect_symbols(arena, node.rhs, symbols);
+        return;
+    }
+    UNREACHABLE();
+}
+
+}
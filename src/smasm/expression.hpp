@@ -0,0 +1,63 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#pragma once
+
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "common/common_types.hpp"
+#include "smasm/lexer.hpp"
+
+namespace stamina {
+
+using ExprId = u32;
+
+struct ExprNode final {
+    enum class Kind : u8 {
+        Constant,
+        Symbol,
+        Unary,
+        Binary,
+    };
+
+    Kind kind;
+    Token::Type op = Token::Type::Error;
+    ExprId lhs = 0;
+    ExprId rhs = 0;
+    s64 value = 0;
+    std::string symbol;
+};
+
+// Storage for the expression trees of a program. Nodes refer to each other by index.
+struct ExprArena final {
+public:
+    ExprId constant(s64 value);
+    ExprId symbol(std::string name);
+    ExprId unary(Token::Type op, ExprId operand);
+    ExprId binary(Token::Type op, ExprId lhs, ExprId rhs);
+
+    const ExprNode& operator[](ExprId id) const { return nodes[id]; }
+    size_t size() const { return nodes.size(); }
+    void clear() { nodes.clear(); }
+
+private:
+    ExprId push(ExprNode node);
+
+    std::vector<ExprNode> nodes;
+};
+
+using SymbolResolver = std::function<std::optional<s64>(std::string_view name)>;
+
+// Returns std::nullopt and sets error if the expression cannot be evaluated.
+std::optional<s64> evaluate(const ExprArena& arena, ExprId id, const SymbolResolver& resolve, std::string& error);
+
+// Returns true if the expression refers to any symbol.
+bool is_symbolic(const ExprArena& arena, ExprId id);
+
+void collect_symbols(const ExprArena& arena, ExprId id, std::vector<std::string_view>& symbols);
+
+}
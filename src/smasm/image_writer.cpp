@@ -0,0 +1,201 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <fmt/format.h>
+#include "common/image_format.hpp"
+#include "common/overloaded.hpp"
+#include "smasm/image_writer.hpp"
+
+#if defined(__unix__) || defined(__APPLE__)
+    #include <fcntl.h>
+    #include <unistd.h>
+    #define STAMINA_HAS_POSIX_IO 1
+#endif
+
+namespace stamina {
+
+namespace {
+
+constexpr u64 align_up(u64 value, u64 alignment) {
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+struct PlannedSegment {
+    const Section* section;
+    image::SegmentHeader header;
+};
+
+std::vector<PlannedSegment> plan_segments(const AssemblyResult& result, u64& file_size) {
+    std::vector<PlannedSegment> segments;
+    for (const Section& section : result.sections) {
+        if (section.size == 0) {
+            continue;
+        }
+        image::SegmentHeader header{};
+        std::strncpy(header.name, section.name.c_str(), sizeof(header.name) - 1);
+        header.vaddr = section.base;
+        header.file_size = section.has_contents ? section.size : 0;
+        header.mem_size = section.size;
+        header.flags = section.flags;
+        segments.push_back(PlannedSegment{&section, header});
+    }
+
+    u64 offset = align_up(sizeof(image::ImageHeader) + segments.size() * sizeof(image::SegmentHeader), image::page_size);
+    for (auto& segment : segments) {
+        segment.header.file_offset = static_cast<u32>(offset);
+        offset = align_up(offset + segment.header.file_size, image::page_size);
+    }
+    file_size = segments.empty() ? sizeof(image::ImageHeader) : segments.back().header.file_offset + segments.back().header.file_size;
+    return segments;
+}
+
+std::vector<u8> build_headers(const AssemblyResult& result, const std::vector<PlannedSegment>& segments) {
+    image::ImageHeader header{};
+    std::memcpy(header.magic, image::magic, sizeof(image::magic));
+    header.version = image::version;
+    header.entry = result.entry;
+    header.segment_count = static_cast<u32>(segments.size());
+
+    std::vector<u8> bytes(sizeof(header) + segments.size() * sizeof(image::SegmentHeader));
+    std::memcpy(bytes.data(), &header, sizeof(header));
+    for (size_t i = 0; i < segments.size(); i++) {
+        std::memcpy(bytes.data() + sizeof(header) + i * sizeof(image::SegmentHeader), &segments[i].header, sizeof(image::SegmentHeader));
+    }
+    return bytes;
+}
+
+#if defined(STAMINA_HAS_POSIX_IO)
+
+bool write_all(int fd, const u8* data, u64 length, u64 offset) {
+    while (length > 0) {
+        const ssize_t written = pwrite(fd, data, length, static_cast<off_t>(offset));
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        length -= static_cast<u64>(written);
+        offset += static_cast<u64>(written);
+    }
+    return true;
+}
+
+bool copy_file_chunk(int out_fd, const FileChunk& chunk, u64 offset) {
+#if defined(__linux__)
+    // The file the assembler mapped, even if its path has since been replaced
+    const int in_fd = chunk.file->fd();
+    if (in_fd >= 0) {
+        loff_t in_off = static_cast<loff_t>(chunk.offset);
+        loff_t out_off = static_cast<loff_t>(offset);
+        u64 remaining = chunk.length;
+        while (remaining > 0) {
+            const ssize_t copied = copy_file_range(in_fd, &in_off, out_fd, &out_off, remaining, 0);
+            if (copied <= 0) {
+                break;
+            }
+            remaining -= static_cast<u64>(copied);
+        }
+        if (remaining == 0) {
+            return true;
+        }
+        // Fall back to writing out of the mapping for whatever could not be copied in-kernel
+        const u64 done = chunk.length - remaining;
+        return write_all(out_fd, chunk.file->data() + chunk.offset + done, remaining, offset + done);
+    }
+#endif
+    return write_all(out_fd, chunk.file->data() + chunk.offset, chunk.length, offset);
+}
+
+#endif
+
+}
+
+bool write_image(const AssemblyResult& result, const std::filesystem::path& path, std::string& error) {
+    u64 file_size = 0;
+    const auto segments = plan_segments(result, file_size);
+    const auto headers = build_headers(result, segments);
+
+    // Written to a temporary file that then replaces the image, as stamina maps images and a loaded
+    // one must not change under it
+    auto temp_path = path;
+    temp_path += fmt::format(".{:08x}.tmp", std::random_device{}());
+
+#if defined(STAMINA_HAS_POSIX_IO)
+    const int fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        error = fmt::format("could not open {}: {}", temp_path.string(), std::strerror(errno));
+        return false;
+    }
+
+    bool ok = write_all(fd, headers.data(), headers.size(), 0);
+    for (const auto& segment : segments) {
+        if (!segment.section->has_contents) {
+            continue;
+        }
+        u64 offset = segment.header.file_offset;
+        for (const Chunk& chunk : segment.section->chunks) {
+            ok = ok && std::visit(overloaded{
+                [&](const std::vector<u8>& bytes) {
+                    const bool written = write_all(fd, bytes.data(), bytes.size(), offset);
+                    offset += bytes.size();
+                    return written;
+                },
+                [&](const FileChunk& file) {
+                    const bool written = copy_file_chunk(fd, file, offset);
+                    offset += file.length;
+                    return written;
+                },
+            }, chunk);
+        }
+    }
+    ok = ok && ftruncate(fd, static_cast<off_t>(file_size)) == 0;
+
+    if (close(fd) != 0 || !ok) {
+        error = fmt::format("could not write {}: {}", temp_path.string(), std::strerror(errno));
+        unlink(temp_path.c_str());
+        return false;
+    }
+#else
+    std::ofstream file{temp_path, std::ios::binary | std::ios::trunc};
+    if (!file) {
+        error = fmt::format("could not open {}", temp_path.string());
+        return false;
+    }
+
+    std::vector<u8> out(file_size);
+    std::copy(headers.begin(), headers.end(), out.begin());
+    for (const auto& segment : segments) {
+        if (segment.section->has_contents) {
+            const auto contents = segment.section->contents();
+            std::copy(contents.begin(), contents.end(), out.begin() + segment.header.file_offset);
+        }
+    }
+    file.write(reinterpret_cast<const char*>(out.data()), static_cast<std::streamsize>(out.size()));
+    file.close();
+    if (!file) {
+        error = fmt::format("could not write {}", temp_path.string());
+        std::error_code ec;
+        std::filesystem::remove(temp_path, ec);
+        return false;
+    }
+#endif
+
+    std::error_code ec;
+    std::filesystem::rename(temp_path, path, ec);
+    if (ec) {
+        error = fmt::format("could not replace {}: {}", path.string(), ec.message());
+        std::filesystem::remove(temp_path, ec);
+        return false;
+    }
+    return true;
+}
+
+}
@@ -0,0 +1,19 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#pragma once
+
+#include <filesystem>
+#include <string>
+#include "smasm/assembler.hpp"
+
+namespace stamina {
+
+// Writes an assembled program as a MINA image (see common/image_format.hpp).
+// File chunks are copied from their source file in-kernel where the host supports it.
+// The image is written to a temporary file beside path that then replaces it, so
+// that anything with the old image loaded keeps its contents.
+bool write_image(const AssemblyResult& result, const std::filesystem::path& path, std::string& error);
+
+}
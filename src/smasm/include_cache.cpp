@@ -0,0 +1,173 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <system_error>
+#include <fmt/format.h>
+#include "smasm/include_cache.hpp"
+
+namespace stamina {
+
+namespace {
+
+std::optional<SourceStamp> stamp_of(const std::filesystem::path& path) {
+    std::error_code ec;
+    const auto mtime = std::filesystem::last_write_time(path, ec);
+    if (ec) {
+        return std::nullopt;
+    }
+    const auto size = std::filesystem::file_size(path, ec);
+    if (ec) {
+        return std::nullopt;
+    }
+    return SourceStamp{
+        static_cast<u64>(std::chrono::duration_cast<std::chrono::nanoseconds>(mtime.time_since_epoch()).count()),
+        static_cast<u64>(size),
+        path.string(),
+    };
+}
+
+std::optional<TokenStream> tokenize_file(const std::filesystem::path& path, SourceStamp stamp) {
+    std::ifstream file{path, std::ios::binary};
+    if (!file) {
+        return std::nullopt;
+    }
+    std::string source{std::istreambuf_iterator<char>{file}, std::istreambuf_iterator<char>{}};
+
+    StringTokenizer tok{std::move(source), path.string()};
+    std::vector<Token> tokens;
+    while (true) {
+        auto t = tok.next_token();
+        if (t.type == Token::Type::EndOfFile) {
+            break;
+        }
+        tokens.push_back(std::move(t));
+    }
+    return TokenStream::from_tokens(tokens, stamp);
+}
+
+u64 fnv1a(std::string_view str) {
+    u64 hash = 0xcbf29ce484222325;
+    for (const char c : str) {
+        hash ^= static_cast<u8>(c);
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+}
+
+IncludeCache& IncludeCache::instance() {
+    static IncludeCache cache;
+    return cache;
+}
+
+void IncludeCache::set_disk_cache_directory(std::optional<std::filesystem::path> directory) {
+    std::lock_guard lock{mutex};
+    disk_cache_directory = std::move(directory);
+}
+
+std::shared_ptr<const TokenStream> IncludeCache::get(const std::filesystem::path& path) {
+    std::error_code ec;
+    const auto canonical = std::filesystem::weakly_canonical(path, ec);
+    const std::string key = ec ? path.string() : canonical.string();
+
+    const auto stamp = stamp_of(key);
+    if (!stamp) {
+        return nullptr;
+    }
+
+    std::lock_guard lock{mutex};
+
+    if (const auto iter = entries.find(key); iter != entries.end() && iter->second->stamp() == *stamp) {
+        statistics.memory_hits++;
+        return iter->second;
+    }
+
+    if (auto stream = load_from_disk(key, *stamp)) {
+        statistics.disk_hits++;
+        auto result = std::make_shared<const TokenStream>(std::move(*stream));
+        entries.insert_or_assign(key, result);
+        return result;
+    }
+
+    auto stream = tokenize_file(key, *stamp);
+    if (!stream) {
+        return nullptr;
+    }
+    statistics.misses++;
+    store_to_disk(key, *stream);
+    auto result = std::make_shared<const TokenStream>(std::move(*stream));
+    entries.insert_or_assign(key, result);
+    return result;
+}
+
+void IncludeCache::clear() {
+    std::lock_guard lock{mutex};
+    entries.clear();
+    statistics = {};
+}
+
+IncludeCache::Stats IncludeCache::stats() const {
+    std::lock_guard lock{mutex};
+    return statistics;
+}
+
+std::filesystem::path IncludeCache::disk_path_for(const std::filesystem::path& path) const {
+    return *disk_cache_directory / fmt::format("{:016x}.smtk", fnv1a(path.string()));
+}
+
+std::optional<TokenStream> IncludeCache::load_from_disk(const std::filesystem::path& path, SourceStamp stamp) const {
+    if (!disk_cache_directory) {
+        return std::nullopt;
+    }
+
+    auto file = MappedFile::open(disk_path_for(path));
+    if (!file) {
+        return std::nullopt;
+    }
+    auto stream = TokenStream::from_file(std::move(*file));
+    if (!stream || stream->stamp() != stamp) {
+        return std::nullopt;
+    }
+    return stream;
+}
+
+void IncludeCache::store_to_disk(const std::filesystem::path& path, const TokenStream& stream) const {
+    if (!disk_cache_directory) {
+        return;
+    }
+
+    std::error_code ec;
+    std::filesystem::create_directories(*disk_cache_directory, ec);
+
+    // Write to a temporary file first so that concurrent assembler processes never observe a partial image
+    const auto final_path = disk_path_for(path);
+    auto temp_path = final_path;
+    temp_path += fmt::format(".{:08x}.tmp", std::random_device{}());
+
+    {
+        std::ofstream file{temp_path, std::ios::binary | std::ios::trunc};
+        if (!file) {
+            return;
+        }
+        const auto image = stream.image();
+        file.write(reinterpret_cast<const char*>(image.data()), static_cast<std::streamsize>(image.size()));
+        if (!file) {
+            file.close();
+            std::filesystem::remove(temp_path, ec);
+            return;
+        }
+    }
+
+    std::filesystem::rename(temp_path, final_path, ec);
+    if (ec) {
+        std::filesystem::remove(temp_path, ec);
+    }
+}
+
+}
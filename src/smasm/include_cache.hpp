@@ -0,0 +1,52 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#pragma once
+
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include "smasm/token_stream.hpp"
+
+namespace stamina {
+
+// Process-wide cache of tokenized source files, keyed by path and modification time.
+//
+// Optionally backed by a directory of serialized TokenStream images, which are
+// mmapped on load. Images are named by a hash of the path and record the path
+// itself, so an image is only used for the file it was produced from. This allows headers shared by many translation units to be
+// lexed once per build rather than once per include.
+struct IncludeCache final {
+public:
+    struct Stats {
+        size_t memory_hits = 0;
+        size_t disk_hits = 0;
+        size_t misses = 0;
+    };
+
+    static IncludeCache& instance();
+
+    void set_disk_cache_directory(std::optional<std::filesystem::path> directory);
+
+    // Returns nullptr if the file cannot be read.
+    std::shared_ptr<const TokenStream> get(const std::filesystem::path& path);
+
+    void clear();
+    Stats stats() const;
+
+private:
+    std::optional<TokenStream> load_from_disk(const std::filesystem::path& path, SourceStamp stamp) const;
+    void store_to_disk(const std::filesystem::path& path, const TokenStream& stream) const;
+    std::filesystem::path disk_path_for(const std::filesystem::path& path) const;
+
+    mutable std::mutex mutex;
+    std::unordered_map<std::string, std::shared_ptr<const TokenStream>> entries;
+    std::optional<std::filesystem::path> disk_cache_directory;
+    Stats statistics;
+};
+
+}
@@ -91,6 +91,7 @@ Token Tokenizer::next_token() {
     if (ch == '\n') {
         next_ch();
         if (can_newline) {
+            can_newline = false;
             return make_token(Token::Type::NewLine);
         }
         return next_token();
@@ -126,6 +127,9 @@ Token Tokenizer::next_token() {
         return lex_directive();
     case ',':
         return make_token(Token::Type::Comma);
+    case ':':
+        can_newline = true;
+        return make_token(Token::Type::Colon);
     case '(':
         return make_token(Token::Type::LParen);
     case ')':
@@ -385,6 +389,11 @@ StringTokenizer::StringTokenizer(std::string str) : str(str) {
     advance();
 }
 
+StringTokenizer::StringTokenizer(std::string str, std::string filename) : str(str) {
+    ch_pos.filename = filename;
+    advance();
+}
+
 void StringTokenizer::advance() {
     if (ch == '\n') {
         ch_pos = ch_pos.next_line();
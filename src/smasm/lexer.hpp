@@ -2,6 +2,8 @@
 // Copyright (c) 2020 MerryMage
 // SPDX-License-Identifier: 0BSD
 
+#pragma once
+
 #include <optional>
 #include <string>
 #include <variant>
@@ -59,6 +61,7 @@ private:
 struct StringTokenizer final : public Tokenizer {
 public:
     explicit StringTokenizer(std::string str);
+    StringTokenizer(std::string str, std::string filename);
 
 protected:
     void advance() override;
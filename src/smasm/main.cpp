@@ -2,6 +2,80 @@
 // Copyright (c) 2020 MerryMage
 // SPDX-License-Identifier: 0BSD
 
-int main() {
+#include <cstdio>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <fmt/format.h>
+#include "smasm/assembler.hpp"
+#include "smasm/image_writer.hpp"
+#include "smasm/include_cache.hpp"
+#include "smasm/parser.hpp"
+#include "smasm/peephole.hpp"
+#include "smasm/token_reader.hpp"
+
+using namespace stamina;
+
+namespace {
+
+void usage() {
+    fmt::print(stderr, "usage: smasm [-O] [-o output] [--cache-dir directory] input.s\n");
+}
+
+}
+
+int main(int argc, char** argv) {
+    std::optional<std::filesystem::path> input;
+    std::filesystem::path output = "a.mina";
+    bool optimize = false;
+
+    for (int i = 1; i < argc; i++) {
+        const std::string_view arg = argv[i];
+        if (arg == "-O") {
+            optimize = true;
+        } else if (arg == "-o" && i + 1 < argc) {
+            output = argv[++i];
+        } else if (arg == "--cache-dir" && i + 1 < argc) {
+            IncludeCache::instance().set_disk_cache_directory(std::filesystem::path{argv[++i]});
+        } else if (!arg.empty() && arg[0] != '-' && !input) {
+            input = arg;
+        } else {
+            usage();
+            return 1;
+        }
+    }
+
+    if (!input) {
+        usage();
+        return 1;
+    }
+
+    TokenReader reader;
+    if (!reader.push_file(*input)) {
+        fmt::print(stderr, "smasm: could not read {}\n", input->string());
+        return 1;
+    }
+
+    Program program;
+    Parser{reader, program}.parse();
+    if (optimize && program.diagnostics.empty()) {
+        const auto stats = optimize_peephole(program);
+        fmt::print(stderr, "smasm: peephole optimizer removed {} and rewrote {} instructions\n", stats.removed, stats.rewritten);
+    }
+    const AssemblyResult result = assemble(program);
+
+    for (const auto& diagnostic : result.diagnostics) {
+        fmt::print(stderr, "{}\n", diagnostic);
+    }
+    if (!result.ok()) {
+        return 1;
+    }
+
+    std::string error;
+    if (!write_image(result, output, error)) {
+        fmt::print(stderr, "smasm: {}\n", error);
+        return 1;
+    }
     return 0;
 }
@@ -0,0 +1,589 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#include <algorithm>
+#include <filesystem>
+#include <utility>
+#include "common/assert.hpp"
+#include "common/image_format.hpp"
+#include "common/string_util.hpp"
+#include "smasm/parser.hpp"
+
+namespace stamina {
+
+namespace {
+
+int binary_precedence(Token::Type type) {
+    switch (type) {
+    case Token::Type::LogicOr:
+        return 1;
+    case Token::Type::LogicAnd:
+        return 2;
+    case Token::Type::BitOr:
+        return 3;
+    case Token::Type::Xor:
+        return 4;
+    case Token::Type::BitAnd:
+        return 5;
+    case Token::Type::Equal:
+    case Token::Type::NotEqual:
+        return 6;
+    case Token::Type::Less:
+    case Token::Type::LessEqual:
+    case Token::Type::Greater:
+    case Token::Type::GreaterEqual:
+        return 7;
+    case Token::Type::ShLeft:
+    case Token::Type::ShRight:
+        return 8;
+    case Token::Type::Plus:
+    case Token::Type::Minus:
+        return 9;
+    case Token::Type::Mul:
+    case Token::Type::Div:
+    case Token::Type::Mod:
+        return 10;
+    default:
+        return 0;
+    }
+}
+
+size_t register_count(OperandShape shape) {
+    switch (shape) {
+    case OperandShape::None:
+        return 0;
+    case OperandShape::R:
+    case OperandShape::RI:
+        return 1;
+    case OperandShape::RR:
+    case OperandShape::RRI:
+        return 2;
+    case OperandShape::RRR:
+    case OperandShape::RRRI:
+        return 3;
+    }
+    UNREACHABLE();
+}
+
+bool has_immediate(OperandShape shape) {
+    return shape == OperandShape::RI || shape == OperandShape::RRI || shape == OperandShape::RRRI;
+}
+
+bool is_end_of_statement(const Token& t) {
+    return t.type == Token::Type::NewLine || t.type == Token::Type::EndOfFile;
+}
+
+const std::string& string_payload(const Token& t) {
+    return std::get<std::string>(t.payload);
+}
+
+}
+
+Parser::Parser(TokenReader& reader, Program& program) : reader(reader), program(program) {
+    if (program.sections.empty()) {
+        program.sections.push_back(SectionDecl{".text", std::nullopt, {}});
+    }
+}
+
+void Parser::parse() {
+    while (peek().type != Token::Type::EndOfFile) {
+        parse_line();
+    }
+}
+
+Parser::PendingToken Parser::fetch_raw() {
+    if (!pending.empty()) {
+        auto t = std::move(pending.front());
+        pending.pop_front();
+        return t;
+    }
+    return PendingToken{reader.next_token(), nullptr};
+}
+
+Token Parser::fetch() {
+    while (true) {
+        auto [t, hideset] = fetch_raw();
+
+        if (t.type == Token::Type::Directive && string_payload(t) == "def") {
+            define_macro(t);
+            continue;
+        }
+
+        if (t.type != Token::Type::Identifier) {
+            return t;
+        }
+
+        const std::string& name = string_payload(t);
+        const auto iter = macros.find(name);
+        if (iter == macros.end() || (hideset && std::find(hideset->begin(), hideset->end(), name) != hideset->end())) {
+            return t;
+        }
+
+        auto new_hideset = std::make_shared<std::vector<std::string>>();
+        if (hideset) {
+            *new_hideset = *hideset;
+        }
+        new_hideset->push_back(name);
+
+        for (auto body = iter->second.rbegin(); body != iter->second.rend(); ++body) {
+            Token expanded = *body;
+            expanded.pos = t.pos;
+            pending.push_front(PendingToken{std::move(expanded), new_hideset});
+        }
+    }
+}
+
+void Parser::define_macro(const Token& directive) {
+    auto name = fetch_raw().token;
+    if (name.type != Token::Type::Identifier) {
+        error(directive.pos, "@def must be followed by an identifier");
+        while (!is_end_of_statement(name)) {
+            name = fetch_raw().token;
+        }
+        return;
+    }
+
+    std::vector<Token> body;
+    while (true) {
+        auto t = fetch_raw().token;
+        if (is_end_of_statement(t)) {
+            if (t.type == Token::Type::EndOfFile) {
+                pending.push_front(PendingToken{std::move(t), nullptr});
+            }
+            break;
+        }
+
+        if (t.type == Token::Type::TokCat) {
+            auto rhs = fetch_raw().token;
+            if (body.empty() || is_end_of_statement(rhs)) {
+                error(t.pos, "@@ must appear between two tokens");
+                pending.push_front(PendingToken{std::move(rhs), nullptr});
+                continue;
+            }
+
+            StringTokenizer tok{body.back().source_code + rhs.source_code, t.pos.filename};
+            auto pasted = tok.next_token();
+            const auto end = tok.next_token();
+            if (end.type != Token::Type::NewLine && end.type != Token::Type::EndOfFile) {
+                error(t.pos, "@@ did not produce a single token");
+                continue;
+            }
+            pasted.pos = body.back().pos;
+            body.back() = std::move(pasted);
+            continue;
+        }
+
+        body.push_back(std::move(t));
+    }
+
+    macros.insert_or_assign(string_payload(name), std::move(body));
+}
+
+const Token& Parser::peek(size_t n) {
+    while (lookahead.size() <= n) {
+        lookahead.push_back(fetch());
+    }
+    return lookahead[n];
+}
+
+Token Parser::advance() {
+    peek();
+    Token t = std::move(lookahead.front());
+    lookahead.pop_front();
+    return t;
+}
+
+bool Parser::accept(Token::Type type) {
+    if (peek().type == type) {
+        advance();
+        return true;
+    }
+    return false;
+}
+
+bool Parser::expect(Token::Type type, const char* what) {
+    if (accept(type)) {
+        return true;
+    }
+    error(peek().pos, fmt::format("expected {}", what));
+    return false;
+}
+
+void Parser::skip_line() {
+    while (!is_end_of_statement(peek())) {
+        advance();
+    }
+    accept(Token::Type::NewLine);
+}
+
+void Parser::error(const Position& pos, std::string message) {
+    program.diagnostics.push_back(Diagnostic{pos, std::move(message)});
+}
+
+SectionDecl& Parser::current_section() {
+    return program.sections[section_index];
+}
+
+void Parser::emit(const Position& pos, StatementBody body) {
+    current_section().statements.push_back(Statement{pos, std::move(body)});
+}
+
+void Parser::parse_line() {
+    const Token& t = peek();
+
+    bool ok = true;
+    switch (t.type) {
+    case Token::Type::NewLine:
+        advance();
+        return;
+    case Token::Type::EndOfFile:
+        return;
+    case Token::Type::Identifier:
+        if (peek(1).type == Token::Type::Colon) {
+            ok = parse_label();
+            // A label may be followed by a statement on the same line
+            if (ok) {
+                return;
+            }
+        } else if (iequal(string_payload(t), "li")) {
+            ok = parse_load_immediate();
+        } else {
+            error(t.pos, fmt::format("unknown instruction {}", string_payload(t)));
+            ok = false;
+        }
+        break;
+    case Token::Type::Mnemonic:
+        ok = parse_instruction();
+        break;
+    case Token::Type::Directive:
+        ok = parse_directive();
+        break;
+    case Token::Type::Error:
+        error(t.pos, string_payload(t));
+        ok = false;
+        break;
+    default:
+        error(t.pos, fmt::format("unexpected {}", t.type));
+        ok = false;
+        break;
+    }
+
+    if (ok && !is_end_of_statement(peek())) {
+        error(peek().pos, "expected end of line");
+        ok = false;
+    }
+    skip_line();
+}
+
+bool Parser::parse_label() {
+    const Token name = advance();
+    advance();
+    emit(name.pos, LabelStmt{string_payload(name)});
+    return true;
+}
+
+bool Parser::parse_instruction() {
+    const Token mnemonic = advance();
+    const auto opcode = opcode_from_name(string_payload(mnemonic));
+    ASSERT(opcode);
+
+    InstructionStmt stmt{*opcode, 0, 0, 0, std::nullopt};
+    const auto shape = operand_shape(*opcode);
+    const size_t num_regs = register_count(shape);
+
+    u8* const fields[] = {&stmt.rd, &stmt.rs, &stmt.rt};
+    for (size_t i = 0; i < num_regs; i++) {
+        if (i != 0 && !expect(Token::Type::Comma, "comma")) {
+            return false;
+        }
+        const auto reg = parse_register();
+        if (!reg) {
+            return false;
+        }
+        *fields[i] = *reg;
+    }
+
+    if (has_immediate(shape)) {
+        const bool optional_immediate = info(*opcode).category == Category::BranchReg;
+        if (!(optional_immediate && is_end_of_statement(peek()))) {
+            if (num_regs != 0 && !expect(Token::Type::Comma, "comma")) {
+                return false;
+            }
+            stmt.imm = parse_expression();
+            if (!stmt.imm) {
+                return false;
+            }
+        }
+    }
+
+    emit(mnemonic.pos, stmt);
+    return true;
+}
+
+bool Parser::parse_load_immediate() {
+    const Token mnemonic = advance();
+
+    const auto rd = parse_register();
+    if (!rd || !expect(Token::Type::Comma, "comma")) {
+        return false;
+    }
+    const auto value = parse_expression();
+    if (!value) {
+        return false;
+    }
+
+    emit(mnemonic.pos, LoadImmStmt{*rd, *value});
+    return true;
+}
+
+bool Parser::parse_directive() {
+    const Token directive = advance();
+    const std::string& name = string_payload(directive);
+
+    if (name == "section") {
+        return parse_section(directive);
+    }
+    if (name == "byte") {
+        return parse_data(directive, 1);
+    }
+    if (name == "half") {
+        return parse_data(directive, 2);
+    }
+    if (name == "word") {
+        return parse_data(directive, 4);
+    }
+    if (name == "string") {
+        const Token str = advance();
+        if (str.type != Token::Type::StringLit) {
+            error(str.pos, "@string must be followed by a string");
+            return false;
+        }
+        const std::string& s = string_payload(str);
+        emit(directive.pos, BytesStmt{std::vector<u8>(s.begin(), s.end())});
+        return true;
+    }
+    if (name == "align") {
+        const auto alignment = parse_constant();
+        if (!alignment) {
+            return false;
+        }
+        if (*alignment <= 0 || *alignment > image::page_size || (*alignment & (*alignment - 1)) != 0) {
+            error(directive.pos, "alignment must be a power of two no greater than the page size");
+            return false;
+        }
+        emit(directive.pos, AlignStmt{static_cast<u32>(*alignment)});
+        return true;
+    }
+    if (name == "space") {
+        const auto size = parse_constant();
+        if (!size) {
+            return false;
+        }
+        if (*size < 0 || *size > UINT32_MAX) {
+            error(directive.pos, "invalid size");
+            return false;
+        }
+        emit(directive.pos, SpaceStmt{static_cast<u32>(*size)});
+        return true;
+    }
+    if (name == "incbin") {
+        return parse_incbin(directive);
+    }
+
+    error(directive.pos, fmt::format("unknown directive @{}", name));
+    return false;
+}
+
+bool Parser::parse_section(const Token& directive) {
+    const Token name = advance();
+    if (name.type != Token::Type::Identifier && name.type != Token::Type::StringLit) {
+        error(name.pos, "@section must be followed by a section name");
+        return false;
+    }
+
+    std::optional<u32> base;
+    if (accept(Token::Type::Comma)) {
+        const auto value = parse_constant();
+        if (!value) {
+            return false;
+        }
+        if (*value < 0 || *value > UINT32_MAX || *value % image::page_size != 0) {
+            error(directive.pos, "section base must be a page-aligned 32-bit address");
+            return false;
+        }
+        base = static_cast<u32>(*value);
+    }
+
+    const std::string& section_name = string_payload(name);
+    const auto iter = std::find_if(program.sections.begin(), program.sections.end(), [&](const auto& s) { return s.name == section_name; });
+    if (iter == program.sections.end()) {
+        program.sections.push_back(SectionDecl{section_name, base, {}});
+        section_index = program.sections.size() - 1;
+        return true;
+    }
+
+    section_index = static_cast<size_t>(iter - program.sections.begin());
+    if (base) {
+        if (iter->base && *iter->base != *base) {
+            error(directive.pos, fmt::format("conflicting base address for section {}", section_name));
+            return false;
+        }
+        iter->base = base;
+    }
+    return true;
+}
+
+bool Parser::parse_data(const Token& directive, u8 width) {
+    DataStmt stmt{width, {}};
+    do {
+        if (width == 1 && peek().type == Token::Type::StringLit) {
+            const Token str = advance();
+            for (const char c : string_payload(str)) {
+                stmt.values.push_back(program.exprs.constant(static_cast<u8>(c)));
+            }
+            continue;
+        }
+        const auto value = parse_expression();
+        if (!value) {
+            return false;
+        }
+        stmt.values.push_back(*value);
+    } while (accept(Token::Type::Comma));
+
+    emit(directive.pos, std::move(stmt));
+    return true;
+}
+
+bool Parser::parse_incbin(const Token& directive) {
+    const Token filename = advance();
+    if (filename.type != Token::Type::StringLit) {
+        error(filename.pos, "@incbin must be followed by a string");
+        return false;
+    }
+
+    std::filesystem::path path{string_payload(filename)};
+    if (path.is_relative()) {
+        path = std::filesystem::path{directive.pos.filename}.parent_path() / path;
+    }
+
+    auto file = MappedFile::open(path);
+    if (!file) {
+        error(filename.pos, fmt::format("could not read {}", path.string()));
+        return false;
+    }
+
+    s64 offset = 0;
+    s64 length = static_cast<s64>(file->size());
+    if (accept(Token::Type::Comma)) {
+        const auto value = parse_constant();
+        if (!value) {
+            return false;
+        }
+        offset = *value;
+        length -= offset;
+        if (accept(Token::Type::Comma)) {
+            const auto len = parse_constant();
+            if (!len) {
+                return false;
+            }
+            length = *len;
+        }
+    }
+
+    if (offset < 0 || length < 0 || static_cast<u64>(offset) + static_cast<u64>(length) > file->size() || length > UINT32_MAX) {
+        error(directive.pos, "@incbin range is outside of the file");
+        return false;
+    }
+
+    emit(directive.pos, IncbinStmt{std::make_shared<const MappedFile>(std::move(*file)), std::move(path), static_cast<u64>(offset), static_cast<u64>(length)});
+    return true;
+}
+
+std::optional<u8> Parser::parse_register() {
+    const Token t = advance();
+    if (t.type == Token::Type::Identifier) {
+        if (const auto reg = register_from_name(string_payload(t))) {
+            return reg;
+        }
+    }
+    error(t.pos, fmt::format("expected register, got `{}`", t.source_code));
+    return std::nullopt;
+}
+
+std::optional<ExprId> Parser::parse_expression(int min_precedence) {
+    auto lhs = parse_primary();
+    if (!lhs) {
+        return std::nullopt;
+    }
+
+    while (true) {
+        const auto op = peek().type;
+        const int precedence = binary_precedence(op);
+        if (precedence == 0 || precedence <= min_precedence) {
+            return lhs;
+        }
+        advance();
+
+        const auto rhs = parse_expression(precedence);
+        if (!rhs) {
+            return std::nullopt;
+        }
+        lhs = program.exprs.binary(op, *lhs, *rhs);
+    }
+}
+
+std::optional<ExprId> Parser::parse_primary() {
+    const Token t = advance();
+    switch (t.type) {
+    case Token::Type::NumericLit:
+        return program.exprs.constant(std::get<s64>(t.payload));
+    case Token::Type::Identifier:
+        if (register_from_name(string_payload(t))) {
+            error(t.pos, fmt::format("register {} cannot be used in an expression", string_payload(t)));
+            return std::nullopt;
+        }
+        return program.exprs.symbol(string_payload(t));
+    case Token::Type::Plus:
+    case Token::Type::Minus:
+    case Token::Type::BitNot:
+    case Token::Type::LogicNot: {
+        const auto operand = parse_primary();
+        if (!operand) {
+            return std::nullopt;
+        }
+        return program.exprs.unary(t.type, *operand);
+    }
+    case Token::Type::LParen: {
+        const auto inner = parse_expression();
+        if (!inner || !expect(Token::Type::RParen, "`)`")) {
+            return std::nullopt;
+        }
+        return inner;
+    }
+    case Token::Type::Error:
+        error(t.pos, string_payload(t));
+        return std::nullopt;
+    default:
+        error(t.pos, fmt::format("expected expression, got `{}`", t.source_code));
+        return std::nullopt;
+    }
+}
+
+std::optional<s64> Parser::parse_constant() {
+    const Position pos = peek().pos;
+    const auto expr = parse_expression();
+    if (!expr) {
+        return std::nullopt;
+    }
+
+    std::string message;
+    const auto value = evaluate(program.exprs, *expr, [](std::string_view) { return std::nullopt; }, message);
+    if (!value) {
+        error(pos, is_symbolic(program.exprs, *expr) ? "expression must be constant" : message);
+        return std::nullopt;
+    }
+    return value;
+}
+
+}
@@ -0,0 +1,69 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#pragma once
+
+#include <deque>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "smasm/lexer.hpp"
+#include "smasm/program.hpp"
+#include "smasm/token_reader.hpp"
+
+namespace stamina {
+
+// Parses the token stream of a translation unit into a Program.
+// Object-like macros defined with `@def name tokens...` are expanded here.
+struct Parser final {
+public:
+    Parser(TokenReader& reader, Program& program);
+
+    void parse();
+
+private:
+    struct PendingToken {
+        Token token;
+        std::shared_ptr<const std::vector<std::string>> hideset;
+    };
+
+    Token fetch();
+    PendingToken fetch_raw();
+    void define_macro(const Token& directive);
+
+    const Token& peek(size_t n = 0);
+    Token advance();
+    bool accept(Token::Type type);
+    bool expect(Token::Type type, const char* what);
+    void skip_line();
+    void error(const Position& pos, std::string message);
+
+    void parse_line();
+    bool parse_label();
+    bool parse_instruction();
+    bool parse_load_immediate();
+    bool parse_directive();
+    bool parse_data(const Token& directive, u8 width);
+    bool parse_incbin(const Token& directive);
+    bool parse_section(const Token& directive);
+
+    std::optional<u8> parse_register();
+    std::optional<ExprId> parse_expression(int min_precedence = 0);
+    std::optional<ExprId> parse_primary();
+    std::optional<s64> parse_constant();
+
+    SectionDecl& current_section();
+    void emit(const Position& pos, StatementBody body);
+
+    TokenReader& reader;
+    Program& program;
+    size_t section_index = 0;
+    std::unordered_map<std::string, std::vector<Token>> macros;
+    std::deque<PendingToken> pending;
+    std::deque<Token> lookahead;
+};
+
+}
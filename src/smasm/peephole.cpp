@@ -0,0 +1,250 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#include <algorithm>
+#include <array>
+#include <string_view>
+#include <vector>
+#include "common/instruction.hpp"
+#include "smasm/peephole.hpp"
+
+namespace stamina {
+
+namespace {
+
+struct Context {
+    Program& program;
+    std::vector<Statement>& statements;
+    PeepholeStats& stats;
+
+    InstructionStmt* inst(size_t i) {
+        return i < statements.size() ? std::get_if<InstructionStmt>(&statements[i].body) : nullptr;
+    }
+
+    std::optional<s64> constant(std::optional<ExprId> expr) const {
+        if (!expr || is_symbolic(program.exprs, *expr)) {
+            return std::nullopt;
+        }
+        std::string message;
+        return evaluate(program.exprs, *expr, [](std::string_view) { return std::nullopt; }, message);
+    }
+
+    void remove(size_t i, size_t count = 1) {
+        statements.erase(statements.begin() + i, statements.begin() + i + count);
+        stats.removed += count;
+    }
+
+    // Conservatively determines whether reg is overwritten before being read after statement i.
+    bool is_dead_after(size_t i, u8 reg) {
+        const u16 mask = u16(1) << reg;
+        for (size_t j = i + 1; j < statements.size(); j++) {
+            if (const auto* li = std::get_if<LoadImmStmt>(&statements[j].body)) {
+                if (li->rd == reg) {
+                    return true;
+                }
+                continue;
+            }
+            const auto* s = inst(j);
+            if (!s) {
+                return false;
+            }
+            const auto effects = register_effects(Instruction{s->opcode, s->rd, s->rs, s->rt, 0});
+            if (effects.reads & mask) {
+                return false;
+            }
+            if (effects.writes & mask) {
+                return true;
+            }
+            if (info(s->opcode).category == Category::BranchReg) {
+                return false;
+            }
+        }
+        return false;
+    }
+};
+
+// MOV rX, rX
+bool remove_self_move(Context& ctx, size_t i) {
+    const auto* s = ctx.inst(i);
+    if (!s || s->opcode != Opcode::MOV || s->rd != s->rs) {
+        return false;
+    }
+    ctx.remove(i);
+    return true;
+}
+
+// ADDI rX, rX, 0 and other operations with an identity immediate
+bool remove_identity_immediate(Context& ctx, size_t i) {
+    auto* s = ctx.inst(i);
+    if (!s) {
+        return false;
+    }
+
+    const auto value = ctx.constant(s->imm);
+    if (!value) {
+        return false;
+    }
+
+    bool identity = false;
+    switch (s->opcode) {
+    case Opcode::ADDI:
+    case Opcode::ORI:
+    case Opcode::XORI:
+    case Opcode::LSL:
+    case Opcode::LSR:
+    case Opcode::ASR:
+    case Opcode::ROR:
+        identity = *value == 0;
+        break;
+    case Opcode::MULTI:
+    case Opcode::DIVI:
+        identity = *value == 1;
+        break;
+    default:
+        break;
+    }
+    if (!identity) {
+        return false;
+    }
+
+    if (s->rd == s->rs) {
+        ctx.remove(i);
+    } else {
+        *s = InstructionStmt{Opcode::MOV, s->rd, s->rs, 0, std::nullopt};
+        ctx.stats.rewritten++;
+    }
+    return true;
+}
+
+// PUSH rX; POP rX
+bool remove_push_pop(Context& ctx, size_t i) {
+    const auto* push = ctx.inst(i);
+    const auto* pop = ctx.inst(i + 1);
+    if (!push || !pop || push->opcode != Opcode::PUSH || pop->opcode != Opcode::POP || push->rd != pop->rd || push->rd == reg_sp) {
+        return false;
+    }
+    ctx.remove(i, 2);
+    return true;
+}
+
+// MOV rA, rB; MOV rB, rA  or  MOV rA, rB; MOV rA, rB
+bool remove_redundant_move(Context& ctx, size_t i) {
+    const auto* a = ctx.inst(i);
+    const auto* b = ctx.inst(i + 1);
+    if (!a || !b || a->opcode != Opcode::MOV || b->opcode != Opcode::MOV) {
+        return false;
+    }
+    const bool swapped = a->rd == b->rs && a->rs == b->rd;
+    const bool repeated = a->rd == b->rd && a->rs == b->rs && a->rd != a->rs;
+    if (!swapped && !repeated) {
+        return false;
+    }
+    ctx.remove(i + 1);
+    return true;
+}
+
+// MOVI rT, imm; CMP/cc rA, rT  ->  CMPI/cc rA, imm  when rT is dead afterwards
+bool use_compare_immediate(Context& ctx, size_t i) {
+    const auto* cmp = ctx.inst(i + 1);
+    if (!cmp || info(cmp->opcode).category != Category::Compare || info(cmp->opcode).format != Format::S) {
+        return false;
+    }
+
+    u8 temp;
+    ExprId value;
+    if (const auto* movi = ctx.inst(i); movi && movi->opcode == Opcode::MOVI) {
+        temp = movi->rd;
+        value = *movi->imm;
+    } else if (const auto* li = std::get_if<LoadImmStmt>(&ctx.statements[i].body)) {
+        const auto c = ctx.constant(li->value);
+        if (!c || *c < -0x8000 || *c > 0x7FFF) {
+            return false;
+        }
+        temp = li->rd;
+        value = li->value;
+    } else {
+        return false;
+    }
+
+    u8 other;
+    if (cmp->rs == temp && cmp->rd != temp) {
+        other = cmp->rd;
+    } else if (cmp->opcode == Opcode::CMP_EQ && cmp->rd == temp && cmp->rs != temp) {
+        other = cmp->rs;
+    } else {
+        return false;
+    }
+
+    if (!ctx.is_dead_after(i + 1, temp)) {
+        return false;
+    }
+
+    ctx.statements[i + 1].body = InstructionStmt{compare_immediate_form(cmp->opcode), other, 0, 0, value};
+    ctx.remove(i);
+    ctx.stats.rewritten++;
+    return true;
+}
+
+using Rule = bool (*)(Context& ctx, size_t i);
+
+constexpr std::array<Rule, 5> rules{
+    remove_self_move,
+    remove_identity_immediate,
+    remove_push_pop,
+    remove_redundant_move,
+    use_compare_immediate,
+};
+
+// Code with hand-computed PC-relative offsets would be broken by removing instructions.
+bool has_position_dependent_code(const Program& program, const SectionDecl& section) {
+    const auto is_hand_computed = [&](ExprId id) {
+        std::vector<std::string_view> symbols;
+        collect_symbols(program.exprs, id, symbols);
+        return std::all_of(symbols.begin(), symbols.end(), [](std::string_view name) { return name == "."; });
+    };
+
+    for (const Statement& stmt : section.statements) {
+        if (const auto* s = std::get_if<InstructionStmt>(&stmt.body); s && s->imm) {
+            if ((s->opcode == Opcode::PCADDI || is_symbolic(program.exprs, *s->imm)) && is_hand_computed(*s->imm)) {
+                return true;
+            }
+        }
+        if (const auto* s = std::get_if<DataStmt>(&stmt.body)) {
+            for (const ExprId value : s->values) {
+                if (is_symbolic(program.exprs, value) && is_hand_computed(value)) {
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+}
+
+PeepholeStats optimize_peephole(Program& program) {
+    PeepholeStats stats;
+    for (SectionDecl& section : program.sections) {
+        if (has_position_dependent_code(program, section)) {
+            continue;
+        }
+
+        Context ctx{program, section.statements, stats};
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (size_t i = 0; i < section.statements.size(); i++) {
+                for (const Rule rule : rules) {
+                    if (rule(ctx, i)) {
+                        changed = true;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+    return stats;
+}
+
+}
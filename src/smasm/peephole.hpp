@@ -0,0 +1,21 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#pragma once
+
+#include "common/common_types.hpp"
+#include "smasm/program.hpp"
+
+namespace stamina {
+
+struct PeepholeStats {
+    size_t removed = 0;
+    size_t rewritten = 0;
+};
+
+// Applies local rewrite rules to runs of instructions that contain no labels or data.
+// Label addresses remain correct because layout happens afterwards.
+PeepholeStats optimize_peephole(Program& program);
+
+}
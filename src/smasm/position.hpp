@@ -2,6 +2,8 @@
 // Copyright (c) 2020 MerryMage
 // SPDX-License-Identifier: 0BSD
 
+#pragma once
+
 #include <tuple>
 #include <string>
 #include <fmt/format.h>
@@ -0,0 +1,84 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#pragma once
+
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <string>
+#include <variant>
+#include <vector>
+#include "common/common_types.hpp"
+#include "common/instruction.hpp"
+#include "common/mapped_file.hpp"
+#include "smasm/diagnostic.hpp"
+#include "smasm/expression.hpp"
+#include "smasm/position.hpp"
+
+namespace stamina {
+
+struct InstructionStmt {
+    Opcode opcode;
+    u8 rd = 0;
+    u8 rs = 0;
+    u8 rt = 0;
+    std::optional<ExprId> imm;
+};
+
+// The LI pseudo-instruction. Its expansion is chosen by relaxation once addresses are known.
+struct LoadImmStmt {
+    u8 rd;
+    ExprId value;
+};
+
+struct DataStmt {
+    u8 width;
+    std::vector<ExprId> values;
+};
+
+struct BytesStmt {
+    std::vector<u8> bytes;
+};
+
+struct AlignStmt {
+    u32 alignment;
+};
+
+struct SpaceStmt {
+    u32 size;
+};
+
+// Binary file contents referenced in place. The bytes never pass through the token stream.
+struct IncbinStmt {
+    std::shared_ptr<const MappedFile> file;
+    std::filesystem::path path;
+    u64 offset;
+    u64 length;
+};
+
+struct LabelStmt {
+    std::string name;
+};
+
+using StatementBody = std::variant<InstructionStmt, LoadImmStmt, DataStmt, BytesStmt, AlignStmt, SpaceStmt, IncbinStmt, LabelStmt>;
+
+struct Statement {
+    Position pos;
+    StatementBody body;
+};
+
+struct SectionDecl {
+    std::string name;
+    std::optional<u32> base;
+    std::vector<Statement> statements;
+};
+
+struct Program {
+    ExprArena exprs;
+    std::vector<SectionDecl> sections;
+    std::vector<Diagnostic> diagnostics;
+};
+
+}
@@ -0,0 +1,64 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#include <cstring>
+#include "common/overloaded.hpp"
+#include "smasm/parser.hpp"
+#include "smasm/peephole.hpp"
+#include "smasm/snippet_assembler.hpp"
+#include "smasm/token_reader.hpp"
+
+namespace stamina {
+
+SnippetAssembler::SnippetAssembler(SnippetOptions options) : options(std::move(options)) {}
+
+void SnippetAssembler::reset_program() {
+    // Keep the .text statement vector and the expression arena allocated across calls
+    program.exprs.clear();
+    program.diagnostics.clear();
+    program.sections.resize(1);
+    program.sections[0].name = ".text";
+    program.sections[0].base = options.base;
+    program.sections[0].statements.clear();
+}
+
+const SnippetResult& SnippetAssembler::assemble(std::string_view source) {
+    reset_program();
+
+    TokenReader reader;
+    reader.push_string(std::string{source}, options.filename);
+    Parser{reader, program}.parse();
+    if (options.optimize && program.diagnostics.empty()) {
+        optimize_peephole(program);
+    }
+
+    last = stamina::assemble(program);
+
+    result.base = options.base;
+    result.words.clear();
+    result.symbols = last.symbols;
+    result.diagnostics = last.diagnostics;
+
+    if (last.ok()) {
+        const Section& text = last.sections[0];
+        result.words.resize((text.size + 3) / 4);
+        u8* out = reinterpret_cast<u8*>(result.words.data());
+        for (const Chunk& chunk : text.chunks) {
+            std::visit(overloaded{
+                [&](const std::vector<u8>& bytes) {
+                    std::memcpy(out, bytes.data(), bytes.size());
+                    out += bytes.size();
+                },
+                [&](const FileChunk& file) {
+                    std::memcpy(out, file.file->data() + file.offset, file.length);
+                    out += file.length;
+                },
+            }, chunk);
+        }
+    }
+
+    return result;
+}
+
+}
@@ -0,0 +1,56 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#pragma once
+
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "common/common_types.hpp"
+#include "smasm/assembler.hpp"
+#include "smasm/diagnostic.hpp"
+#include "smasm/program.hpp"
+
+namespace stamina {
+
+struct SnippetOptions {
+    u32 base = 0;
+    bool optimize = false;
+    std::string filename = "(snippet)";
+};
+
+struct SnippetResult {
+    u32 base = 0;
+    std::vector<u32> words;
+    std::map<std::string, u32> symbols;
+    std::vector<Diagnostic> diagnostics;
+
+    bool ok() const { return diagnostics.empty(); }
+};
+
+// Assembles source buffers entirely in memory, for tools that generate code on the fly.
+//
+// words contains the encoded .text section placed at options.base. Storage is
+// reused between calls, so a single instance should be kept for many snippets.
+// The returned reference is valid until the next call to assemble.
+struct SnippetAssembler final {
+public:
+    explicit SnippetAssembler(SnippetOptions options = {});
+
+    const SnippetResult& assemble(std::string_view source);
+
+    // Full result of the last call, including any sections other than .text.
+    const AssemblyResult& assembly() const { return last; }
+
+private:
+    void reset_program();
+
+    SnippetOptions options;
+    Program program;
+    AssemblyResult last;
+    SnippetResult result;
+};
+
+}
@@ -0,0 +1,88 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#include <utility>
+#include "smasm/token_reader.hpp"
+
+namespace stamina {
+
+TokenReader::TokenReader(IncludeCache& cache) : cache(cache) {}
+
+bool TokenReader::push_file(const std::filesystem::path& path) {
+    auto stream = cache.get(path);
+    if (!stream) {
+        return false;
+    }
+    frames.push_back(Frame{std::move(stream), path.string(), path.parent_path()});
+    return true;
+}
+
+void TokenReader::push_string(std::string source, std::string filename) {
+    StringTokenizer tok{std::move(source), filename};
+    std::vector<Token> tokens;
+    while (true) {
+        auto t = tok.next_token();
+        if (t.type == Token::Type::EndOfFile) {
+            break;
+        }
+        tokens.push_back(std::move(t));
+    }
+    auto stream = std::make_shared<const TokenStream>(TokenStream::from_tokens(tokens));
+    auto directory = std::filesystem::path{filename}.parent_path();
+    frames.push_back(Frame{std::move(stream), std::move(filename), std::move(directory)});
+}
+
+std::optional<Token> TokenReader::take() {
+    while (!frames.empty()) {
+        Frame& frame = frames.back();
+        if (frame.index < frame.stream->size()) {
+            Token t = frame.stream->at(frame.index++, frame.filename);
+            last_pos = t.pos;
+            return t;
+        }
+        frames.pop_back();
+    }
+    return std::nullopt;
+}
+
+Token TokenReader::next_token() {
+    auto t = take();
+    if (!t) {
+        return Token{last_pos, Token::Type::EndOfFile, {}, ""};
+    }
+    if (t->type == Token::Type::Directive && std::get<std::string>(t->payload) == "include") {
+        return handle_include(*t);
+    }
+    return std::move(*t);
+}
+
+Token TokenReader::handle_include(const Token& directive) {
+    const auto error = [&directive](std::string msg) {
+        return Token{directive.pos, Token::Type::Error, std::move(msg), directive.source_code};
+    };
+
+    const auto filename = take();
+    if (!filename || filename->type != Token::Type::StringLit) {
+        return error("@include must be followed by a string");
+    }
+    const auto newline = take();
+    if (newline && newline->type != Token::Type::NewLine) {
+        return error("unexpected token after @include");
+    }
+
+    if (frames.size() >= max_include_depth) {
+        return error("@include nested too deeply");
+    }
+
+    std::filesystem::path path{std::get<std::string>(filename->payload)};
+    if (path.is_relative() && !frames.empty()) {
+        path = frames.back().directory / path;
+    }
+    if (!push_file(path)) {
+        return error("could not read included file " + path.string());
+    }
+    return next_token();
+}
+
+}
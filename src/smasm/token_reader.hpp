@@ -0,0 +1,46 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#pragma once
+
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+#include "smasm/include_cache.hpp"
+#include "smasm/lexer.hpp"
+#include "smasm/token_stream.hpp"
+
+namespace stamina {
+
+// Produces the token sequence of a translation unit, expanding `@include "file"`
+// directives in place. Included files are obtained from an IncludeCache.
+struct TokenReader final {
+public:
+    explicit TokenReader(IncludeCache& cache = IncludeCache::instance());
+
+    bool push_file(const std::filesystem::path& path);
+    void push_string(std::string source, std::string filename = "(unknown)");
+
+    Token next_token();
+
+private:
+    static constexpr size_t max_include_depth = 64;
+
+    struct Frame {
+        std::shared_ptr<const TokenStream> stream;
+        std::string filename;
+        std::filesystem::path directory;
+        size_t index = 0;
+    };
+
+    std::optional<Token> take();
+    Token handle_include(const Token& directive);
+
+    IncludeCache& cache;
+    std::vector<Frame> frames;
+    Position last_pos;
+};
+
+}
@@ -0,0 +1,215 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#include <cstring>
+#include <utility>
+#include "common/assert.hpp"
+#include "smasm/token_stream.hpp"
+
+namespace stamina {
+
+namespace {
+
+constexpr char magic[4] = {'S', 'M', 'T', 'K'};
+constexpr u32 format_version = 3;
+
+// Token::Type::Error and the tokens of token.inc
+constexpr u8 token_type_count = 1
+#define TOKEN(token) +1
+#include "smasm/token.inc"
+#undef TOKEN
+    ;
+
+struct Header {
+    char magic[4];
+    u32 version;
+    u64 source_mtime;
+    u64 source_size;
+    u32 token_count;
+    u32 pool_size;
+    // The source path comes first in the pool
+    u32 path_length;
+    u32 reserved;
+};
+static_assert(sizeof(Header) == 40);
+
+enum class PayloadKind : u8 {
+    None,
+    String,
+    Integer,
+};
+
+struct Record {
+    u8 type;
+    PayloadKind payload_kind;
+    u16 reserved;
+    u32 line;
+    u32 column;
+    u32 source_offset;
+    u32 source_length;
+    u32 string_length;
+    // Integer payload, or string payload offset into the pool
+    s64 value;
+};
+static_assert(sizeof(Record) == 32);
+
+template <typename T>
+T read_pod(const u8* ptr) {
+    T result;
+    std::memcpy(&result, ptr, sizeof(T));
+    return result;
+}
+
+}
+
+TokenStream::TokenStream(std::variant<std::vector<u8>, MappedFile> storage) : storage(std::move(storage)) {}
+
+TokenStream TokenStream::from_tokens(const std::vector<Token>& tokens, SourceStamp stamp) {
+    std::string pool;
+    std::vector<Record> records;
+    records.reserve(tokens.size());
+
+    const auto intern = [&pool](const std::string& str) {
+        const u32 offset = static_cast<u32>(pool.size());
+        pool += str;
+        return offset;
+    };
+
+    intern(stamp.path);
+    for (const Token& t : tokens) {
+        Record r{};
+        r.type = static_cast<u8>(t.type);
+        r.line = t.pos.line;
+        r.column = t.pos.column;
+        r.source_length = static_cast<u32>(t.source_code.size());
+        r.source_offset = intern(t.source_code);
+        if (const auto* str = std::get_if<std::string>(&t.payload)) {
+            r.payload_kind = PayloadKind::String;
+            r.string_length = static_cast<u32>(str->size());
+            r.value = intern(*str);
+        } else if (const auto* value = std::get_if<s64>(&t.payload)) {
+            r.payload_kind = PayloadKind::Integer;
+            r.value = *value;
+        } else {
+            r.payload_kind = PayloadKind::None;
+        }
+        records.push_back(r);
+    }
+
+    Header header{};
+    std::memcpy(header.magic, magic, sizeof(magic));
+    header.version = format_version;
+    header.source_mtime = stamp.mtime;
+    header.source_size = stamp.size;
+    header.token_count = static_cast<u32>(records.size());
+    header.pool_size = static_cast<u32>(pool.size());
+    header.path_length = static_cast<u32>(stamp.path.size());
+
+    std::vector<u8> image(sizeof(Header) + records.size() * sizeof(Record) + pool.size());
+    u8* ptr = image.data();
+    std::memcpy(ptr, &header, sizeof(Header));
+    ptr += sizeof(Header);
+    std::memcpy(ptr, records.data(), records.size() * sizeof(Record));
+    ptr += records.size() * sizeof(Record);
+    std::memcpy(ptr, pool.data(), pool.size());
+
+    return TokenStream{std::move(image)};
+}
+
+std::optional<TokenStream> TokenStream::from_bytes(std::vector<u8> image) {
+    TokenStream result{std::move(image)};
+    if (!result.validate()) {
+        return std::nullopt;
+    }
+    return result;
+}
+
+std::optional<TokenStream> TokenStream::from_file(MappedFile file) {
+    TokenStream result{std::move(file)};
+    if (!result.validate()) {
+        return std::nullopt;
+    }
+    return result;
+}
+
+std::span<const u8> TokenStream::image() const {
+    return std::visit([](const auto& s) { return std::span<const u8>{s.data(), s.size()}; }, storage);
+}
+
+bool TokenStream::validate() const {
+    const auto bytes = image();
+    if (bytes.size() < sizeof(Header)) {
+        return false;
+    }
+
+    const auto header = read_pod<Header>(bytes.data());
+    if (std::memcmp(header.magic, magic, sizeof(magic)) != 0 || header.version != format_version) {
+        return false;
+    }
+    if (bytes.size() != sizeof(Header) + u64{header.token_count} * sizeof(Record) + header.pool_size || header.path_length > header.pool_size) {
+        return false;
+    }
+
+    const u8* records = bytes.data() + sizeof(Header);
+    for (size_t i = 0; i < header.token_count; i++) {
+        const auto r = read_pod<Record>(records + i * sizeof(Record));
+        if (r.type >= token_type_count || u64{r.source_offset} + r.source_length > header.pool_size) {
+            return false;
+        }
+        switch (r.payload_kind) {
+        case PayloadKind::None:
+        case PayloadKind::Integer:
+            break;
+        case PayloadKind::String:
+            if (r.value < 0 || u64(r.value) + r.string_length > header.pool_size) {
+                return false;
+            }
+            break;
+        default:
+            return false;
+        }
+    }
+
+    return true;
+}
+
+SourceStamp TokenStream::stamp() const {
+    const auto bytes = image();
+    const auto header = read_pod<Header>(bytes.data());
+    const char* pool = reinterpret_cast<const char*>(bytes.data() + sizeof(Header) + header.token_count * sizeof(Record));
+    return SourceStamp{header.source_mtime, header.source_size, std::string(pool, header.path_length)};
+}
+
+size_t TokenStream::size() const {
+    return read_pod<Header>(image().data()).token_count;
+}
+
+Token TokenStream::at(size_t index, const std::string& filename) const {
+    const auto bytes = image();
+    const auto header = read_pod<Header>(bytes.data());
+    DEBUG_ASSERT(index < header.token_count);
+
+    const auto r = read_pod<Record>(bytes.data() + sizeof(Header) + index * sizeof(Record));
+    const char* pool = reinterpret_cast<const char*>(bytes.data() + sizeof(Header) + header.token_count * sizeof(Record));
+
+    Token result{
+        Position{filename, r.line, r.column},
+        static_cast<Token::Type>(r.type),
+        {},
+        std::string(pool + r.source_offset, r.source_length),
+    };
+    switch (r.payload_kind) {
+    case PayloadKind::None:
+        break;
+    case PayloadKind::String:
+        result.payload = std::string(pool + r.value, r.string_length);
+        break;
+    case PayloadKind::Integer:
+        result.payload = r.value;
+        break;
+    }
+    return result;
+}
+
+}
@@ -0,0 +1,52 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#pragma once
+
+#include <optional>
+#include <span>
+#include <string>
+#include <variant>
+#include <vector>
+#include "common/common_types.hpp"
+#include "common/mapped_file.hpp"
+#include "smasm/lexer.hpp"
+
+namespace stamina {
+
+// Identifies the source file a TokenStream was produced from, and its version.
+struct SourceStamp final {
+    u64 mtime = 0;
+    u64 size = 0;
+    // Canonical path of the file
+    std::string path;
+
+    friend auto operator<=>(const SourceStamp&, const SourceStamp&) = default;
+};
+
+// A fully tokenized source file in a compact, position-independent binary form.
+//
+// The image consists of a header, an array of fixed-size token records and a
+// string pool. The same image is used in memory and on disk, so a stream loaded
+// from a cache file is used directly out of the mapping without any parsing.
+struct TokenStream final {
+public:
+    static TokenStream from_tokens(const std::vector<Token>& tokens, SourceStamp stamp = {});
+    static std::optional<TokenStream> from_bytes(std::vector<u8> image);
+    static std::optional<TokenStream> from_file(MappedFile file);
+
+    SourceStamp stamp() const;
+    size_t size() const;
+    Token at(size_t index, const std::string& filename) const;
+
+    std::span<const u8> image() const;
+
+private:
+    explicit TokenStream(std::variant<std::vector<u8>, MappedFile> storage);
+    bool validate() const;
+
+    std::variant<std::vector<u8>, MappedFile> storage;
+};
+
+}
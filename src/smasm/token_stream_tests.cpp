@@ -0,0 +1,130 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <catch.hpp>
+#include "common/common_types.hpp"
+#include "smasm/include_cache.hpp"
+#include "smasm/lexer.hpp"
+#include "smasm/token_reader.hpp"
+#include "smasm/token_stream.hpp"
+
+using namespace stamina;
+
+namespace {
+
+std::vector<Token> read_all(TokenReader& reader) {
+    std::vector<Token> tokens;
+    while (true) {
+        const auto t = reader.next_token();
+        if (t.type == Token::Type::EndOfFile) {
+            break;
+        }
+        tokens.push_back(t);
+    }
+    return tokens;
+}
+
+}
+
+TEST_CASE("token stream: round trip", "[smasm]") {
+    StringTokenizer tok{"@def foo 0x10 ; comment\nmovi r1, 'a'\n`raw`", "a.s"};
+    std::vector<Token> tokens;
+    while (true) {
+        const auto t = tok.next_token();
+        if (t.type == Token::Type::EndOfFile) {
+            break;
+        }
+        tokens.push_back(t);
+    }
+
+    const auto stream = TokenStream::from_tokens(tokens, SourceStamp{1, 2, "/src/a.s"});
+    const auto image = stream.image();
+    const auto loaded = TokenStream::from_bytes(std::vector<u8>(image.begin(), image.end()));
+    REQUIRE(loaded);
+    REQUIRE(loaded->stamp() == SourceStamp{1, 2, "/src/a.s"});
+    REQUIRE(loaded->size() == tokens.size());
+    for (size_t i = 0; i < tokens.size(); i++) {
+        REQUIRE(loaded->at(i, "a.s") == tokens[i]);
+    }
+
+    std::vector<u8> truncated(image.begin(), image.end() - 1);
+    REQUIRE(!TokenStream::from_bytes(truncated));
+
+    // The type of the first record, after the 40-byte header, is out of range
+    std::vector<u8> bad_type(image.begin(), image.end());
+    REQUIRE(bad_type[40] == static_cast<u8>(Token::Type::Directive));
+    bad_type[40] = 0xff;
+    REQUIRE(!TokenStream::from_bytes(bad_type));
+}
+
+TEST_CASE("token reader: include from cache", "[smasm]") {
+    const auto dir = std::filesystem::temp_directory_path() / "stamina-include-cache-test";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+    std::ofstream{dir / "consts.inc"} << "@def answer 42\n";
+
+    IncludeCache cache;
+    cache.set_disk_cache_directory(dir / "cache");
+
+    for (int i = 0; i < 2; i++) {
+        TokenReader reader{cache};
+        reader.push_string("@include \"consts.inc\"\nmovi r0, answer\n", (dir / "main.s").string());
+        const auto tokens = read_all(reader);
+        REQUIRE(tokens.size() == 9);
+        REQUIRE(tokens[0].type == Token::Type::Directive);
+        REQUIRE(tokens[0].pos.filename == (dir / "consts.inc").string());
+        REQUIRE(tokens[2].payload == decltype(tokens[2].payload){s64{42}});
+        REQUIRE(tokens[4].type == Token::Type::Mnemonic);
+    }
+    REQUIRE(cache.stats().misses == 1);
+    REQUIRE(cache.stats().memory_hits == 1);
+
+    IncludeCache fresh;
+    fresh.set_disk_cache_directory(dir / "cache");
+    REQUIRE(fresh.get(dir / "consts.inc"));
+    REQUIRE(fresh.stats().disk_hits == 1);
+
+    std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("include cache: an image is only used for its own file", "[smasm]") {
+    const auto dir = std::filesystem::temp_directory_path() / "stamina-include-cache-path-test";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+    const auto cache_dir = dir / "cache";
+    const auto cached_images = [&] {
+        std::vector<std::filesystem::path> images;
+        for (const auto& entry : std::filesystem::directory_iterator{cache_dir}) {
+            images.push_back(entry.path());
+        }
+        return images;
+    };
+
+    // Same size and modification time
+    std::ofstream{dir / "a.inc"} << "@def value 1\n";
+    std::ofstream{dir / "b.inc"} << "@def value 2\n";
+    std::filesystem::last_write_time(dir / "b.inc", std::filesystem::last_write_time(dir / "a.inc"));
+
+    IncludeCache cache;
+    cache.set_disk_cache_directory(cache_dir);
+    REQUIRE(cache.get(dir / "b.inc"));
+    const auto b_image = cached_images().at(0);
+    std::filesystem::remove(b_image);
+    REQUIRE(cache.get(dir / "a.inc"));
+
+    // Pretend the names of the two images collide
+    std::filesystem::rename(cached_images().at(0), b_image);
+    IncludeCache fresh;
+    fresh.set_disk_cache_directory(cache_dir);
+    const auto stream = fresh.get(dir / "b.inc");
+    REQUIRE(stream);
+    REQUIRE(fresh.stats().disk_hits == 0);
+    REQUIRE(stream->at(2, "b.inc").payload == decltype(Token::payload){s64{2}});
+
+    std::filesystem::remove_all(dir);
+}
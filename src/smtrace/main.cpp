@@ -0,0 +1,100 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <fmt/format.h>
+#include "common/instruction.hpp"
+#include "common/mapped_file.hpp"
+#include "stamina/trace.hpp"
+
+using namespace stamina;
+
+namespace {
+
+void usage() {
+    fmt::print(stderr, "usage: smtrace [--core N] [--skip N] [--count N] trace.bin\n");
+}
+
+std::string format_entry(const TraceEntry& entry) {
+    std::string result = fmt::format("{} {:08x}: ", entry.core, entry.record.pc);
+    const auto inst = decode(entry.record.word);
+    if (!inst) {
+        return result + fmt::format(".word {:08x}", entry.record.word);
+    }
+    result += disassemble(*inst);
+
+    if (entry.delta) {
+        if (register_effects(*inst).writes & (1u << inst->rd)) {
+            result += fmt::format("  ; r{} = {:08x}", inst->rd, entry.delta->value);
+        }
+        if (info(inst->opcode).category == Category::Memory) {
+            result += fmt::format("  ; [{:08x}]", entry.delta->address);
+        }
+    }
+    return result;
+}
+
+}
+
+int main(int argc, char** argv) {
+    std::optional<std::filesystem::path> input;
+    std::optional<u32> core;
+    u64 skip = 0;
+    u64 count = UINT64_MAX;
+
+    for (int i = 1; i < argc; i++) {
+        const std::string_view arg = argv[i];
+        if (arg == "--core" && i + 1 < argc) {
+            core = static_cast<u32>(std::strtoul(argv[++i], nullptr, 0));
+        } else if (arg == "--skip" && i + 1 < argc) {
+            skip = std::strtoull(argv[++i], nullptr, 0);
+        } else if (arg == "--count" && i + 1 < argc) {
+            count = std::strtoull(argv[++i], nullptr, 0);
+        } else if (!arg.empty() && arg[0] != '-' && !input) {
+            input = arg;
+        } else {
+            usage();
+            return 1;
+        }
+    }
+
+    if (!input) {
+        usage();
+        return 1;
+    }
+
+    const auto file = MappedFile::open(*input);
+    if (!file) {
+        fmt::print(stderr, "smtrace: could not read {}\n", input->string());
+        return 1;
+    }
+    TraceParser parser{file->bytes()};
+    if (!parser.valid()) {
+        fmt::print(stderr, "smtrace: {} is not a trace\n", input->string());
+        return 1;
+    }
+
+    // Entries are only decoded once they are selected
+    while (count > 0) {
+        const auto entry = parser.next();
+        if (!entry) {
+            break;
+        }
+        if (core && entry->core != *core) {
+            continue;
+        }
+        if (skip > 0) {
+            skip--;
+            continue;
+        }
+        fmt::print("{}\n", format_entry(*entry));
+        count--;
+    }
+    return 0;
+}
@@ -0,0 +1,393 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#include <algorithm>
+#include "common/assert.hpp"
+#include "stamina/block_cache.hpp"
+#include "stamina/interpreter.hpp"
+#include "stamina/ir/passes.hpp"
+#include "stamina/mmu.hpp"
+#include "stamina/semantics.hpp"
+
+namespace stamina {
+
+namespace {
+
+template <Opcode op>
+Step run_micro_op(CpuState& state, Memory& memory, const MicroOp& u) {
+    return execute<op>(state, memory, Operands{u.rd, u.rs, u.rt, u.imm});
+}
+
+template <Opcode op>
+MicroOp decode_micro_op(u32 word) {
+    const Operands o = extract_operands<op>(word);
+    return MicroOp{&run_micro_op<op>, op, static_cast<u8>(o.rd), static_cast<u8>(o.rs), static_cast<u8>(o.rt), o.imm};
+}
+
+// Micro-op constructors indexed by Opcode
+constexpr MicroOp (*micro_op_factories[])(u32) = {
+#define INSTRUCTION(name, ...) &decode_micro_op<Opcode::name>,
+#define COMPAREINST(name, cond, ...) &decode_micro_op<Opcode::name##_##cond>,
+#include "common/instructions.inc"
+#undef INSTRUCTION
+#undef COMPAREINST
+};
+static_assert(std::size(micro_op_factories) == num_opcodes);
+
+// Micro-op handlers indexed by Opcode
+constexpr MicroOpHandler micro_op_handlers[] = {
+#define INSTRUCTION(name, ...) &run_micro_op<Opcode::name>,
+#define COMPAREINST(name, cond, ...) &run_micro_op<Opcode::name##_##cond>,
+#include "common/instructions.inc"
+#undef INSTRUCTION
+#undef COMPAREINST
+};
+static_assert(std::size(micro_op_handlers) == num_opcodes);
+
+}
+
+MicroOp make_micro_op(Opcode op, u8 rd, u8 rs, u8 rt, u32 imm) {
+    return MicroOp{micro_op_handlers[static_cast<size_t>(op)], op, rd, rs, rt, imm};
+}
+
+namespace {
+
+template <typename Fetch>
+DecodedBlock decode_block_with(u32 pc, Fetch&& fetch) {
+    DecodedBlock block;
+    block.start_pc = pc;
+    while (block.ops.size() < BlockCache::max_block_length) {
+        u32 word;
+        if (!fetch(block.end_pc(), word)) {
+            break;
+        }
+        const u8 index = opcode_decode_table[word >> 24];
+        if (index == invalid_opcode_index) {
+            break;
+        }
+        block.ops.push_back(micro_op_factories[index](word));
+        const Opcode opcode = static_cast<Opcode>(index);
+#if defined(STAMINA_HAS_INSTRUCTION_COUNTS)
+        block.opcodes.push_back(opcode);
+#endif
+        if (info(opcode).category == Category::BranchReg || opcode == Opcode::MTOC) {
+            break;
+        }
+    }
+    return block;
+}
+
+}
+
+DecodedBlock decode_block(const Memory& memory, u32 pc) {
+    return decode_block_with(pc, [&](u32 address, u32& word) { return memory.fetch(address, word); });
+}
+
+DecodedBlock decode_block(const CpuState& state, const Memory& memory, u32 pc) {
+    if (!state.paging()) {
+        return decode_block(memory, pc);
+    }
+
+    // Walk once per page rather than once per instruction
+    u32 page = invalid_tlb_tag;
+    u32 physical_page = 0;
+    return decode_block_with(pc, [&](u32 address, u32& word) {
+        if ((address & page_mask) != page) {
+            if (!walk_page_table(state, memory, address & page_mask, false, physical_page)) {
+                return false;
+            }
+            page = address & page_mask;
+        }
+        return memory.fetch(physical_page | (address & ~page_mask), word);
+    });
+}
+
+void protect_block(const CpuState& state, const Memory& memory, u32 pc) {
+    constexpr u32 max_block_bytes = BlockCache::max_block_length * 4;
+    if (!state.paging()) {
+        memory.protect_code(pc, max_block_bytes);
+        return;
+    }
+    // A block spans at most two pages
+    for (const u32 address : {pc, pc + max_block_bytes - 1}) {
+        u32 physical;
+        if (walk_page_table(state, memory, address & page_mask, false, physical)) {
+            memory.protect_code(physical, page_size);
+        }
+    }
+}
+
+void CodeWriteTracker::add(u64 memory_id, const DecodedBlock& block) {
+    for (u32 p = page(block.start_pc); p <= page(block.end_pc() - 1); p++) {
+        pages[p].push_back(block.start_pc);
+    }
+    // Only the memory the block came from protects its pages
+    if (memory_id != current) {
+        leave();
+    }
+}
+
+void CodeWriteTracker::remove(const DecodedBlock& block) {
+    for (u32 p = page(block.start_pc); p <= page(block.end_pc() - 1); p++) {
+        const auto iter = pages.find(p);
+        auto& starts = iter.value();
+        starts.erase(std::find(starts.begin(), starts.end(), block.start_pc));
+        if (starts.empty()) {
+            pages.erase(iter);
+        }
+    }
+}
+
+std::vector<u32> CodeWriteTracker::blocks_on(u32 address, u32 size) const {
+    std::vector<u32> result;
+    if (size == 0) {
+        return result;
+    }
+    const u32 first = page(address);
+    const u32 last = page(static_cast<u32>(std::min<u64>(u64{address} + size, u64{1} << 32) - 1));
+    const auto take = [&](const std::vector<u32>& starts) { result.insert(result.end(), starts.begin(), starts.end()); };
+    if (u64{last} - first + 1 > pages.size()) {
+        for (const auto& [p, starts] : pages) {
+            if (p >= first && p <= last) {
+                take(starts);
+            }
+        }
+    } else {
+        for (u32 p = first; p <= last; p++) {
+            if (const auto iter = pages.find(p); iter != pages.end()) {
+                take(iter->second);
+            }
+        }
+    }
+    return result;
+}
+
+void CodeWriteTracker::leave() {
+    if (current != 0) {
+        others[current] = seen;
+        current = 0;
+    }
+}
+
+void CodeWriteTracker::forget(const Memory& memory) {
+    others.erase(memory.id());
+    if (current == memory.id()) {
+        current = 0;
+    }
+}
+
+void CodeWriteTracker::sync(const Memory& written, const std::function<void(u32, u32)>& invalidate, const std::function<void()>& clear) {
+    if (written.id() != current) {
+        leave();
+        ASSERT(pages.empty() || written.code_page_offset() == page_offset);
+        page_offset = written.code_page_offset();
+        current = written.id();
+        seen = 0;
+        if (const auto iter = others.find(current); iter != others.end()) {
+            seen = iter->second;
+            others.erase(iter);
+        }
+        for (const auto& [p, starts] : pages) {
+            const u64 start = std::max<u64>(u64{p} << Memory::code_page_bits, page_offset) - page_offset;
+            written.protect_code(static_cast<u32>(start), 1);
+        }
+    }
+
+    const u64 count = written.code_write_count();
+    std::vector<CodeWrite> writes;
+    if (!written.visit_code_writes(seen, [&](const CodeWrite& write) { writes.push_back(write); })) {
+        clear();
+    }
+    seen = count;
+
+    for (const CodeWrite& write : writes) {
+        invalidate(write.address, write.size);
+    }
+    for (const CodeWrite& write : writes) {
+        for (u32 p = page(write.address); p <= page(write.address + write.size - 1); p++) {
+            if (pages.contains(p)) {
+                written.protect_code(write.address, write.size);
+                break;
+            }
+        }
+    }
+}
+
+const DecodedBlock* BlockCache::get_slow(const CpuState& state, const Memory& memory, u32 pc) {
+    if (state.mmu_generation != generation) {
+        // Blocks were decoded under a different translation
+        clear();
+        generation = state.mmu_generation;
+    }
+    if (!code_writes.up_to_date(memory)) {
+        code_writes.sync(
+            memory, [&](u32 address, u32 size) { state.paging() ? clear() : invalidate(address, size); }, [&] { clear(); });
+    }
+
+    const DecodedBlock* result;
+    if (const auto iter = blocks.find(pc); iter != blocks.end()) {
+        result = iter->second.get();
+    } else {
+        protect_block(state, memory, pc);
+        auto block = std::make_unique<DecodedBlock>(decode_block(state, memory, pc));
+        if (block->ops.empty()) {
+            return nullptr;
+        }
+        ir::specialize(*block, options, stats);
+        result = blocks.emplace(pc, std::move(block)).first->second.get();
+        code_writes.add(memory.id(), *result);
+    }
+    fast_lookup[(pc >> 2) % fast_lookup_size] = result;
+    return result;
+}
+
+void BlockCache::invalidate(u32 address, u32 size) {
+    const u64 end = u64{address} + size;
+    for (const u32 pc : code_writes.blocks_on(address, size)) {
+        const auto iter = blocks.find(pc);
+        if (iter == blocks.end()) {
+            continue;
+        }
+        const DecodedBlock& block = *iter->second;
+        if (block.start_pc < end && address < u64{block.end_pc()}) {
+            auto& slot = fast_lookup[(block.start_pc >> 2) % fast_lookup_size];
+            if (slot == &block) {
+                slot = nullptr;
+            }
+            code_writes.remove(block);
+            blocks.erase(iter);
+        }
+    }
+}
+
+void BlockCache::clear() {
+    fast_lookup.fill(nullptr);
+    blocks.clear();
+    code_writes.clear();
+}
+
+namespace {
+
+// Counts the first count instructions of block as retired.
+FORCE_INLINE void count_block([[maybe_unused]] CpuState& state, [[maybe_unused]] const DecodedBlock& block, [[maybe_unused]] size_t count) {
+#if defined(STAMINA_HAS_INSTRUCTION_COUNTS)
+    for (size_t i = 0; i < count; i++) {
+        state.counts[block.opcodes[i]]++;
+    }
+#endif
+}
+
+}
+
+#if defined(STAMINA_HAS_COMPUTED_GOTO)
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+StopReason interpret_cached(CpuState& state, Memory& memory, BlockCache& cache, u64 budget) {
+    // Inline handlers indexed by Opcode; the hot loop avoids the indirect call through MicroOp::handler
+    static const void* const handlers[] = {
+#define INSTRUCTION(name, ...) &&op_##name,
+#define COMPAREINST(name, cond, ...) &&op_##name##_##cond,
+#include "common/instructions.inc"
+#undef INSTRUCTION
+#undef COMPAREINST
+    };
+    static_assert(std::size(handlers) == num_opcodes);
+
+    while (budget > 0) {
+        const DecodedBlock* block = cache.get(state, memory, state.pc);
+        if (!block) [[unlikely]] {
+            // Let the interpreter report the fetch fault or invalid instruction
+            return interpret(state, memory, 1);
+        }
+
+        const MicroOp* op = block->ops.data();
+        const MicroOp* const end = op + std::min<u64>(block->ops.size(), budget);
+        Step step;
+
+#define DISPATCH()                                                                               \
+        do {                                                                                     \
+            if (op == end) [[unlikely]] {                                                        \
+                goto block_done;                                                                 \
+            }                                                                                    \
+            goto *handlers[static_cast<u8>(op->opcode)];                                         \
+        } while (false)
+
+        DISPATCH();
+
+#define INSTRUCTION(name, ...)                                                                   \
+    op_##name:                                                                                   \
+        step = execute<Opcode::name>(state, memory, Operands{op->rd, op->rs, op->rt, op->imm});  \
+        if (step != Step::Continue) [[unlikely]] {                                               \
+            goto stop;                                                                           \
+        }                                                                                        \
+        op++;                                                                                    \
+        if constexpr (writes_memory(Opcode::name)) {                                             \
+            if (cache.behind(memory)) [[unlikely]] {                                             \
+                goto block_done;                                                                 \
+            }                                                                                    \
+        }                                                                                        \
+        DISPATCH();
+#define COMPAREINST(name, cond, ...) INSTRUCTION(name##_##cond)
+#include "common/instructions.inc"
+#undef INSTRUCTION
+#undef COMPAREINST
+
+#undef DISPATCH
+
+    stop: {
+        // An instruction that stops the core completes; a faulting one does not
+        const u64 count = static_cast<u64>(op - block->ops.data()) + (step != Step::MemoryFault ? 1 : 0);
+        state.retired += count;
+        count_block(state, *block, count);
+        return stop_reason(step);
+    }
+
+    block_done:
+        const u64 count = static_cast<u64>(op - block->ops.data());
+        state.retired += count;
+        count_block(state, *block, count);
+        budget -= count;
+    }
+    return StopReason::BudgetExhausted;
+}
+
+#pragma GCC diagnostic pop
+
+#else
+
+StopReason interpret_cached(CpuState& state, Memory& memory, BlockCache& cache, u64 budget) {
+    while (budget > 0) {
+        const DecodedBlock* block = cache.get(state, memory, state.pc);
+        if (!block) [[unlikely]] {
+            // Let the interpreter report the fetch fault or invalid instruction
+            return interpret(state, memory, 1);
+        }
+
+        size_t count = static_cast<size_t>(std::min<u64>(block->ops.size(), budget));
+        for (size_t i = 0; i < count; i++) {
+            const MicroOp& op = block->ops[i];
+            const Step step = op.handler(state, memory, op);
+            if (step != Step::Continue) [[unlikely]] {
+                // An instruction that stops the core completes; a faulting one does not
+                state.retired += i + (step != Step::MemoryFault ? 1 : 0);
+                count_block(state, *block, i + (step != Step::MemoryFault ? 1 : 0));
+                return stop_reason(step);
+            }
+            if (writes_memory(op.opcode) && cache.behind(memory)) [[unlikely]] {
+                count = i + 1;
+                break;
+            }
+        }
+        state.retired += count;
+        count_block(state, *block, count);
+        budget -= count;
+    }
+    return StopReason::BudgetExhausted;
+}
+
+#endif
+
+}
@@ -0,0 +1,153 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#pragma once
+
+#include <array>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <tsl/robin_map.h>
+#include "common/common_types.hpp"
+#include "common/instruction.hpp"
+#include "common/macros.hpp"
+#include "stamina/cpu_state.hpp"
+#include "stamina/ir/passes.hpp"
+#include "stamina/memory.hpp"
+
+namespace stamina {
+
+struct MicroOp;
+enum class Step;
+
+using MicroOpHandler = Step (*)(CpuState& state, Memory& memory, const MicroOp& op);
+
+// A pre-decoded instruction: a direct pointer to its execute<op> specialization plus its operand fields.
+struct MicroOp {
+    MicroOpHandler handler;
+    Opcode opcode;
+    u8 rd;
+    u8 rs;
+    u8 rt;
+    u32 imm;
+};
+static_assert(sizeof(MicroOp) == 16);
+
+// Builds a micro-op from already extracted operand fields. imm may be any 32-bit value.
+MicroOp make_micro_op(Opcode op, u8 rd, u8 rs, u8 rt, u32 imm);
+
+// Straight-line guest code starting at start_pc. A block ends after the first register branch or
+// MTOC, before the first undecodable word, or after max_block_length instructions. Ending at MTOC
+// returns control to the caller, which must check CpuState::mmu_generation before going on.
+struct DecodedBlock {
+    u32 start_pc;
+    std::vector<MicroOp> ops;
+#if defined(STAMINA_HAS_INSTRUCTION_COUNTS)
+    // Opcodes as decoded, before specialization rewrites any
+    std::vector<Opcode> opcodes;
+#endif
+
+    u32 end_pc() const { return start_pc + static_cast<u32>(ops.size()) * 4; }
+};
+
+// Decodes the block starting at pc. The result is empty if the first word cannot be fetched or decoded.
+DecodedBlock decode_block(const Memory& memory, u32 pc);
+// As above, fetching through the address translation of state.
+DecodedBlock decode_block(const CpuState& state, const Memory& memory, u32 pc);
+
+// Protects the pages a block at pc may be decoded from against writes, translating pc through state.
+// Done before decoding, so that no write after the block is read goes unrecorded.
+void protect_block(const CpuState& state, const Memory& memory, u32 pc);
+
+// The blocks a code cache holds on each code page, and the code writes recorded by Memory that it
+// has seen. A cache may run with several memories of the same size holding the same code, as
+// machines sharing translated code do; see machine.hpp. Each memory's code writes are followed
+// separately, and on changing memories every page holding blocks is protected in the new one.
+struct CodeWriteTracker final {
+public:
+    FORCE_INLINE bool up_to_date(const Memory& memory) const { return memory.id() == current && memory.code_write_count() == seen; }
+
+    // Adds a block decoded from the memory with id memory_id.
+    void add(u64 memory_id, const DecodedBlock& block);
+    // Forgets a block passed to add.
+    void remove(const DecodedBlock& block);
+    void clear() { pages.clear(); }
+    // Start PCs of the blocks on the pages overlapping [address, address + size), among them every
+    // block overlapping the range. A block on two of the pages is listed twice.
+    std::vector<u32> blocks_on(u32 address, u32 size) const;
+
+    // Calls invalidate with each code write to memory not yet seen, or clear if some are no longer
+    // kept. Then protects the written pages again where blocks remain.
+    void sync(const Memory& memory, const std::function<void(u32 address, u32 size)>& invalidate, const std::function<void()>& clear);
+    // Stops following memory, which the cache will not run with again.
+    void forget(const Memory& memory);
+
+private:
+    u32 page(u32 address) const { return static_cast<u32>((u64{address} + page_offset) >> Memory::code_page_bits); }
+    // Until the next sync, follows no memory.
+    void leave();
+
+    // Memory the cache last ran with, and its code writes seen
+    u64 current = 0;
+    u64 seen = 0;
+    // Code writes seen of the other memories
+    tsl::robin_map<u64, u64> others;
+    // Numbers the pages, as Memory::code_page does for every memory followed
+    u32 page_offset = 0;
+    // Start PCs of the blocks on each page
+    tsl::robin_map<u32, std::vector<u32>> pages;
+};
+
+// Decoded blocks keyed by guest PC. Blocks are specialized with the IR constant passes enabled in options.
+// The cache drops blocks overlapping code writes recorded by Memory at the next lookup; callers
+// modifying code by other means must invalidate. It empties itself when address translation
+// changes, and on any code write while paging is enabled, as blocks are keyed by virtual address.
+struct BlockCache final {
+public:
+    static constexpr size_t max_block_length = 64;
+
+    explicit BlockCache(const ir::Options& options = {}) : options(options) {}
+
+    // Returns the block at pc, decoding it on first use. Returns nullptr if nothing at pc is decodable.
+    FORCE_INLINE const DecodedBlock* get(const CpuState& state, const Memory& memory, u32 pc) {
+        const DecodedBlock* block = fast_lookup[(pc >> 2) % fast_lookup_size];
+        if (block && block->start_pc == pc && state.mmu_generation == generation && code_writes.up_to_date(memory)) [[likely]] {
+            return block;
+        }
+        return get_slow(state, memory, pc);
+    }
+
+    // Whether code writes were recorded that the cache has not dropped blocks for yet.
+    FORCE_INLINE bool behind(const Memory& memory) const { return !code_writes.up_to_date(memory); }
+
+    // Drops every block overlapping [address, address + size).
+    void invalidate(u32 address, u32 size);
+    void clear();
+    // Forgets memory, which the cache will not run with again.
+    void forget(const Memory& memory) { code_writes.forget(memory); }
+
+    size_t size() const { return blocks.size(); }
+    const ir::Stats& ir_stats() const { return stats; }
+
+private:
+    const DecodedBlock* get_slow(const CpuState& state, const Memory& memory, u32 pc);
+
+    // Direct-mapped front for the hash map, indexed by word address
+    static constexpr size_t fast_lookup_size = 4096;
+    std::array<const DecodedBlock*, fast_lookup_size> fast_lookup{};
+
+    tsl::robin_map<u32, std::unique_ptr<DecodedBlock>> blocks;
+    // CpuState::mmu_generation the blocks were decoded under
+    u32 generation = 0;
+    CodeWriteTracker code_writes;
+
+    ir::Options options;
+    ir::Stats stats;
+};
+
+// Executes at most budget instructions starting at state.pc, running from decoded blocks.
+// Behaves identically to interpret. A store that writes code ends its block.
+StopReason interpret_cached(CpuState& state, Memory& memory, BlockCache& cache, u64 budget);
+
+}
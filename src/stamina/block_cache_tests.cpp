@@ -0,0 +1,195 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#include <string>
+#include <catch.hpp>
+#include "common/common_types.hpp"
+#include "stamina/block_cache.hpp"
+#include "stamina/cpu_state.hpp"
+#include "stamina/interpreter.hpp"
+#include "stamina/memory.hpp"
+#include "stamina/test_program.hpp"
+
+using namespace stamina;
+using namespace stamina::test;
+
+namespace {
+
+
+const std::string call_program =
+    "    movi r1, 10\n"
+    "    movi r2, 0\n"
+    "    li r3, function\n"
+    "    li r5, loop\n"
+    "loop:\n"
+    "    rcall r3\n"
+    "    addi r1, r1, -1\n"
+    "    cmpi/eq r1, 0\n"
+    "    pcaddi r4, 12\n"
+    "    mf r4, r5\n"
+    "    robra r4, r0\n"
+    "    mtoc r15, r2\n"
+    "function:\n"
+    "    push r1\n"
+    "    add r2, r2, r1\n"
+    "    pop r1\n"
+    "    ret\n";
+
+// Patches a block that has already run, then the instruction after the store in its own block.
+// Halts with 11 if both patches take effect.
+const std::string self_modifying_program =
+    "    li r5, target\n"
+    "    rcall r5\n"
+    "    li r1, template\n"
+    "    ld r2, r1, 0\n"
+    "    st r2, r5, 0\n"
+    "    rcall r5\n"
+    "    li r1, template2\n"
+    "    ld r2, r1, 0\n"
+    "    pcaddi r6, 8\n"
+    "    st r2, r6, 0\n"
+    "    movi r4, 1\n"
+    "    add r3, r3, r4\n"
+    "    mtoc r15, r3\n"
+    "target:\n"
+    "    movi r3, 7\n"
+    "    ret\n"
+    "template:\n"
+    "    movi r3, 9\n"
+    "template2:\n"
+    "    movi r4, 2\n";
+
+}
+
+TEST_CASE("block cache: blocks end at register branches", "[stamina]") {
+    Memory memory{ram_size};
+    CpuState state;
+    load_program(memory, state, call_program);
+
+    const DecodedBlock entry = decode_block(memory, 0);
+    REQUIRE(entry.ops.size() == 5);
+    REQUIRE(entry.ops.back().opcode == Opcode::RCALL);
+    REQUIRE(entry.ops[0].opcode == Opcode::MOVI);
+    REQUIRE(entry.ops[0].rd == 1);
+    REQUIRE(entry.ops[0].imm == 10);
+
+    std::memset(memory.bytes().data() + 8, 0xFF, 4);
+    REQUIRE(decode_block(memory, 0).ops.size() == 2);
+    REQUIRE(decode_block(memory, 8).ops.empty());
+    REQUIRE(decode_block(memory, 2).ops.empty());
+}
+
+TEST_CASE("block cache: matches the interpreter", "[stamina]") {
+    for (const u64 budget : {u64{1}, u64{7}, u64{1000}}) {
+        Memory reference_memory{ram_size};
+        CpuState reference;
+        load_program(reference_memory, reference, call_program);
+
+        Memory memory{ram_size};
+        CpuState state;
+        load_program(memory, state, call_program);
+        BlockCache cache;
+
+        StopReason expected, actual;
+        do {
+            expected = interpret(reference, reference_memory, budget);
+            actual = interpret_cached(state, memory, cache, budget);
+            REQUIRE(actual == expected);
+            REQUIRE(state.pc == reference.pc);
+            REQUIRE(state.gpr == reference.gpr);
+            REQUIRE(state.retired == reference.retired);
+        } while (expected == StopReason::BudgetExhausted);
+
+        REQUIRE(actual == StopReason::Halted);
+        REQUIRE(state.control(ControlRegister::Halt) == 55);
+    }
+}
+
+TEST_CASE("block cache: invalidation", "[stamina]") {
+    Memory memory{ram_size};
+    CpuState state;
+    load_program(memory, state, "movi r1, 1\nmtoc r15, r1\n");
+    BlockCache cache;
+
+    REQUIRE(interpret_cached(state, memory, cache, 100) == StopReason::Halted);
+    REQUIRE(state.control(ControlRegister::Halt) == 1);
+    REQUIRE(cache.size() == 1);
+
+    // Patch the immediate of the first instruction
+    memory.bytes()[0] = 2;
+    state = CpuState{};
+    cache.invalidate(0x100, 4);
+    REQUIRE(cache.size() == 1);
+    cache.invalidate(0, 1);
+    REQUIRE(cache.size() == 0);
+
+    REQUIRE(interpret_cached(state, memory, cache, 100) == StopReason::Halted);
+    REQUIRE(state.control(ControlRegister::Halt) == 2);
+}
+
+TEST_CASE("block cache: invalidation finds blocks by page", "[stamina]") {
+    Memory memory{ram_size};
+    CpuState state;
+    load_program(memory, state,
+        "    li r1, straddle\n"
+        "    rbra r1\n"
+        "    @align 4096\n"
+        "    @space 4088\n"
+        "straddle:\n"
+        "    movi r2, 1\n"
+        "    movi r3, 2\n"
+        "    mtoc r15, r2\n");
+    BlockCache cache;
+
+    REQUIRE(interpret_cached(state, memory, cache, 100) == StopReason::Halted);
+    REQUIRE(cache.size() == 2);
+
+    // The second block starts on one page and ends on the next
+    cache.invalidate(0x1000, 4);
+    REQUIRE(cache.size() == 2);
+    cache.invalidate(0x2000, 4);
+    REQUIRE(cache.size() == 1);
+
+    state = CpuState{};
+    state.gpr[reg_sp] = memory.size();
+    REQUIRE(interpret_cached(state, memory, cache, 100) == StopReason::Halted);
+    REQUIRE(cache.size() == 2);
+    cache.invalidate(0, 0xFFFFFFFF);
+    REQUIRE(cache.size() == 0);
+}
+
+TEST_CASE("block cache: faults", "[stamina]") {
+    Memory memory{ram_size};
+    CpuState state;
+    load_program(memory, state, "li r1, 0x100000\nld r2, r1, 0\n");
+    BlockCache cache;
+
+    REQUIRE(interpret_cached(state, memory, cache, 1000) == StopReason::MemoryFault);
+    REQUIRE(state.pc == 8);
+    REQUIRE(state.control(ControlRegister::FaultAddress) == 0x100000);
+    REQUIRE(state.retired == 2);
+
+    state = CpuState{};
+    cache.clear();
+    std::memset(memory.bytes().data(), 0xFF, 4);
+    REQUIRE(interpret_cached(state, memory, cache, 1000) == StopReason::InvalidInstruction);
+    REQUIRE(state.pc == 0);
+    REQUIRE(state.retired == 0);
+}
+
+#if defined(STAMINA_HAS_FASTMEM)
+TEST_CASE("block cache: code writes invalidate blocks", "[stamina]") {
+    for (const u64 budget : {u64{1}, u64{7}, u64{1000}}) {
+        Memory memory{ram_size};
+        CpuState state;
+        load_program(memory, state, self_modifying_program);
+        BlockCache cache;
+
+        while (interpret_cached(state, memory, cache, budget) == StopReason::BudgetExhausted) {
+        }
+        REQUIRE(state.control(ControlRegister::Halt) == 11);
+        REQUIRE(state.retired == 17);
+    }
+}
+#endif
@@ -0,0 +1,132 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#pragma once
+
+#include <array>
+#include "common/common_types.hpp"
+#include "common/instruction.hpp"
+#include "common/macros.hpp"
+#include "stamina/instruction_counts.hpp"
+
+namespace stamina {
+
+inline constexpr size_t num_control_registers = 16;
+
+// Control registers accessed with MTOC/MFRC.
+enum class ControlRegister : u8 {
+    Status = 0,
+    FaultAddress = 1,
+    // Physical address of the page directory; see mmu.hpp.
+    PageTable = 2,
+    // Writing a virtual address drops its translation from the TLB.
+    TlbInvalidate = 3,
+    // Index of the core in a multi-core machine; see smp.hpp.
+    CoreId = 4,
+    // Writing to Wait idles the core until the next scheduled event, or for at most the written number
+    // of cycles if that is not zero, unless IoPending has bits set; see scheduler.hpp.
+    Wait = 5,
+    // Writing the physical address of an I/O request submits it; see devices.hpp.
+    IoSubmit = 6,
+    // One bit per device, set when a request to it completes. Writing clears the bits written.
+    IoPending = 7,
+    // Writing to Halt stops the machine; the written value is the exit code.
+    Halt = 15,
+};
+
+// Status bits
+inline constexpr u32 status_paging = 1 << 0;
+
+// A cached address translation. Tags are virtual page addresses; an access matches if its address,
+// masked to the page and to the bits that must be zero for its alignment, equals the tag, so unaligned
+// accesses always miss. invalid_tlb_tag never matches.
+struct TlbEntry {
+    u32 read_tag;
+    u32 write_tag;
+    // Physical minus virtual address, modulo 2^32
+    u32 offset;
+    u32 padding;
+};
+static_assert(sizeof(TlbEntry) == 16);
+
+inline constexpr u32 invalid_tlb_tag = 0xFFF;
+inline constexpr size_t tlb_size = 256;
+
+// Calls in progress, as seen by RCALL, ROCALL and RET while a profiler is attached; see profiler.hpp.
+struct ShadowCallStack {
+    struct Frame {
+        // Entry point of the callee
+        u32 target;
+        u32 return_address;
+    };
+    static constexpr size_t max_depth = 256;
+
+    std::array<Frame, max_depth> frames;
+    // Frames past max_depth are counted but not recorded
+    size_t depth = 0;
+
+    void call(u32 target, u32 return_address);
+    // Pops back to the frame that returns to target, if there is one.
+    void ret(u32 target);
+};
+
+enum class StopReason {
+    BudgetExhausted,
+    Halted,
+    InvalidInstruction,
+    MemoryFault,
+    // The core wrote to the Wait control register
+    Waiting,
+    // The core wrote to the IoSubmit control register
+    IoSubmitted,
+};
+
+struct CpuState {
+    std::array<u32, num_gprs> gpr{};
+    u32 pc = 0;
+    bool t = false;
+
+    std::array<u32, num_control_registers> cr{};
+    std::array<u32, num_gprs> ur{};
+
+    // Exclusive monitor for LDC/STC
+    bool monitor_valid = false;
+    u32 monitor_address = 0;
+    // Word loaded by the LDC, which STC compares against
+    u32 monitor_value = 0;
+
+    u64 retired = 0;
+
+    // Direct-mapped, indexed by virtual page number
+    std::array<TlbEntry, tlb_size> tlb = empty_tlb();
+    // Advanced whenever a control register write may change address translation
+    u32 mmu_generation = 0;
+
+    // Kept up to date by calls and returns when set; not part of the architectural state
+    ShadowCallStack* call_stack = nullptr;
+
+#if defined(STAMINA_HAS_INSTRUCTION_COUNTS)
+    InstructionCounts counts;
+#endif
+
+    bool paging() const { return cr[static_cast<size_t>(ControlRegister::Status)] & status_paging; }
+
+    static constexpr std::array<TlbEntry, tlb_size> empty_tlb() {
+        std::array<TlbEntry, tlb_size> result;
+        result.fill(TlbEntry{invalid_tlb_tag, invalid_tlb_tag, 0, 0});
+        return result;
+    }
+
+    u32& control(ControlRegister reg) { return cr[static_cast<size_t>(reg)]; }
+    u32 control(ControlRegister reg) const { return cr[static_cast<size_t>(reg)]; }
+};
+
+// Counts a retired instruction in state.counts, if instruction counts are compiled in.
+FORCE_INLINE void count_instruction([[maybe_unused]] CpuState& state, [[maybe_unused]] Opcode op) {
+#if defined(STAMINA_HAS_INSTRUCTION_COUNTS)
+    state.counts[op]++;
+#endif
+}
+
+}
@@ -0,0 +1,118 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "stamina/devices.hpp"
+
+namespace stamina {
+
+namespace {
+
+void finish(CpuState& state, Memory& memory, u32 address, const IoRequest& request, u32 status, u32 transferred) {
+    memory.write<u32>(address + offsetof(IoRequest, transferred), transferred);
+    memory.write<u32>(address + offsetof(IoRequest, status), status);
+    state.control(ControlRegister::IoPending) |= u32{1} << (request.device % 32);
+}
+
+}
+
+Devices::Devices(HostIo& io, int console_in, int console_out) : io(io), console_in(console_in), console_out(console_out) {}
+
+Devices::~Devices() {
+    if (disk >= 0) {
+        close(disk);
+    }
+}
+
+bool Devices::attach_disk(const std::filesystem::path& path) {
+    const int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size % sector_size != 0) {
+        close(fd);
+        return false;
+    }
+    if (disk >= 0) {
+        close(disk);
+    }
+    disk = fd;
+    disk_size = static_cast<u64>(st.st_size);
+    return true;
+}
+
+CoreRunner Devices::runner(Scheduler& scheduler, CoreRunner engine) {
+    return [this, &scheduler, engine = std::move(engine)](CpuState& state, Memory& memory, u64 budget) {
+        while (true) {
+            const u64 retired = state.retired;
+            const StopReason reason = engine(state, memory, budget);
+            if (reason != StopReason::IoSubmitted) {
+                return reason;
+            }
+            submit(scheduler, state, memory, state.control(ControlRegister::IoSubmit));
+            budget -= state.retired - retired;
+            if (budget == 0) {
+                return StopReason::BudgetExhausted;
+            }
+        }
+    };
+}
+
+void Devices::submit(Scheduler& scheduler, CpuState& state, Memory& memory, u32 address) {
+    IoRequest request;
+    if (!memory.read_bytes(address, {reinterpret_cast<u8*>(&request), sizeof(request)})) {
+        return;
+    }
+
+    const bool write = request.command == io_write;
+    int fd = -1;
+    u64 offset = HostIoRequest::stream;
+    switch (static_cast<Device>(request.device)) {
+    case Device::Console:
+        fd = write ? console_out : console_in;
+        break;
+    case Device::Block:
+        if (u64{request.sector} * sector_size + request.length <= disk_size) {
+            fd = disk;
+            offset = u64{request.sector} * sector_size;
+        }
+        break;
+    }
+    const bool valid = fd >= 0 && (request.command == io_read || write) && request.length <= max_io_length &&
+                       u64{request.buffer} + request.length <= memory.size();
+    if (!valid) {
+        finish(state, memory, address, request, io_status_error, 0);
+        return;
+    }
+
+    auto data = std::make_shared<std::vector<u8>>(request.length);
+    if (write) {
+        memory.read_bytes(request.buffer, *data);
+    }
+    memory.write<u32>(address + offsetof(IoRequest, status), io_status_busy);
+
+    // The host thread that completes the transfer hands the result to the core's own thread
+    scheduler.expect_post();
+    io.submit(HostIoRequest{fd, write, offset, *data, [&scheduler, &state, &memory, address, request, data](s64 result) {
+        scheduler.post([&state, &memory, address, request, data, result](u64) {
+            if (result < 0) {
+                finish(state, memory, address, request, io_status_error, 0);
+                return;
+            }
+            const auto transferred = static_cast<u32>(result);
+            if (request.command == io_read) {
+                memory.write_bytes(request.buffer, std::span{*data}.first(transferred));
+            }
+            finish(state, memory, address, request, io_status_done, transferred);
+        });
+    }});
+}
+
+}
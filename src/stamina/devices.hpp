@@ -0,0 +1,89 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#pragma once
+
+#include <filesystem>
+#include "common/common_types.hpp"
+#include "stamina/cpu_state.hpp"
+#include "stamina/host_io.hpp"
+#include "stamina/memory.hpp"
+#include "stamina/scheduler.hpp"
+#include "stamina/smp.hpp"
+
+// Emulated devices.
+//
+// A guest drives a device with an IoRequest in RAM, submitted by writing its physical address to the
+// IoSubmit control register. That stops the core just long enough to hand the request to the host,
+// which carries out the transfer asynchronously while the guest keeps running. When the transfer
+// completes, the device writes the outcome into the request and sets its bit in the IoPending control
+// register of the core that submitted it. Completions are events posted to that core's scheduler, so
+// a core waiting with Wait wakes for them. A core does not wait while IoPending has bits set.
+//
+// The console reads the host's standard input and writes its standard output. The block device reads
+// and writes a host file in sectors. Data passes through a host buffer: the buffer of a write may be
+// reused as soon as the write is submitted, and the buffer of a read is filled when it completes.
+
+namespace stamina {
+
+enum class Device : u32 {
+    Console = 0,
+    Block = 1,
+};
+
+inline constexpr u32 io_read = 0;
+inline constexpr u32 io_write = 1;
+
+inline constexpr u32 io_status_busy = 1;
+inline constexpr u32 io_status_done = 2;
+inline constexpr u32 io_status_error = 3;
+
+inline constexpr u32 sector_size = 512;
+inline constexpr u32 max_io_length = 1024 * 1024;
+
+// Layout of a request in guest memory.
+struct IoRequest {
+    u32 device;
+    // io_read or io_write
+    u32 command;
+    // First sector of a block transfer; the console ignores it
+    u32 sector;
+    // Physical address and length of the data
+    u32 buffer;
+    u32 length;
+    // Written by the device: io_status_busy once submitted, then io_status_done or io_status_error
+    u32 status;
+    // Bytes transferred, written on completion
+    u32 transferred;
+};
+static_assert(sizeof(IoRequest) == 28);
+
+struct Devices final {
+public:
+    Devices(HostIo& io, int console_in, int console_out);
+    ~Devices();
+
+    Devices(const Devices&) = delete;
+    Devices& operator=(const Devices&) = delete;
+
+    // Backs the block device with the file at path, which must be a whole number of sectors.
+    bool attach_disk(const std::filesystem::path& path);
+
+    // Wraps engine so that the requests it submits go to the devices, with their completions posted
+    // to scheduler.
+    CoreRunner runner(Scheduler& scheduler, CoreRunner engine);
+
+    // Hands the request at address to its device. A request that is not in RAM is ignored; one that is
+    // malformed fails at once.
+    void submit(Scheduler& scheduler, CpuState& state, Memory& memory, u32 address);
+
+private:
+    HostIo& io;
+    int console_in;
+    int console_out;
+    int disk = -1;
+    u64 disk_size = 0;
+};
+
+}
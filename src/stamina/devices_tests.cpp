@@ -0,0 +1,231 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <catch.hpp>
+#include <fcntl.h>
+#include <unistd.h>
+#include "common/common_types.hpp"
+#include "smasm/snippet_assembler.hpp"
+#include "stamina/cpu_state.hpp"
+#include "stamina/devices.hpp"
+#include "stamina/host_io.hpp"
+#include "stamina/interpreter.hpp"
+#include "stamina/memory.hpp"
+#include "stamina/scheduler.hpp"
+
+#if defined(STAMINA_HAS_X64_JIT)
+    #include "stamina/x64/jit.hpp"
+#endif
+
+using namespace stamina;
+
+namespace {
+
+constexpr u32 ram_size = 64 * 1024;
+constexpr u32 request_address = 0x1000;
+constexpr u32 data_address = 0x2000;
+
+// Submits the request at 0x1000, waits for it, and halts with the pending bits
+const std::string submit_program =
+    "    li r1, 0x1000\n"
+    "    mtoc r6, r1\n"
+    "    movi r2, 0\n"
+    "    mtoc r5, r2\n"
+    "    mfrc r3, r7\n"
+    "    mtoc r7, r3\n"
+    "    mtoc r15, r3\n";
+
+struct Pipe {
+    int read = -1;
+    int write = -1;
+    Pipe() { REQUIRE(pipe(&read) == 0); }
+    ~Pipe() {
+        close(read);
+        close(write);
+    }
+};
+
+struct TempPath {
+    std::filesystem::path path = std::filesystem::temp_directory_path() / ("stamina-disk-" + std::to_string(getpid()) + ".img");
+    ~TempPath() { std::filesystem::remove(path); }
+};
+
+std::vector<CoreRunner> engines() {
+    std::vector<CoreRunner> result{&interpret, &interpret_switch};
+#if defined(STAMINA_HAS_X64_JIT)
+    auto jit = std::make_shared<x64::Jit>(1024 * 1024);
+    REQUIRE(jit->valid());
+    result.emplace_back([jit](CpuState& state, Memory& memory, u64 budget) { return jit->run(state, memory, budget); });
+#endif
+    return result;
+}
+
+// Runs submit_program with request in memory, returning the request as the device left it.
+IoRequest run_request(Devices& devices, const CoreRunner& engine, Memory& memory, IoRequest request) {
+    SnippetAssembler assembler;
+    const auto& result = assembler.assemble(submit_program);
+    REQUIRE(result.ok());
+    std::memcpy(memory.bytes().data(), result.words.data(), result.words.size() * 4);
+    REQUIRE(memory.write_bytes(request_address, {reinterpret_cast<const u8*>(&request), sizeof(request)}));
+
+    CpuState state;
+    Scheduler scheduler;
+    const CoreRunner run = devices.runner(scheduler, engine);
+    REQUIRE(scheduler.run(state, memory, run, 1000) == StopReason::Halted);
+    REQUIRE(state.control(ControlRegister::Halt) == u32{1} << request.device);
+    REQUIRE(state.control(ControlRegister::IoPending) == 0);
+
+    REQUIRE(memory.read_bytes(request_address, {reinterpret_cast<u8*>(&request), sizeof(request)}));
+    return request;
+}
+
+}
+
+TEST_CASE("devices: host io backends", "[stamina]") {
+    for (const bool allow_io_uring : {true, false}) {
+        HostIo io{2, allow_io_uring};
+        if (!allow_io_uring) {
+            REQUIRE(!io.uses_io_uring());
+        }
+
+        const TempPath temp;
+        std::vector<u8> written(4096);
+        for (size_t i = 0; i < written.size(); i++) {
+            written[i] = static_cast<u8>(i * 7);
+        }
+        const int fd = ::open(temp.path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+        REQUIRE(fd >= 0);
+
+        // More requests than fit in the ring at once
+        std::atomic<int> completed = 0;
+        std::atomic<int> failed = 0;
+        for (size_t i = 0; i < 200; i++) {
+            const size_t offset = i % 8 * 512;
+            io.submit(HostIoRequest{fd, true, offset, std::span{written}.subspan(offset, 512), [&](s64 result) {
+                failed += result != 512;
+                completed++;
+            }});
+        }
+        while (completed < 200) {
+            std::this_thread::yield();
+        }
+        REQUIRE(failed == 0);
+
+        std::vector<u8> read(4096);
+        std::atomic<s64> result = 0;
+        io.submit(HostIoRequest{fd, false, 0, read, [&](s64 transferred) { result = transferred; }});
+        while (result == 0) {
+            std::this_thread::yield();
+        }
+        REQUIRE(result == 4096);
+        REQUIRE(read == written);
+
+        io.submit(HostIoRequest{-1, false, 0, read, [&](s64 transferred) { result = transferred; }});
+        while (result > 0) {
+            std::this_thread::yield();
+        }
+        REQUIRE(result == -EBADF);
+        close(fd);
+    }
+}
+
+TEST_CASE("devices: host io cancels reads when destroyed", "[stamina]") {
+    for (const bool allow_io_uring : {true, false}) {
+        Pipe input;
+        Pipe output;
+        std::vector<u8> read(16);
+        std::atomic<s64> read_result = 0;
+        std::atomic<s64> write_result = 0;
+        {
+            HostIo io{1, allow_io_uring};
+            io.submit(HostIoRequest{input.read, false, HostIoRequest::stream, read, [&](s64 result) { read_result = result; }});
+            // Nothing is ever written to the pipe
+            std::this_thread::sleep_for(std::chrono::milliseconds{10});
+            io.submit(HostIoRequest{output.write, true, HostIoRequest::stream, std::span{read}.first(4), [&](s64 result) { write_result = result; }});
+        }
+        REQUIRE(read_result == -ECANCELED);
+        // Writes are completed, not cancelled
+        REQUIRE(write_result == 4);
+    }
+}
+
+TEST_CASE("devices: console", "[stamina]") {
+    for (const bool allow_io_uring : {true, false}) {
+        for (const CoreRunner& engine : engines()) {
+            HostIo io{1, allow_io_uring};
+            Pipe input;
+            Pipe output;
+            Devices devices{io, input.read, output.write};
+            Memory memory{ram_size};
+
+            const std::string hello = "hello";
+            REQUIRE(memory.write_bytes(data_address, {reinterpret_cast<const u8*>(hello.data()), hello.size()}));
+            IoRequest request = run_request(devices, engine, memory, IoRequest{0, io_write, 0, data_address, 5, 0, 0});
+            REQUIRE(request.status == io_status_done);
+            REQUIRE(request.transferred == 5);
+            char text[8] = {};
+            REQUIRE(read(output.read, text, sizeof(text)) == 5);
+            REQUIRE(std::string{text} == hello);
+
+            REQUIRE(write(input.write, "ping", 4) == 4);
+            request = run_request(devices, engine, memory, IoRequest{0, io_read, 0, data_address + 0x100, 16, 0, 0});
+            REQUIRE(request.status == io_status_done);
+            REQUIRE(request.transferred == 4);
+            REQUIRE(std::memcmp(memory.bytes().data() + data_address + 0x100, "ping", 4) == 0);
+        }
+    }
+}
+
+TEST_CASE("devices: block device", "[stamina]") {
+    for (const bool allow_io_uring : {true, false}) {
+        for (const CoreRunner& engine : engines()) {
+            const TempPath temp;
+            {
+                std::ofstream file{temp.path, std::ios::binary};
+                for (u32 sector = 0; sector < 4; sector++) {
+                    const std::string contents(sector_size, static_cast<char>('a' + sector));
+                    file.write(contents.data(), sector_size);
+                }
+            }
+
+            HostIo io{1, allow_io_uring};
+            Devices devices{io, -1, -1};
+            REQUIRE(devices.attach_disk(temp.path));
+            Memory memory{ram_size};
+
+            IoRequest request = run_request(devices, engine, memory, IoRequest{1, io_read, 1, data_address, 2 * sector_size, 0, 0});
+            REQUIRE(request.status == io_status_done);
+            REQUIRE(request.transferred == 2 * sector_size);
+            REQUIRE(memory.bytes()[data_address] == 'b');
+            REQUIRE(memory.bytes()[data_address + 2 * sector_size - 1] == 'c');
+
+            std::memset(memory.bytes().data() + data_address, 'z', sector_size);
+            request = run_request(devices, engine, memory, IoRequest{1, io_write, 3, data_address, sector_size, 0, 0});
+            REQUIRE(request.status == io_status_done);
+
+            // Past the end of the disk, and past the end of RAM
+            request = run_request(devices, engine, memory, IoRequest{1, io_read, 3, data_address, 2 * sector_size, 0, 0});
+            REQUIRE(request.status == io_status_error);
+            request = run_request(devices, engine, memory, IoRequest{1, io_read, 0, ram_size - 4, sector_size, 0, 0});
+            REQUIRE(request.status == io_status_error);
+
+            std::ifstream file{temp.path, std::ios::binary};
+            std::string contents{std::istreambuf_iterator<char>{file}, std::istreambuf_iterator<char>{}};
+            REQUIRE(contents.size() == 4 * sector_size);
+            REQUIRE(contents.substr(3 * sector_size) == std::string(sector_size, 'z'));
+            REQUIRE(contents[2 * sector_size] == 'c');
+        }
+    }
+}
@@ -0,0 +1,124 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#include "stamina/fastmem.hpp"
+
+#if defined(STAMINA_HAS_FASTMEM)
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <type_traits>
+#include <signal.h>
+#include <ucontext.h>
+#include "common/assert.hpp"
+
+// Bounds of the section of entries emitted by STAMINA_FASTMEM_FIXUP, defined by the linker
+extern "C" const s32 __start_stamina_fixups[] __attribute__((weak));
+extern "C" const s32 __stop_stamina_fixups[] __attribute__((weak));
+
+namespace stamina::fastmem {
+
+namespace {
+
+// Offsets relative to the field they are stored in
+struct StaticFixup {
+    s32 fault;
+    s32 recovery;
+};
+
+// Faults are handled on the thread that takes them, so each thread only sees its own tables and
+// another thread may modify its tables meanwhile
+constexpr size_t max_tables = 16;
+thread_local std::array<std::atomic<const FixupTable*>, max_tables> tables{};
+
+struct sigaction previous_action;
+
+uintptr_t find_recovery(uintptr_t pc) {
+    const auto* begin = reinterpret_cast<const StaticFixup*>(__start_stamina_fixups);
+    const auto* end = reinterpret_cast<const StaticFixup*>(__stop_stamina_fixups);
+    for (const StaticFixup* entry = begin; entry != end; entry++) {
+        const auto base = reinterpret_cast<uintptr_t>(entry);
+        if (base + static_cast<uintptr_t>(static_cast<intptr_t>(entry->fault)) == pc) {
+            return base + sizeof(s32) + static_cast<uintptr_t>(static_cast<intptr_t>(entry->recovery));
+        }
+    }
+
+    for (const auto& slot : tables) {
+        const FixupTable* table = slot.load(std::memory_order_acquire);
+        if (!table) {
+            continue;
+        }
+        const auto& fixups = table->fixups;
+        const auto iter = std::lower_bound(fixups.begin(), fixups.end(), pc, [](const Fixup& f, uintptr_t p) { return f.fault < p; });
+        if (iter != fixups.end() && iter->fault == pc) {
+            return iter->recovery;
+        }
+    }
+    return 0;
+}
+
+auto& program_counter(void* raw_context) {
+    auto* context = static_cast<ucontext_t*>(raw_context);
+#if defined(__linux__)
+    return context->uc_mcontext.gregs[REG_RIP];
+#else
+    return context->uc_mcontext.mc_rip;
+#endif
+}
+
+void handle_fault(int signal, siginfo_t* info, void* raw_context) {
+    auto& pc = program_counter(raw_context);
+    if (const uintptr_t recovery = find_recovery(static_cast<uintptr_t>(pc))) {
+        pc = static_cast<std::remove_reference_t<decltype(pc)>>(recovery);
+        return;
+    }
+
+    // Not a guest memory access
+    if (previous_action.sa_flags & SA_SIGINFO) {
+        previous_action.sa_sigaction(signal, info, raw_context);
+    } else if (previous_action.sa_handler != SIG_DFL && previous_action.sa_handler != SIG_IGN) {
+        previous_action.sa_handler(signal);
+    } else {
+        // Returning re-executes the access, which now gets the default action
+        sigaction(signal, &previous_action, nullptr);
+    }
+}
+
+}
+
+void install_fault_handler() {
+    static std::once_flag once;
+    std::call_once(once, [] {
+        struct sigaction action {};
+        action.sa_sigaction = &handle_fault;
+        action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+        sigemptyset(&action.sa_mask);
+        ASSERT(sigaction(SIGSEGV, &action, &previous_action) == 0);
+    });
+}
+
+void add_fixup_table(const FixupTable* table) {
+    for (auto& slot : tables) {
+        const FixupTable* expected = nullptr;
+        if (slot.compare_exchange_strong(expected, table, std::memory_order_acq_rel)) {
+            return;
+        }
+    }
+    ASSERT_FALSE("too many fixup tables");
+}
+
+void remove_fixup_table(const FixupTable* table) {
+    for (auto& slot : tables) {
+        const FixupTable* expected = table;
+        if (slot.compare_exchange_strong(expected, nullptr, std::memory_order_acq_rel)) {
+            return;
+        }
+    }
+}
+
+}
+
+#endif
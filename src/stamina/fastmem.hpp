@@ -0,0 +1,128 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "common/common_types.hpp"
+#include "common/macros.hpp"
+
+// Guest memory accesses without bounds checks.
+//
+// Guest RAM is placed in a host reservation that covers the whole 32-bit guest address space, with
+// everything past the end of RAM inaccessible, so an access is a single host load or store at
+// base + address. An access past RAM raises SIGSEGV. Every host instruction that may touch guest
+// memory has a fixup naming where to continue if it faults, and the signal handler resumes there,
+// which makes a fault behave exactly like a failed bounds check.
+//
+// Fixups for the accessors below are collected by the linker; translated code registers its own.
+// Needs asm goto with outputs and ELF section start/stop symbols.
+
+#if defined(__x86_64__) && defined(__ELF__) && (defined(__linux__) || defined(__FreeBSD__)) && \
+    ((defined(__clang__) && __clang_major__ >= 11) || (!defined(__clang__) && defined(__GNUC__) && __GNUC__ >= 11))
+    #define STAMINA_HAS_FASTMEM 1
+#endif
+
+#if defined(STAMINA_HAS_FASTMEM)
+
+namespace stamina::fastmem {
+
+struct Fixup {
+    uintptr_t fault;
+    uintptr_t recovery;
+};
+
+// Fixups for code generated at run time, sorted by fault address.
+struct FixupTable {
+    std::vector<Fixup> fixups;
+};
+
+// Installs the fault handler once per process. Faults outside any fixup go to the previous handler.
+void install_fault_handler();
+
+// Makes the fault handler consult table for faults on the calling thread until it is removed from
+// that thread. table must not be modified while it is registered on another thread.
+void add_fixup_table(const FixupTable* table);
+void remove_fixup_table(const FixupTable* table);
+
+// Registers table on the calling thread for the lifetime of the object.
+struct ScopedFixupTable final {
+    explicit ScopedFixupTable(const FixupTable* table) : table(table) { add_fixup_table(table); }
+    ~ScopedFixupTable() { remove_fixup_table(table); }
+
+    ScopedFixupTable(const ScopedFixupTable&) = delete;
+    ScopedFixupTable& operator=(const ScopedFixupTable&) = delete;
+
+private:
+    const FixupTable* table;
+};
+
+// Section entry recording the instruction at local label 1 and the C++ label it recovers at.
+// Offsets are relative to the entry so that the section needs no relocations.
+#define STAMINA_FASTMEM_FIXUP                                                                     \
+    ".pushsection stamina_fixups, \"a\"\n"                                                        \
+    ".balign 4\n"                                                                                 \
+    ".long 1b - .\n"                                                                              \
+    ".long %l[fault] - .\n"                                                                       \
+    ".popsection\n"
+
+// Reads guest memory at host; false if the access faulted.
+template <typename T>
+FORCE_INLINE bool load(const u8* host, T& value) {
+    static_assert(sizeof(T) == 1 || sizeof(T) == 2 || sizeof(T) == 4);
+    // A character array operand tells the compiler which bytes are read without implying a type
+    const auto& bytes = *reinterpret_cast<const u8(*)[sizeof(T)]>(host);
+    u32 result;
+    if constexpr (sizeof(T) == 1) {
+        asm goto("1: movzbl %1, %0\n" STAMINA_FASTMEM_FIXUP : "=r"(result) : "m"(bytes) : : fault);
+    } else if constexpr (sizeof(T) == 2) {
+        asm goto("1: movzwl %1, %0\n" STAMINA_FASTMEM_FIXUP : "=r"(result) : "m"(bytes) : : fault);
+    } else {
+        asm goto("1: movl %1, %0\n" STAMINA_FASTMEM_FIXUP : "=r"(result) : "m"(bytes) : : fault);
+    }
+    value = static_cast<T>(result);
+    return true;
+fault:
+    return false;
+}
+
+// Writes guest memory at host; false if the access faulted.
+template <typename T>
+FORCE_INLINE bool store(u8* host, T value) {
+    static_assert(sizeof(T) == 1 || sizeof(T) == 2 || sizeof(T) == 4);
+    auto& bytes = *reinterpret_cast<u8(*)[sizeof(T)]>(host);
+    if constexpr (sizeof(T) == 1) {
+        asm goto("1: movb %b1, %0\n" STAMINA_FASTMEM_FIXUP : "=m"(bytes) : "q"(value) : : fault);
+    } else if constexpr (sizeof(T) == 2) {
+        asm goto("1: movw %w1, %0\n" STAMINA_FASTMEM_FIXUP : "=m"(bytes) : "r"(value) : : fault);
+    } else {
+        asm goto("1: movl %k1, %0\n" STAMINA_FASTMEM_FIXUP : "=m"(bytes) : "r"(value) : : fault);
+    }
+    return true;
+fault:
+    return false;
+}
+
+// Atomically replaces the aligned word at host with desired if it holds expected; false if the
+// access faulted. Otherwise exchanged reports whether the word was replaced.
+FORCE_INLINE bool compare_exchange(u8* host, u32 expected, u32 desired, bool& exchanged) {
+    auto& word = *reinterpret_cast<u32*>(host);
+    u8 equal;
+    asm goto("1: lock cmpxchgl %[desired], %[word]\n" STAMINA_FASTMEM_FIXUP "sete %[equal]\n"
+             : [word] "+m"(word), "+a"(expected), [equal] "=q"(equal)
+             : [desired] "r"(desired)
+             : "cc"
+             : fault);
+    exchanged = equal != 0;
+    return true;
+fault:
+    return false;
+}
+
+#undef STAMINA_FASTMEM_FIXUP
+
+}
+
+#endif
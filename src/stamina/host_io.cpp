@@ -0,0 +1,369 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <utility>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include "common/assert.hpp"
+#include "stamina/host_io.hpp"
+
+#if defined(STAMINA_HAS_IO_URING)
+    #include <linux/io_uring.h>
+    #include <sys/mman.h>
+    #include <sys/syscall.h>
+    #include <tsl/robin_set.h>
+#endif
+
+namespace stamina {
+
+namespace {
+
+// Performs request, unless it reads a stream and stop_event is signalled before there is anything to read.
+s64 transfer(const HostIoRequest& request, int stop_event) {
+    if (request.offset == HostIoRequest::stream && !request.write) {
+        pollfd fds[] = {{request.fd, POLLIN, 0}, {stop_event, POLLIN, 0}};
+        while (poll(fds, 2, -1) < 0) {
+            ASSERT_MSG(errno == EINTR, "poll failed");
+        }
+        if (fds[1].revents & POLLIN) {
+            return -ECANCELED;
+        }
+    }
+
+    ssize_t result;
+    do {
+        if (request.offset == HostIoRequest::stream) {
+            result = request.write ? ::write(request.fd, request.buffer.data(), request.buffer.size())
+                                   : ::read(request.fd, request.buffer.data(), request.buffer.size());
+        } else {
+            const auto offset = static_cast<off_t>(request.offset);
+            result = request.write ? ::pwrite(request.fd, request.buffer.data(), request.buffer.size(), offset)
+                                   : ::pread(request.fd, request.buffer.data(), request.buffer.size(), offset);
+        }
+    } while (result < 0 && errno == EINTR);
+    return result < 0 ? -errno : result;
+}
+
+}
+
+#if defined(STAMINA_HAS_IO_URING)
+
+namespace {
+
+int io_uring_setup(u32 entries, io_uring_params* params) {
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+int io_uring_enter(int fd, u32 to_submit, u32 min_complete, u32 flags) {
+    int result;
+    do {
+        result = static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+    } while (result < 0 && errno == EINTR);
+    return result;
+}
+
+// user_data of ring entries that are not requests
+constexpr u64 wake_entry = 0;
+constexpr u64 cancel_entry = 1;
+
+}
+
+// The rings shared with the kernel. Head and tail indices are written by one side and read by the other.
+struct HostIo::Ring {
+    int fd = -1;
+    void* sq_map = MAP_FAILED;
+    size_t sq_map_size = 0;
+    void* cq_map = MAP_FAILED;
+    size_t cq_map_size = 0;
+    io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+    size_t sqes_size = 0;
+
+    u32* sq_tail;
+    u32 sq_mask;
+    u32* sq_array;
+    u32 entries;
+    u32* cq_head;
+    u32* cq_tail;
+    u32 cq_mask;
+    io_uring_cqe* cqes;
+
+    // Entries in the ring whose completions have not been consumed
+    u32 in_flight = 0;
+    // Requests in the ring, and those waiting for room in it
+    tsl::robin_set<HostIoRequest*> submitted;
+    std::deque<HostIoRequest*> overflow;
+    // Entries in the ring that the kernel has not taken yet
+    u32 unsubmitted = 0;
+
+    // Copies entry into the ring and submits it.
+    void push(const io_uring_sqe& entry) {
+        ASSERT(unsubmitted < entries);
+        const u32 tail = *sq_tail;
+        const u32 index = tail & sq_mask;
+        sqes[index] = entry;
+        sq_array[index] = index;
+        std::atomic_ref<u32>{*sq_tail}.store(tail + 1, std::memory_order_release);
+        in_flight++;
+        unsubmitted++;
+
+        // The kernel may refuse while its completion queue is full; the reaper tries again once it
+        // has made room
+        const int count = io_uring_enter(fd, unsubmitted, 0, 0);
+        if (count > 0) {
+            unsubmitted -= static_cast<u32>(count);
+        } else {
+            ASSERT_MSG(errno == EAGAIN || errno == EBUSY, "io_uring submission failed");
+        }
+    }
+
+    ~Ring() {
+        if (sqes != MAP_FAILED) {
+            munmap(sqes, sqes_size);
+        }
+        if (cq_map != MAP_FAILED && cq_map != sq_map) {
+            munmap(cq_map, cq_map_size);
+        }
+        if (sq_map != MAP_FAILED) {
+            munmap(sq_map, sq_map_size);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+};
+
+bool HostIo::setup_ring(size_t entries) {
+    io_uring_params params{};
+    auto result = std::make_unique<Ring>();
+    result->fd = io_uring_setup(static_cast<u32>(entries), &params);
+    // Kernels without io_uring, and sandboxes that forbid it
+    if (result->fd < 0) {
+        return false;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        return false;
+    }
+
+    Ring& r = *result;
+    r.sq_map_size = std::max<size_t>(params.sq_off.array + params.sq_entries * sizeof(u32), params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+    r.sq_map = mmap(nullptr, r.sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r.fd, IORING_OFF_SQ_RING);
+    if (r.sq_map == MAP_FAILED) {
+        return false;
+    }
+    r.cq_map = r.sq_map;
+    r.cq_map_size = r.sq_map_size;
+    r.sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    r.sqes = static_cast<io_uring_sqe*>(mmap(nullptr, r.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r.fd, IORING_OFF_SQES));
+    if (r.sqes == MAP_FAILED) {
+        return false;
+    }
+
+    u8* const sq = static_cast<u8*>(r.sq_map);
+    r.sq_tail = reinterpret_cast<u32*>(sq + params.sq_off.tail);
+    r.sq_mask = *reinterpret_cast<u32*>(sq + params.sq_off.ring_mask);
+    r.sq_array = reinterpret_cast<u32*>(sq + params.sq_off.array);
+    r.entries = params.sq_entries;
+    r.cq_head = reinterpret_cast<u32*>(sq + params.cq_off.head);
+    r.cq_tail = reinterpret_cast<u32*>(sq + params.cq_off.tail);
+    r.cq_mask = *reinterpret_cast<u32*>(sq + params.cq_off.ring_mask);
+    r.cqes = reinterpret_cast<io_uring_cqe*>(sq + params.cq_off.cqes);
+
+    ring = std::move(result);
+    return true;
+}
+
+void HostIo::push_to_ring(HostIoRequest* request) {
+    Ring& r = *ring;
+    // Leaves room in the completion queue, which holds twice as many entries, for cancelling each
+    // request
+    if (r.submitted.size() == r.entries) {
+        r.overflow.push_back(request);
+        return;
+    }
+
+    io_uring_sqe sqe{};
+    sqe.opcode = request->write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe.fd = request->fd;
+    // An offset of -1 uses the file position, as read and write do
+    sqe.off = request->offset == HostIoRequest::stream ? ~u64{0} : request->offset;
+    sqe.addr = reinterpret_cast<u64>(request->buffer.data());
+    sqe.len = static_cast<u32>(request->buffer.size());
+    sqe.user_data = reinterpret_cast<u64>(request);
+    r.submitted.insert(request);
+    r.push(sqe);
+}
+
+void HostIo::cancel_reads(std::vector<HostIoRequest*>& cancelled) {
+    Ring& r = *ring;
+    std::erase_if(r.overflow, [&](HostIoRequest* request) {
+        if (!request->write) {
+            cancelled.push_back(request);
+        }
+        return !request->write;
+    });
+    for (HostIoRequest* const request : r.submitted) {
+        if (!request->write) {
+            io_uring_sqe sqe{};
+            sqe.opcode = IORING_OP_ASYNC_CANCEL;
+            sqe.addr = reinterpret_cast<u64>(request);
+            sqe.user_data = cancel_entry;
+            r.push(sqe);
+        }
+    }
+    if (r.in_flight == 0) {
+        // Wakes the reaper with nothing else to wait for
+        io_uring_sqe sqe{};
+        sqe.opcode = IORING_OP_NOP;
+        sqe.user_data = wake_entry;
+        r.push(sqe);
+    }
+}
+
+void HostIo::reap() {
+    Ring& r = *ring;
+    std::vector<std::pair<HostIoRequest*, s64>> completed;
+    while (true) {
+        if (io_uring_enter(r.fd, 0, 1, IORING_ENTER_GETEVENTS) < 0) {
+            ASSERT_MSG(errno == EAGAIN || errno == EBUSY, "io_uring wait failed");
+        }
+
+        // Only this thread consumes completions
+        u32 head = *r.cq_head;
+        const u32 tail = std::atomic_ref<u32>{*r.cq_tail}.load(std::memory_order_acquire);
+        const u32 reaped = tail - head;
+        for (; head != tail; head++) {
+            const io_uring_cqe& cqe = r.cqes[head & r.cq_mask];
+            if (cqe.user_data != wake_entry && cqe.user_data != cancel_entry) {
+                completed.emplace_back(reinterpret_cast<HostIoRequest*>(cqe.user_data), cqe.res);
+            }
+        }
+        std::atomic_ref<u32>{*r.cq_head}.store(head, std::memory_order_release);
+
+        bool finished;
+        {
+            // Also orders the completions after the submissions, which went through the kernel
+            const std::lock_guard lock{mutex};
+            r.in_flight -= reaped;
+            for (const auto& [request, result] : completed) {
+                r.submitted.erase(request);
+            }
+            while (r.submitted.size() < r.entries && !r.overflow.empty()) {
+                HostIoRequest* const next = r.overflow.front();
+                r.overflow.pop_front();
+                push_to_ring(next);
+            }
+            if (r.unsubmitted > 0) {
+                const int submitted = io_uring_enter(r.fd, r.unsubmitted, 0, 0);
+                if (submitted > 0) {
+                    r.unsubmitted -= static_cast<u32>(submitted);
+                }
+            }
+            finished = stopping && r.in_flight == 0;
+        }
+
+        for (const auto& [request, result] : completed) {
+            request->done(result);
+            delete request;
+        }
+        completed.clear();
+        if (finished) {
+            return;
+        }
+    }
+}
+
+#endif
+
+HostIo::HostIo(size_t worker_count, bool allow_io_uring) {
+#if defined(STAMINA_HAS_IO_URING)
+    if (allow_io_uring && setup_ring(64)) {
+        reaper = std::thread{[this] { reap(); }};
+        return;
+    }
+#else
+    (void)allow_io_uring;
+#endif
+    ASSERT(worker_count > 0);
+    stop_event = eventfd(0, EFD_CLOEXEC);
+    ASSERT_MSG(stop_event >= 0, "could not create an eventfd");
+    for (size_t i = 0; i < worker_count; i++) {
+        workers.emplace_back([this] { work(); });
+    }
+}
+
+HostIo::~HostIo() {
+#if defined(STAMINA_HAS_IO_URING)
+    if (ring) {
+        std::vector<HostIoRequest*> cancelled;
+        {
+            const std::lock_guard lock{mutex};
+            stopping = true;
+            cancel_reads(cancelled);
+        }
+        for (HostIoRequest* const request : cancelled) {
+            request->done(-ECANCELED);
+            delete request;
+        }
+        reaper.join();
+        return;
+    }
+#endif
+    {
+        const std::lock_guard lock{mutex};
+        stopping = true;
+    }
+    // Never reset, so that every stream read from now on is cancelled
+    const u64 signal = 1;
+    ASSERT(::write(stop_event, &signal, sizeof(signal)) == sizeof(signal));
+    queued.notify_all();
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    close(stop_event);
+}
+
+bool HostIo::uses_io_uring() const {
+#if defined(STAMINA_HAS_IO_URING)
+    return ring != nullptr;
+#else
+    return false;
+#endif
+}
+
+void HostIo::submit(HostIoRequest request) {
+#if defined(STAMINA_HAS_IO_URING)
+    if (ring) {
+        const std::lock_guard lock{mutex};
+        push_to_ring(new HostIoRequest{std::move(request)});
+        return;
+    }
+#endif
+    {
+        const std::lock_guard lock{mutex};
+        queue.push_back(std::move(request));
+    }
+    queued.notify_one();
+}
+
+void HostIo::work() {
+    while (true) {
+        std::unique_lock lock{mutex};
+        queued.wait(lock, [&] { return stopping || !queue.empty(); });
+        if (queue.empty()) {
+            return;
+        }
+        const HostIoRequest request = std::move(queue.front());
+        queue.pop_front();
+        // Writes still queued when stopping are completed, and reads cancelled
+        const bool cancelled = stopping && !request.write;
+        lock.unlock();
+        request.done(cancelled ? -ECANCELED : transfer(request, stop_event));
+    }
+}
+
+}
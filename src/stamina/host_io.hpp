@@ -0,0 +1,85 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <thread>
+#include <vector>
+#include "common/common_types.hpp"
+
+// Asynchronous host file I/O for emulated devices.
+//
+// Requests are submitted without blocking and complete on a host thread. On Linux, HostIo submits
+// them to an io_uring and a reaper thread waits for their completions. Where io_uring is missing or
+// not permitted, a pool of worker threads does blocking reads and writes instead; a worker waits
+// for a stream to become readable before reading it, so that the read can be cancelled.
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+    #define STAMINA_HAS_IO_URING 1
+#endif
+
+namespace stamina {
+
+struct HostIoRequest {
+    // Reads and writes streams such as consoles at their current position
+    static constexpr u64 stream = UINT64_MAX;
+
+    int fd;
+    bool write;
+    u64 offset;
+    // Must stay valid until done is called
+    std::span<u8> buffer;
+    // Called on a host thread with the number of bytes transferred, or minus the errno
+    std::function<void(s64 result)> done;
+};
+
+struct HostIo final {
+public:
+    explicit HostIo(size_t workers = 2, bool allow_io_uring = true);
+    // Waits for the writes in flight to complete, and cancels the reads, which may wait on a console
+    // indefinitely. The done of a cancelled read is called with -ECANCELED, unless it completed first.
+    ~HostIo();
+
+    HostIo(const HostIo&) = delete;
+    HostIo& operator=(const HostIo&) = delete;
+
+    void submit(HostIoRequest request);
+
+    bool uses_io_uring() const;
+
+private:
+    void work();
+
+    std::mutex mutex;
+    bool stopping = false;
+
+    // Thread pool
+    std::condition_variable queued;
+    std::deque<HostIoRequest> queue;
+    std::vector<std::thread> workers;
+    // Signalled when stopping, which cancels stream reads waiting for input
+    int stop_event = -1;
+
+#if defined(STAMINA_HAS_IO_URING)
+    struct Ring;
+    bool setup_ring(size_t entries);
+    // Puts request in the ring. Called with mutex held.
+    void push_to_ring(HostIoRequest* request);
+    // Takes the reads waiting for room out of the ring into cancelled, and asks the kernel to cancel
+    // those in the ring. Called with mutex held.
+    void cancel_reads(std::vector<HostIoRequest*>& cancelled);
+    void reap();
+
+    std::unique_ptr<Ring> ring;
+    std::thread reaper;
+#endif
+};
+
+}
@@ -0,0 +1,104 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#pragma once
+
+#include <array>
+#include <string_view>
+#include "common/common_types.hpp"
+#include "common/instruction.hpp"
+
+// Dynamic instruction mix.
+//
+// Built with STAMINA_HAS_INSTRUCTION_COUNTS (the STAMINA_INSTRUCTION_COUNTS CMake option), every
+// engine counts the instructions it retires by opcode into CpuState::counts. The interpreters count
+// each instruction as they run it. The block cache adds the opcodes of each block as it leaves it.
+// Translated code pays one increment per block entry, and the JIT adds executions times the block's
+// opcodes when a run ends. Without the option none of this is compiled in.
+
+namespace stamina {
+
+#if defined(STAMINA_HAS_INSTRUCTION_COUNTS)
+inline constexpr bool instruction_counts_enabled = true;
+#else
+inline constexpr bool instruction_counts_enabled = false;
+#endif
+
+inline constexpr size_t num_categories = static_cast<size_t>(Category::Shift) + 1;
+inline constexpr size_t num_formats = static_cast<size_t>(Format::F) + 1;
+
+constexpr std::string_view category_name(Category category) {
+    switch (category) {
+    case Category::Arithmetic:
+        return "Arithmetic";
+    case Category::Logical:
+        return "Logical";
+    case Category::Compare:
+        return "Compare";
+    case Category::BranchReg:
+        return "BranchReg";
+    case Category::Memory:
+        return "Memory";
+    case Category::Move:
+        return "Move";
+    case Category::Shift:
+        return "Shift";
+    }
+    return "";
+}
+
+constexpr std::string_view format_name(Format format) {
+    switch (format) {
+    case Format::I:
+        return "I";
+    case Format::S:
+        return "S";
+    case Format::M:
+        return "M";
+    case Format::F:
+        return "F";
+    }
+    return "";
+}
+
+// Retired instructions by opcode, in the order of instructions.inc.
+struct InstructionCounts {
+    std::array<u64, num_opcodes> by_opcode{};
+
+    u64& operator[](Opcode op) { return by_opcode[static_cast<size_t>(op)]; }
+    u64 operator[](Opcode op) const { return by_opcode[static_cast<size_t>(op)]; }
+
+    InstructionCounts& operator+=(const InstructionCounts& other) {
+        for (size_t i = 0; i < num_opcodes; i++) {
+            by_opcode[i] += other.by_opcode[i];
+        }
+        return *this;
+    }
+
+    u64 total() const {
+        u64 result = 0;
+        for (const u64 count : by_opcode) {
+            result += count;
+        }
+        return result;
+    }
+
+    std::array<u64, num_categories> by_category() const {
+        std::array<u64, num_categories> result{};
+        for (size_t i = 0; i < num_opcodes; i++) {
+            result[static_cast<size_t>(opcode_info[i].category)] += by_opcode[i];
+        }
+        return result;
+    }
+
+    std::array<u64, num_formats> by_format() const {
+        std::array<u64, num_formats> result{};
+        for (size_t i = 0; i < num_opcodes; i++) {
+            result[static_cast<size_t>(opcode_info[i].format)] += by_opcode[i];
+        }
+        return result;
+    }
+};
+
+}
@@ -0,0 +1,132 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#include <string>
+#include <catch.hpp>
+#include "common/common_types.hpp"
+#include "stamina/block_cache.hpp"
+#include "stamina/cpu_state.hpp"
+#include "stamina/instruction_counts.hpp"
+#include "stamina/interpreter.hpp"
+#include "stamina/memory.hpp"
+#include "stamina/test_program.hpp"
+
+#if defined(STAMINA_HAS_X64_JIT)
+    #include "stamina/x64/jit.hpp"
+#endif
+
+using namespace stamina;
+using namespace stamina::test;
+
+TEST_CASE("instruction counts: categories and formats", "[stamina]") {
+    InstructionCounts counts;
+    counts[Opcode::ADD] = 3;
+    counts[Opcode::ADDI] = 4;
+    counts[Opcode::LD] = 5;
+    counts[Opcode::CMP_EQ] = 6;
+
+    InstructionCounts other;
+    other[Opcode::LD] = 1;
+    counts += other;
+
+    REQUIRE(counts.total() == 19);
+    const auto by_category = counts.by_category();
+    REQUIRE(by_category[static_cast<size_t>(Category::Arithmetic)] == 7);
+    REQUIRE(by_category[static_cast<size_t>(Category::Memory)] == 6);
+    REQUIRE(by_category[static_cast<size_t>(Category::Compare)] == 6);
+    REQUIRE(by_category[static_cast<size_t>(Category::Shift)] == 0);
+    const auto by_format = counts.by_format();
+    REQUIRE(by_format[static_cast<size_t>(Format::S)] == 9);
+    REQUIRE(by_format[static_cast<size_t>(Format::I)] == 10);
+    REQUIRE(category_name(Category::BranchReg) == "BranchReg");
+    REQUIRE(format_name(Format::F) == "F");
+}
+
+#if defined(STAMINA_HAS_INSTRUCTION_COUNTS)
+
+namespace {
+
+// Calls, memory accesses and a loop, ending in a store that faults part way through its block
+const std::string program =
+    "    movi r1, 10\n"
+    "    li r3, function\n"
+    "    li r5, loop\n"
+    "    li r6, 0x1000\n"
+    "loop:\n"
+    "    rcall r3\n"
+    "    addi r1, r1, -1\n"
+    "    cmpi/eq r1, 0\n"
+    "    pcaddi r4, 12\n"
+    "    mf r4, r5\n"
+    "    robra r4, r0\n"
+    "    li r7, 0x7FFFFFF0\n"
+    "    st r1, r7, 0\n"
+    "    mtoc r15, r0\n"
+    "function:\n"
+    "    push r1\n"
+    "    ld r2, r6, 0\n"
+    "    add r2, r2, r1\n"
+    "    st r2, r6, 0\n"
+    "    lsl r8, r2, 2\n"
+    "    pop r1\n"
+    "    ret\n";
+
+// Counts by decoding each instruction before single-stepping it
+InstructionCounts expected_counts() {
+    Memory memory{ram_size};
+    CpuState state;
+    load_program(memory, state, program);
+    InstructionCounts counts;
+    while (true) {
+        u32 word = 0;
+        REQUIRE(memory.fetch(state.pc, word));
+        const u64 retired = state.retired;
+        const StopReason reason = interpret_switch(state, memory, 1);
+        if (state.retired != retired) {
+            counts[static_cast<Opcode>(opcode_decode_table[word >> 24])]++;
+        }
+        if (reason != StopReason::BudgetExhausted) {
+            REQUIRE(reason == StopReason::MemoryFault);
+            return counts;
+        }
+    }
+}
+
+template <typename Run>
+void check_counts(const InstructionCounts& expected, Run&& run) {
+    // In slices that end part way through blocks
+    for (const u64 slice : {u64{7}, u64{1000}}) {
+        Memory memory{ram_size};
+        CpuState state;
+        load_program(memory, state, program);
+        StopReason reason;
+        do {
+            reason = run(state, memory, slice);
+        } while (reason == StopReason::BudgetExhausted);
+        REQUIRE(reason == StopReason::MemoryFault);
+        REQUIRE(state.counts.total() == state.retired);
+        REQUIRE(state.counts.by_opcode == expected.by_opcode);
+    }
+}
+
+}
+
+TEST_CASE("instruction counts: engines agree with single-stepping", "[stamina]") {
+    const InstructionCounts expected = expected_counts();
+    REQUIRE(expected[Opcode::RCALL] == 10);
+    REQUIRE(expected[Opcode::ST] == 10);
+    REQUIRE(expected[Opcode::MTOC] == 0);
+
+    check_counts(expected, interpret);
+    check_counts(expected, interpret_switch);
+    BlockCache cache;
+    check_counts(expected, [&](CpuState& state, Memory& memory, u64 budget) { return interpret_cached(state, memory, cache, budget); });
+#if defined(STAMINA_HAS_X64_JIT)
+    x64::Jit jit{1024 * 1024};
+    REQUIRE(jit.valid());
+    check_counts(expected, [&](CpuState& state, Memory& memory, u64 budget) { return jit.run(state, memory, budget); });
+#endif
+}
+
+#endif
@@ -0,0 +1,180 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#include "stamina/interpreter.hpp"
+#include "stamina/mmu.hpp"
+#include "stamina/semantics.hpp"
+
+namespace stamina {
+
+StopReason interpret_switch(CpuState& state, Memory& memory, u64 budget) {
+    for (; budget > 0; budget--) {
+        u32 word;
+        if (!fetch_virtual(state, memory, state.pc, word)) [[unlikely]] {
+            state.control(ControlRegister::FaultAddress) = state.pc;
+            return StopReason::MemoryFault;
+        }
+
+        Step step;
+        switch (opcode_decode_table[word >> 24]) {
+#define INSTRUCTION(name, ...)                                                                   \
+        case static_cast<u8>(Opcode::name):                                                      \
+            step = execute<Opcode::name>(state, memory, extract_operands<Opcode::name>(word));   \
+            break;
+#define COMPAREINST(name, cond, ...) INSTRUCTION(name##_##cond)
+#include "common/instructions.inc"
+#undef INSTRUCTION
+#undef COMPAREINST
+        default:
+            return StopReason::InvalidInstruction;
+        }
+
+        if (step != Step::MemoryFault) {
+            count_instruction(state, static_cast<Opcode>(opcode_decode_table[word >> 24]));
+        }
+        if (step != Step::Continue) [[unlikely]] {
+            state.retired += step != Step::MemoryFault;
+            return stop_reason(step);
+        }
+        state.retired++;
+    }
+    return StopReason::BudgetExhausted;
+}
+
+#if defined(STAMINA_HAS_COMPUTED_GOTO)
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+namespace {
+
+// Translation of the page being executed, so that fetches from it skip the TLB
+struct FetchPage {
+    u32 tag = invalid_tlb_tag;
+    u32 offset = 0;
+};
+
+FORCE_INLINE bool fetch_paged(CpuState& state, const Memory& memory, FetchPage& page, u32& word) {
+    if ((state.pc & (page_mask | 3)) == page.tag) [[likely]] {
+        return memory.read(state.pc + page.offset, word);
+    }
+    if (!fetch_virtual(state, memory, state.pc, word)) {
+        return false;
+    }
+    // The fetch left its translation in the TLB
+    const TlbEntry& entry = state.tlb[tlb_index(state.pc)];
+    page = FetchPage{entry.read_tag, entry.offset};
+    return true;
+}
+
+// Fetches translate only while paging is enabled, so the loop is specialized on it. Returns with
+// mode_changed set after an MTOC that toggles paging.
+template <bool paging>
+StopReason interpret_threaded(CpuState& state, Memory& memory, u64 budget, bool& mode_changed) {
+    // Handler addresses indexed by Opcode, followed by the invalid instruction handler
+    static const void* const handlers[] = {
+#define INSTRUCTION(name, ...) &&op_##name,
+#define COMPAREINST(name, cond, ...) &&op_##name##_##cond,
+#include "common/instructions.inc"
+#undef INSTRUCTION
+#undef COMPAREINST
+        &&invalid,
+    };
+    static_assert(std::size(handlers) == num_opcodes + 1);
+
+    u32 word;
+    Step step;
+    u64 remaining = budget;
+    FetchPage fetch_page;
+
+#define DISPATCH()                                                                               \
+    do {                                                                                         \
+        if (remaining == 0) [[unlikely]] {                                                       \
+            goto budget_exhausted;                                                               \
+        }                                                                                        \
+        remaining--;                                                                             \
+        if (!(paging ? fetch_paged(state, memory, fetch_page, word)                              \
+                     : memory.fetch(state.pc, word))) [[unlikely]] {                             \
+            goto fetch_fault;                                                                    \
+        }                                                                                        \
+        const u8 index = opcode_decode_table[word >> 24];                                        \
+        goto *handlers[index == invalid_opcode_index ? num_opcodes : index];                     \
+    } while (false)
+
+    DISPATCH();
+
+#define INSTRUCTION(name, ...)                                                                   \
+    op_##name:                                                                                   \
+        step = execute<Opcode::name>(state, memory, extract_operands<Opcode::name>(word));       \
+        if (step != Step::Continue) [[unlikely]] {                                               \
+            goto stop;                                                                           \
+        }                                                                                        \
+        count_instruction(state, Opcode::name);                                                  \
+        if constexpr (Opcode::name == Opcode::MTOC) {                                            \
+            if (state.paging() != paging) {                                                      \
+                goto mode_change;                                                                \
+            }                                                                                    \
+            fetch_page = FetchPage{};                                                            \
+        }                                                                                        \
+        DISPATCH();
+#define COMPAREINST(name, cond, ...) INSTRUCTION(name##_##cond)
+#include "common/instructions.inc"
+#undef INSTRUCTION
+#undef COMPAREINST
+
+#undef DISPATCH
+
+invalid:
+    state.retired += budget - remaining - 1;
+    return StopReason::InvalidInstruction;
+
+fetch_fault:
+    state.retired += budget - remaining - 1;
+    state.control(ControlRegister::FaultAddress) = state.pc;
+    return StopReason::MemoryFault;
+
+stop:
+    // An instruction that stops the core completes; a faulting one does not
+    state.retired += budget - remaining - (step == Step::MemoryFault ? 1 : 0);
+    if (step != Step::MemoryFault) {
+        count_instruction(state, static_cast<Opcode>(opcode_decode_table[word >> 24]));
+    }
+    return stop_reason(step);
+
+mode_change:
+    state.retired += budget - remaining;
+    mode_changed = true;
+    return StopReason::BudgetExhausted;
+
+budget_exhausted:
+    state.retired += budget;
+    return StopReason::BudgetExhausted;
+}
+
+}
+
+StopReason interpret(CpuState& state, Memory& memory, u64 budget) {
+    while (true) {
+        const u64 retired = state.retired;
+        bool mode_changed = false;
+        const StopReason reason = state.paging() ? interpret_threaded<true>(state, memory, budget, mode_changed)
+                                                 : interpret_threaded<false>(state, memory, budget, mode_changed);
+        if (!mode_changed) {
+            return reason;
+        }
+        budget -= state.retired - retired;
+    }
+}
+
+#pragma GCC diagnostic pop
+
+#else
+
+StopReason interpret(CpuState& state, Memory& memory, u64 budget) {
+    return interpret_switch(state, memory, budget);
+}
+
+#endif
+
+}
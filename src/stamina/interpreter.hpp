@@ -0,0 +1,24 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#pragma once
+
+#include "common/common_types.hpp"
+#include "stamina/cpu_state.hpp"
+#include "stamina/memory.hpp"
+
+#if defined(__GNUC__) || defined(__clang__)
+    #define STAMINA_HAS_COMPUTED_GOTO 1
+#endif
+
+namespace stamina {
+
+// Executes at most budget instructions starting at state.pc.
+// Uses threaded dispatch where the compiler supports computed goto.
+StopReason interpret(CpuState& state, Memory& memory, u64 budget);
+
+// Portable switch-dispatched interpreter. Behaves identically to interpret.
+StopReason interpret_switch(CpuState& state, Memory& memory, u64 budget);
+
+}
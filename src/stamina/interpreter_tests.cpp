@@ -0,0 +1,147 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#include <cstring>
+#include <string>
+#include <catch.hpp>
+#include "common/common_types.hpp"
+#include "common/instruction.hpp"
+#include "stamina/cpu_state.hpp"
+#include "stamina/interpreter.hpp"
+#include "stamina/memory.hpp"
+#include "stamina/test_program.hpp"
+
+using namespace stamina;
+using namespace stamina::test;
+
+namespace {
+
+const std::string sum_program =
+    "    movi r1, 0\n"
+    "    movi r2, 100\n"
+    "    li r3, loop\n"
+    "    li r4, done\n"
+    "loop:\n"
+    "    add r1, r1, r2\n"
+    "    addi r2, r2, -1\n"
+    "    cmpi/eq r2, 0\n"
+    "    mov r5, r3\n"
+    "    mt r5, r4\n"
+    "    rbra r5\n"
+    "done:\n"
+    "    mtoc r15, r1\n";
+
+}
+
+TEST_CASE("interpreter: loop and halt", "[stamina]") {
+    for (const auto run : {interpret, interpret_switch}) {
+        Memory memory{ram_size};
+        CpuState state;
+        load_program(memory, state, sum_program);
+
+        REQUIRE(run(state, memory, 1'000'000) == StopReason::Halted);
+        REQUIRE(state.control(ControlRegister::Halt) == 5050);
+        REQUIRE(state.retired == 4 + 100 * 6 + 1);
+    }
+}
+
+TEST_CASE("interpreter: budget is exact", "[stamina]") {
+    for (const auto run : {interpret, interpret_switch}) {
+        Memory memory{ram_size};
+        CpuState state;
+        load_program(memory, state, sum_program);
+
+        REQUIRE(run(state, memory, 10) == StopReason::BudgetExhausted);
+        REQUIRE(state.retired == 10);
+        REQUIRE(state.pc == 16);
+    }
+}
+
+TEST_CASE("interpreter: arithmetic, memory and calls", "[stamina]") {
+    const std::string source =
+        "    li r1, 0x12345678\n"
+        "    lsr r2, r1, 16\n"
+        "    flsl r3, r1, r2, 8\n"
+        "    movi r4, -7\n"
+        "    divi r5, r4, 2\n"
+        "    remi r6, r4, 2\n"
+        "    div r7, r4, r0\n"
+        "    li r8, buffer\n"
+        "    st r1, r8, 0\n"
+        "    ldb r9, r8, 1\n"
+        "    push r1\n"
+        "    pop r10\n"
+        "    li r11, function\n"
+        "    rcall r11\n"
+        "    ldc r12, r8, 0\n"
+        "    stc r4, r8, 0\n"
+        "    mfrc r13, r0\n"
+        "    mtoc r15, r0\n"
+        "function:\n"
+        "    popcnt r0, r1\n"
+        "    ret\n"
+        "buffer: @word 0\n";
+
+    for (const auto run : {interpret, interpret_switch}) {
+        Memory memory{ram_size};
+        CpuState state;
+        load_program(memory, state, source);
+
+        REQUIRE(run(state, memory, 1000) == StopReason::Halted);
+        REQUIRE(state.gpr[2] == 0x1234);
+        REQUIRE(state.gpr[3] == 0x34567800);
+        REQUIRE(state.gpr[5] == static_cast<u32>(-3));
+        REQUIRE(state.gpr[6] == static_cast<u32>(-1));
+        REQUIRE(state.gpr[7] == 0xFFFFFFFF);
+        REQUIRE(state.gpr[9] == 0x56);
+        REQUIRE(state.gpr[10] == 0x12345678);
+        REQUIRE(state.gpr[0] == 13);
+        REQUIRE(state.gpr[12] == 0x12345678);
+        REQUIRE(state.t);
+        u32 stored;
+        REQUIRE(memory.read(state.gpr[8], stored));
+        REQUIRE(stored == static_cast<u32>(-7));
+    }
+}
+
+TEST_CASE("interpreter: shift amounts are taken modulo 32", "[stamina]") {
+    // The assembler rejects these immediates, but they can be encoded
+    const u32 words[] = {
+        encode(Instruction{Opcode::MOVI, 1, 0, 0, -16}),
+        encode(Instruction{Opcode::LSL, 2, 1, 0, 33}),
+        encode(Instruction{Opcode::LSR, 3, 1, 0, 36}),
+        encode(Instruction{Opcode::ASR, 4, 1, 0, 0xFFFF}),
+        encode(Instruction{Opcode::ROR, 5, 1, 0, 40}),
+    };
+
+    for (const auto run : {interpret, interpret_switch}) {
+        Memory memory{ram_size};
+        CpuState state;
+        std::memcpy(memory.bytes().data(), words, sizeof(words));
+
+        REQUIRE(run(state, memory, 5) == StopReason::BudgetExhausted);
+        REQUIRE(state.gpr[2] == 0xFFFFFFE0);
+        REQUIRE(state.gpr[3] == 0x0FFFFFFF);
+        REQUIRE(state.gpr[4] == 0xFFFFFFFF);
+        REQUIRE(state.gpr[5] == 0xF0FFFFFF);
+    }
+}
+
+TEST_CASE("interpreter: faults", "[stamina]") {
+    for (const auto run : {interpret, interpret_switch}) {
+        Memory memory{ram_size};
+        CpuState state;
+        load_program(memory, state, "li r1, 0x100000\nld r2, r1, 0\n");
+
+        REQUIRE(run(state, memory, 1000) == StopReason::MemoryFault);
+        REQUIRE(state.pc == 8);
+        REQUIRE(state.control(ControlRegister::FaultAddress) == 0x100000);
+        REQUIRE(state.retired == 2);
+
+        state = CpuState{};
+        std::memset(memory.bytes().data(), 0xFF, 4);
+        REQUIRE(run(state, memory, 1000) == StopReason::InvalidInstruction);
+        REQUIRE(state.pc == 0);
+    }
+}
@@ -0,0 +1,123 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#pragma once
+
+#include <array>
+#include <string>
+#include <vector>
+#include "common/common_types.hpp"
+
+// Block-local intermediate representation between decode and execution.
+//
+// Each instruction defines at most one 32-bit value, named by its index in the block, so the IR is
+// in SSA form. Guest registers are only touched through GetReg/SetReg, which is what lets the
+// passes cache and drop register traffic. Instructions without an IR translation become a
+// CallHandler that runs the decoded MicroOp against the guest state; passes treat it as a barrier.
+// Plain loads and stores are only translated where guest memory is host-mapped (see fastmem.hpp),
+// since the backends then need no bounds checks for them.
+
+namespace stamina {
+
+struct DecodedBlock;
+struct MicroOp;
+
+}
+
+namespace stamina::ir {
+
+using Value = u16;
+inline constexpr Value no_value = 0xFFFF;
+
+enum class Op : u8 {
+    // Removed by a pass
+    Nop,
+
+    // Pure values
+    Const,      // imm
+    GetReg,     // gpr[index]
+    GetT,
+    GetCr,      // cr[index]
+    GetUr,      // ur[index]
+    Add,
+    Sub,
+    Mul,
+    And,
+    Or,
+    Xor,
+    Not,
+    Shl,        // shift amounts are taken modulo 32
+    Lshr,
+    Ashr,
+    Ror,
+    CmpEq,      // 1 if the comparison holds, else 0
+    CmpLo,
+    CmpLs,
+    CmpLt,
+    CmpLe,
+    Select,     // args[0] != 0 ? args[1] : args[2]
+
+    // Effects
+    SetReg,     // gpr[index] = args[0]
+    SetT,       // t = args[0]
+    SetUr,      // ur[index] = args[0]
+    Load,       // imm bytes at guest address args[0], zero-extended; may fault
+    Store,      // imm bytes of args[1] to guest address args[0]; may fault
+    CallHandler,
+};
+
+struct Inst {
+    Op op = Op::Nop;
+    u8 index = 0;
+    // Position of the guest instruction this was translated from
+    u8 guest_index = 0;
+    std::array<Value, 3> args{no_value, no_value, no_value};
+    u32 imm = 0;
+    const MicroOp* micro_op = nullptr;
+};
+
+enum class ExitKind : u8 {
+    Fallthrough,
+    Jump,
+    Call,
+    Return,
+    // After MTOC: back to the dispatcher, which must see any change of address translation
+    Dispatch,
+};
+
+struct Block {
+    u32 start_pc = 0;
+    u32 guest_length = 0;
+    std::vector<Inst> insts;
+
+    ExitKind exit_kind = ExitKind::Fallthrough;
+    // Guest PC that control passes to after the block
+    Value exit_target = no_value;
+
+    const Inst& at(Value v) const { return insts[v]; }
+    u32 pc_of(const Inst& inst) const { return start_pc + inst.guest_index * 4u; }
+};
+
+constexpr bool is_pure(Op op) {
+    return op >= Op::Const && op <= Op::Select;
+}
+
+// Whether op defines a value. Loads do but are not pure, since they may fault.
+constexpr bool has_value(Op op) {
+    return is_pure(op) || op == Op::Load;
+}
+
+constexpr bool is_compare(Op op) {
+    return op >= Op::CmpEq && op <= Op::CmpLe;
+}
+
+// Translates a decoded block. The block must outlive the result, which points at its MicroOps.
+Block translate(const DecodedBlock& decoded);
+
+// Evaluates a pure operation on constant arguments.
+u32 evaluate(Op op, u32 a, u32 b, u32 c);
+
+std::string to_string(const Block& block);
+
+}
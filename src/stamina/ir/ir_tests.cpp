@@ -0,0 +1,172 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <catch.hpp>
+#include "common/common_types.hpp"
+#include "smasm/snippet_assembler.hpp"
+#include "stamina/block_cache.hpp"
+#include "stamina/cpu_state.hpp"
+#include "stamina/interpreter.hpp"
+#include "stamina/ir/passes.hpp"
+#include "stamina/memory.hpp"
+
+using namespace stamina;
+
+namespace {
+
+constexpr u32 ram_size = 64 * 1024;
+
+DecodedBlock decode(Memory& memory, const std::string& source) {
+    SnippetAssembler assembler;
+    const auto& result = assembler.assemble(source);
+    REQUIRE(result.ok());
+    std::memcpy(memory.bytes().data(), result.words.data(), result.words.size() * 4);
+    return decode_block(memory, 0);
+}
+
+size_t count(const ir::Block& block, ir::Op op) {
+    return static_cast<size_t>(std::count_if(block.insts.begin(), block.insts.end(), [op](const ir::Inst& inst) { return inst.op == op; }));
+}
+
+size_t count(const ir::Block& block, ir::Op op, u32 index) {
+    return static_cast<size_t>(std::count_if(block.insts.begin(), block.insts.end(), [=](const ir::Inst& inst) { return inst.op == op && inst.index == index; }));
+}
+
+// Value written to gpr[index] by the last SetReg of the block
+const ir::Inst* last_write(const ir::Block& block, u32 index) {
+    for (auto iter = block.insts.rbegin(); iter != block.insts.rend(); ++iter) {
+        if (iter->op == ir::Op::SetReg && iter->index == index) {
+            return &block.at(iter->args[0]);
+        }
+    }
+    return nullptr;
+}
+
+}
+
+TEST_CASE("ir: constant propagation", "[stamina]") {
+    Memory memory{ram_size};
+    const DecodedBlock decoded = decode(memory,
+        "    li r1, 0x89ABCDEF\n"
+        "    pcaddi r2, 8\n"
+        "    movi r3, 5\n"
+        "    pcadd r4, r3\n"
+        "    lsl r5, r3, 4\n"
+        "    mtoc r15, r1\n");
+
+    ir::Block block = ir::translate(decoded);
+    ir::Stats stats;
+    ir::optimize(block, ir::Options{}, stats);
+    INFO(ir::to_string(block));
+
+    REQUIRE(last_write(block, 1)->op == ir::Op::Const);
+    REQUIRE(last_write(block, 1)->imm == 0x89ABCDEF);
+    REQUIRE(last_write(block, 2)->imm == 8 + 8);
+    REQUIRE(last_write(block, 4)->imm == 16 + 5);
+    REQUIRE(last_write(block, 5)->imm == 5 << 4);
+    REQUIRE(count(block, ir::Op::GetReg, 1) == 0);
+    REQUIRE(count(block, ir::Op::GetReg, 3) == 0);
+    REQUIRE(stats.constants_folded > 0);
+    REQUIRE(stats.insts_out < stats.insts_in);
+}
+
+TEST_CASE("ir: redundant compares and dead writes", "[stamina]") {
+    Memory memory{ram_size};
+    const DecodedBlock decoded = decode(memory,
+        "    cmpi/eq r1, 0\n"
+        "    mti r2, 1\n"
+        "    cmpi/eq r1, 0\n"
+        "    mti r3, 1\n"
+        "    movi r4, 1\n"
+        "    movi r4, 2\n"
+        "    add r5, r1, r1\n"
+        "    mtoc r15, r4\n");
+
+    ir::Block block = ir::translate(decoded);
+    ir::Stats stats;
+    ir::optimize(block, ir::Options{}, stats);
+    INFO(ir::to_string(block));
+
+    REQUIRE(count(block, ir::Op::CmpEq) == 1);
+    REQUIRE(count(block, ir::Op::SetT) == 1);
+    REQUIRE(count(block, ir::Op::GetReg, 1) == 1);
+    REQUIRE(stats.reads_forwarded > 0);
+    REQUIRE(stats.compares_eliminated > 0);
+    REQUIRE(last_write(block, 4)->imm == 2);
+    REQUIRE(count(block, ir::Op::SetReg, 4) == 1);
+    REQUIRE(stats.writes_eliminated > 0);
+}
+
+TEST_CASE("ir: passes can be disabled", "[stamina]") {
+    Memory memory{ram_size};
+    const DecodedBlock decoded = decode(memory,
+        "    li r1, 0x12345678\n"
+        "    cmpi/eq r1, 0\n"
+        "    cmpi/eq r1, 0\n"
+        "    mtoc r15, r1\n");
+
+    ir::Options options;
+    REQUIRE(options.set("constant-propagation", false));
+    REQUIRE(options.set("redundant-compare-elimination", false));
+    REQUIRE(options.set("dead-write-elimination", false));
+    REQUIRE(!options.set("no-such-pass", false));
+
+    ir::Block block = ir::translate(decoded);
+    ir::Stats stats;
+    ir::optimize(block, options, stats);
+    INFO(ir::to_string(block));
+
+    REQUIRE(stats.constants_folded == 0);
+    REQUIRE(stats.compares_eliminated == 0);
+    REQUIRE(stats.writes_eliminated == 0);
+    REQUIRE(count(block, ir::Op::CmpEq) == 2);
+    REQUIRE(count(block, ir::Op::GetReg, 1) == 1);
+}
+
+TEST_CASE("ir: specialized blocks match the interpreter", "[stamina]") {
+    const std::string source =
+        "    li r1, 0x89ABCDEF\n"
+        "    pcaddi r2, 8\n"
+        "    addi r3, r2, 1\n"
+        "    divi r4, r0, 3\n"
+        "    addi r5, r1, 1\n"
+        "    mtoc r15, r5\n";
+
+    Memory memory{ram_size};
+    DecodedBlock decoded = decode(memory, source);
+    ir::Stats stats;
+    ir::specialize(decoded, ir::Options{}, stats);
+
+    // The MOVU half of li, PCADDI and the ADDI of its result. r1 is reloaded after the division handler,
+    // so the last ADDI stays
+    REQUIRE(decoded.ops[1].opcode == Opcode::MOVI);
+    REQUIRE(decoded.ops[1].imm == 0x89ABCDEF);
+    REQUIRE(decoded.ops[2].opcode == Opcode::MOVI);
+    REQUIRE(decoded.ops[3].opcode == Opcode::MOVI);
+    REQUIRE(decoded.ops[5].opcode == Opcode::ADDI);
+    REQUIRE(stats.specialized == 3);
+
+    // Every budget stops inside the block at a different point
+    for (u64 budget = 1; budget <= 7; budget++) {
+        Memory reference_memory{ram_size};
+        CpuState reference;
+        decode(reference_memory, source);
+
+        CpuState state;
+        BlockCache cache;
+        StopReason expected, actual;
+        do {
+            expected = interpret(reference, reference_memory, budget);
+            actual = interpret_cached(state, memory, cache, budget);
+            REQUIRE(actual == expected);
+            REQUIRE(state.pc == reference.pc);
+            REQUIRE(state.gpr == reference.gpr);
+            REQUIRE(state.retired == reference.retired);
+        } while (expected == StopReason::BudgetExhausted);
+        REQUIRE(actual == StopReason::Halted);
+    }
+}
@@ -0,0 +1,447 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#include <algorithm>
+#include <array>
+#include <vector>
+#include "common/instruction.hpp"
+#include "stamina/block_cache.hpp"
+#include "stamina/ir/passes.hpp"
+
+namespace stamina::ir {
+
+namespace {
+
+constexpr size_t arity(Op op) {
+    switch (op) {
+    case Op::Not:
+        return 1;
+    case Op::Select:
+        return 3;
+    default:
+        return op >= Op::Add && op <= Op::CmpLe ? 2 : 0;
+    }
+}
+
+// Redirects uses of removed values. Values only refer to earlier ones, so a single forward walk
+// that resolves each instruction's arguments before looking at it sees every replacement.
+struct Forwarder {
+    std::vector<Value> to;
+
+    explicit Forwarder(const Block& block) : to(block.insts.size(), no_value) {}
+
+    Value resolve(Value v) const {
+        while (v != no_value && to[v] != no_value) {
+            v = to[v];
+        }
+        return v;
+    }
+
+    void apply(Inst& inst) const {
+        for (Value& arg : inst.args) {
+            arg = resolve(arg);
+        }
+    }
+
+    void replace(Block& block, size_t index, Value with) {
+        to[index] = with;
+        block.insts[index] = Inst{};
+    }
+
+    void finish(Block& block) const {
+        block.exit_target = resolve(block.exit_target);
+    }
+};
+
+void make_constant(Inst& inst, u32 value) {
+    inst.op = Op::Const;
+    inst.args = {no_value, no_value, no_value};
+    inst.imm = value;
+}
+
+// Whether a and b are the same value or equal constants
+bool same_value(const Block& block, Value a, Value b) {
+    if (a == b) {
+        return true;
+    }
+    if (a == no_value || b == no_value) {
+        return false;
+    }
+    return block.at(a).op == Op::Const && block.at(b).op == Op::Const && block.at(a).imm == block.at(b).imm;
+}
+
+size_t live_insts(const Block& block) {
+    return static_cast<size_t>(std::count_if(block.insts.begin(), block.insts.end(), [](const Inst& inst) { return inst.op != Op::Nop; }));
+}
+
+}
+
+bool Options::set(std::string_view name, bool enabled) {
+    if (name == "register-caching") {
+        register_caching = enabled;
+    } else if (name == "constant-propagation") {
+        constant_propagation = enabled;
+    } else if (name == "redundant-compare-elimination") {
+        redundant_compare_elimination = enabled;
+    } else if (name == "dead-write-elimination") {
+        dead_write_elimination = enabled;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void cache_registers(Block& block, Stats& stats) {
+    Forwarder forwarder{block};
+    std::array<Value, num_gprs> regs;
+    regs.fill(no_value);
+    Value t = no_value;
+
+    for (size_t i = 0; i < block.insts.size(); i++) {
+        Inst& inst = block.insts[i];
+        forwarder.apply(inst);
+
+        switch (inst.op) {
+        case Op::GetReg:
+            if (regs[inst.index] != no_value) {
+                forwarder.replace(block, i, regs[inst.index]);
+                stats.reads_forwarded++;
+            } else {
+                regs[inst.index] = static_cast<Value>(i);
+            }
+            break;
+        case Op::SetReg:
+            if (regs[inst.index] == inst.args[0]) {
+                // Writes back the value the register already holds
+                inst = Inst{};
+                stats.writes_eliminated++;
+            } else {
+                regs[inst.index] = inst.args[0];
+            }
+            break;
+        case Op::GetT:
+            if (t != no_value) {
+                forwarder.replace(block, i, t);
+                stats.reads_forwarded++;
+            } else {
+                t = static_cast<Value>(i);
+            }
+            break;
+        case Op::SetT:
+            if (t == inst.args[0]) {
+                inst = Inst{};
+                stats.writes_eliminated++;
+            } else {
+                t = inst.args[0];
+            }
+            break;
+        case Op::CallHandler:
+            // Handlers may write any register, and code generation keeps no value live across one
+            regs.fill(no_value);
+            t = no_value;
+            break;
+        default:
+            break;
+        }
+    }
+    forwarder.finish(block);
+}
+
+void propagate_constants(Block& block, Stats& stats) {
+    // Known bits of each value: bits set in mask have the corresponding bit of value
+    struct Bits {
+        u32 mask = 0;
+        u32 value = 0;
+
+        bool full() const { return mask == 0xFFFFFFFF; }
+        bool is(u32 v) const { return full() && value == v; }
+    };
+
+    Forwarder forwarder{block};
+    std::vector<Bits> bits(block.insts.size());
+
+    for (size_t i = 0; i < block.insts.size(); i++) {
+        Inst& inst = block.insts[i];
+        forwarder.apply(inst);
+        if (!is_pure(inst.op)) {
+            continue;
+        }
+        if (inst.op == Op::Const) {
+            bits[i] = Bits{0xFFFFFFFF, inst.imm};
+            continue;
+        }
+
+        const size_t n = arity(inst.op);
+        if (n == 0) {
+            continue;
+        }
+        std::array<Bits, 3> arg{};
+        bool all_known = true;
+        for (size_t j = 0; j < n; j++) {
+            arg[j] = bits[inst.args[j]];
+            all_known = all_known && arg[j].full();
+        }
+
+        if (all_known) {
+            make_constant(inst, evaluate(inst.op, arg[0].value, arg[1].value, arg[2].value));
+            bits[i] = Bits{0xFFFFFFFF, inst.imm};
+            stats.constants_folded++;
+            continue;
+        }
+
+        // Identities that leave one argument unchanged
+        Value same = no_value;
+        switch (inst.op) {
+        case Op::Add:
+        case Op::Or:
+        case Op::Xor:
+            same = arg[1].is(0) ? inst.args[0] : arg[0].is(0) ? inst.args[1] : no_value;
+            break;
+        case Op::Sub:
+        case Op::Shl:
+        case Op::Lshr:
+        case Op::Ashr:
+        case Op::Ror:
+            same = arg[1].is(0) ? inst.args[0] : no_value;
+            break;
+        case Op::And:
+            same = arg[1].is(0xFFFFFFFF) ? inst.args[0] : arg[0].is(0xFFFFFFFF) ? inst.args[1] : no_value;
+            break;
+        case Op::Select:
+            if (arg[0].full()) {
+                same = arg[0].value != 0 ? inst.args[1] : inst.args[2];
+            }
+            break;
+        default:
+            break;
+        }
+        if (same != no_value) {
+            bits[i] = bits[same];
+            forwarder.replace(block, i, same);
+            stats.constants_folded++;
+            continue;
+        }
+
+        // Partially known results; MOVL followed by MOVU becomes fully known here
+        Bits result;
+        switch (inst.op) {
+        case Op::And: {
+            const u32 zeros = (arg[0].mask & ~arg[0].value) | (arg[1].mask & ~arg[1].value);
+            result.mask = (arg[0].mask & arg[1].mask) | zeros;
+            result.value = arg[0].value & arg[1].value & result.mask;
+            break;
+        }
+        case Op::Or: {
+            const u32 ones = (arg[0].mask & arg[0].value) | (arg[1].mask & arg[1].value);
+            result.mask = (arg[0].mask & arg[1].mask) | ones;
+            result.value = (arg[0].value | arg[1].value) & result.mask;
+            break;
+        }
+        case Op::Shl:
+            if (arg[1].full()) {
+                const u32 amount = arg[1].value & 31;
+                result.mask = (arg[0].mask << amount) | ((u32{1} << amount) - 1);
+                result.value = arg[0].value << amount;
+            }
+            break;
+        case Op::Lshr:
+            if (arg[1].full()) {
+                const u32 amount = arg[1].value & 31;
+                result.mask = (arg[0].mask >> amount) | ~(0xFFFFFFFF >> amount);
+                result.value = arg[0].value >> amount;
+            }
+            break;
+        default:
+            break;
+        }
+
+        if (result.full()) {
+            make_constant(inst, result.value);
+            stats.constants_folded++;
+        }
+        bits[i] = result;
+    }
+    forwarder.finish(block);
+}
+
+void eliminate_redundant_compares(Block& block, Stats& stats) {
+    struct Compare {
+        Op op;
+        Value a;
+        Value b;
+        Value result;
+    };
+
+    Forwarder forwarder{block};
+    std::vector<Compare> compares;
+    Value t = no_value;
+
+    for (size_t i = 0; i < block.insts.size(); i++) {
+        Inst& inst = block.insts[i];
+        forwarder.apply(inst);
+
+        if (is_compare(inst.op)) {
+            const auto iter = std::find_if(compares.begin(), compares.end(), [&](const Compare& c) {
+                return c.op == inst.op && same_value(block, c.a, inst.args[0]) && same_value(block, c.b, inst.args[1]);
+            });
+            if (iter != compares.end()) {
+                forwarder.replace(block, i, iter->result);
+                stats.compares_eliminated++;
+            } else {
+                compares.push_back(Compare{inst.op, inst.args[0], inst.args[1], static_cast<Value>(i)});
+            }
+            continue;
+        }
+
+        switch (inst.op) {
+        case Op::GetT:
+            t = static_cast<Value>(i);
+            break;
+        case Op::SetT:
+            if (inst.args[0] == t) {
+                inst = Inst{};
+                stats.compares_eliminated++;
+            } else {
+                t = inst.args[0];
+            }
+            break;
+        case Op::CallHandler:
+            // Values do not live across handler calls, and STC writes T
+            compares.clear();
+            t = no_value;
+            break;
+        default:
+            break;
+        }
+    }
+    forwarder.finish(block);
+}
+
+void eliminate_dead_writes(Block& block, Stats& stats) {
+    // Registers and T are live at the end of the block and before every memory access and
+    // handler call, which may fault and must see precise state
+    constexpr u16 all_registers = 0xFFFF;
+    u16 live = all_registers;
+    bool t_live = true;
+
+    std::vector<u32> uses(block.insts.size());
+    if (block.exit_target != no_value) {
+        uses[block.exit_target]++;
+    }
+
+    for (size_t i = block.insts.size(); i-- > 0;) {
+        Inst& inst = block.insts[i];
+        const u16 bit = static_cast<u16>(1 << inst.index);
+
+        switch (inst.op) {
+        case Op::SetReg:
+            if (!(live & bit)) {
+                inst = Inst{};
+                stats.writes_eliminated++;
+                continue;
+            }
+            live &= ~bit;
+            break;
+        case Op::GetReg:
+            live |= bit;
+            break;
+        case Op::SetT:
+            if (!t_live) {
+                inst = Inst{};
+                stats.writes_eliminated++;
+                continue;
+            }
+            t_live = false;
+            break;
+        case Op::GetT:
+            t_live = true;
+            break;
+        case Op::Load:
+        case Op::Store:
+        case Op::CallHandler:
+            live = all_registers;
+            t_live = true;
+            break;
+        default:
+            break;
+        }
+
+        if (is_pure(inst.op) && uses[i] == 0) {
+            inst = Inst{};
+            stats.values_eliminated++;
+            continue;
+        }
+        for (const Value arg : inst.args) {
+            if (arg != no_value) {
+                uses[arg]++;
+            }
+        }
+    }
+}
+
+Stats& Stats::operator+=(const Stats& other) {
+    blocks += other.blocks;
+    insts_in += other.insts_in;
+    insts_out += other.insts_out;
+    reads_forwarded += other.reads_forwarded;
+    constants_folded += other.constants_folded;
+    compares_eliminated += other.compares_eliminated;
+    writes_eliminated += other.writes_eliminated;
+    values_eliminated += other.values_eliminated;
+    specialized += other.specialized;
+    return *this;
+}
+
+void optimize(Block& block, const Options& options, Stats& stats) {
+    stats.blocks++;
+    stats.insts_in += live_insts(block);
+    if (options.register_caching) {
+        cache_registers(block, stats);
+    }
+    if (options.constant_propagation) {
+        propagate_constants(block, stats);
+        if (options.register_caching) {
+            // Folded identities can expose writes of a register's own value
+            cache_registers(block, stats);
+        }
+    }
+    if (options.redundant_compare_elimination) {
+        eliminate_redundant_compares(block, stats);
+    }
+    if (options.dead_write_elimination) {
+        eliminate_dead_writes(block, stats);
+    }
+    stats.insts_out += live_insts(block);
+}
+
+void specialize(DecodedBlock& decoded, const Options& options, Stats& stats) {
+    if (!options.constant_propagation) {
+        return;
+    }
+
+    Block block = translate(decoded);
+    if (options.register_caching) {
+        cache_registers(block, stats);
+    }
+    propagate_constants(block, stats);
+
+    for (const Inst& inst : block.insts) {
+        if (inst.op != Op::SetReg || block.at(inst.args[0]).op != Op::Const) {
+            continue;
+        }
+        MicroOp& op = decoded.ops[inst.guest_index];
+        const Category category = info(op.opcode).category;
+        if (op.opcode == Opcode::MOVI || category == Category::BranchReg || category == Category::Memory || inst.index != op.rd) {
+            continue;
+        }
+        const RegisterEffects effects = register_effects(Instruction{op.opcode, op.rd, op.rs, op.rt, static_cast<s32>(op.imm)});
+        if (effects.writes != (1 << op.rd) || effects.writes_t) {
+            continue;
+        }
+        op = make_micro_op(Opcode::MOVI, op.rd, 0, 0, block.at(inst.args[0]).imm);
+        stats.specialized++;
+    }
+}
+
+}
@@ -0,0 +1,59 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#pragma once
+
+#include <string_view>
+#include "common/common_types.hpp"
+#include "stamina/ir/ir.hpp"
+
+namespace stamina::ir {
+
+struct Options {
+    // Forwards guest register and T reads from earlier reads and writes in the block, and drops
+    // writes of the value a register already holds.
+    bool register_caching = true;
+    // Folds values whose bits are all known, such as PCADDI results and MOVL/MOVU pairs.
+    bool constant_propagation = true;
+    // Reuses identical compares and drops writes of T that do not change it.
+    bool redundant_compare_elimination = true;
+    // Drops register and T writes that are overwritten before being read, then unused values.
+    bool dead_write_elimination = true;
+
+    // Not a pass: has translated calls and returns maintain CpuState::call_stack for the profiler.
+    bool shadow_calls = false;
+
+    // Sets the pass called name. Returns false if there is no such pass.
+    bool set(std::string_view name, bool enabled);
+};
+
+struct Stats {
+    size_t blocks = 0;
+    size_t insts_in = 0;
+    size_t insts_out = 0;
+    size_t reads_forwarded = 0;
+    size_t constants_folded = 0;
+    size_t compares_eliminated = 0;
+    size_t writes_eliminated = 0;
+    size_t values_eliminated = 0;
+    // Decoded instructions rewritten by specialize
+    size_t specialized = 0;
+
+    Stats& operator+=(const Stats& other);
+};
+
+void cache_registers(Block& block, Stats& stats);
+void propagate_constants(Block& block, Stats& stats);
+void eliminate_redundant_compares(Block& block, Stats& stats);
+void eliminate_dead_writes(Block& block, Stats& stats);
+
+// Runs the enabled passes in order. Register caching runs again after constant propagation.
+void optimize(Block& block, const Options& options, Stats& stats);
+
+// Rewrites each instruction of decoded whose only effect is to set its destination register to a
+// block-local constant into a MOVI of that constant. Every instruction boundary keeps its
+// architectural state, so the result is safe to stop anywhere, unlike the output of optimize.
+void specialize(DecodedBlock& decoded, const Options& options, Stats& stats);
+
+}
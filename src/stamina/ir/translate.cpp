@@ -0,0 +1,349 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#include <bit>
+#include <fmt/format.h>
+#include "common/assert.hpp"
+#include "common/instruction.hpp"
+#include "stamina/block_cache.hpp"
+#include "stamina/fastmem.hpp"
+#include "stamina/ir/ir.hpp"
+
+namespace stamina::ir {
+
+namespace {
+
+struct Builder {
+    Block& block;
+    u8 guest_index = 0;
+
+    Value emit(Inst inst) {
+        ASSERT(block.insts.size() < no_value);
+        inst.guest_index = guest_index;
+        block.insts.push_back(inst);
+        return static_cast<Value>(block.insts.size() - 1);
+    }
+
+    Value constant(u32 imm) {
+        return emit(Inst{Op::Const, 0, 0, {no_value, no_value, no_value}, imm, nullptr});
+    }
+
+    Value get(Op op, u32 index) {
+        return emit(Inst{op, static_cast<u8>(index), 0, {no_value, no_value, no_value}, 0, nullptr});
+    }
+
+    Value reg(u32 index) {
+        return get(Op::GetReg, index);
+    }
+
+    Value op(Op op, Value a, Value b = no_value, Value c = no_value) {
+        return emit(Inst{op, 0, 0, {a, b, c}, 0, nullptr});
+    }
+
+    void set(Op op, u32 index, Value v) {
+        emit(Inst{op, static_cast<u8>(index), 0, {v, no_value, no_value}, 0, nullptr});
+    }
+
+    Value load(Value address, u32 size) {
+        return emit(Inst{Op::Load, 0, 0, {address, no_value, no_value}, size, nullptr});
+    }
+
+    void store(Value address, Value value, u32 size) {
+        emit(Inst{Op::Store, 0, 0, {address, value, no_value}, size, nullptr});
+    }
+
+    void call_handler(const MicroOp& micro_op) {
+        emit(Inst{Op::CallHandler, 0, 0, {no_value, no_value, no_value}, 0, &micro_op});
+    }
+
+    void exit(ExitKind kind, Value target) {
+        block.exit_kind = kind;
+        block.exit_target = target;
+    }
+};
+
+Op compare_op(Opcode opcode) {
+    switch (info(opcode).minor & 0b0111) {
+    case 0b000:
+        return Op::CmpEq;
+    case 0b001:
+        return Op::CmpLo;
+    case 0b010:
+        return Op::CmpLs;
+    case 0b011:
+        return Op::CmpLt;
+    default:
+        return Op::CmpLe;
+    }
+}
+
+void translate_one(Builder& b, const MicroOp& u, u32 pc) {
+    const auto rs = [&] { return b.reg(u.rs); };
+    const auto rt = [&] { return b.reg(u.rt); };
+    const auto imm = [&] { return b.constant(u.imm); };
+    const auto set_rd = [&](Value v) { b.set(Op::SetReg, u.rd, v); };
+
+    if (info(u.opcode).category == Category::Compare) {
+        const Value rhs = info(u.opcode).format == Format::I ? imm() : rs();
+        b.set(Op::SetT, 0, b.op(compare_op(u.opcode), b.reg(u.rd), rhs));
+        return;
+    }
+
+    switch (u.opcode) {
+    case Opcode::ADDI:
+        return set_rd(b.op(Op::Add, rs(), imm()));
+    case Opcode::MULTI:
+        return set_rd(b.op(Op::Mul, rs(), imm()));
+    case Opcode::SLTI:
+        return set_rd(b.op(Op::CmpLt, rs(), imm()));
+    case Opcode::SLTIU:
+        return set_rd(b.op(Op::CmpLo, rs(), imm()));
+    case Opcode::NOP:
+        return;
+    case Opcode::PCADDI:
+        return set_rd(b.constant(pc + u.imm));
+    case Opcode::ADD:
+        return set_rd(b.op(Op::Add, rs(), rt()));
+    case Opcode::MULT:
+        return set_rd(b.op(Op::Mul, rs(), rt()));
+    case Opcode::SLT:
+        return set_rd(b.op(Op::CmpLt, rs(), rt()));
+    case Opcode::SLTU:
+        return set_rd(b.op(Op::CmpLo, rs(), rt()));
+    case Opcode::SUB:
+        return set_rd(b.op(Op::Sub, rs(), rt()));
+    case Opcode::PCADD:
+        return set_rd(b.op(Op::Add, b.constant(pc), rs()));
+
+    case Opcode::ANDI:
+        return set_rd(b.op(Op::And, rs(), imm()));
+    case Opcode::ORI:
+        return set_rd(b.op(Op::Or, rs(), imm()));
+    case Opcode::XORI:
+        return set_rd(b.op(Op::Xor, rs(), imm()));
+    case Opcode::NANDI:
+        return set_rd(b.op(Op::Not, b.op(Op::And, rs(), imm())));
+    case Opcode::AND:
+        return set_rd(b.op(Op::And, rs(), rt()));
+    case Opcode::OR:
+        return set_rd(b.op(Op::Or, rs(), rt()));
+    case Opcode::XOR:
+        return set_rd(b.op(Op::Xor, rs(), rt()));
+    case Opcode::NAND:
+        return set_rd(b.op(Op::Not, b.op(Op::And, rs(), rt())));
+
+    // The target is read before the link register is written, in case they are the same
+    case Opcode::RBRA:
+        return b.exit(ExitKind::Jump, b.op(Op::Add, b.reg(u.rd), imm()));
+    case Opcode::RCALL: {
+        const Value target = b.op(Op::Add, b.reg(u.rd), imm());
+        b.set(Op::SetReg, reg_lr, b.constant(pc + 4));
+        return b.exit(ExitKind::Call, target);
+    }
+    case Opcode::RET:
+        return b.exit(ExitKind::Return, b.reg(reg_lr));
+    case Opcode::ROBRA:
+        return b.exit(ExitKind::Jump, b.op(Op::Add, b.reg(u.rd), rs()));
+    case Opcode::ROCALL: {
+        const Value target = b.op(Op::Add, b.reg(u.rd), rs());
+        b.set(Op::SetReg, reg_lr, b.constant(pc + 4));
+        return b.exit(ExitKind::Call, target);
+    }
+
+    case Opcode::MOVI:
+        return set_rd(imm());
+    case Opcode::MTI:
+        return set_rd(b.op(Op::Select, b.get(Op::GetT, 0), imm(), b.reg(u.rd)));
+    case Opcode::MFT:
+        return set_rd(b.op(Op::Select, b.get(Op::GetT, 0), b.reg(u.rd), imm()));
+    case Opcode::MOVL:
+        return set_rd(b.op(Op::Or, b.op(Op::And, b.reg(u.rd), b.constant(0xFFFF0000)), imm()));
+    case Opcode::MOVU:
+        return set_rd(b.op(Op::Or, b.constant(u.imm << 16), b.op(Op::And, b.reg(u.rd), b.constant(0xFFFF))));
+    case Opcode::MOV:
+        return set_rd(rs());
+    case Opcode::MT:
+        return set_rd(b.op(Op::Select, b.get(Op::GetT, 0), rs(), b.reg(u.rd)));
+    case Opcode::MF:
+        return set_rd(b.op(Op::Select, b.get(Op::GetT, 0), b.reg(u.rd), rs()));
+    case Opcode::MFRC:
+        return set_rd(b.get(Op::GetCr, u.rs));
+    case Opcode::MTOU:
+        return b.set(Op::SetUr, u.rd, rs());
+    case Opcode::MFRU:
+        return set_rd(b.get(Op::GetUr, u.rs));
+
+    case Opcode::LSL:
+        return set_rd(b.op(Op::Shl, rs(), imm()));
+    case Opcode::LSR:
+        return set_rd(b.op(Op::Lshr, rs(), imm()));
+    case Opcode::ASR:
+        return set_rd(b.op(Op::Ashr, rs(), imm()));
+    case Opcode::ROR:
+        return set_rd(b.op(Op::Ror, rs(), imm()));
+    case Opcode::RLSL:
+        return set_rd(b.op(Op::Shl, rs(), rt()));
+    case Opcode::RLSR:
+        return set_rd(b.op(Op::Lshr, rs(), rt()));
+    case Opcode::RASR:
+        return set_rd(b.op(Op::Ashr, rs(), rt()));
+    case Opcode::RROR:
+        return set_rd(b.op(Op::Ror, rs(), rt()));
+    // Funnel shifts of rs:rt by a five-bit immediate
+    case Opcode::FLSL:
+        if (u.imm == 0) {
+            return set_rd(rs());
+        }
+        return set_rd(b.op(Op::Or, b.op(Op::Shl, rs(), imm()), b.op(Op::Lshr, rt(), b.constant(32 - u.imm))));
+    case Opcode::FLSR:
+        if (u.imm == 0) {
+            return set_rd(rt());
+        }
+        return set_rd(b.op(Op::Or, b.op(Op::Lshr, rt(), imm()), b.op(Op::Shl, rs(), b.constant(32 - u.imm))));
+
+#if defined(STAMINA_HAS_FASTMEM)
+    case Opcode::LD:
+        return set_rd(b.load(b.op(Op::Add, rs(), imm()), 4));
+    case Opcode::LDH:
+        return set_rd(b.load(b.op(Op::Add, rs(), imm()), 2));
+    case Opcode::LDB:
+        return set_rd(b.load(b.op(Op::Add, rs(), imm()), 1));
+    case Opcode::ST:
+        return b.store(b.op(Op::Add, rs(), imm()), b.reg(u.rd), 4);
+    case Opcode::STH:
+        return b.store(b.op(Op::Add, rs(), imm()), b.reg(u.rd), 2);
+    case Opcode::STB:
+        return b.store(b.op(Op::Add, rs(), imm()), b.reg(u.rd), 1);
+    case Opcode::RLD:
+        return set_rd(b.load(b.op(Op::Add, rs(), rt()), 4));
+    case Opcode::RDLH:
+        return set_rd(b.load(b.op(Op::Add, rs(), rt()), 2));
+    case Opcode::RLDB:
+        return set_rd(b.load(b.op(Op::Add, rs(), rt()), 1));
+    case Opcode::RST:
+        return b.store(b.op(Op::Add, rs(), rt()), b.reg(u.rd), 4);
+    case Opcode::RSTH:
+        return b.store(b.op(Op::Add, rs(), rt()), b.reg(u.rd), 2);
+    case Opcode::RSTB:
+        return b.store(b.op(Op::Add, rs(), rt()), b.reg(u.rd), 1);
+#endif
+
+    case Opcode::MTOC:
+        b.call_handler(u);
+        return b.exit(ExitKind::Dispatch, no_value);
+
+    default:
+        // Division, bit counting, stack and exclusive accesses
+        return b.call_handler(u);
+    }
+}
+
+}
+
+Block translate(const DecodedBlock& decoded) {
+    Block block;
+    block.start_pc = decoded.start_pc;
+    block.guest_length = static_cast<u32>(decoded.ops.size());
+    block.insts.reserve(decoded.ops.size() * 4);
+
+    Builder b{block};
+    for (size_t i = 0; i < decoded.ops.size(); i++) {
+        b.guest_index = static_cast<u8>(i);
+        translate_one(b, decoded.ops[i], decoded.start_pc + static_cast<u32>(i) * 4);
+    }
+    if (block.exit_target == no_value) {
+        block.exit_target = b.constant(decoded.end_pc());
+    }
+    return block;
+}
+
+u32 evaluate(Op op, u32 a, u32 b, u32 c) {
+    switch (op) {
+    case Op::Add:
+        return a + b;
+    case Op::Sub:
+        return a - b;
+    case Op::Mul:
+        return a * b;
+    case Op::And:
+        return a & b;
+    case Op::Or:
+        return a | b;
+    case Op::Xor:
+        return a ^ b;
+    case Op::Not:
+        return ~a;
+    case Op::Shl:
+        return a << (b & 31);
+    case Op::Lshr:
+        return a >> (b & 31);
+    case Op::Ashr:
+        return static_cast<u32>(static_cast<s32>(a) >> (b & 31));
+    case Op::Ror:
+        return std::rotr(a, static_cast<int>(b & 31));
+    case Op::CmpEq:
+        return a == b;
+    case Op::CmpLo:
+        return a < b;
+    case Op::CmpLs:
+        return a <= b;
+    case Op::CmpLt:
+        return static_cast<s32>(a) < static_cast<s32>(b);
+    case Op::CmpLe:
+        return static_cast<s32>(a) <= static_cast<s32>(b);
+    case Op::Select:
+        return a != 0 ? b : c;
+    default:
+        UNREACHABLE();
+    }
+}
+
+std::string to_string(const Block& block) {
+    static constexpr const char* names[] = {
+        "nop", "const", "get_reg", "get_t", "get_cr", "get_ur", "add", "sub", "mul", "and", "or", "xor", "not",
+        "shl", "lshr", "ashr", "ror", "cmp_eq", "cmp_lo", "cmp_ls", "cmp_lt", "cmp_le", "select",
+        "set_reg", "set_t", "set_ur", "load", "store", "call_handler",
+    };
+    static_assert(std::size(names) == static_cast<size_t>(Op::CallHandler) + 1);
+
+    std::string result;
+    for (size_t i = 0; i < block.insts.size(); i++) {
+        const Inst& inst = block.insts[i];
+        if (inst.op == Op::Nop) {
+            continue;
+        }
+        result += fmt::format("%{} = {}", i, names[static_cast<size_t>(inst.op)]);
+        switch (inst.op) {
+        case Op::Const:
+            result += fmt::format(" {:#x}", inst.imm);
+            break;
+        case Op::GetReg:
+        case Op::GetCr:
+        case Op::GetUr:
+        case Op::SetReg:
+        case Op::SetUr:
+            result += fmt::format(" [{}]", inst.index);
+            break;
+        case Op::Load:
+        case Op::Store:
+            result += fmt::format(" u{}", inst.imm * 8);
+            break;
+        case Op::CallHandler:
+            result += fmt::format(" @{:08x}", block.pc_of(inst));
+            break;
+        default:
+            break;
+        }
+        for (const Value arg : inst.args) {
+            if (arg != no_value) {
+                result += fmt::format(" %{}", arg);
+            }
+        }
+        result += '\n';
+    }
+    result += fmt::format("exit %{}\n", block.exit_target);
+    return result;
+}
+
+}
@@ -0,0 +1,64 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#include <algorithm>
+#include <cstring>
+#include <fmt/format.h>
+#include "common/image_format.hpp"
+#include "common/mapped_file.hpp"
+#include "stamina/loader.hpp"
+
+namespace stamina {
+
+bool load_image(const std::filesystem::path& path, Memory& memory, CpuState& state, std::string& error) {
+    const auto file = MappedFile::open(path);
+    if (!file) {
+        error = fmt::format("could not read {}", path.string());
+        return false;
+    }
+
+    image::ImageHeader header;
+    if (file->size() < sizeof(header)) {
+        error = "file is too small to be a MINA image";
+        return false;
+    }
+    std::memcpy(&header, file->data(), sizeof(header));
+    if (std::memcmp(header.magic, image::magic, sizeof(image::magic)) != 0 || header.version != image::version) {
+        error = "not a MINA image";
+        return false;
+    }
+    if (sizeof(header) + u64{header.segment_count} * sizeof(image::SegmentHeader) > file->size()) {
+        error = "truncated segment table";
+        return false;
+    }
+
+    for (u32 i = 0; i < header.segment_count; i++) {
+        image::SegmentHeader segment;
+        std::memcpy(&segment, file->data() + sizeof(header) + i * sizeof(segment), sizeof(segment));
+
+        if (u64{segment.file_offset} + segment.file_size > file->size() || segment.file_size > segment.mem_size) {
+            error = fmt::format("segment {} is malformed", i);
+            return false;
+        }
+        if (u64{segment.vaddr} + segment.mem_size > memory.size()) {
+            error = fmt::format("segment {} does not fit in guest memory", i);
+            return false;
+        }
+
+        // Whole pages of contents are mapped from the file where the host allows it, and the rest copied
+        u32 mapped = segment.file_size / image::page_size * image::page_size;
+        if (!memory.map_file(segment.vaddr, file->fd(), segment.file_offset, mapped)) {
+            mapped = 0;
+        }
+        std::copy_n(file->data() + segment.file_offset + mapped, segment.file_size - mapped, memory.bytes().begin() + segment.vaddr + mapped);
+        memory.zero(segment.vaddr + segment.file_size, segment.mem_size - segment.file_size);
+    }
+
+    state = CpuState{};
+    state.pc = header.entry;
+    state.gpr[reg_sp] = memory.size();
+    return true;
+}
+
+}
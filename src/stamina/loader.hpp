@@ -0,0 +1,23 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#pragma once
+
+#include <filesystem>
+#include <string>
+#include "stamina/cpu_state.hpp"
+#include "stamina/memory.hpp"
+
+namespace stamina {
+
+// Loads a MINA image (see common/image_format.hpp) into guest memory and
+// initializes pc to the entry point and sp to the top of memory. Segment
+// contents are mapped copy-on-write from the image where Memory::map_file
+// allows, so that loading does not read them, and the zero-filled parts of
+// segments are left to be filled on demand. An image must therefore not be
+// modified in place while loaded; smasm replaces images rather than
+// rewriting them.
+bool load_image(const std::filesystem::path& path, Memory& memory, CpuState& state, std::string& error);
+
+}
@@ -0,0 +1,134 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <catch.hpp>
+#include <unistd.h>
+#include "common/common_types.hpp"
+#include "common/mapped_file.hpp"
+#include "smasm/assembler.hpp"
+#include "smasm/image_writer.hpp"
+#include "smasm/include_cache.hpp"
+#include "smasm/parser.hpp"
+#include "smasm/token_reader.hpp"
+#include "stamina/cpu_state.hpp"
+#include "stamina/interpreter.hpp"
+#include "stamina/loader.hpp"
+#include "stamina/memory.hpp"
+
+using namespace stamina;
+
+namespace {
+
+// Copies a page and a half of .rodata into .bss and halts with the last word copied
+const std::string program =
+    "    li r1, table\n"
+    "    li r2, buffer\n"
+    "    li r3, 0x600\n"
+    "    li r9, loop\n"
+    "    li r10, done\n"
+    "loop:\n"
+    "    ld r4, r1, 0\n"
+    "    st r4, r2, 0\n"
+    "    addi r1, r1, 4\n"
+    "    addi r2, r2, 4\n"
+    "    addi r3, r3, -1\n"
+    "    cmpi/eq r3, 0\n"
+    "    mov r5, r9\n"
+    "    mt r5, r10\n"
+    "    rbra r5\n"
+    "done:\n"
+    "    mtoc r15, r4\n"
+    "@section .rodata\n"
+    "table: @incbin \"table.bin\"\n"
+    "@section .bss\n"
+    "buffer: @space 0x1800\n";
+
+void write_program(const std::filesystem::path& dir, const std::string& source, const std::filesystem::path& path) {
+    IncludeCache cache;
+    TokenReader reader{cache};
+    reader.push_string(source, (dir / "loader.s").string());
+    Program parsed;
+    Parser{reader, parsed}.parse();
+    const AssemblyResult result = assemble(parsed);
+    REQUIRE(result.ok());
+    std::string error;
+    REQUIRE(write_image(result, path, error));
+}
+
+void write_table(const std::filesystem::path& dir) {
+    std::vector<u32> table(0x600);
+    for (size_t i = 0; i < table.size(); i++) {
+        table[i] = static_cast<u32>(table.size() - i);
+    }
+    std::ofstream{dir / "table.bin", std::ios::binary}.write(reinterpret_cast<const char*>(table.data()), static_cast<std::streamsize>(table.size() * 4));
+}
+
+}
+
+TEST_CASE("loader: images are mapped into guest memory", "[stamina]") {
+    const auto dir = std::filesystem::temp_directory_path() / ("stamina-loader-" + std::to_string(getpid()));
+    std::filesystem::create_directories(dir);
+    const auto path = dir / "loader.mina";
+    write_table(dir);
+    write_program(dir, program, path);
+    const auto image = MappedFile::open(path);
+    REQUIRE(image);
+    const std::vector<u8> contents{image->bytes().begin(), image->bytes().end()};
+
+    // Not a whole number of pages, so nothing can be mapped and everything is copied
+    for (const u32 size : {u32{64 * 1024}, u32{64 * 1024 - 12}}) {
+        Memory memory{size};
+        std::fill_n(memory.bytes().begin(), size, u8{0xAA});
+
+        CpuState state;
+        std::string error;
+        REQUIRE(load_image(path, memory, state, error));
+        REQUIRE(state.pc == 0);
+        REQUIRE(state.gpr[reg_sp] == size);
+        REQUIRE(interpret(state, memory, 100000) == StopReason::Halted);
+        REQUIRE(state.control(ControlRegister::Halt) == 1);
+
+        // The copy went to guest memory alone, and the rest of .bss was zeroed
+        u32 word = 0;
+        REQUIRE(memory.read(0x3000, word));
+        REQUIRE(word == 0x600);
+        REQUIRE(memory.read(0x3000 + 0x17fc, word));
+        REQUIRE(word == 1);
+        REQUIRE(memory.write<u32>(0x1000, 0));
+        REQUIRE(std::equal(contents.begin(), contents.end(), MappedFile::open(path)->data()));
+    }
+    std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("loader: images can be reassembled while loaded", "[stamina]") {
+    const auto dir = std::filesystem::temp_directory_path() / ("stamina-reload-" + std::to_string(getpid()));
+    std::filesystem::create_directories(dir);
+    const auto path = dir / "loader.mina";
+    write_table(dir);
+    write_program(dir, program, path);
+
+    Memory memory{64 * 1024};
+    CpuState state;
+    std::string error;
+    REQUIRE(load_image(path, memory, state, error));
+
+    // The loaded image keeps its contents, including pages the guest has not touched yet
+    write_program(dir, "    mtoc r15, r0\n", path);
+    REQUIRE(interpret(state, memory, 100000) == StopReason::Halted);
+    u32 word = 0;
+    REQUIRE(memory.read(0x3000, word));
+    REQUIRE(word == 0x600);
+    REQUIRE(memory.read(0x3000 + 0x17fc, word));
+    REQUIRE(word == 1);
+
+    // Only the image itself is left behind
+    REQUIRE(std::distance(std::filesystem::directory_iterator{dir}, std::filesystem::directory_iterator{}) == 2);
+    std::filesystem::remove_all(dir);
+}
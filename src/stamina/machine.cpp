@@ -0,0 +1,122 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#include "common/assert.hpp"
+#include "stamina/interpreter.hpp"
+#include "stamina/loader.hpp"
+#include "stamina/machine.hpp"
+
+namespace stamina {
+
+#if defined(STAMINA_HAS_X64_JIT)
+
+SharedCode::SharedCode(const ir::Options& options) : jit(x64::Jit::default_code_cache_size, options) {}
+
+bool SharedCode::valid() const {
+    return jit.valid();
+}
+
+#else
+
+SharedCode::SharedCode(const ir::Options& options) : cache(options) {}
+
+bool SharedCode::valid() const {
+    return true;
+}
+
+#endif
+
+Machine::Machine(const MachineOptions& options) : options(options), ram(options.ram_size), shared(options.shared_code) {
+    if (!shared) {
+        engine = make_engine(options.engine);
+    }
+}
+
+Machine::~Machine() {
+    if (shared) {
+        const std::lock_guard lock{shared->mutex};
+#if defined(STAMINA_HAS_X64_JIT)
+        shared->jit.forget(ram);
+#else
+        shared->cache.forget(ram);
+#endif
+    }
+}
+
+bool Machine::load(const std::filesystem::path& image, std::string& error) {
+    if (!load_image(image, ram, cpu, error)) {
+        return false;
+    }
+    loaded_code_writes = ram.code_write_count();
+    loaded_generation = cpu.mmu_generation;
+    return true;
+}
+
+StopReason Machine::run(u64 cycles) {
+    const CoreRunner runner{[this](CpuState& state, Memory& memory, u64 budget) { return shared ? run_shared(budget) : engine(state, memory, budget); }};
+    return events.run(cpu, ram, runner, cycles);
+}
+
+void Machine::restore(const Snapshot& snapshot) {
+    restore_snapshot(snapshot, cpu, ram);
+#if !defined(STAMINA_HAS_FASTMEM)
+    // Code caches are only told about restores that change code with fastmem. A machine still
+    // sharing code has the code of the image both now and in every snapshot taken from it.
+    if (cache) {
+        cache->clear();
+    }
+#endif
+}
+
+StopReason Machine::run_shared(u64 budget) {
+    // Keeps the shared code alive after leaving it
+    const std::shared_ptr<SharedCode> code = shared;
+    const std::lock_guard lock{code->mutex};
+#if defined(STAMINA_HAS_X64_JIT)
+    const StopReason reason = code->jit.run(cpu, ram, budget);
+#else
+    const StopReason reason = interpret_cached(cpu, ram, code->cache, budget);
+#endif
+    if (ram.code_write_count() != loaded_code_writes || cpu.mmu_generation != loaded_generation) {
+        leave_shared_code();
+    }
+    return reason;
+}
+
+void Machine::leave_shared_code() {
+#if defined(STAMINA_HAS_X64_JIT)
+    auto& code = shared->jit;
+#else
+    auto& code = shared->cache;
+#endif
+    // The shared code may have decoded the changed code since. Blocks decoded under a different
+    // address translation are dropped when the next machine runs.
+    if (!ram.visit_code_writes(loaded_code_writes, [&](const CodeWrite& write) { code.invalidate(write.address, write.size); })) {
+        code.clear();
+    }
+    code.forget(ram);
+    shared.reset();
+    engine = make_engine(options.engine);
+}
+
+CoreRunner Machine::make_engine(MachineEngine kind) {
+    switch (kind) {
+    case MachineEngine::Threaded:
+        return &interpret;
+    case MachineEngine::Jit:
+#if defined(STAMINA_HAS_X64_JIT)
+        jit = std::make_unique<x64::Jit>(x64::Jit::default_code_cache_size, options.ir_options);
+        ASSERT_MSG(jit->valid(), "could not allocate executable memory");
+        return [this](CpuState& state, Memory& memory, u64 budget) { return jit->run(state, memory, budget); };
+#else
+        [[fallthrough]];
+#endif
+    case MachineEngine::Cached:
+        cache = std::make_unique<BlockCache>(options.ir_options);
+        return [this](CpuState& state, Memory& memory, u64 budget) { return interpret_cached(state, memory, *cache, budget); };
+    }
+    UNREACHABLE();
+}
+
+}
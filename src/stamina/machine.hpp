@@ -0,0 +1,128 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#pragma once
+
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include "common/common_types.hpp"
+#include "stamina/block_cache.hpp"
+#include "stamina/cpu_state.hpp"
+#include "stamina/ir/passes.hpp"
+#include "stamina/memory.hpp"
+#include "stamina/scheduler.hpp"
+#include "stamina/smp.hpp"
+#include "stamina/snapshot.hpp"
+
+#if defined(STAMINA_HAS_X64_JIT)
+    #include "stamina/x64/jit.hpp"
+#endif
+
+// Embedding the emulator.
+//
+// A Machine is one single-core guest with its own RAM and scheduler, for hosting many small guests in
+// one process. Apart from guest RAM it takes a few KiB, and an engine with its code cache unless it
+// shares one. With STAMINA_HAS_FASTMEM each machine also reserves 4 GiB of host address space.
+//
+// Machines running the same image can share the code translated from it through a SharedCode, so
+// that it is translated once. A machine runs the shared code while its code is that of the image: it
+// leaves for an engine of its own, for good, as soon as it modifies its code or changes its address
+// translation, and what the shared code took from the change is dropped. The host may change guest
+// data between runs, but must not change the code of a machine that still shares.
+
+namespace stamina {
+
+enum class MachineEngine {
+    Threaded,
+    Cached,
+    // The block cache interpreter where the JIT is not available
+    Jit,
+};
+
+// Code decoded and translated from one image, shared by the machines running it, which must all
+// have the same amount of RAM. Machines take turns running the shared code, so machines driven from
+// several host threads are better given one SharedCode per thread.
+struct SharedCode final {
+public:
+    explicit SharedCode(const ir::Options& options = {});
+
+    SharedCode(const SharedCode&) = delete;
+    SharedCode& operator=(const SharedCode&) = delete;
+
+    // False if executable memory could not be allocated.
+    bool valid() const;
+
+private:
+    friend struct Machine;
+
+    std::mutex mutex;
+#if defined(STAMINA_HAS_X64_JIT)
+    x64::Jit jit;
+#else
+    BlockCache cache;
+#endif
+};
+
+struct MachineOptions {
+    u32 ram_size = 1024 * 1024;
+    MachineEngine engine = MachineEngine::Cached;
+    ir::Options ir_options;
+    // Runs the code shared with other machines instead of engine while the machine's code is that of
+    // the image
+    std::shared_ptr<SharedCode> shared_code;
+};
+
+struct Machine final {
+public:
+    explicit Machine(const MachineOptions& options);
+    ~Machine();
+
+    Machine(const Machine&) = delete;
+    Machine& operator=(const Machine&) = delete;
+
+    // Loads a MINA image and points the core at its entry point, as load_image does.
+    bool load(const std::filesystem::path& image, std::string& error);
+
+    // Executes at most cycles instructions, calling scheduled events as they become due.
+    StopReason run(u64 cycles);
+
+    // Saves the state of the machine, to restore it cheaply; see snapshot.hpp.
+    Snapshot snapshot() { return take_snapshot(cpu, ram); }
+    // Returns to a snapshot taken from this machine.
+    void restore(const Snapshot& snapshot);
+
+    CpuState& state() { return cpu; }
+    Memory& memory() { return ram; }
+    Scheduler& scheduler() { return events; }
+
+    // Whether the machine still runs shared code.
+    bool sharing_code() const { return shared != nullptr; }
+
+private:
+    StopReason run_shared(u64 budget);
+    // Leaves the shared code for an engine of its own. Called with the shared code's mutex held.
+    void leave_shared_code();
+    CoreRunner make_engine(MachineEngine engine);
+
+    MachineOptions options;
+    CpuState cpu;
+    Memory ram;
+    Scheduler events;
+    CoreRunner engine;
+
+    std::shared_ptr<SharedCode> shared;
+    // Code writes and address translation of the image as loaded
+    u64 loaded_code_writes = 0;
+    u32 loaded_generation = 0;
+
+    // Private engines
+    std::unique_ptr<BlockCache> cache;
+#if defined(STAMINA_HAS_X64_JIT)
+    std::unique_ptr<x64::Jit> jit;
+#endif
+};
+
+}
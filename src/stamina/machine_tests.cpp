@@ -0,0 +1,148 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+#include <catch.hpp>
+#include <unistd.h>
+#include "common/common_types.hpp"
+#include "smasm/assembler.hpp"
+#include "smasm/image_writer.hpp"
+#include "smasm/include_cache.hpp"
+#include "smasm/parser.hpp"
+#include "smasm/token_reader.hpp"
+#include "stamina/machine.hpp"
+
+using namespace stamina;
+
+namespace {
+
+// Counts to 1000 and halts with the count. With flag set, it first patches the loop, which is on a
+// page of its own, to count in threes.
+const std::string program =
+    "    li r1, flag\n"
+    "    ld r2, r1, 0\n"
+    "    cmpi/eq r2, 0\n"
+    "    li r3, run\n"
+    "    li r4, patch\n"
+    "    mov r5, r4\n"
+    "    mt r5, r3\n"
+    "    rbra r5\n"
+    "patch:\n"
+    "    li r1, template\n"
+    "    ld r2, r1, 0\n"
+    "    li r1, step\n"
+    "    st r2, r1, 0\n"
+    "run:\n"
+    "    movi r6, 0\n"
+    "    li r7, 1000\n"
+    "    li r8, step\n"
+    "    li r9, done\n"
+    "    rbra r8\n"
+    "@align 4096\n"
+    "step:\n"
+    "    addi r6, r6, 1\n"
+    "    addi r7, r7, -1\n"
+    "    cmpi/eq r7, 0\n"
+    "    mov r5, r8\n"
+    "    mt r5, r9\n"
+    "    rbra r5\n"
+    "done:\n"
+    "    mtoc r15, r6\n"
+    "template:\n"
+    "    addi r6, r6, 3\n"
+    "@section .data\n"
+    "flag: @word 0\n";
+
+struct TempImage {
+    std::filesystem::path path = std::filesystem::temp_directory_path() / ("stamina-machine-" + std::to_string(getpid()) + ".mina");
+    u32 flag = 0;
+
+    TempImage() {
+        IncludeCache cache;
+        TokenReader reader{cache};
+        reader.push_string(program, "machine.s");
+        Program parsed;
+        Parser{reader, parsed}.parse();
+        const AssemblyResult result = assemble(parsed);
+        REQUIRE(result.ok());
+        flag = static_cast<u32>(result.symbols.at("flag"));
+        std::string error;
+        REQUIRE(write_image(result, path, error));
+    }
+    ~TempImage() { std::filesystem::remove(path); }
+};
+
+void load(Machine& machine, const TempImage& image) {
+    std::string error;
+    REQUIRE(machine.load(image.path, error));
+}
+
+}
+
+TEST_CASE("machine: run, snapshot and restore", "[stamina]") {
+    const TempImage image;
+    for (const MachineEngine engine : {MachineEngine::Threaded, MachineEngine::Cached, MachineEngine::Jit}) {
+        Machine machine{MachineOptions{64 * 1024, engine, {}, nullptr}};
+        load(machine, image);
+        REQUIRE(machine.state().gpr[reg_sp] == 64 * 1024);
+
+        REQUIRE(machine.run(100) == StopReason::BudgetExhausted);
+        REQUIRE(machine.scheduler().now() == 100);
+        const Snapshot snapshot = machine.snapshot();
+        REQUIRE(machine.run(100000) == StopReason::Halted);
+        REQUIRE(machine.state().control(ControlRegister::Halt) == 1000);
+
+        // Patched after the snapshot
+        machine.restore(snapshot);
+        REQUIRE(machine.memory().write<u32>(image.flag, 1));
+        machine.state().pc = 0;
+        REQUIRE(machine.run(100000) == StopReason::Halted);
+        REQUIRE(machine.state().control(ControlRegister::Halt) == 3000);
+
+        machine.restore(snapshot);
+        REQUIRE(machine.run(100000) == StopReason::Halted);
+        REQUIRE(machine.state().control(ControlRegister::Halt) == 1000);
+    }
+}
+
+TEST_CASE("machine: machines share translated code", "[stamina]") {
+    const TempImage image;
+    const auto code = std::make_shared<SharedCode>();
+    REQUIRE(code->valid());
+    const MachineOptions options{64 * 1024, MachineEngine::Jit, {}, code};
+
+    std::vector<std::unique_ptr<Machine>> machines;
+    for (size_t i = 0; i < 3; i++) {
+        machines.push_back(std::make_unique<Machine>(options));
+        load(*machines.back(), image);
+        REQUIRE(machines.back()->sharing_code());
+    }
+    Machine& first = *machines[0];
+    Machine& patched = *machines[1];
+    Machine& last = *machines[2];
+
+    const Snapshot snapshot = first.snapshot();
+    REQUIRE(first.run(500) == StopReason::BudgetExhausted);
+
+    // Patching its code takes a machine off the shared code, without the others seeing the patch
+    REQUIRE(patched.memory().write<u32>(image.flag, 1));
+    REQUIRE(patched.run(100000) == StopReason::Halted);
+    REQUIRE(patched.state().control(ControlRegister::Halt) == 3000);
+    REQUIRE(!patched.sharing_code());
+
+    REQUIRE(first.run(100000) == StopReason::Halted);
+    REQUIRE(first.state().control(ControlRegister::Halt) == 1000);
+    REQUIRE(last.run(100000) == StopReason::Halted);
+    REQUIRE(last.state().control(ControlRegister::Halt) == 1000);
+    REQUIRE(first.sharing_code());
+    REQUIRE(last.sharing_code());
+
+    first.restore(snapshot);
+    machines.erase(machines.begin() + 1);
+    REQUIRE(first.run(100000) == StopReason::Halted);
+    REQUIRE(first.state().control(ControlRegister::Halt) == 1000);
+}
@@ -2,6 +2,437 @@
 // Copyright (c) 2020 MerryMage
 // SPDX-License-Identifier: 0BSD
 
-int main() {
-	return 0;
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fmt/format.h>
+#include <unistd.h>
+#include "common/assert.hpp"
+#include "stamina/block_cache.hpp"
+#include "stamina/devices.hpp"
+#include "stamina/host_io.hpp"
+#include "stamina/instruction_counts.hpp"
+#include "stamina/interpreter.hpp"
+#include "stamina/ir/passes.hpp"
+#include "stamina/loader.hpp"
+#include "stamina/profiler.hpp"
+#include "stamina/scheduler.hpp"
+#include "stamina/smp.hpp"
+#include "stamina/trace.hpp"
+#if defined(STAMINA_HAS_X64_JIT)
+    #include "stamina/x64/jit.hpp"
+#endif
+
+using namespace stamina;
+
+namespace {
+
+enum class Engine {
+    Threaded,
+    Cached,
+    // The switch interpreter writing a trace; chosen by --trace
+    Traced,
+#if defined(STAMINA_HAS_X64_JIT)
+    Jit,
+    // Runs the JIT and the interpreter in lockstep, stopping at the first divergence
+    Lockstep,
+#endif
+};
+
+constexpr u32 max_cores = 256;
+
+std::optional<Engine> parse_engine(std::string_view name) {
+    if (name == "threaded") {
+        return Engine::Threaded;
+    }
+    if (name == "cached") {
+        return Engine::Cached;
+    }
+#if defined(STAMINA_HAS_X64_JIT)
+    if (name == "jit") {
+        return Engine::Jit;
+    }
+    if (name == "lockstep") {
+        return Engine::Lockstep;
+    }
+#endif
+    return std::nullopt;
+}
+
+void usage() {
+#if defined(STAMINA_HAS_X64_JIT)
+    fmt::print(stderr, "usage: stamina [--ram MiB] [--cores N [--threads N]] [--engine threaded|cached|jit|lockstep] [--jit-threshold N] [--jit-workers N] [--disable-pass NAME]... [--trace FILE [--trace-deltas]] [--profile FILE [--profile-interval N]] [--disk FILE] [--stats] image.mina\n");
+#else
+    fmt::print(stderr, "usage: stamina [--ram MiB] [--cores N [--threads N]] [--engine threaded|cached] [--disable-pass NAME]... [--trace FILE [--trace-deltas]] [--profile FILE [--profile-interval N]] [--disk FILE] [--stats] image.mina\n");
+#endif
+}
+
+// Each core gets its own engine
+#if defined(STAMINA_HAS_X64_JIT)
+CoreRunnerFactory core_runner(Engine engine, const ir::Options& options, const x64::Tiering& tiering, TraceWriter* trace) {
+#else
+CoreRunnerFactory core_runner(Engine engine, const ir::Options& options, TraceWriter* trace) {
+#endif
+    switch (engine) {
+    case Engine::Threaded:
+        return [](size_t) { return CoreRunner{&interpret}; };
+    case Engine::Cached:
+        return [options](size_t) {
+            auto cache = std::make_shared<BlockCache>(options);
+            return CoreRunner{[cache](CpuState& state, Memory& memory, u64 budget) { return interpret_cached(state, memory, *cache, budget); }};
+        };
+    case Engine::Traced:
+        return [trace](size_t core) {
+            TraceRing* ring = &trace->ring(core);
+            const bool deltas = trace->deltas();
+            return CoreRunner{[ring, deltas](CpuState& state, Memory& memory, u64 budget) { return interpret_traced(state, memory, *ring, deltas, budget); }};
+        };
+#if defined(STAMINA_HAS_X64_JIT)
+    case Engine::Jit:
+        return [options, tiering](size_t) {
+            auto jit = std::make_shared<x64::Jit>(x64::Jit::default_code_cache_size, options, tiering);
+            ASSERT_MSG(jit->valid(), "could not allocate executable memory");
+            return CoreRunner{[jit](CpuState& state, Memory& memory, u64 budget) { return jit->run(state, memory, budget); }};
+        };
+    case Engine::Lockstep:
+        break;
+#endif
+    }
+    UNREACHABLE();
+}
+
+// Schedules the events of each core with its own scheduler, which also receives its I/O completions
+CoreRunnerFactory scheduled(CoreRunnerFactory make_runner, const std::vector<std::unique_ptr<Scheduler>>& schedulers, Devices& devices) {
+    return [make_runner, &schedulers, &devices](size_t core) {
+        Scheduler* scheduler = schedulers[core].get();
+        return CoreRunner{[scheduler, run = devices.runner(*scheduler, make_runner(core))](CpuState& state, Memory& memory, u64 budget) { return scheduler->run(state, memory, run, budget); }};
+    };
+}
+
+// Samples each core with its own profiler
+CoreRunnerFactory profiled(CoreRunnerFactory make_runner, const std::vector<std::unique_ptr<Profiler>>& profilers) {
+    return [make_runner, &profilers](size_t core) {
+        Profiler* profiler = profilers[core].get();
+        return CoreRunner{[profiler, run = make_runner(core)](CpuState& state, Memory& memory, u64 budget) { return profiler->run(state, memory, run, budget); }};
+    };
+}
+
+bool write_profile(const std::filesystem::path& path, const std::vector<std::unique_ptr<Profiler>>& profilers) {
+    Profile profile;
+    for (const auto& profiler : profilers) {
+        profile.merge(profiler->profile());
+    }
+
+    std::FILE* file = std::fopen(path.string().c_str(), "w");
+    if (!file) {
+        return false;
+    }
+    profile.write_folded(file);
+    const bool ok = std::fclose(file) == 0;
+
+    fmt::print(stderr, "stamina: {} samples\n", profile.samples);
+    for (const HotBlock& block : profile.hot_blocks(10)) {
+        fmt::print(stderr, "stamina: {:5.1f}% {:08x}-{:08x}\n", 100.0 * block.samples / profile.samples, block.start, block.end);
+    }
+    return ok;
+}
+
+void print_instruction_counts(const InstructionCounts& counts) {
+    const u64 total = counts.total();
+    const auto percent = [&](u64 count) { return total == 0 ? 0.0 : 100.0 * count / total; };
+
+    const auto by_category = counts.by_category();
+    for (size_t i = 0; i < num_categories; i++) {
+        fmt::print(stderr, "stamina: {:>12} {:5.1f}% {}\n", category_name(static_cast<Category>(i)), percent(by_category[i]), by_category[i]);
+    }
+    const auto by_format = counts.by_format();
+    for (size_t i = 0; i < num_formats; i++) {
+        fmt::print(stderr, "stamina: {:>12} {:5.1f}% {}\n", fmt::format("{}-format", format_name(static_cast<Format>(i))), percent(by_format[i]), by_format[i]);
+    }
+
+    std::vector<size_t> opcodes;
+    for (size_t i = 0; i < num_opcodes; i++) {
+        if (counts.by_opcode[i] != 0) {
+            opcodes.push_back(i);
+        }
+    }
+    std::sort(opcodes.begin(), opcodes.end(), [&](size_t a, size_t b) { return counts.by_opcode[a] > counts.by_opcode[b]; });
+    for (const size_t i : opcodes) {
+        fmt::print(stderr, "stamina: {:>12} {:5.1f}% {}\n", opcode_info[i].name, percent(counts.by_opcode[i]), counts.by_opcode[i]);
+    }
+}
+
+void print_ir_stats(const ir::Stats& stats) {
+    fmt::print(stderr, "stamina: {} blocks, {} -> {} ir instructions\n", stats.blocks, stats.insts_in, stats.insts_out);
+    fmt::print(stderr, "stamina: {} reads forwarded, {} constants folded, {} compares eliminated, {} writes eliminated, {} values eliminated, {} instructions specialized\n",
+               stats.reads_forwarded, stats.constants_folded, stats.compares_eliminated, stats.writes_eliminated, stats.values_eliminated, stats.specialized);
+}
+
+}
+
+int main(int argc, char** argv) {
+    std::optional<std::filesystem::path> image_path;
+    u32 ram_mib = 16;
+    u32 core_count = 1;
+    // Host threads to run the cores on; by default one per core
+    u32 thread_count = 0;
+    Engine engine = Engine::Cached;
+    bool print_stats = false;
+    std::optional<std::filesystem::path> trace_path;
+    bool trace_deltas = false;
+    std::optional<std::filesystem::path> profile_path;
+    std::optional<std::filesystem::path> disk_path;
+    u64 profile_interval = Profiler::default_interval;
+    ir::Options options;
+#if defined(STAMINA_HAS_X64_JIT)
+    x64::Tiering tiering;
+#endif
+
+    for (int i = 1; i < argc; i++) {
+        const std::string_view arg = argv[i];
+        if (arg == "--ram" && i + 1 < argc) {
+            ram_mib = static_cast<u32>(std::strtoul(argv[++i], nullptr, 0));
+        } else if (arg == "--cores" && i + 1 < argc) {
+            core_count = static_cast<u32>(std::strtoul(argv[++i], nullptr, 0));
+        } else if (arg == "--threads" && i + 1 < argc) {
+            thread_count = static_cast<u32>(std::strtoul(argv[++i], nullptr, 0));
+            if (thread_count == 0) {
+                usage();
+                return 1;
+            }
+        } else if (arg == "--engine" && i + 1 < argc) {
+            const auto parsed = parse_engine(argv[++i]);
+            if (!parsed) {
+                usage();
+                return 1;
+            }
+            engine = *parsed;
+#if defined(STAMINA_HAS_X64_JIT)
+        } else if (arg == "--jit-threshold" && i + 1 < argc) {
+            tiering.threshold = static_cast<u32>(std::strtoul(argv[++i], nullptr, 0));
+        } else if (arg == "--jit-workers" && i + 1 < argc) {
+            tiering.workers = static_cast<u32>(std::strtoul(argv[++i], nullptr, 0));
+#endif
+        } else if (arg == "--disable-pass" && i + 1 < argc) {
+            if (!options.set(argv[++i], false)) {
+                fmt::print(stderr, "stamina: unknown pass {}\n", argv[i]);
+                return 1;
+            }
+        } else if (arg == "--trace" && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else if (arg == "--trace-deltas") {
+            trace_deltas = true;
+        } else if (arg == "--profile" && i + 1 < argc) {
+            profile_path = argv[++i];
+        } else if (arg == "--profile-interval" && i + 1 < argc) {
+            profile_interval = std::strtoull(argv[++i], nullptr, 0);
+        } else if (arg == "--disk" && i + 1 < argc) {
+            disk_path = argv[++i];
+        } else if (arg == "--stats") {
+            print_stats = true;
+        } else if (!arg.empty() && arg[0] != '-' && !image_path) {
+            image_path = arg;
+        } else {
+            usage();
+            return 1;
+        }
+    }
+
+    if (!image_path || ram_mib == 0 || ram_mib > 4095 || core_count == 0 || core_count > max_cores) {
+        usage();
+        return 1;
+    }
+    if ((trace_deltas && !trace_path) || profile_interval == 0) {
+        usage();
+        return 1;
+    }
+    if (trace_path) {
+        engine = Engine::Traced;
+    }
+#if defined(STAMINA_HAS_X64_JIT)
+    if (engine == Engine::Lockstep && core_count > 1) {
+        fmt::print(stderr, "stamina: lockstep runs a single core\n");
+        return 1;
+    }
+    if (engine == Engine::Lockstep && profile_path) {
+        fmt::print(stderr, "stamina: lockstep cannot be profiled\n");
+        return 1;
+    }
+#endif
+
+    Memory memory{ram_mib * 1024 * 1024};
+    CpuState state;
+    std::string error;
+    if (!load_image(*image_path, memory, state, error)) {
+        fmt::print(stderr, "stamina: {}\n", error);
+        return 1;
+    }
+
+    std::optional<TraceWriter> trace;
+    if (trace_path) {
+        trace.emplace(*trace_path, core_count, trace_deltas);
+        if (!trace->valid()) {
+            fmt::print(stderr, "stamina: could not write {}\n", trace_path->string());
+            return 1;
+        }
+    }
+
+    // Declared before the host I/O, which posts completions to them until it is destroyed
+    std::vector<std::unique_ptr<Scheduler>> schedulers;
+    for (u32 i = 0; i < core_count; i++) {
+        schedulers.push_back(std::make_unique<Scheduler>());
+    }
+
+    HostIo host_io;
+    Devices devices{host_io, STDIN_FILENO, STDOUT_FILENO};
+    if (disk_path && !devices.attach_disk(*disk_path)) {
+        fmt::print(stderr, "stamina: could not open disk {}\n", disk_path->string());
+        return 1;
+    }
+
+    std::vector<std::unique_ptr<Profiler>> profilers;
+    if (profile_path) {
+        options.shadow_calls = true;
+        for (u32 i = 0; i < core_count; i++) {
+            profilers.push_back(std::make_unique<Profiler>(profile_interval));
+        }
+    }
+
+    BlockCache cache{options};
+#if defined(STAMINA_HAS_X64_JIT)
+    std::optional<x64::Jit> jit;
+    std::optional<x64::Divergence> divergence;
+    if (core_count == 1 && (engine == Engine::Jit || engine == Engine::Lockstep)) {
+        jit.emplace(x64::Jit::default_code_cache_size, options, tiering);
+        if (!jit->valid()) {
+            fmt::print(stderr, "stamina: could not allocate executable memory\n");
+            return 1;
+        }
+    }
+#endif
+
+    const auto start = std::chrono::steady_clock::now();
+    StopReason reason;
+    u64 retired = 0;
+    [[maybe_unused]] InstructionCounts counts;
+    if (core_count > 1) {
+        std::vector<CpuState> cores = make_cores(state, core_count);
+#if defined(STAMINA_HAS_X64_JIT)
+        CoreRunnerFactory make_runner = core_runner(engine, options, tiering, trace ? &*trace : nullptr);
+#else
+        CoreRunnerFactory make_runner = core_runner(engine, options, trace ? &*trace : nullptr);
+#endif
+        make_runner = scheduled(std::move(make_runner), schedulers, devices);
+        if (profile_path) {
+            make_runner = profiled(std::move(make_runner), profilers);
+        }
+        const SmpResult result = thread_count != 0 && thread_count < core_count ? run_smp_pooled(cores, memory, make_runner, UINT64_MAX, thread_count)
+                                                                                : run_smp(cores, memory, make_runner, UINT64_MAX);
+        reason = result.reason;
+        for (const CpuState& core : cores) {
+            retired += core.retired;
+#if defined(STAMINA_HAS_INSTRUCTION_COUNTS)
+            counts += core.counts;
+#endif
+        }
+        // Report the core that stopped the machine
+        state = cores[result.core];
+    } else {
+        const CoreRunner run_engine = [&](CpuState& state, Memory& memory, u64 budget) {
+            switch (engine) {
+            case Engine::Threaded:
+                return interpret(state, memory, budget);
+            case Engine::Cached:
+                return interpret_cached(state, memory, cache, budget);
+            case Engine::Traced:
+                return interpret_traced(state, memory, trace->ring(0), trace->deltas(), budget);
+#if defined(STAMINA_HAS_X64_JIT)
+            case Engine::Jit:
+                return jit->run(state, memory, budget);
+            case Engine::Lockstep:
+                return x64::run_lockstep(*jit, state, memory, budget, divergence);
+#endif
+            }
+            UNREACHABLE();
+        };
+        const CoreRunner run_devices = devices.runner(*schedulers[0], run_engine);
+        const CoreRunner run = [&](CpuState& state, Memory& memory, u64 budget) { return schedulers[0]->run(state, memory, run_devices, budget); };
+        do {
+            reason = profile_path ? profilers[0]->run(state, memory, run, UINT64_MAX) : run(state, memory, UINT64_MAX);
+#if defined(STAMINA_HAS_X64_JIT)
+            if (divergence) {
+                fmt::print(stderr, "stamina: jit diverged from interpreter in block {:08x}\n{}", divergence->block_pc, divergence->description);
+                return 1;
+            }
+#endif
+        } while (reason == StopReason::BudgetExhausted);
+        retired = state.retired;
+#if defined(STAMINA_HAS_INSTRUCTION_COUNTS)
+        counts = state.counts;
+#endif
+    }
+    const auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    if (profile_path && !write_profile(*profile_path, profilers)) {
+        fmt::print(stderr, "stamina: could not write {}\n", profile_path->string());
+        return 1;
+    }
+
+    if (print_stats) {
+        fmt::print(stderr, "stamina: {} instructions in {:.3f}s ({:.1f} MIPS)\n", retired, elapsed, retired / elapsed / 1e6);
+        u64 idle = 0;
+        for (const auto& scheduler : schedulers) {
+            idle += scheduler->idle_cycles();
+        }
+        if (idle != 0) {
+            fmt::print(stderr, "stamina: {} cycles skipped waiting\n", idle);
+        }
+        if constexpr (instruction_counts_enabled) {
+            print_instruction_counts(counts);
+        }
+        // With several cores, each engine kept its own statistics and is gone by now
+        if (core_count == 1) {
+            switch (engine) {
+            case Engine::Threaded:
+            case Engine::Traced:
+                break;
+            case Engine::Cached:
+                print_ir_stats(cache.ir_stats());
+                break;
+#if defined(STAMINA_HAS_X64_JIT)
+            case Engine::Jit:
+            case Engine::Lockstep:
+                print_ir_stats(jit->ir_stats());
+                fmt::print(stderr, "stamina: {} blocks translated, {} block executions interpreted\n", jit->block_count(), jit->interpreted_count());
+                break;
+#endif
+            }
+        }
+    }
+
+    switch (reason) {
+    case StopReason::Halted:
+        return static_cast<int>(state.control(ControlRegister::Halt));
+    case StopReason::InvalidInstruction:
+        fmt::print(stderr, "stamina: invalid instruction at {:08x}\n", state.pc);
+        return 1;
+    case StopReason::MemoryFault:
+        fmt::print(stderr, "stamina: memory fault at {:08x} accessing {:08x}\n", state.pc, state.control(ControlRegister::FaultAddress));
+        return 1;
+    case StopReason::Waiting:
+        fmt::print(stderr, "stamina: waiting at {:08x} with no events pending\n", state.pc);
+        return 1;
+    case StopReason::IoSubmitted:
+        break;
+    case StopReason::BudgetExhausted:
+        break;
+    }
+    return 1;
 }
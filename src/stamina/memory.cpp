@@ -0,0 +1,341 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#include <algorithm>
+#include <atomic>
+#include <utility>
+#include "common/assert.hpp"
+#include "stamina/memory.hpp"
+
+#if defined(STAMINA_HAS_FASTMEM)
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+namespace stamina {
+
+namespace {
+
+std::atomic<u64> next_memory_id = 1;
+std::atomic<u64> next_snapshot_id = 1;
+
+}
+
+#if defined(STAMINA_HAS_FASTMEM)
+
+Memory::Memory(u32 size) : ram_size(size), identity(next_memory_id.fetch_add(1, std::memory_order_relaxed)) {
+    ASSERT(size % 4 == 0);
+    fastmem::install_fault_handler();
+
+    const size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    ram_pages_size = (size_t{size} + page_size - 1) / page_size * page_size;
+    // Any guest address plus the widest access stays inside the reservation
+    reservation_size = ram_pages_size + (size_t{1} << 32) + page_size;
+
+    reservation = mmap(nullptr, reservation_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    ASSERT_MSG(reservation != MAP_FAILED, "could not reserve host address space for guest memory");
+    ASSERT(ram_pages_size == 0 || mprotect(reservation, ram_pages_size, PROT_READ | PROT_WRITE) == 0);
+    page_offset = static_cast<u32>(ram_pages_size - size);
+    base = static_cast<u8*>(reservation) + page_offset;
+
+    ASSERT(page_size == size_t{1} << code_page_bits);
+    protected_pages = std::make_unique<std::atomic<bool>[]>(ram_pages_size >> code_page_bits);
+}
+
+Memory::~Memory() {
+    munmap(reservation, reservation_size);
+}
+
+MemorySnapshot Memory::snapshot() {
+    MemorySnapshot result;
+    result.fd = memfd_create("stamina-snapshot", MFD_CLOEXEC);
+    ASSERT_MSG(result.fd != -1, "could not create a file for a memory snapshot");
+    result.size = ram_pages_size;
+    result.id = next_snapshot_id.fetch_add(1, std::memory_order_relaxed);
+    ASSERT(ftruncate(result.fd, static_cast<off_t>(ram_pages_size)) == 0);
+
+    const auto* pages = static_cast<const u8*>(reservation);
+    for (size_t written = 0; written < ram_pages_size;) {
+        const ssize_t n = pwrite(result.fd, pages + written, ram_pages_size - written, static_cast<off_t>(written));
+        ASSERT_MSG(n > 0, "could not write a memory snapshot");
+        written += static_cast<size_t>(n);
+    }
+
+    restore(result);
+    return result;
+}
+
+void Memory::restore(const MemorySnapshot& snapshot) {
+    ASSERT(snapshot.size == ram_pages_size);
+    if (ram_pages_size == 0) {
+        return;
+    }
+    const std::lock_guard lock{code_mutex};
+    constexpr size_t page_size = size_t{1} << code_page_bits;
+    auto* const pages = static_cast<u8*>(reservation);
+
+    // A protected page has not been written since it was protected, so restoring the snapshot RAM is
+    // mapped from only changes pages protected since, while another snapshot may change any of them.
+    // Those are kept as they are, to tell which of them the snapshot changes.
+    const bool remap = snapshot.id != mapped_snapshot;
+    const auto& candidates = remap ? code_pages : fresh_code_pages;
+    const std::vector<size_t> compared(candidates.begin(), candidates.end());
+    std::vector<u8> code(compared.size() * page_size);
+    for (size_t i = 0; i < compared.size(); i++) {
+        std::copy_n(pages + (compared[i] << code_page_bits), page_size, code.begin() + i * page_size);
+    }
+
+    if (remap) {
+        // Replacing the mapping drops the private copies of pages written since; the rest were never
+        // copied. The new mapping is writable throughout.
+        const void* mapped = mmap(reservation, ram_pages_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, snapshot.fd, 0);
+        ASSERT_MSG(mapped == reservation, "could not map a memory snapshot");
+        mapped_snapshot = snapshot.id;
+        for (const size_t page : code_pages) {
+            set_page_protection(page, false);
+        }
+    } else {
+        // Pages written since read from the snapshot again, and protection is kept
+        ASSERT(madvise(reservation, ram_pages_size, MADV_DONTNEED) == 0);
+    }
+
+    // Code pages the snapshot changed count as written
+    for (size_t i = 0; i < compared.size(); i++) {
+        if (!std::equal(code.begin() + i * page_size, code.begin() + (i + 1) * page_size, pages + (compared[i] << code_page_bits))) {
+            unprotect_page(compared[i]);
+            record_page_write(compared[i]);
+        }
+    }
+    fresh_code_pages.clear();
+}
+
+bool Memory::map_file(u32 address, int fd, u64 offset, u32 size) {
+    constexpr u64 page_mask = (u64{1} << code_page_bits) - 1;
+    if (fd < 0 || (u64{address} + page_offset) & page_mask || offset & page_mask || size & page_mask || u64{address} + size > ram_size) {
+        return false;
+    }
+    // Touching a mapped page past the end of the file would raise SIGBUS, and a file someone else
+    // can write may be truncated or changed under the mapping at any time
+    struct stat st;
+    if (fstat(fd, &st) != 0 || offset + size > static_cast<u64>(st.st_size)) {
+        return false;
+    }
+    if (!S_ISREG(st.st_mode) || st.st_mode & (S_IWGRP | S_IWOTH) || (st.st_uid != geteuid() && st.st_mode & S_IWUSR)) {
+        return false;
+    }
+    if (size == 0) {
+        return true;
+    }
+    // The mapping replaces any protection, so the pages count as written
+    unprotect_code(address, size);
+    const void* mapped = mmap(base + address, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, static_cast<off_t>(offset));
+    ASSERT_MSG(mapped == base + address, "could not map a file into guest memory");
+    mapped_snapshot = 0;
+    return true;
+}
+
+bool Memory::zero(u32 address, u32 size) {
+    if (u64{address} + size > ram_size) {
+        return false;
+    }
+    if (size == 0) {
+        return true;
+    }
+    unprotect_code(address, size);
+
+    constexpr u64 page_mask = (u64{1} << code_page_bits) - 1;
+    const u64 start = u64{address} + page_offset;
+    const u64 first = (start + page_mask) & ~page_mask;
+    const u64 last = (start + size) & ~page_mask;
+    if (first >= last) {
+        std::fill_n(base + address, size, u8{0});
+        return true;
+    }
+    std::fill(base + address, static_cast<u8*>(reservation) + first, u8{0});
+    void* const pages = static_cast<u8*>(reservation) + first;
+    const void* mapped = mmap(pages, last - first, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+    ASSERT_MSG(mapped == pages, "could not replace guest memory");
+    mapped_snapshot = 0;
+    std::fill(static_cast<u8*>(reservation) + last, base + address + size, u8{0});
+    return true;
+}
+
+void Memory::set_page_protection(size_t page, bool writable) const {
+    u8* const host = static_cast<u8*>(reservation) + (page << code_page_bits);
+    ASSERT(mprotect(host, size_t{1} << code_page_bits, writable ? PROT_READ | PROT_WRITE : PROT_READ) == 0);
+}
+
+void Memory::protect_code(u32 address, u32 size) const {
+    if (size == 0 || address >= ram_size) {
+        return;
+    }
+    const u32 last = code_page(static_cast<u32>(std::min<u64>(u64{address} + size, ram_size) - 1));
+    for (u32 page = code_page(address); page <= last; page++) {
+        if (protected_pages[page].load(std::memory_order_relaxed)) {
+            continue;
+        }
+        const std::lock_guard lock{code_mutex};
+        if (!protected_pages[page].load(std::memory_order_relaxed)) {
+            set_page_protection(page, false);
+            protected_pages[page].store(true, std::memory_order_relaxed);
+            protected_count.fetch_add(1, std::memory_order_relaxed);
+            code_pages.insert(page);
+            fresh_code_pages.insert(page);
+        }
+    }
+}
+
+bool Memory::unprotect_code(u32 address, u32 size) {
+    if (u64{address} + size > ram_size) {
+        return false;
+    }
+    const std::lock_guard lock{code_mutex};
+    bool written = false;
+    for (u32 page = code_page(address); page <= code_page(address + size - 1); page++) {
+        if (protected_pages[page].load(std::memory_order_relaxed)) {
+            unprotect_page(page);
+            written = true;
+        }
+    }
+    if (written) {
+        record_code_write(CodeWrite{address, size});
+    }
+    return true;
+}
+
+void Memory::unprotect_all_code() {
+    if (protected_count.load(std::memory_order_relaxed) == 0) {
+        return;
+    }
+    const std::lock_guard lock{code_mutex};
+    const std::vector<size_t> pages(code_pages.begin(), code_pages.end());
+    for (const size_t page : pages) {
+        unprotect_page(page);
+        record_page_write(page);
+    }
+}
+
+void Memory::unprotect_page(size_t page) {
+    set_page_protection(page, true);
+    protected_pages[page].store(false, std::memory_order_relaxed);
+    protected_count.fetch_sub(1, std::memory_order_relaxed);
+    code_pages.erase(page);
+    fresh_code_pages.erase(page);
+}
+
+void Memory::record_page_write(size_t page) {
+    // The first page of RAM may start part way into its host page
+    const u64 start = std::max<u64>(page << code_page_bits, page_offset) - page_offset;
+    const u64 end = ((page + 1) << code_page_bits) - page_offset;
+    record_code_write(CodeWrite{static_cast<u32>(start), static_cast<u32>(end - start)});
+}
+
+void Memory::record_code_write(const CodeWrite& write) {
+    const u64 count = code_writes.load(std::memory_order_relaxed);
+    code_log[count % code_log_size] = write;
+    code_writes.store(count + 1, std::memory_order_release);
+}
+
+MemorySnapshot::MemorySnapshot(MemorySnapshot&& other) noexcept : fd(std::exchange(other.fd, -1)), size(other.size) {}
+
+MemorySnapshot& MemorySnapshot::operator=(MemorySnapshot&& other) noexcept {
+    std::swap(fd, other.fd);
+    std::swap(size, other.size);
+    return *this;
+}
+
+MemorySnapshot::~MemorySnapshot() {
+    if (fd != -1) {
+        close(fd);
+    }
+}
+
+#else
+
+Memory::Memory(u32 size) : ram_size(size), identity(next_memory_id.fetch_add(1, std::memory_order_relaxed)), ram(size) {
+    ASSERT(size % 4 == 0);
+    base = ram.data();
+}
+
+Memory::~Memory() = default;
+
+void Memory::protect_code(u32, u32) const {}
+
+bool Memory::unprotect_code(u32 address, u32 size) {
+    return u64{address} + size <= ram_size;
+}
+
+void Memory::unprotect_all_code() {}
+
+bool Memory::map_file(u32, int, u64, u32) {
+    return false;
+}
+
+bool Memory::zero(u32 address, u32 size) {
+    if (u64{address} + size > ram_size) {
+        return false;
+    }
+    std::fill_n(base + address, size, u8{0});
+    return true;
+}
+
+MemorySnapshot Memory::snapshot() {
+    MemorySnapshot result;
+    result.ram = ram;
+    return result;
+}
+
+void Memory::restore(const MemorySnapshot& snapshot) {
+    ASSERT(snapshot.ram.size() == ram.size());
+    std::copy(snapshot.ram.begin(), snapshot.ram.end(), ram.begin());
+}
+
+MemorySnapshot::MemorySnapshot(MemorySnapshot&& other) noexcept = default;
+MemorySnapshot& MemorySnapshot::operator=(MemorySnapshot&& other) noexcept = default;
+MemorySnapshot::~MemorySnapshot() = default;
+
+#endif
+
+Memory::Memory(const Memory& other) : Memory(other.size()) {
+    std::copy(other.bytes().begin(), other.bytes().end(), bytes().begin());
+}
+
+bool Memory::read_bytes(u32 address, std::span<u8> data) const {
+    if (u64{address} + data.size() > ram_size) {
+        return false;
+    }
+    std::copy_n(base + address, data.size(), data.begin());
+    return true;
+}
+
+bool Memory::write_bytes(u32 address, std::span<const u8> data) {
+    if (u64{address} + data.size() > ram_size) {
+        return false;
+    }
+    // One store at a time, since another core's code cache may protect a page part way through
+    for (size_t i = 0; i < data.size(); i++) {
+        write<u8>(static_cast<u32>(address + i), data[i]);
+    }
+    return true;
+}
+
+bool Memory::compare_exchange(u32 address, u32 expected, u32 desired, bool& exchanged) {
+    ASSERT(address % 4 == 0);
+    if (u64{address} + 4 > ram_size) {
+        return false;
+    }
+    // base is word-aligned because RAM ends at a page boundary and its size is a multiple of 4
+#if defined(STAMINA_HAS_FASTMEM)
+    // Faults on a protected page whether or not the word matches
+    while (!fastmem::compare_exchange(base + address, expected, desired, exchanged)) {
+        unprotect_code(address, 4);
+    }
+#else
+    exchanged = std::atomic_ref<u32>{*reinterpret_cast<u32*>(base + address)}.compare_exchange_strong(expected, desired);
+#endif
+    return true;
+}
+
+}
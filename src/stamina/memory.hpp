@@ -0,0 +1,231 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <vector>
+#include <tsl/robin_set.h>
+#include "common/common_types.hpp"
+#include "common/macros.hpp"
+#include "stamina/fastmem.hpp"
+
+namespace stamina {
+
+// RAM contents saved by Memory::snapshot.
+struct MemorySnapshot final {
+public:
+    MemorySnapshot(MemorySnapshot&& other) noexcept;
+    MemorySnapshot& operator=(MemorySnapshot&& other) noexcept;
+    ~MemorySnapshot();
+
+private:
+    friend struct Memory;
+    MemorySnapshot() = default;
+
+#if defined(STAMINA_HAS_FASTMEM)
+    // File holding the pages of RAM
+    int fd = -1;
+    size_t size = 0;
+    // Distinct for every snapshot taken by the process
+    u64 id = 0;
+#else
+    std::vector<u8> ram;
+#endif
+};
+
+// A write to guest memory holding decoded code, as recorded by Memory.
+struct CodeWrite {
+    u32 address;
+    u32 size;
+};
+
+// Guest physical memory, mapped from address zero. Guest memory is little-endian. Its size is a
+// multiple of 4.
+//
+// With STAMINA_HAS_FASTMEM, RAM ends at the end of a page of a host reservation that extends over
+// the whole guest address space beyond it and is inaccessible there. Accesses then have no bounds
+// checks: an out-of-range access faults in the host and the fault handler fails it instead.
+//
+// Code caches protect the pages they decode blocks from, which makes them read-only in the host.
+// The first write to a protected page faults; the page is made writable again and the write is
+// recorded and then completed. Caches drop the blocks overlapping each recorded write at their next
+// block lookup, and protect the page again if they still hold blocks on it. Writes to pages without
+// code pay nothing. Without STAMINA_HAS_FASTMEM nothing is protected or recorded, and callers must
+// invalidate code caches after modifying code.
+struct Memory final {
+public:
+    explicit Memory(u32 size);
+    Memory(const Memory& other);
+    Memory& operator=(const Memory&) = delete;
+    ~Memory();
+
+    u32 size() const { return ram_size; }
+    // Distinct for every Memory created by the process, so that caches can tell memories apart.
+    u64 id() const { return identity; }
+    // Writable access makes every protected page writable and records it as written.
+    std::span<u8> bytes() {
+        unprotect_all_code();
+        return {base, ram_size};
+    }
+    std::span<const u8> bytes() const { return {base, ram_size}; }
+
+    // Host address of guest address zero.
+    u8* host_base() const { return base; }
+
+    // Saves the contents of RAM. With STAMINA_HAS_FASTMEM, RAM is then mapped copy-on-write over
+    // the snapshot, so that restoring it only discards the pages written since, and records a code
+    // write to each protected page whose contents it changes. Protected pages cannot be written, so
+    // restoring the snapshot RAM is mapped from compares only the pages protected since; restoring
+    // another snapshot, or one after map_file or zero, maps it afresh and compares every protected
+    // page. Otherwise restoring copies all of RAM, and callers must invalidate code caches as after
+    // any other change to code.
+    MemorySnapshot snapshot();
+    // Returns RAM to the contents saved in snapshot, which must come from a memory of the same size.
+    void restore(const MemorySnapshot& snapshot);
+
+    template <typename T>
+    FORCE_INLINE bool read(u32 address, T& value) const {
+#if defined(STAMINA_HAS_FASTMEM)
+        return fastmem::load(base + address, value);
+#else
+        if (u64{address} + sizeof(T) > ram_size) [[unlikely]] {
+            return false;
+        }
+        std::memcpy(&value, base + address, sizeof(T));
+        return true;
+#endif
+    }
+
+    template <typename T>
+    FORCE_INLINE bool write(u32 address, T value) {
+#if defined(STAMINA_HAS_FASTMEM)
+        if (fastmem::store(base + address, value)) [[likely]] {
+            return true;
+        }
+        // The page may hold code, or may have been protected again since it was made writable
+        while (unprotect_code(address, sizeof(T))) {
+            if (fastmem::store(base + address, value)) {
+                return true;
+            }
+        }
+        return false;
+#else
+        if (u64{address} + sizeof(T) > ram_size) [[unlikely]] {
+            return false;
+        }
+        std::memcpy(base + address, &value, sizeof(T));
+        return true;
+#endif
+    }
+
+    // Copies between RAM and host buffers, as devices do. False, copying nothing, if the range is not
+    // in RAM.
+    bool read_bytes(u32 address, std::span<u8> data) const;
+    bool write_bytes(u32 address, std::span<const u8> data);
+
+    // Maps size bytes of the file fd from offset over RAM at address, copy-on-write, so that pages are
+    // read from the file when first touched and shared with the host's page cache until written. Not
+    // allowed while code runs. False, changing nothing, unless address and offset both start host
+    // pages, size is a whole number of them and the range is in both RAM and the file. Without STAMINA_HAS_FASTMEM
+    // nothing can be mapped, and callers copy instead.
+    //
+    // Pages not yet touched follow changes to the file, and touching them once it is truncated kills
+    // the process, so the file must not be modified in place while mapped. Files that are not
+    // regular, or that users other than the current one can write, are never mapped.
+    bool map_file(u32 address, int fd, u64 offset, u32 size);
+    // Zeroes [address, address + size). The whole host pages in the range are replaced with fresh
+    // ones that the host only fills when they are first touched. Not allowed while code runs. False
+    // if the range is not in RAM.
+    bool zero(u32 address, u32 size);
+
+    // Atomically replaces the aligned word at address with desired if it holds expected. False if
+    // address is outside RAM; otherwise exchanged reports whether the word was replaced.
+    bool compare_exchange(u32 address, u32 expected, u32 desired, bool& exchanged);
+
+    FORCE_INLINE bool fetch(u32 address, u32& word) const {
+        if (address % 4 != 0) [[unlikely]] {
+            return false;
+        }
+        return read(address, word);
+    }
+
+    // Protection is per host page; code_page numbers the page holding a guest address.
+    static constexpr u32 code_page_bits = 12;
+    u32 code_page(u32 address) const { return static_cast<u32>((u64{address} + page_offset) >> code_page_bits); }
+    // Code page n starts at guest address (n << code_page_bits) - code_page_offset(), or at zero.
+    u32 code_page_offset() const { return page_offset; }
+
+    // Protects the pages overlapping [address, address + size) that lie in RAM. Only the host
+    // mapping changes, so this is allowed on a const Memory.
+    void protect_code(u32 address, u32 size) const;
+
+    // Number of code writes recorded so far.
+    u64 code_write_count() const { return code_writes.load(std::memory_order_acquire); }
+    // The counter behind code_write_count, for translated code to read directly.
+    const std::atomic<u64>* code_write_counter() const { return &code_writes; }
+    // Calls visit with each code write from number first on. False, without calling visit, if some
+    // of them are no longer kept.
+    template <typename Visit>
+    bool visit_code_writes(u64 first, Visit&& visit) const {
+        const std::lock_guard lock{code_mutex};
+        const u64 last = code_writes.load(std::memory_order_relaxed);
+        if (last - first > code_log_size) {
+            return false;
+        }
+        for (u64 i = first; i < last; i++) {
+            visit(code_log[i % code_log_size]);
+        }
+        return true;
+    }
+
+private:
+    // Makes the pages overlapping [address, address + size) writable, recording a write to any
+    // that were protected. False if the range is not in RAM.
+    bool unprotect_code(u32 address, u32 size);
+    void unprotect_all_code();
+#if defined(STAMINA_HAS_FASTMEM)
+    void set_page_protection(size_t page, bool writable) const;
+    // Makes protected host page page writable, without recording a write
+    void unprotect_page(size_t page);
+    void record_code_write(const CodeWrite& write);
+    // Records a write to the whole of host page page
+    void record_page_write(size_t page);
+#endif
+
+    u32 ram_size;
+    u64 identity;
+    u8* base;
+    // Distance from the start of the first host page of RAM to guest address zero
+    u32 page_offset = 0;
+
+    static constexpr size_t code_log_size = 256;
+    mutable std::mutex code_mutex;
+    // Host pages of RAM that are protected
+    std::unique_ptr<std::atomic<bool>[]> protected_pages;
+    mutable std::atomic<size_t> protected_count = 0;
+    std::array<CodeWrite, code_log_size> code_log;
+    std::atomic<u64> code_writes = 0;
+#if defined(STAMINA_HAS_FASTMEM)
+    // Protected host pages, and those of them protected since RAM was last mapped from a snapshot
+    mutable tsl::robin_set<size_t> code_pages;
+    mutable tsl::robin_set<size_t> fresh_code_pages;
+    // Snapshot all of RAM is mapped from, or zero
+    u64 mapped_snapshot = 0;
+
+    void* reservation;
+    size_t reservation_size;
+    // Whole host pages at the start of reservation that hold RAM
+    size_t ram_pages_size;
+#else
+    std::vector<u8> ram;
+#endif
+};
+
+}
@@ -0,0 +1,274 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <catch.hpp>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "common/common_types.hpp"
+#include "common/instruction.hpp"
+#include "smasm/snippet_assembler.hpp"
+#include "stamina/block_cache.hpp"
+#include "stamina/interpreter.hpp"
+#include "stamina/memory.hpp"
+#include "stamina/snapshot.hpp"
+#include "stamina/test_program.hpp"
+
+using namespace stamina;
+
+TEST_CASE("memory: accesses past the end fail", "[stamina]") {
+    // Not a multiple of the page size, so the end of RAM is inside a page
+    for (const u32 size : {u32{64 * 1024}, u32{1000}}) {
+        Memory memory{size};
+        REQUIRE(memory.size() == size);
+
+        REQUIRE(memory.write<u32>(size - 4, 0x12345678));
+        u32 word = 0;
+        REQUIRE(memory.read(size - 4, word));
+        REQUIRE(word == 0x12345678);
+        u8 byte = 0;
+        REQUIRE(memory.read(size - 1, byte));
+        REQUIRE(byte == 0x12);
+
+        // Straddling the end
+        REQUIRE(!memory.read(size - 2, word));
+        REQUIRE(!memory.write<u16>(size - 1, 0xFFFF));
+        REQUIRE(!memory.read(size, byte));
+        REQUIRE(!memory.write<u8>(size, 0));
+        REQUIRE(!memory.read(0xFFFFFFFF, byte));
+        REQUIRE(!memory.read(0xFFFFFFFE, word));
+        REQUIRE(!memory.fetch(size, word));
+
+        // Failed writes leave memory alone
+        REQUIRE(memory.read(size - 4, word));
+        REQUIRE(word == 0x12345678);
+    }
+}
+
+TEST_CASE("memory: copies are independent", "[stamina]") {
+    Memory memory{4096};
+    REQUIRE(memory.write<u32>(0, 1));
+
+    Memory copy = memory;
+    REQUIRE(copy.write<u32>(0, 2));
+    u32 word = 0;
+    REQUIRE(memory.read(0, word));
+    REQUIRE(word == 1);
+    REQUIRE(copy.read(0, word));
+    REQUIRE(word == 2);
+}
+
+#if defined(STAMINA_HAS_FASTMEM)
+TEST_CASE("memory: writes to protected code are recorded", "[stamina]") {
+    Memory memory{64 * 1024};
+    memory.protect_code(0x1008, 8);
+    REQUIRE(memory.code_write_count() == 0);
+
+    // The first write to the page is recorded and the page becomes writable
+    REQUIRE(memory.write<u16>(0x1ffe, 0x1234));
+    REQUIRE(memory.write<u32>(0x1000, 5));
+    REQUIRE(memory.code_write_count() == 1);
+    REQUIRE(memory.write<u32>(0x2000, 5));
+    REQUIRE(memory.code_write_count() == 1);
+    std::vector<CodeWrite> writes;
+    REQUIRE(memory.visit_code_writes(0, [&](const CodeWrite& write) { writes.push_back(write); }));
+    REQUIRE(writes.size() == 1);
+    REQUIRE(writes[0].address == 0x1ffe);
+    REQUIRE(writes[0].size == 2);
+
+    memory.protect_code(0x1000, 4);
+    bool exchanged = false;
+    REQUIRE(memory.compare_exchange(0x1000, 4, 6, exchanged));
+    REQUIRE(!exchanged);
+    REQUIRE(memory.code_write_count() == 2);
+    REQUIRE(memory.compare_exchange(0x1000, 5, 6, exchanged));
+    REQUIRE(exchanged);
+
+    // Writable access to all of RAM counts as a write to every protected page
+    memory.protect_code(0x3000, 4);
+    memory.protect_code(0x5000, 4);
+    REQUIRE(memory.bytes()[0x3000] == 0);
+    REQUIRE(memory.code_write_count() == 4);
+    u32 word = 0;
+    REQUIRE(memory.read(0x1000, word));
+    REQUIRE(word == 6);
+
+    // Lost writes are reported
+    for (u32 i = 0; i < 300; i++) {
+        memory.protect_code(0x1000, 4);
+        REQUIRE(memory.write<u32>(0x1000, i));
+    }
+    REQUIRE(memory.code_write_count() == 304);
+    REQUIRE(!memory.visit_code_writes(0, [](const CodeWrite&) {}));
+    REQUIRE(memory.visit_code_writes(100, [](const CodeWrite&) {}));
+}
+#endif
+
+#if defined(STAMINA_HAS_FASTMEM)
+TEST_CASE("memory: files map copy-on-write", "[stamina]") {
+    const auto path = std::filesystem::temp_directory_path() / ("stamina-map-" + std::to_string(getpid()) + ".bin");
+    std::vector<u8> contents(3 * 4096);
+    for (size_t i = 0; i < contents.size(); i++) {
+        contents[i] = static_cast<u8>(i * 13);
+    }
+    std::ofstream{path, std::ios::binary}.write(reinterpret_cast<const char*>(contents.data()), static_cast<std::streamsize>(contents.size()));
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    REQUIRE(fd >= 0);
+    REQUIRE(fchmod(fd, 0644) == 0);
+
+    Memory memory{64 * 1024};
+    memory.protect_code(0x2000, 4);
+    REQUIRE(memory.map_file(0x1000, fd, 4096, 2 * 4096));
+    REQUIRE(memory.code_write_count() == 1);
+    REQUIRE(std::memcmp(memory.bytes().data() + 0x1000, contents.data() + 4096, 2 * 4096) == 0);
+
+    // Writes stay in guest memory
+    REQUIRE(memory.write<u32>(0x1000, 0));
+    REQUIRE(memory.write<u32>(0x2000, 0));
+    std::vector<u8> file(contents.size());
+    REQUIRE(pread(fd, file.data(), file.size(), 0) == static_cast<ssize_t>(file.size()));
+    REQUIRE(file == contents);
+
+    // Only whole pages of the file
+    REQUIRE(!memory.map_file(0x1004, fd, 0, 4096));
+    REQUIRE(!memory.map_file(0x1000, fd, 4, 4096));
+    REQUIRE(!memory.map_file(0x1000, fd, 0, 4));
+    REQUIRE(!memory.map_file(0x1000, fd, 4096, 3 * 4096));
+    REQUIRE(!memory.map_file(60 * 1024, fd, 0, 2 * 4096));
+    REQUIRE(!Memory{1000}.map_file(0, fd, 0, 4096));
+
+    // Nor files that other users could change under the mapping
+    REQUIRE(fchmod(fd, 0664) == 0);
+    REQUIRE(!memory.map_file(0x1000, fd, 0, 4096));
+    REQUIRE(fchmod(fd, 0644) == 0);
+    REQUIRE(memory.map_file(0x1000, fd, 0, 4096));
+    REQUIRE(std::memcmp(memory.bytes().data() + 0x1000, contents.data(), 4096) == 0);
+
+    REQUIRE(memory.zero(0x1ff0, 0x1020));
+    REQUIRE(memory.bytes()[0x1fef] == contents[4096 + 0xfef]);
+    REQUIRE(std::all_of(memory.bytes().begin() + 0x1ff0, memory.bytes().begin() + 0x3010, [](u8 byte) { return byte == 0; }));
+    REQUIRE(!memory.zero(60 * 1024, 8 * 1024));
+
+    close(fd);
+    std::filesystem::remove(path);
+}
+#endif
+
+TEST_CASE("memory: restoring a snapshot discards later writes", "[stamina]") {
+    for (const u32 size : {u32{64 * 1024}, u32{1000}}) {
+        Memory memory{size};
+        REQUIRE(memory.write<u32>(0, 1));
+        REQUIRE(memory.write<u32>(size - 4, 2));
+        const MemorySnapshot first = memory.snapshot();
+
+        REQUIRE(memory.write<u32>(0, 3));
+        REQUIRE(memory.write<u32>(size / 2, 4));
+        const MemorySnapshot second = memory.snapshot();
+        REQUIRE(memory.write<u32>(size - 4, 5));
+
+        u32 word = 0;
+        memory.restore(first);
+        REQUIRE(memory.read(0, word));
+        REQUIRE(word == 1);
+        REQUIRE(memory.read(size / 2, word));
+        REQUIRE(word == 0);
+        REQUIRE(memory.read(size - 4, word));
+        REQUIRE(word == 2);
+        // Still guarded past the end
+        REQUIRE(!memory.read(size - 2, word));
+
+        memory.restore(second);
+        REQUIRE(memory.read(0, word));
+        REQUIRE(word == 3);
+        REQUIRE(memory.read(size / 2, word));
+        REQUIRE(word == 4);
+        REQUIRE(memory.read(size - 4, word));
+        REQUIRE(word == 2);
+
+        // Restoring again after writing
+        REQUIRE(memory.write<u32>(0, 6));
+        memory.restore(second);
+        REQUIRE(memory.read(0, word));
+        REQUIRE(word == 3);
+    }
+}
+
+TEST_CASE("memory: a restored machine runs the same way again", "[stamina]") {
+    SnippetAssembler assembler;
+    const auto& result = assembler.assemble(
+        "    li r1, 0x1000\n"
+        "    ld r2, r1, 0\n"
+        "    addi r2, r2, 1\n"
+        "    st r2, r1, 0\n"
+        "    mtoc r15, r2\n");
+    REQUIRE(result.ok());
+
+    Memory memory{64 * 1024};
+    CpuState state;
+    std::memcpy(memory.bytes().data(), result.words.data(), result.words.size() * 4);
+    const Snapshot snapshot = take_snapshot(state, memory);
+
+    for (int i = 0; i < 3; i++) {
+        REQUIRE(interpret(state, memory, 100) == StopReason::Halted);
+        REQUIRE(state.control(ControlRegister::Halt) == 1);
+        restore_snapshot(snapshot, state, memory);
+        REQUIRE(state.pc == 0);
+        REQUIRE(state.retired == 0);
+    }
+}
+
+#if defined(STAMINA_HAS_FASTMEM)
+TEST_CASE("memory: restoring code is seen by code caches", "[stamina]") {
+    for (const u32 size : {u32{64 * 1024}, u32{64 * 1024 - 12}}) {
+        Memory memory{size};
+        CpuState state;
+        test::load_program(memory, state, "    movi r1, 5\n    mtoc r15, r1\n");
+        const Snapshot snapshot = take_snapshot(state, memory);
+        BlockCache cache;
+
+        REQUIRE(interpret_cached(state, memory, cache, 100) == StopReason::Halted);
+        REQUIRE(state.control(ControlRegister::Halt) == 5);
+
+        REQUIRE(memory.write<u32>(0, encode(Instruction{Opcode::MOVI, 1, 0, 0, 7})));
+        state.pc = 0;
+        REQUIRE(interpret_cached(state, memory, cache, 100) == StopReason::Halted);
+        REQUIRE(state.control(ControlRegister::Halt) == 7);
+
+        // The restore changes the code the cache decoded
+        const u64 writes = memory.code_write_count();
+        restore_snapshot(snapshot, state, memory);
+        REQUIRE(memory.code_write_count() == writes + 1);
+        REQUIRE(interpret_cached(state, memory, cache, 100) == StopReason::Halted);
+        REQUIRE(state.control(ControlRegister::Halt) == 5);
+
+        // This one leaves the code as it was, and protected
+        restore_snapshot(snapshot, state, memory);
+        REQUIRE(memory.code_write_count() == writes + 1);
+        REQUIRE(interpret_cached(state, memory, cache, 100) == StopReason::Halted);
+        REQUIRE(state.control(ControlRegister::Halt) == 5);
+        REQUIRE(memory.write<u32>(0, encode(Instruction{Opcode::MOVI, 1, 0, 0, 7})));
+        REQUIRE(memory.code_write_count() == writes + 2);
+
+        // Switching between snapshots compares the code with each
+        state.pc = 0;
+        const Snapshot patched = take_snapshot(state, memory);
+        REQUIRE(interpret_cached(state, memory, cache, 100) == StopReason::Halted);
+        REQUIRE(state.control(ControlRegister::Halt) == 7);
+        restore_snapshot(snapshot, state, memory);
+        REQUIRE(memory.code_write_count() == writes + 3);
+        REQUIRE(interpret_cached(state, memory, cache, 100) == StopReason::Halted);
+        REQUIRE(state.control(ControlRegister::Halt) == 5);
+        restore_snapshot(patched, state, memory);
+        REQUIRE(memory.code_write_count() == writes + 4);
+        REQUIRE(interpret_cached(state, memory, cache, 100) == StopReason::Halted);
+        REQUIRE(state.control(ControlRegister::Halt) == 7);
+    }
+}
+#endif
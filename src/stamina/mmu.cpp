@@ -0,0 +1,142 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#include <array>
+#include "stamina/mmu.hpp"
+
+namespace stamina {
+
+namespace {
+
+bool read_entry(const Memory& memory, u32 table, u32 index, u32& entry) {
+    return memory.read(table + index * 4, entry) && (entry & pte_valid);
+}
+
+// Finds the valid page table entry for address whose page lies in RAM.
+bool find_entry(const CpuState& state, const Memory& memory, u32 address, u32& table_entry) {
+    u32 directory_entry;
+    if (!read_entry(memory, state.control(ControlRegister::PageTable) & page_mask, address >> 22, directory_entry)) {
+        return false;
+    }
+    if (!read_entry(memory, directory_entry & page_mask, (address >> page_bits) % 1024, table_entry)) {
+        return false;
+    }
+    return u64{table_entry & page_mask} + page_size <= memory.size();
+}
+
+// Translates address and caches the translation. Fails if there is none, or if write and the page is read-only.
+bool fill_tlb(CpuState& state, const Memory& memory, u32 address, bool write, u32& physical) {
+    u32 table_entry;
+    if (!find_entry(state, memory, address, table_entry)) {
+        return false;
+    }
+
+    const u32 virtual_page = address & page_mask;
+    const bool writable = table_entry & pte_writable;
+    state.tlb[tlb_index(address)] = TlbEntry{virtual_page, writable ? virtual_page : invalid_tlb_tag, (table_entry & page_mask) - virtual_page, 0};
+
+    physical = (table_entry & page_mask) | (address & ~page_mask);
+    return writable || !write;
+}
+
+bool straddles_page(u32 address, size_t size) {
+    return (address & ~page_mask) + size > page_size;
+}
+
+}
+
+bool walk_page_table(const CpuState& state, const Memory& memory, u32 address, bool write, u32& physical) {
+    u32 table_entry;
+    if (!find_entry(state, memory, address, table_entry) || (write && !(table_entry & pte_writable))) {
+        return false;
+    }
+    physical = (table_entry & page_mask) | (address & ~page_mask);
+    return true;
+}
+
+bool translate(CpuState& state, const Memory& memory, u32 address, bool write, u32& physical) {
+    if (!state.paging()) {
+        physical = address;
+        return true;
+    }
+    const TlbEntry& entry = state.tlb[tlb_index(address)];
+    if ((write ? entry.write_tag : entry.read_tag) == (address & page_mask)) {
+        physical = address + entry.offset;
+        return true;
+    }
+    return fill_tlb(state, memory, address, write, physical);
+}
+
+void control_register_written(CpuState& state, u32 index) {
+    switch (static_cast<ControlRegister>(index)) {
+    case ControlRegister::Status:
+    case ControlRegister::PageTable:
+        state.tlb = CpuState::empty_tlb();
+        state.mmu_generation++;
+        break;
+    case ControlRegister::TlbInvalidate: {
+        const u32 address = state.control(ControlRegister::TlbInvalidate);
+        TlbEntry& entry = state.tlb[tlb_index(address)];
+        if (entry.read_tag == (address & page_mask)) {
+            entry = TlbEntry{invalid_tlb_tag, invalid_tlb_tag, 0, 0};
+        }
+        state.mmu_generation++;
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+namespace detail {
+
+template <typename T>
+bool read_virtual_slow(CpuState& state, const Memory& memory, u32 address, T& value) {
+    if (!straddles_page(address, sizeof(T))) {
+        u32 physical;
+        return fill_tlb(state, memory, address, false, physical) && memory.read(physical, value);
+    }
+
+    u32 result = 0;
+    for (u32 i = 0; i < sizeof(T); i++) {
+        u8 byte;
+        if (!read_virtual(state, memory, address + i, byte)) {
+            return false;
+        }
+        result |= u32{byte} << (i * 8);
+    }
+    value = static_cast<T>(result);
+    return true;
+}
+
+template <typename T>
+bool write_virtual_slow(CpuState& state, Memory& memory, u32 address, T value) {
+    if (!straddles_page(address, sizeof(T))) {
+        u32 physical;
+        return fill_tlb(state, memory, address, true, physical) && memory.write(physical, value);
+    }
+
+    // Translate every byte first so that a fault writes nothing
+    std::array<u32, sizeof(T)> physical;
+    for (u32 i = 0; i < sizeof(T); i++) {
+        if (!fill_tlb(state, memory, address + i, true, physical[i])) {
+            return false;
+        }
+    }
+    for (u32 i = 0; i < sizeof(T); i++) {
+        memory.write(physical[i], static_cast<u8>(value >> (i * 8)));
+    }
+    return true;
+}
+
+template bool read_virtual_slow(CpuState&, const Memory&, u32, u8&);
+template bool read_virtual_slow(CpuState&, const Memory&, u32, u16&);
+template bool read_virtual_slow(CpuState&, const Memory&, u32, u32&);
+template bool write_virtual_slow(CpuState&, Memory&, u32, u8);
+template bool write_virtual_slow(CpuState&, Memory&, u32, u16);
+template bool write_virtual_slow(CpuState&, Memory&, u32, u32);
+
+}
+
+}
@@ -0,0 +1,88 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#pragma once
+
+#include "common/common_types.hpp"
+#include "common/macros.hpp"
+#include "stamina/cpu_state.hpp"
+#include "stamina/memory.hpp"
+
+// Guest virtual memory.
+//
+// While status_paging is set in Status, every fetch and data access is translated through a
+// two-level table of 4 KiB pages. PageTable holds the physical address of a page directory of 1024
+// entries indexed by address bits 31-22; each valid entry points to a page table of 1024 entries
+// indexed by bits 21-12. Entries of both levels hold a physical page address in bits 31-12 and
+// pte_valid; page table entries also grant writes with pte_writable. Pages must lie wholly in RAM.
+// An access without a translation is a memory fault at its virtual address.
+//
+// Translations are cached in the TLB of CpuState. Writing Status or PageTable flushes it, and
+// writing TlbInvalidate drops one page. Each of these also advances CpuState::mmu_generation so
+// that code caches drop blocks decoded under the old translation.
+
+namespace stamina {
+
+inline constexpr u32 page_bits = 12;
+inline constexpr u32 page_size = 1 << page_bits;
+inline constexpr u32 page_mask = ~(page_size - 1);
+
+inline constexpr u32 pte_valid = 1 << 0;
+inline constexpr u32 pte_writable = 1 << 1;
+
+// Translates address by walking the page table, without using the TLB.
+bool walk_page_table(const CpuState& state, const Memory& memory, u32 address, bool write, u32& physical);
+
+// Translates address through the TLB, filling it on a miss. The identity while paging is disabled.
+bool translate(CpuState& state, const Memory& memory, u32 address, bool write, u32& physical);
+
+// Applies the effect on translation of an MTOC to control register index.
+void control_register_written(CpuState& state, u32 index);
+
+constexpr size_t tlb_index(u32 address) {
+    return (address >> page_bits) % tlb_size;
+}
+
+namespace detail {
+
+// TLB misses, unaligned accesses and accesses that straddle pages.
+template <typename T>
+bool read_virtual_slow(CpuState& state, const Memory& memory, u32 address, T& value);
+template <typename T>
+bool write_virtual_slow(CpuState& state, Memory& memory, u32 address, T value);
+
+}
+
+template <typename T>
+FORCE_INLINE bool read_virtual(CpuState& state, const Memory& memory, u32 address, T& value) {
+    if (!state.paging()) [[likely]] {
+        return memory.read(address, value);
+    }
+    const TlbEntry& entry = state.tlb[tlb_index(address)];
+    if (entry.read_tag == (address & (page_mask | (sizeof(T) - 1)))) [[likely]] {
+        return memory.read(address + entry.offset, value);
+    }
+    return detail::read_virtual_slow(state, memory, address, value);
+}
+
+template <typename T>
+FORCE_INLINE bool write_virtual(CpuState& state, Memory& memory, u32 address, T value) {
+    if (!state.paging()) [[likely]] {
+        return memory.write(address, value);
+    }
+    const TlbEntry& entry = state.tlb[tlb_index(address)];
+    if (entry.write_tag == (address & (page_mask | (sizeof(T) - 1)))) [[likely]] {
+        return memory.write(address + entry.offset, value);
+    }
+    return detail::write_virtual_slow(state, memory, address, value);
+}
+
+FORCE_INLINE bool fetch_virtual(CpuState& state, const Memory& memory, u32 address, u32& word) {
+    if (address % 4 != 0) [[unlikely]] {
+        return false;
+    }
+    return read_virtual(state, memory, address, word);
+}
+
+}
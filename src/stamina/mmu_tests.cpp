@@ -0,0 +1,232 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#include <cstring>
+#include <string>
+#include <catch.hpp>
+#include "common/common_types.hpp"
+#include "smasm/snippet_assembler.hpp"
+#include "stamina/block_cache.hpp"
+#include "stamina/cpu_state.hpp"
+#include "stamina/interpreter.hpp"
+#include "stamina/memory.hpp"
+#include "stamina/mmu.hpp"
+
+#if defined(STAMINA_HAS_X64_JIT)
+    #include "stamina/x64/jit.hpp"
+#endif
+
+using namespace stamina;
+
+namespace {
+
+constexpr u32 ram_size = 64 * 1024;
+constexpr u32 directory = 0x8000;
+constexpr u32 low_table = 0x9000;
+constexpr u32 high_table = 0xA000;
+constexpr u32 high_base = 0x40000000;
+
+void set_entry(Memory& memory, u32 table, u32 index, u32 entry) {
+    REQUIRE(memory.write(table + index * 4, entry));
+}
+
+// Identity-maps RAM, read-only at 0x4000, and maps high_base to 0x5000 and the page after it to 0x3000.
+void build_page_table(Memory& memory) {
+    set_entry(memory, directory, 0, low_table | pte_valid);
+    set_entry(memory, directory, high_base >> 22, high_table | pte_valid);
+    for (u32 page = 0; page < ram_size / page_size; page++) {
+        set_entry(memory, low_table, page, page * page_size | pte_valid | (page == 4 ? 0 : pte_writable));
+    }
+    set_entry(memory, high_table, 0, 0x5000 | pte_valid | pte_writable);
+    set_entry(memory, high_table, 1, 0x3000 | pte_valid | pte_writable);
+}
+
+void enable_paging(CpuState& state) {
+    state.control(ControlRegister::PageTable) = directory;
+    control_register_written(state, static_cast<u32>(ControlRegister::PageTable));
+    state.control(ControlRegister::Status) = status_paging;
+    control_register_written(state, static_cast<u32>(ControlRegister::Status));
+}
+
+const std::string paging_program =
+    "    li r1, 0x8000\n"
+    "    mtoc r2, r1\n"
+    "    movi r1, 1\n"
+    "    mtoc r0, r1\n"
+    "    li r3, 0x40000000\n"
+    "    li r7, 0x5000\n"
+    "    movi r2, 100\n"
+    "    movi r1, 0\n"
+    "    li r4, loop\n"
+    "    li r5, done\n"
+    "loop:\n"
+    "    st r2, r3, 0\n"
+    "    ld r6, r3, 0\n"
+    "    add r1, r1, r6\n"
+    "    ldb r6, r7, 0\n"
+    "    add r1, r1, r6\n"
+    "    sth r2, r3, 0xFFF\n"
+    "    ld r6, r3, 0xFFE\n"
+    "    add r1, r1, r6\n"
+    "    addi r2, r2, -1\n"
+    "    cmpi/eq r2, 0\n"
+    "    mov r8, r4\n"
+    "    mt r8, r5\n"
+    "    rbra r8\n"
+    "done:\n"
+    "    li r7, 0x4000\n"
+    "    ld r6, r7, 0\n"
+    "    st r6, r7, 0\n";
+
+void load_paging_program(Memory& memory, CpuState& state) {
+    SnippetAssembler assembler;
+    const auto& result = assembler.assemble(paging_program);
+    REQUIRE(result.ok());
+    std::memcpy(memory.bytes().data(), result.words.data(), result.words.size() * 4);
+    build_page_table(memory);
+    state.pc = 0;
+}
+
+}
+
+TEST_CASE("mmu: translation", "[stamina]") {
+    Memory memory{ram_size};
+    CpuState state;
+    build_page_table(memory);
+
+    // Physical until paging is enabled
+    u32 word = 0;
+    REQUIRE(read_virtual(state, memory, directory, word));
+    REQUIRE(word == (low_table | pte_valid));
+    REQUIRE(!read_virtual(state, memory, high_base, word));
+
+    enable_paging(state);
+    REQUIRE(state.paging());
+
+    // Aliases of the same physical page
+    REQUIRE(write_virtual<u32>(state, memory, high_base + 8, 0x12345678));
+    REQUIRE(read_virtual(state, memory, 0x5008, word));
+    REQUIRE(word == 0x12345678);
+    REQUIRE(memory.read(0x5008, word));
+    REQUIRE(word == 0x12345678);
+
+    // Unmapped, and read-only
+    REQUIRE(!read_virtual(state, memory, 0x00100000, word));
+    REQUIRE(!read_virtual(state, memory, high_base + 2 * page_size, word));
+    REQUIRE(read_virtual(state, memory, 0x4000, word));
+    REQUIRE(!write_virtual<u8>(state, memory, 0x4000, 1));
+    REQUIRE(memory.read(0x4000, word));
+    REQUIRE(word == 0);
+
+    // Straddling two pages that are not physically adjacent
+    REQUIRE(write_virtual<u32>(state, memory, high_base + page_size - 2, 0xAABBCCDD));
+    u16 half = 0;
+    REQUIRE(memory.read(0x5FFE, half));
+    REQUIRE(half == 0xCCDD);
+    REQUIRE(memory.read(0x3000, half));
+    REQUIRE(half == 0xAABB);
+    REQUIRE(read_virtual(state, memory, high_base + page_size - 2, word));
+    REQUIRE(word == 0xAABBCCDD);
+
+    // A straddling write that faults on its second page writes nothing
+    REQUIRE(!write_virtual<u32>(state, memory, 0x3FFE, 0xFFFFFFFF));
+    REQUIRE(memory.read(0x3FFC, word));
+    REQUIRE(word == 0);
+}
+
+TEST_CASE("mmu: control register writes flush the TLB", "[stamina]") {
+    Memory memory{ram_size};
+    CpuState state;
+    build_page_table(memory);
+    REQUIRE(memory.write<u32>(0x5000, 1));
+    REQUIRE(memory.write<u32>(0x6000, 2));
+    enable_paging(state);
+    const u32 generation = state.mmu_generation;
+
+    u32 word = 0;
+    REQUIRE(read_virtual(state, memory, high_base, word));
+    REQUIRE(word == 1);
+
+    // The TLB keeps the old translation until it is invalidated
+    set_entry(memory, high_table, 0, 0x6000 | pte_valid);
+    REQUIRE(read_virtual(state, memory, high_base, word));
+    REQUIRE(word == 1);
+    REQUIRE(write_virtual<u32>(state, memory, high_base, 1));
+
+    state.control(ControlRegister::TlbInvalidate) = high_base + 0x123;
+    control_register_written(state, static_cast<u32>(ControlRegister::TlbInvalidate));
+    REQUIRE(state.mmu_generation != generation);
+    REQUIRE(read_virtual(state, memory, high_base, word));
+    REQUIRE(word == 2);
+    REQUIRE(!write_virtual<u32>(state, memory, high_base, 3));
+
+    state.control(ControlRegister::Status) = 0;
+    control_register_written(state, static_cast<u32>(ControlRegister::Status));
+    REQUIRE(read_virtual(state, memory, 0x5000, word));
+    REQUIRE(!read_virtual(state, memory, high_base, word));
+}
+
+TEST_CASE("mmu: blocks are decoded through the page table", "[stamina]") {
+    Memory memory{ram_size};
+    CpuState state;
+    build_page_table(memory);
+    SnippetAssembler assembler;
+    const auto& result = assembler.assemble("addi r1, r1, 1\nmtoc r15, r1\n");
+    REQUIRE(result.ok());
+    REQUIRE(memory.write(0x5FFC, result.words[0]));
+    REQUIRE(memory.write(0x3000, result.words[1]));
+    enable_paging(state);
+
+    // The block at the end of the page continues on the page mapped after it
+    const DecodedBlock block = decode_block(state, memory, high_base + page_size - 4);
+    REQUIRE(block.ops.size() == 2);
+    REQUIRE(block.ops[0].opcode == Opcode::ADDI);
+    REQUIRE(block.ops[1].opcode == Opcode::MTOC);
+
+    REQUIRE(decode_block(state, memory, 0x00100000).ops.empty());
+}
+
+TEST_CASE("mmu: execution engines agree", "[stamina]") {
+    Memory reference_memory{ram_size};
+    CpuState reference;
+    load_paging_program(reference_memory, reference);
+    REQUIRE(interpret(reference, reference_memory, 100000) == StopReason::MemoryFault);
+    REQUIRE(reference.control(ControlRegister::FaultAddress) == 0x4000);
+    REQUIRE(reference.paging());
+
+    const auto check = [&](const CpuState& state, const Memory& memory) {
+        REQUIRE(state.pc == reference.pc);
+        REQUIRE(state.gpr == reference.gpr);
+        REQUIRE(state.cr == reference.cr);
+        REQUIRE(state.retired == reference.retired);
+        REQUIRE(std::memcmp(memory.bytes().data(), reference_memory.bytes().data(), ram_size) == 0);
+    };
+
+    {
+        Memory memory{ram_size};
+        CpuState state;
+        load_paging_program(memory, state);
+        REQUIRE(interpret_switch(state, memory, 100000) == StopReason::MemoryFault);
+        check(state, memory);
+    }
+    {
+        Memory memory{ram_size};
+        CpuState state;
+        load_paging_program(memory, state);
+        BlockCache cache;
+        REQUIRE(interpret_cached(state, memory, cache, 100000) == StopReason::MemoryFault);
+        check(state, memory);
+    }
+#if defined(STAMINA_HAS_X64_JIT)
+    {
+        Memory memory{ram_size};
+        CpuState state;
+        load_paging_program(memory, state);
+        x64::Jit jit{1024 * 1024};
+        REQUIRE(jit.valid());
+        REQUIRE(jit.run(state, memory, 100000) == StopReason::MemoryFault);
+        check(state, memory);
+    }
+#endif
+}
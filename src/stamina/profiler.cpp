@@ -0,0 +1,174 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#include <algorithm>
+#include <string>
+#include <fmt/format.h>
+#include "common/assert.hpp"
+#include "common/instruction.hpp"
+#include "stamina/block_cache.hpp"
+#include "stamina/mmu.hpp"
+#include "stamina/profiler.hpp"
+
+namespace stamina {
+
+void ShadowCallStack::call(u32 target, u32 return_address) {
+    if (depth < max_depth) {
+        frames[depth] = Frame{target, return_address};
+    }
+    depth++;
+}
+
+void ShadowCallStack::ret(u32 target) {
+    if (depth > max_depth) {
+        // The frame being returned from was not recorded
+        depth--;
+        return;
+    }
+    // Usually the innermost frame; deeper ones are popped by returns that skip frames, as longjmp does
+    for (size_t i = depth; i > 0; i--) {
+        if (frames[i - 1].return_address == target) {
+            depth = i - 1;
+            return;
+        }
+    }
+}
+
+namespace {
+
+// Reads the word at address without filling the TLB, which the guest may rely on being stale.
+bool peek(const CpuState& state, const Memory& memory, u32 address, u32& word) {
+    if (state.paging() && !walk_page_table(state, memory, address, false, address)) {
+        return false;
+    }
+    return memory.fetch(address, word);
+}
+
+// Whether the word cannot be decoded or ends a block, as decode_block has it.
+bool ends_block(u32 word, bool& decodable) {
+    const u8 index = opcode_decode_table[word >> 24];
+    decodable = index != invalid_opcode_index;
+    if (!decodable) {
+        return true;
+    }
+    const Opcode opcode = static_cast<Opcode>(index);
+    return info(opcode).category == Category::BranchReg || opcode == Opcode::MTOC;
+}
+
+constexpr u32 max_block_bytes = BlockCache::max_block_length * 4;
+
+}
+
+void Profile::merge(const Profile& other) {
+    samples += other.samples;
+    for (const auto& [stack, count] : other.stacks) {
+        stacks[stack] += count;
+    }
+    for (const auto& [start, block] : other.blocks) {
+        auto [iter, inserted] = blocks.try_emplace(start, block);
+        if (!inserted) {
+            iter.value().samples += block.samples;
+        }
+    }
+}
+
+void Profile::write_folded(std::FILE* file) const {
+    for (const auto& [stack, count] : stacks) {
+        std::string line;
+        for (const u32 frame : stack) {
+            line += fmt::format("{}{:08x}", line.empty() ? "" : ";", frame);
+        }
+        fmt::print(file, "{} {}\n", line, count);
+    }
+}
+
+std::vector<HotBlock> Profile::hot_blocks(size_t count) const {
+    std::vector<HotBlock> result;
+    result.reserve(blocks.size());
+    for (const auto& [start, block] : blocks) {
+        result.push_back(block);
+    }
+    const auto hotter = [](const HotBlock& a, const HotBlock& b) { return a.samples != b.samples ? a.samples > b.samples : a.start < b.start; };
+    std::sort(result.begin(), result.end(), hotter);
+    result.resize(std::min(count, result.size()));
+    return result;
+}
+
+Profiler::Profiler(u64 interval) : interval(interval) {
+    ASSERT(interval > 0);
+    until_sample = next_slice();
+}
+
+StopReason Profiler::run(CpuState& state, Memory& memory, const CoreRunner& runner, u64 budget) {
+    if (!root) {
+        root = state.pc;
+    }
+    state.call_stack = &call_stack;
+
+    StopReason reason = StopReason::BudgetExhausted;
+    while (budget > 0) {
+        const u64 slice = std::min(budget, until_sample);
+        reason = runner(state, memory, slice);
+        if (reason != StopReason::BudgetExhausted) {
+            break;
+        }
+        budget -= slice;
+        until_sample -= slice;
+        if (until_sample == 0) {
+            sample(state, memory);
+            until_sample = next_slice();
+        }
+    }
+
+    state.call_stack = nullptr;
+    return reason;
+}
+
+void Profiler::sample(const CpuState& state, const Memory& memory) {
+    data.samples++;
+
+    frames.clear();
+    frames.push_back(*root);
+    for (size_t i = 0; i < std::min(call_stack.depth, ShadowCallStack::max_depth); i++) {
+        frames.push_back(call_stack.frames[i].target);
+    }
+    if (const auto iter = data.stacks.find(frames); iter != data.stacks.end()) {
+        iter->second++;
+    } else {
+        data.stacks.emplace(frames, 1);
+    }
+
+    // The straight-line code around the PC, as far as the nearest block ends on either side
+    const u32 pc = state.pc;
+    u32 word;
+    bool decodable;
+    u32 start = pc;
+    while (pc - start < max_block_bytes && start != 0 && peek(state, memory, start - 4, word) && !ends_block(word, decodable)) {
+        start -= 4;
+    }
+    u32 end = pc;
+    while (end - start < max_block_bytes && peek(state, memory, end, word)) {
+        const bool last = ends_block(word, decodable);
+        if (decodable) {
+            end += 4;
+        }
+        if (last) {
+            break;
+        }
+    }
+
+    auto [iter, inserted] = data.blocks.try_emplace(start, HotBlock{start, end, 0});
+    iter.value().end = std::max(iter->second.end, end);
+    iter.value().samples++;
+}
+
+u64 Profiler::next_slice() {
+    // xorshift64
+    random ^= random << 13;
+    random ^= random >> 7;
+    random ^= random << 17;
+    return interval / 2 + random % interval + 1;
+}
+
+}
@@ -0,0 +1,81 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#pragma once
+
+#include <cstdio>
+#include <map>
+#include <optional>
+#include <vector>
+#include <tsl/robin_map.h>
+#include "common/common_types.hpp"
+#include "stamina/cpu_state.hpp"
+#include "stamina/memory.hpp"
+#include "stamina/smp.hpp"
+
+// Sampling guest profiler.
+//
+// A Profiler runs a core through any engine in slices of instructions and samples it between
+// slices, so the engines run uninstrumented. Slice lengths vary randomly around the sampling
+// interval so that a loop whose length divides the interval is not always caught at the same point.
+// Each sample records the straight-line block containing the PC and the calls in progress. While
+// the profiler is attached, RCALL, ROCALL and RET keep those calls in CpuState::call_stack. The
+// JIT does this only with ir::Options::shadow_calls.
+//
+// MINA images carry no symbols, so functions are named by their entry points and blocks by the
+// address of their first instruction.
+
+namespace stamina {
+
+struct HotBlock {
+    u32 start;
+    // Address after the last instruction
+    u32 end;
+    u64 samples;
+};
+
+struct Profile {
+    u64 samples = 0;
+    // Entry points of the calls in progress, outermost first, and the number of samples taken in them
+    std::map<std::vector<u32>, u64> stacks;
+    tsl::robin_map<u32, HotBlock> blocks;
+
+    void merge(const Profile& other);
+
+    // Writes one line per stack in the folded format taken by flamegraph.pl.
+    void write_folded(std::FILE* file) const;
+    // The count blocks with the most samples, most first.
+    std::vector<HotBlock> hot_blocks(size_t count) const;
+};
+
+struct Profiler final {
+public:
+    static constexpr u64 default_interval = 100'000;
+
+    explicit Profiler(u64 interval = default_interval);
+
+    Profiler(const Profiler&) = delete;
+    Profiler& operator=(const Profiler&) = delete;
+
+    // Executes at most budget instructions with runner, sampling between slices. The call stack is
+    // kept across calls, and state.call_stack is only set while running.
+    StopReason run(CpuState& state, Memory& memory, const CoreRunner& runner, u64 budget);
+
+    const Profile& profile() const { return data; }
+
+private:
+    void sample(const CpuState& state, const Memory& memory);
+    u64 next_slice();
+
+    u64 interval;
+    u64 until_sample;
+    u64 random = 0x9E3779B97F4A7C15;
+    // PC when the profiler was first run, the outermost frame of every stack
+    std::optional<u32> root;
+    ShadowCallStack call_stack;
+    std::vector<u32> frames;
+    Profile data;
+};
+
+}
@@ -0,0 +1,166 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#include <cstring>
+#include <string>
+#include <vector>
+#include <catch.hpp>
+#include "common/common_types.hpp"
+#include "smasm/snippet_assembler.hpp"
+#include "stamina/block_cache.hpp"
+#include "stamina/cpu_state.hpp"
+#include "stamina/interpreter.hpp"
+#include "stamina/memory.hpp"
+#include "stamina/profiler.hpp"
+
+#if defined(STAMINA_HAS_X64_JIT)
+    #include "stamina/x64/jit.hpp"
+#endif
+
+using namespace stamina;
+
+namespace {
+
+constexpr u32 ram_size = 64 * 1024;
+
+// Calls inner 200 times, which calls leaf, which spends nearly all of the time in a loop
+const std::string nested_program =
+    "    li r3, inner\n"
+    "    li r5, loop\n"
+    "    movi r1, 200\n"
+    "loop:\n"
+    "    rcall r3\n"
+    "    addi r1, r1, -1\n"
+    "    cmpi/eq r1, 0\n"
+    "    pcaddi r4, 12\n"
+    "    mf r4, r5\n"
+    "    robra r4, r0\n"
+    "    mtoc r15, r0\n"
+    "inner:\n"
+    "    push r14\n"
+    "    li r6, leaf\n"
+    "    rcall r6\n"
+    "    pop r14\n"
+    "    ret\n"
+    "leaf:\n"
+    "    movi r7, 100\n"
+    "    li r8, spin\n"
+    "spin:\n"
+    "    addi r7, r7, -1\n"
+    "    cmpi/eq r7, 0\n"
+    "    pcaddi r9, 12\n"
+    "    mf r9, r8\n"
+    "    robra r9, r0\n"
+    "    ret\n";
+
+void check_profile(const CoreRunner& run) {
+    SnippetAssembler assembler;
+    const auto& result = assembler.assemble(nested_program);
+    REQUIRE(result.ok());
+    Memory memory{ram_size};
+    std::memcpy(memory.bytes().data(), result.words.data(), result.words.size() * 4);
+    CpuState state;
+    state.gpr[reg_sp] = ram_size;
+
+    Profiler profiler{101};
+    StopReason reason;
+    do {
+        reason = profiler.run(state, memory, run, 5000);
+        REQUIRE(state.call_stack == nullptr);
+    } while (reason == StopReason::BudgetExhausted);
+    REQUIRE(reason == StopReason::Halted);
+
+    const Profile& profile = profiler.profile();
+    REQUIRE(profile.samples > 500);
+
+    // Nearly every sample is in leaf, called from inner, called from the entry point
+    std::vector<u32> hottest;
+    u64 hottest_samples = 0;
+    for (const auto& [stack, samples] : profile.stacks) {
+        REQUIRE(stack.size() <= 3);
+        REQUIRE(stack[0] == 0);
+        if (samples > hottest_samples) {
+            hottest = stack;
+            hottest_samples = samples;
+        }
+    }
+    REQUIRE(hottest.size() == 3);
+    REQUIRE(hottest_samples * 10 > profile.samples * 9);
+
+    const std::vector<HotBlock> hot = profile.hot_blocks(2);
+    REQUIRE(hot.size() == 2);
+    REQUIRE(hot[0].start == hottest[2]);
+    REQUIRE(hot[0].end > hot[0].start);
+    REQUIRE(hot[0].samples >= hot[1].samples);
+}
+
+}
+
+TEST_CASE("profiler: shadow call stack", "[stamina]") {
+    ShadowCallStack stack;
+    stack.call(0x100, 0x10);
+    stack.call(0x200, 0x104);
+    stack.call(0x300, 0x204);
+    REQUIRE(stack.depth == 3);
+    stack.ret(0x204);
+    REQUIRE(stack.depth == 2);
+    REQUIRE(stack.frames[1].target == 0x200);
+
+    // Returning past a frame, and returning to where nothing called from
+    stack.call(0x300, 0x208);
+    stack.ret(0x10);
+    REQUIRE(stack.depth == 0);
+    stack.ret(0x10);
+    REQUIRE(stack.depth == 0);
+
+    // Frames too deep to record are still counted
+    for (u32 i = 0; i < ShadowCallStack::max_depth + 2; i++) {
+        stack.call(0x1000, i * 4);
+    }
+    REQUIRE(stack.depth == ShadowCallStack::max_depth + 2);
+    stack.ret(0x1234);
+    stack.ret(0x1234);
+    REQUIRE(stack.depth == ShadowCallStack::max_depth);
+    stack.ret((ShadowCallStack::max_depth - 1) * 4);
+    REQUIRE(stack.depth == ShadowCallStack::max_depth - 1);
+}
+
+TEST_CASE("profiler: samples stacks and blocks", "[stamina]") {
+    check_profile(&interpret);
+    check_profile(&interpret_switch);
+
+    BlockCache cache;
+    check_profile([&](CpuState& state, Memory& memory, u64 budget) { return interpret_cached(state, memory, cache, budget); });
+
+#if defined(STAMINA_HAS_X64_JIT)
+    ir::Options options;
+    options.shadow_calls = true;
+    x64::Jit jit{1024 * 1024, options};
+    REQUIRE(jit.valid());
+    check_profile([&](CpuState& state, Memory& memory, u64 budget) { return jit.run(state, memory, budget); });
+#endif
+}
+
+TEST_CASE("profiler: merged profiles", "[stamina]") {
+    Profile a;
+    a.samples = 3;
+    a.stacks[{0, 0x100}] = 3;
+    a.blocks.emplace(0x100, HotBlock{0x100, 0x110, 3});
+    Profile b;
+    b.samples = 5;
+    b.stacks[{0, 0x100}] = 1;
+    b.stacks[{0}] = 4;
+    b.blocks.emplace(0x100, HotBlock{0x100, 0x110, 1});
+    b.blocks.emplace(0x40, HotBlock{0x40, 0x48, 4});
+
+    a.merge(b);
+    REQUIRE(a.samples == 8);
+    REQUIRE(a.stacks.at({0, 0x100}) == 4);
+    REQUIRE(a.stacks.at({0}) == 4);
+    const std::vector<HotBlock> hot = a.hot_blocks(10);
+    REQUIRE(hot.size() == 2);
+    REQUIRE(hot[0].start == 0x40);
+    REQUIRE(hot[1].start == 0x100);
+    REQUIRE(hot[1].samples == 4);
+}
@@ -0,0 +1,125 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#include <algorithm>
+#include "stamina/scheduler.hpp"
+
+namespace stamina {
+
+EventId Scheduler::schedule_at(u64 due, EventCallback callback) {
+    const EventId id = next_id++;
+    heap.push_back(Event{due, id});
+    std::push_heap(heap.begin(), heap.end(), later);
+    callbacks.emplace(id, std::move(callback));
+    next_due = std::min(next_due, due);
+    return id;
+}
+
+bool Scheduler::cancel(EventId id) {
+    if (callbacks.erase(id) == 0) {
+        return false;
+    }
+    // The heap entry stays until it reaches the front
+    update_deadline();
+    return true;
+}
+
+void Scheduler::advance(u64 cycles) {
+    clock += cycles;
+    if (clock >= next_due) {
+        call_due();
+    }
+}
+
+void Scheduler::call_due() {
+    while (!heap.empty() && heap.front().due <= clock) {
+        const Event event = heap.front();
+        std::pop_heap(heap.begin(), heap.end(), later);
+        heap.pop_back();
+        const auto iter = callbacks.find(event.id);
+        if (iter == callbacks.end()) {
+            continue;
+        }
+        const EventCallback callback = std::move(iter.value());
+        callbacks.erase(iter);
+        callback(event.due);
+    }
+    update_deadline();
+}
+
+void Scheduler::post(EventCallback callback) {
+    {
+        const std::lock_guard lock{post_mutex};
+        posted.push_back(std::move(callback));
+        has_posted.store(true, std::memory_order_release);
+    }
+    post_arrived.notify_one();
+}
+
+void Scheduler::call_posted() {
+    std::vector<EventCallback> ready;
+    {
+        const std::lock_guard lock{post_mutex};
+        ready.swap(posted);
+        has_posted.store(false, std::memory_order_relaxed);
+    }
+    expected_posts -= ready.size();
+    for (const EventCallback& callback : ready) {
+        callback(clock);
+    }
+}
+
+void Scheduler::wait_for_post() {
+    std::unique_lock lock{post_mutex};
+    post_arrived.wait(lock, [&] { return !posted.empty(); });
+}
+
+void Scheduler::update_deadline() {
+    while (!heap.empty() && !callbacks.contains(heap.front().id)) {
+        std::pop_heap(heap.begin(), heap.end(), later);
+        heap.pop_back();
+    }
+    next_due = heap.empty() ? never : heap.front().due;
+}
+
+StopReason Scheduler::run(CpuState& state, Memory& memory, const CoreRunner& runner, u64 budget) {
+    while (budget > 0) {
+        if (has_posted.load(std::memory_order_acquire)) {
+            call_posted();
+        }
+        // Events may have been scheduled in the past since the last slice
+        if (next_due <= clock) {
+            call_due();
+        }
+        const u64 slice = std::min({budget, next_due - clock, expected_posts > 0 ? post_interval : never});
+        const u64 retired = state.retired;
+        const StopReason reason = runner(state, memory, slice);
+        const u64 executed = state.retired - retired;
+        budget -= executed;
+        advance(executed);
+
+        if (reason == StopReason::Waiting) {
+            // Completed I/O wakes the core before it sleeps
+            if (state.control(ControlRegister::IoPending) != 0) {
+                continue;
+            }
+            const u32 limit = state.control(ControlRegister::Wait);
+            const u64 wake = limit == 0 ? next_due : std::min(next_due, clock + limit);
+            if (wake == never) {
+                if (expected_posts == 0) {
+                    return StopReason::Waiting;
+                }
+                wait_for_post();
+                continue;
+            }
+            idle += wake - clock;
+            advance(wake - clock);
+        } else if (reason != StopReason::BudgetExhausted) {
+            return reason;
+        }
+    }
+    return StopReason::BudgetExhausted;
+}
+
+}
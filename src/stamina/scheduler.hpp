@@ -0,0 +1,107 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <vector>
+#include <tsl/robin_map.h>
+#include "common/common_types.hpp"
+#include "stamina/cpu_state.hpp"
+#include "stamina/memory.hpp"
+#include "stamina/smp.hpp"
+
+// Cycle-based event scheduling.
+//
+// A Scheduler keeps the events of one core in a min-heap ordered by the cycle they are due at, and
+// caches the earliest of them as its deadline. It runs the core through any engine in slices that end
+// at the deadline, so the engines never poll for events: each slice ends where the engine runs out of
+// budget, and the events that are due are called between slices. A cycle is one retired instruction.
+//
+// A core that writes to the Wait control register stops running until its next event. The clock skips
+// straight to that event, or to the end of the wait if the value written limits it, and the cycles
+// skipped are counted as idle. A core with bits set in IoPending does not wait.
+//
+// Other threads, such as host I/O, post events to a scheduler instead of scheduling them. Posted
+// events are called between slices at the current cycle. While posts are expected, slices are kept
+// short so that they are seen promptly, and a core waiting for nothing else blocks until one arrives.
+
+namespace stamina {
+
+using EventId = u64;
+// Called with the cycle the event was due at, which may be earlier than the clock when it is called.
+using EventCallback = std::function<void(u64 due)>;
+
+struct Scheduler final {
+public:
+    static constexpr u64 never = UINT64_MAX;
+
+    Scheduler() = default;
+
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+
+    // Calls callback once the clock reaches cycle due. Events due at the same cycle are called in the
+    // order they were scheduled. Callbacks may schedule and cancel events.
+    EventId schedule_at(u64 due, EventCallback callback);
+    EventId schedule_in(u64 delay, EventCallback callback) { return schedule_at(clock + delay, std::move(callback)); }
+    // False if the event has already been called or cancelled.
+    bool cancel(EventId id);
+
+    u64 now() const { return clock; }
+    // Cycle of the earliest pending event, or never.
+    u64 deadline() const { return next_due; }
+    size_t pending() const { return callbacks.size(); }
+    // Cycles skipped while the core was waiting
+    u64 idle_cycles() const { return idle; }
+
+    // Advances the clock by cycles and calls the events that become due.
+    void advance(u64 cycles);
+
+    // Counts an event that another thread will post. Only called on the scheduler's thread.
+    void expect_post() { expected_posts++; }
+    // Calls callback on the scheduler's thread between slices, with the cycle at that time. Each post
+    // must have been expected. Safe to call from any thread.
+    void post(EventCallback callback);
+
+    // Executes at most budget instructions with runner, calling events as they become due. Returns
+    // Waiting only if the core waits with no limit while no event is pending or expected.
+    StopReason run(CpuState& state, Memory& memory, const CoreRunner& runner, u64 budget);
+
+private:
+    struct Event {
+        u64 due;
+        EventId id;
+    };
+    // Orders the heap so that its front is the earliest event
+    static bool later(const Event& a, const Event& b) { return a.due != b.due ? a.due > b.due : a.id > b.id; }
+
+    void call_due();
+    void call_posted();
+    // Blocks until an expected event is posted.
+    void wait_for_post();
+    // Drops cancelled events from the front of the heap and caches the deadline.
+    void update_deadline();
+
+    u64 clock = 0;
+    u64 idle = 0;
+    u64 next_due = never;
+    EventId next_id = 0;
+    std::vector<Event> heap;
+    // Events that are neither called nor cancelled
+    tsl::robin_map<EventId, EventCallback> callbacks;
+
+    // Longest slice while posts are expected
+    static constexpr u64 post_interval = 64 * 1024;
+    u64 expected_posts = 0;
+    std::mutex post_mutex;
+    std::condition_variable post_arrived;
+    std::vector<EventCallback> posted;
+    std::atomic<bool> has_posted = false;
+};
+
+}
@@ -0,0 +1,139 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <catch.hpp>
+#include "common/common_types.hpp"
+#include "stamina/block_cache.hpp"
+#include "stamina/cpu_state.hpp"
+#include "stamina/interpreter.hpp"
+#include "stamina/memory.hpp"
+#include "stamina/scheduler.hpp"
+#include "stamina/test_program.hpp"
+
+#if defined(STAMINA_HAS_X64_JIT)
+    #include "stamina/x64/jit.hpp"
+#endif
+
+using namespace stamina;
+using namespace stamina::test;
+
+namespace {
+
+const std::string sum_program =
+    "    movi r1, 0\n"
+    "    movi r2, 100\n"
+    "    li r3, loop\n"
+    "    li r4, done\n"
+    "loop:\n"
+    "    add r1, r1, r2\n"
+    "    addi r2, r2, -1\n"
+    "    cmpi/eq r2, 0\n"
+    "    mov r5, r3\n"
+    "    mt r5, r4\n"
+    "    rbra r5\n"
+    "done:\n"
+    "    mtoc r15, r1\n";
+
+// Waits for the next event, then for 1000 cycles, then for an event that never comes
+const std::string wait_program =
+    "    movi r1, 0\n"
+    "    mtoc r5, r1\n"
+    "    movi r2, 1000\n"
+    "    mtoc r5, r2\n"
+    "    mtoc r5, r1\n";
+
+std::vector<CoreRunner> engines() {
+    std::vector<CoreRunner> result{&interpret, &interpret_switch};
+    auto cache = std::make_shared<BlockCache>();
+    result.emplace_back([cache](CpuState& state, Memory& memory, u64 budget) { return interpret_cached(state, memory, *cache, budget); });
+#if defined(STAMINA_HAS_X64_JIT)
+    auto jit = std::make_shared<x64::Jit>(1024 * 1024);
+    REQUIRE(jit->valid());
+    result.emplace_back([jit](CpuState& state, Memory& memory, u64 budget) { return jit->run(state, memory, budget); });
+#endif
+    return result;
+}
+
+}
+
+TEST_CASE("scheduler: events are called in order", "[stamina]") {
+    Scheduler scheduler;
+    std::vector<int> called;
+    scheduler.schedule_at(30, [&](u64) { called.push_back(30); });
+    scheduler.schedule_at(10, [&](u64) { called.push_back(1); });
+    scheduler.schedule_at(10, [&](u64) { called.push_back(2); });
+    const EventId cancelled = scheduler.schedule_at(5, [&](u64) { called.push_back(5); });
+    const EventId later = scheduler.schedule_at(20, [&](u64) { called.push_back(20); });
+    REQUIRE(scheduler.deadline() == 5);
+    REQUIRE(scheduler.cancel(cancelled));
+    REQUIRE(!scheduler.cancel(cancelled));
+    REQUIRE(scheduler.deadline() == 10);
+
+    scheduler.advance(15);
+    REQUIRE(called == std::vector<int>{1, 2});
+    REQUIRE(scheduler.deadline() == 20);
+    REQUIRE(scheduler.cancel(later));
+    REQUIRE(scheduler.deadline() == 30);
+    REQUIRE(scheduler.pending() == 1);
+
+    // A periodic event reschedules itself from when it was due
+    std::vector<u64> ticks;
+    std::function<void(u64)> tick = [&](u64 due) {
+        ticks.push_back(due);
+        scheduler.schedule_at(due + 7, tick);
+    };
+    scheduler.schedule_in(7, tick);
+    scheduler.advance(20);
+    REQUIRE(ticks == std::vector<u64>{22, 29});
+    REQUIRE(called == std::vector<int>{1, 2, 30});
+    REQUIRE(scheduler.deadline() == 36);
+}
+
+TEST_CASE("scheduler: slices end at events", "[stamina]") {
+    for (const CoreRunner& run : engines()) {
+        Memory memory{ram_size};
+        CpuState state;
+        load_program(memory, state, sum_program);
+
+        Scheduler scheduler;
+        std::vector<u64> retired;
+        std::function<void(u64)> tick = [&](u64 due) {
+            retired.push_back(state.retired);
+            scheduler.schedule_at(due + 100, tick);
+        };
+        scheduler.schedule_at(50, tick);
+
+        StopReason reason;
+        while ((reason = scheduler.run(state, memory, run, 64)) == StopReason::BudgetExhausted) {
+        }
+        REQUIRE(reason == StopReason::Halted);
+        REQUIRE(state.control(ControlRegister::Halt) == 5050);
+        REQUIRE(scheduler.now() == state.retired);
+        REQUIRE(retired == std::vector<u64>{50, 150, 250, 350, 450, 550});
+        REQUIRE(scheduler.idle_cycles() == 0);
+    }
+}
+
+TEST_CASE("scheduler: waiting skips to the next event", "[stamina]") {
+    for (const CoreRunner& run : engines()) {
+        Memory memory{ram_size};
+        CpuState state;
+        load_program(memory, state, wait_program);
+
+        Scheduler scheduler;
+        u64 woken_at = 0;
+        scheduler.schedule_at(100, [&](u64) { woken_at = state.retired; });
+
+        REQUIRE(scheduler.run(state, memory, run, 1000) == StopReason::Waiting);
+        REQUIRE(woken_at == 2);
+        REQUIRE(state.retired == 5);
+        REQUIRE(state.pc == 20);
+        REQUIRE(scheduler.now() == 100 + 2 + 1000 + 1);
+        REQUIRE(scheduler.idle_cycles() == 98 + 1000);
+    }
+}
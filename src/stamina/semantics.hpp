@@ -0,0 +1,397 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#pragma once
+
+#include <bit>
+#include "common/common_types.hpp"
+#include "common/instruction.hpp"
+#include "common/macros.hpp"
+#include "stamina/cpu_state.hpp"
+#include "stamina/memory.hpp"
+#include "stamina/mmu.hpp"
+
+// Execution semantics of each MINA instruction, shared by every execution engine.
+
+namespace stamina {
+
+struct Operands {
+    u32 rd;
+    u32 rs;
+    u32 rt;
+    u32 imm;
+};
+
+// Extracts only the fields present in op's format; everything is resolved at compile time.
+template <Opcode op>
+FORCE_INLINE constexpr Operands extract_operands(u32 word) {
+    constexpr Format format = info(op).format;
+    Operands o{(word >> 20) & 0xF, 0, 0, 0};
+    if constexpr (format == Format::I || format == Format::S || format == Format::F) {
+        o.rs = (word >> 16) & 0xF;
+    }
+    if constexpr (format == Format::S || format == Format::F) {
+        o.rt = (word >> 12) & 0xF;
+    }
+    if constexpr (format == Format::I) {
+        if constexpr (has_signed_immediate(op)) {
+            o.imm = static_cast<u32>(static_cast<s32>(static_cast<s16>(word & 0xFFFF)));
+        } else {
+            o.imm = word & 0xFFFF;
+        }
+    } else if constexpr (format == Format::M) {
+        o.imm = word & 0xFFFF;
+    } else if constexpr (format == Format::F) {
+        o.imm = word & 0x1F;
+    }
+    return o;
+}
+
+// Outcome of executing a single instruction.
+enum class Step {
+    Continue,
+    Halt,
+    MemoryFault,
+    Wait,
+    Submit,
+};
+
+// Why an engine stops after an instruction that did not continue. Only a faulting instruction does
+// not retire.
+FORCE_INLINE constexpr StopReason stop_reason(Step step) {
+    switch (step) {
+    case Step::Continue:
+        break;
+    case Step::Halt:
+        return StopReason::Halted;
+    case Step::MemoryFault:
+        return StopReason::MemoryFault;
+    case Step::Wait:
+        return StopReason::Waiting;
+    case Step::Submit:
+        return StopReason::IoSubmitted;
+    }
+    return StopReason::BudgetExhausted;
+}
+
+namespace detail {
+
+FORCE_INLINE u32 div_signed(u32 a, u32 b) {
+    if (b == 0) {
+        return 0xFFFFFFFF;
+    }
+    if (a == 0x80000000 && b == 0xFFFFFFFF) {
+        return a;
+    }
+    return static_cast<u32>(static_cast<s32>(a) / static_cast<s32>(b));
+}
+
+FORCE_INLINE u32 rem_signed(u32 a, u32 b) {
+    if (b == 0) {
+        return a;
+    }
+    if (a == 0x80000000 && b == 0xFFFFFFFF) {
+        return 0;
+    }
+    return static_cast<u32>(static_cast<s32>(a) % static_cast<s32>(b));
+}
+
+template <Opcode op>
+FORCE_INLINE constexpr bool compare(u32 a, u32 b) {
+    constexpr u8 cond = info(op).minor & 0b0111;
+    if constexpr (cond == 0b000) {
+        return a == b;
+    } else if constexpr (cond == 0b001) {
+        return a < b;
+    } else if constexpr (cond == 0b010) {
+        return a <= b;
+    } else if constexpr (cond == 0b011) {
+        return static_cast<s32>(a) < static_cast<s32>(b);
+    } else {
+        return static_cast<s32>(a) <= static_cast<s32>(b);
+    }
+}
+
+FORCE_INLINE Step fault(CpuState& s, u32 address) {
+    s.control(ControlRegister::FaultAddress) = address;
+    return Step::MemoryFault;
+}
+
+template <typename T>
+FORCE_INLINE Step load(CpuState& s, const Memory& m, u32 rd, u32 address) {
+    T value;
+    if (!read_virtual(s, m, address, value)) [[unlikely]] {
+        return fault(s, address);
+    }
+    s.gpr[rd] = value;
+    s.pc += 4;
+    return Step::Continue;
+}
+
+template <typename T>
+FORCE_INLINE Step store(CpuState& s, Memory& m, u32 rd, u32 address) {
+    if (!write_virtual(s, m, address, static_cast<T>(s.gpr[rd]))) [[unlikely]] {
+        return fault(s, address);
+    }
+    s.pc += 4;
+    return Step::Continue;
+}
+
+}
+
+template <Opcode op>
+FORCE_INLINE Step execute(CpuState& s, Memory& m, const Operands& o) {
+    auto& r = s.gpr;
+    const u32 pc = s.pc;
+
+    // Register branches
+    if constexpr (op == Opcode::RBRA) {
+        s.pc = r[o.rd] + o.imm;
+        return Step::Continue;
+    } else if constexpr (op == Opcode::RCALL) {
+        const u32 target = r[o.rd] + o.imm;
+        r[reg_lr] = pc + 4;
+        s.pc = target;
+        if (s.call_stack) [[unlikely]] {
+            s.call_stack->call(target, pc + 4);
+        }
+        return Step::Continue;
+    } else if constexpr (op == Opcode::RET) {
+        s.pc = r[reg_lr];
+        if (s.call_stack) [[unlikely]] {
+            s.call_stack->ret(s.pc);
+        }
+        return Step::Continue;
+    } else if constexpr (op == Opcode::ROBRA) {
+        s.pc = r[o.rd] + r[o.rs];
+        return Step::Continue;
+    } else if constexpr (op == Opcode::ROCALL) {
+        const u32 target = r[o.rd] + r[o.rs];
+        r[reg_lr] = pc + 4;
+        s.pc = target;
+        if (s.call_stack) [[unlikely]] {
+            s.call_stack->call(target, pc + 4);
+        }
+        return Step::Continue;
+    }
+
+    // Memory
+    else if constexpr (op == Opcode::LD) {
+        return detail::load<u32>(s, m, o.rd, r[o.rs] + o.imm);
+    } else if constexpr (op == Opcode::LDH) {
+        return detail::load<u16>(s, m, o.rd, r[o.rs] + o.imm);
+    } else if constexpr (op == Opcode::LDB) {
+        return detail::load<u8>(s, m, o.rd, r[o.rs] + o.imm);
+    } else if constexpr (op == Opcode::ST) {
+        return detail::store<u32>(s, m, o.rd, r[o.rs] + o.imm);
+    } else if constexpr (op == Opcode::STH) {
+        return detail::store<u16>(s, m, o.rd, r[o.rs] + o.imm);
+    } else if constexpr (op == Opcode::STB) {
+        return detail::store<u8>(s, m, o.rd, r[o.rs] + o.imm);
+    } else if constexpr (op == Opcode::LDC) {
+        const u32 address = r[o.rs] + o.imm;
+        const Step step = detail::load<u32>(s, m, o.rd, address);
+        if (step == Step::Continue) {
+            s.monitor_valid = true;
+            s.monitor_address = address;
+            s.monitor_value = r[o.rd];
+        }
+        return step;
+    } else if constexpr (op == Opcode::STC) {
+        const u32 address = r[o.rs] + o.imm;
+        if (!s.monitor_valid || s.monitor_address != address) {
+            s.monitor_valid = false;
+            s.t = false;
+            s.pc += 4;
+            return Step::Continue;
+        }
+        if (address % 4 != 0) [[unlikely]] {
+            // Not atomic; see smp.hpp
+            const Step step = detail::store<u32>(s, m, o.rd, address);
+            if (step == Step::Continue) {
+                s.monitor_valid = false;
+                s.t = true;
+            }
+            return step;
+        }
+        u32 physical;
+        bool exchanged;
+        if (!translate(s, m, address, true, physical) || !m.compare_exchange(physical, s.monitor_value, r[o.rd], exchanged)) [[unlikely]] {
+            return detail::fault(s, address);
+        }
+        s.monitor_valid = false;
+        s.t = exchanged;
+        s.pc += 4;
+        return Step::Continue;
+    } else if constexpr (op == Opcode::RLD) {
+        return detail::load<u32>(s, m, o.rd, r[o.rs] + r[o.rt]);
+    } else if constexpr (op == Opcode::RDLH) {
+        return detail::load<u16>(s, m, o.rd, r[o.rs] + r[o.rt]);
+    } else if constexpr (op == Opcode::RLDB) {
+        return detail::load<u8>(s, m, o.rd, r[o.rs] + r[o.rt]);
+    } else if constexpr (op == Opcode::RST) {
+        return detail::store<u32>(s, m, o.rd, r[o.rs] + r[o.rt]);
+    } else if constexpr (op == Opcode::RSTH) {
+        return detail::store<u16>(s, m, o.rd, r[o.rs] + r[o.rt]);
+    } else if constexpr (op == Opcode::RSTB) {
+        return detail::store<u8>(s, m, o.rd, r[o.rs] + r[o.rt]);
+    } else if constexpr (op == Opcode::POP) {
+        u32 value;
+        if (!read_virtual(s, m, r[reg_sp], value)) [[unlikely]] {
+            return detail::fault(s, r[reg_sp]);
+        }
+        r[reg_sp] += 4;
+        r[o.rd] = value;
+        s.pc += 4;
+        return Step::Continue;
+    } else if constexpr (op == Opcode::PUSH) {
+        const u32 address = r[reg_sp] - 4;
+        if (!write_virtual(s, m, address, r[o.rd])) [[unlikely]] {
+            return detail::fault(s, address);
+        }
+        r[reg_sp] = address;
+        s.pc += 4;
+        return Step::Continue;
+    }
+
+    // Control registers
+    else if constexpr (op == Opcode::MTOC) {
+        if (o.rd == static_cast<u32>(ControlRegister::IoPending)) {
+            s.cr[o.rd] &= ~r[o.rs];
+        } else {
+            s.cr[o.rd] = r[o.rs];
+        }
+        s.pc += 4;
+        if (o.rd == static_cast<u32>(ControlRegister::Halt)) {
+            return Step::Halt;
+        }
+        if (o.rd == static_cast<u32>(ControlRegister::Wait)) {
+            return Step::Wait;
+        }
+        if (o.rd == static_cast<u32>(ControlRegister::IoSubmit)) {
+            return Step::Submit;
+        }
+        control_register_written(s, o.rd);
+        return Step::Continue;
+    }
+
+    // Everything else only writes registers and falls through to the next instruction
+    else {
+        if constexpr (op == Opcode::ADDI) {
+            r[o.rd] = r[o.rs] + o.imm;
+        } else if constexpr (op == Opcode::MULTI) {
+            r[o.rd] = r[o.rs] * o.imm;
+        } else if constexpr (op == Opcode::DIVI) {
+            r[o.rd] = detail::div_signed(r[o.rs], o.imm);
+        } else if constexpr (op == Opcode::REMI) {
+            r[o.rd] = detail::rem_signed(r[o.rs], o.imm);
+        } else if constexpr (op == Opcode::SLTI) {
+            r[o.rd] = static_cast<s32>(r[o.rs]) < static_cast<s32>(o.imm);
+        } else if constexpr (op == Opcode::SLTIU) {
+            r[o.rd] = r[o.rs] < o.imm;
+        } else if constexpr (op == Opcode::NOP) {
+        } else if constexpr (op == Opcode::PCADDI) {
+            r[o.rd] = pc + o.imm;
+        } else if constexpr (op == Opcode::ADD) {
+            r[o.rd] = r[o.rs] + r[o.rt];
+        } else if constexpr (op == Opcode::MULT) {
+            r[o.rd] = r[o.rs] * r[o.rt];
+        } else if constexpr (op == Opcode::DIV) {
+            r[o.rd] = detail::div_signed(r[o.rs], r[o.rt]);
+        } else if constexpr (op == Opcode::REM) {
+            r[o.rd] = detail::rem_signed(r[o.rs], r[o.rt]);
+        } else if constexpr (op == Opcode::SLT) {
+            r[o.rd] = static_cast<s32>(r[o.rs]) < static_cast<s32>(r[o.rt]);
+        } else if constexpr (op == Opcode::SLTU) {
+            r[o.rd] = r[o.rs] < r[o.rt];
+        } else if constexpr (op == Opcode::SUB) {
+            r[o.rd] = r[o.rs] - r[o.rt];
+        } else if constexpr (op == Opcode::PCADD) {
+            r[o.rd] = pc + r[o.rs];
+        } else if constexpr (op == Opcode::ANDI) {
+            r[o.rd] = r[o.rs] & o.imm;
+        } else if constexpr (op == Opcode::ORI) {
+            r[o.rd] = r[o.rs] | o.imm;
+        } else if constexpr (op == Opcode::XORI) {
+            r[o.rd] = r[o.rs] ^ o.imm;
+        } else if constexpr (op == Opcode::NANDI) {
+            r[o.rd] = ~(r[o.rs] & o.imm);
+        } else if constexpr (op == Opcode::AND) {
+            r[o.rd] = r[o.rs] & r[o.rt];
+        } else if constexpr (op == Opcode::OR) {
+            r[o.rd] = r[o.rs] | r[o.rt];
+        } else if constexpr (op == Opcode::XOR) {
+            r[o.rd] = r[o.rs] ^ r[o.rt];
+        } else if constexpr (op == Opcode::NAND) {
+            r[o.rd] = ~(r[o.rs] & r[o.rt]);
+        } else if constexpr (op == Opcode::POPCNT) {
+            r[o.rd] = static_cast<u32>(std::popcount(r[o.rs]));
+        } else if constexpr (op == Opcode::CLO) {
+            r[o.rd] = static_cast<u32>(std::countl_one(r[o.rs]));
+        } else if constexpr (op == Opcode::PLO) {
+            r[o.rd] = static_cast<u32>(std::countr_zero(r[o.rs]));
+        } else if constexpr (info(op).category == Category::Compare && info(op).format == Format::I) {
+            s.t = detail::compare<op>(r[o.rd], o.imm);
+        } else if constexpr (info(op).category == Category::Compare && info(op).format == Format::S) {
+            s.t = detail::compare<op>(r[o.rd], r[o.rs]);
+        } else if constexpr (op == Opcode::MOVI) {
+            r[o.rd] = o.imm;
+        } else if constexpr (op == Opcode::MTI) {
+            if (s.t) {
+                r[o.rd] = o.imm;
+            }
+        } else if constexpr (op == Opcode::MFT) {
+            if (!s.t) {
+                r[o.rd] = o.imm;
+            }
+        } else if constexpr (op == Opcode::MOVL) {
+            r[o.rd] = (r[o.rd] & 0xFFFF0000) | o.imm;
+        } else if constexpr (op == Opcode::MOVU) {
+            r[o.rd] = (o.imm << 16) | (r[o.rd] & 0xFFFF);
+        } else if constexpr (op == Opcode::MOV) {
+            r[o.rd] = r[o.rs];
+        } else if constexpr (op == Opcode::MT) {
+            if (s.t) {
+                r[o.rd] = r[o.rs];
+            }
+        } else if constexpr (op == Opcode::MF) {
+            if (!s.t) {
+                r[o.rd] = r[o.rs];
+            }
+        } else if constexpr (op == Opcode::MFRC) {
+            r[o.rd] = s.cr[o.rs];
+        } else if constexpr (op == Opcode::MTOU) {
+            s.ur[o.rd] = r[o.rs];
+        } else if constexpr (op == Opcode::MFRU) {
+            r[o.rd] = s.ur[o.rs];
+        } else if constexpr (op == Opcode::LSL) {
+            // Shift amounts are taken modulo 32, as in the IR, whatever the width of the field
+            r[o.rd] = r[o.rs] << (o.imm & 31);
+        } else if constexpr (op == Opcode::LSR) {
+            r[o.rd] = r[o.rs] >> (o.imm & 31);
+        } else if constexpr (op == Opcode::ASR) {
+            r[o.rd] = static_cast<u32>(static_cast<s32>(r[o.rs]) >> (o.imm & 31));
+        } else if constexpr (op == Opcode::ROR) {
+            r[o.rd] = std::rotr(r[o.rs], static_cast<int>(o.imm & 31));
+        } else if constexpr (op == Opcode::RLSL) {
+            r[o.rd] = r[o.rs] << (r[o.rt] & 31);
+        } else if constexpr (op == Opcode::RLSR) {
+            r[o.rd] = r[o.rs] >> (r[o.rt] & 31);
+        } else if constexpr (op == Opcode::RASR) {
+            r[o.rd] = static_cast<u32>(static_cast<s32>(r[o.rs]) >> (r[o.rt] & 31));
+        } else if constexpr (op == Opcode::RROR) {
+            r[o.rd] = std::rotr(r[o.rs], static_cast<int>(r[o.rt] & 31));
+        } else if constexpr (op == Opcode::FLSL) {
+            r[o.rd] = static_cast<u32>(((u64{r[o.rs]} << 32 | r[o.rt]) << o.imm) >> 32);
+        } else if constexpr (op == Opcode::FLSR) {
+            r[o.rd] = static_cast<u32>((u64{r[o.rs]} << 32 | r[o.rt]) >> o.imm);
+        } else {
+            static_assert(op != op, "Unimplemented instruction");
+        }
+        s.pc = pc + 4;
+        return Step::Continue;
+    }
+}
+
+}
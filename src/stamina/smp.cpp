@@ -0,0 +1,226 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+#include "common/assert.hpp"
+#include "stamina/smp.hpp"
+
+namespace stamina {
+
+namespace {
+
+// A core of a pooled machine. It starts suspended, and suspends again after each slice.
+struct CoreTask final {
+    struct promise_type {
+        CoreTask get_return_object() { return CoreTask{std::coroutine_handle<promise_type>::from_promise(*this)}; }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    explicit CoreTask(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+    CoreTask(CoreTask&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    CoreTask& operator=(CoreTask&&) = delete;
+    ~CoreTask() {
+        if (handle) {
+            handle.destroy();
+        }
+    }
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+// What the threads of a pooled machine share
+struct Pool {
+    Pool(std::vector<CpuState>& cores, Memory& memory, const CoreRunnerFactory& make_runner, u64 budget, u64 slice, size_t thread_count)
+        : cores(cores), memory(memory), make_runner(make_runner), budget(budget), slice(slice), queues(thread_count) {}
+
+    std::vector<CpuState>& cores;
+    Memory& memory;
+    const CoreRunnerFactory& make_runner;
+    u64 budget;
+    u64 slice;
+
+    std::atomic<bool> stopping = false;
+    std::mutex result_mutex;
+    std::optional<SmpResult> result;
+
+    // Cores ready to run, one queue per thread. A thread takes cores from the front of its own queue
+    // and puts them back at the end, and takes them from the end of the others' when its own is empty.
+    struct Queue {
+        std::mutex mutex;
+        std::deque<std::coroutine_handle<>> ready;
+    };
+    std::vector<Queue> queues;
+    // Cores not finished, and cores in some queue. Threads sleep while every unfinished core is running.
+    std::atomic<size_t> unfinished = 0;
+    std::atomic<size_t> queued = 0;
+    std::mutex sleep_mutex;
+    std::condition_variable wake;
+
+    void push(size_t thread, std::coroutine_handle<> core) {
+        {
+            const std::lock_guard lock{queues[thread].mutex};
+            queues[thread].ready.push_back(core);
+        }
+        queued.fetch_add(1, std::memory_order_release);
+        {
+            const std::lock_guard lock{sleep_mutex};
+        }
+        wake.notify_one();
+    }
+
+    std::coroutine_handle<> pop(size_t thread) {
+        for (size_t i = 0; i < queues.size(); i++) {
+            Queue& queue = queues[(thread + i) % queues.size()];
+            const std::lock_guard lock{queue.mutex};
+            if (queue.ready.empty()) {
+                continue;
+            }
+            std::coroutine_handle<> core;
+            if (i == 0) {
+                core = queue.ready.front();
+                queue.ready.pop_front();
+            } else {
+                core = queue.ready.back();
+                queue.ready.pop_back();
+            }
+            queued.fetch_sub(1, std::memory_order_relaxed);
+            return core;
+        }
+        return nullptr;
+    }
+
+    void work(size_t thread) {
+        while (true) {
+            const std::coroutine_handle<> core = pop(thread);
+            if (!core) {
+                std::unique_lock lock{sleep_mutex};
+                wake.wait(lock, [&] { return queued.load(std::memory_order_acquire) > 0 || unfinished.load(std::memory_order_acquire) == 0; });
+                if (unfinished.load(std::memory_order_acquire) == 0) {
+                    return;
+                }
+                continue;
+            }
+
+            core.resume();
+            if (!core.done()) {
+                push(thread, core);
+            } else if (unfinished.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                {
+                    const std::lock_guard lock{sleep_mutex};
+                }
+                wake.notify_all();
+                return;
+            }
+        }
+    }
+
+    void stop(size_t index, StopReason reason) {
+        const std::lock_guard lock{result_mutex};
+        if (!result) {
+            result = SmpResult{index, reason};
+        }
+        stopping.store(true, std::memory_order_relaxed);
+    }
+};
+
+CoreTask run_pooled_core(Pool& pool, size_t index) {
+    // On whichever thread runs the core first
+    const CoreRunner run = pool.make_runner(index);
+    CpuState& state = pool.cores[index];
+    u64 remaining = pool.budget;
+    while (remaining > 0 && !pool.stopping.load(std::memory_order_relaxed)) {
+        const u64 retired = state.retired;
+        const StopReason reason = run(state, pool.memory, std::min(remaining, pool.slice));
+        remaining -= state.retired - retired;
+        if (reason != StopReason::BudgetExhausted) {
+            pool.stop(index, reason);
+            co_return;
+        }
+        co_await std::suspend_always{};
+    }
+}
+
+}
+
+std::vector<CpuState> make_cores(const CpuState& boot, size_t count) {
+    std::vector<CpuState> cores(count, boot);
+    for (size_t i = 0; i < count; i++) {
+        cores[i].control(ControlRegister::CoreId) = static_cast<u32>(i);
+    }
+    return cores;
+}
+
+SmpResult run_smp(std::vector<CpuState>& cores, Memory& memory, const CoreRunnerFactory& make_runner, u64 budget) {
+    std::atomic<bool> stopping = false;
+    std::mutex result_mutex;
+    std::optional<SmpResult> result;
+
+    const auto run_core = [&](size_t index) {
+        const CoreRunner run = make_runner(index);
+        CpuState& state = cores[index];
+        u64 remaining = budget;
+        while (remaining > 0 && !stopping.load(std::memory_order_relaxed)) {
+            const u64 retired = state.retired;
+            const StopReason reason = run(state, memory, std::min(remaining, smp_slice));
+            remaining -= state.retired - retired;
+            if (reason != StopReason::BudgetExhausted) {
+                const std::lock_guard lock{result_mutex};
+                if (!result) {
+                    result = SmpResult{index, reason};
+                }
+                stopping.store(true, std::memory_order_relaxed);
+                return;
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    threads.reserve(cores.size());
+    for (size_t i = 0; i < cores.size(); i++) {
+        threads.emplace_back(run_core, i);
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    return result.value_or(SmpResult{0, StopReason::BudgetExhausted});
+}
+
+SmpResult run_smp_pooled(std::vector<CpuState>& cores, Memory& memory, const CoreRunnerFactory& make_runner, u64 budget, size_t thread_count, u64 core_slice) {
+    ASSERT(thread_count > 0 && core_slice > 0);
+    thread_count = std::min(thread_count, cores.size());
+    Pool pool{cores, memory, make_runner, budget, core_slice, thread_count};
+
+    std::vector<CoreTask> tasks;
+    tasks.reserve(cores.size());
+    for (size_t i = 0; i < cores.size(); i++) {
+        tasks.push_back(run_pooled_core(pool, i));
+        pool.queues[i % thread_count].ready.push_back(tasks.back().handle);
+    }
+    pool.unfinished = cores.size();
+    pool.queued = cores.size();
+
+    std::vector<std::thread> threads;
+    threads.reserve(thread_count);
+    for (size_t i = 0; i < thread_count; i++) {
+        threads.emplace_back([&pool, i] { pool.work(i); });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    return pool.result.value_or(SmpResult{0, StopReason::BudgetExhausted});
+}
+
+}
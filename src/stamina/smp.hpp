@@ -0,0 +1,69 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#pragma once
+
+#include <functional>
+#include <vector>
+#include "common/common_types.hpp"
+#include "stamina/cpu_state.hpp"
+#include "stamina/memory.hpp"
+
+// Multi-core guest emulation.
+//
+// Each guest core runs on its own host thread with its own execution engine, and all cores share
+// one Memory. Alternatively the cores take turns on a smaller pool of host threads; see
+// run_smp_pooled. Cores start as copies of the boot state that differ only in CoreId. The machine
+// stops when any core halts or faults.
+//
+// Exclusive accesses: LDC records its address and the word it loaded in the core's monitor. STC
+// stores only if the monitor covers its address and memory still holds that word, which it checks
+// and updates with one host compare-and-swap. A store by another core that leaves the same word in
+// place therefore does not make STC fail. STC to an address that is not word-aligned is a plain
+// store and is not atomic.
+//
+// Memory ordering: each core sees its own accesses in program order. Aligned loads and stores are
+// single-copy atomic, and other cores observe them in the order the host provides: on x86-64, stores
+// become visible in program order and a load may complete before an earlier store to another address.
+// A successful STC is a full barrier.
+//
+// Code caches are per core. With STAMINA_HAS_FASTMEM, Memory records every core's stores to pages
+// holding code, and each core's cache drops the blocks they overwrite when it next looks up a block,
+// which is at the latest when its current slice ends; until then a core may still run the old code.
+// Without it, code that is modified while another core may run it must be invalidated explicitly.
+
+namespace stamina {
+
+// Executes at most budget instructions of one core, as interpret does.
+using CoreRunner = std::function<StopReason(CpuState& state, Memory& memory, u64 budget)>;
+// Called once for each core, on the thread that first runs it, with the index of the core to create
+// the engine that runs it.
+using CoreRunnerFactory = std::function<CoreRunner(size_t core)>;
+
+struct SmpResult {
+    // The core that stopped the machine, and why
+    size_t core;
+    StopReason reason;
+};
+
+// Instructions a core runs between checks for another core stopping the machine
+inline constexpr u64 smp_slice = 64 * 1024;
+
+// Makes count cores from boot, numbered from zero in CoreId.
+std::vector<CpuState> make_cores(const CpuState& boot, size_t count);
+
+// Runs each core on its own thread until one stops for any reason other than running out of budget,
+// or until every core has executed budget instructions. Cores still running when another stops
+// stop at the end of their current slice, up to smp_slice instructions later.
+SmpResult run_smp(std::vector<CpuState>& cores, Memory& memory, const CoreRunnerFactory& make_runner, u64 budget);
+
+// Runs the cores as run_smp does, but on thread_count host threads. Each core is a coroutine that
+// executes slice instructions and yields, after which its thread runs the next core in its queue.
+// A thread whose queue is empty steals a core from another thread's, so a core may run on any of
+// the threads, and its engine must not be tied to the thread that created it. A core spinning on a
+// lock held by a core that is not running only delays the holder by its slice. A core whose engine
+// blocks, waiting for an interrupt, holds its thread meanwhile.
+SmpResult run_smp_pooled(std::vector<CpuState>& cores, Memory& memory, const CoreRunnerFactory& make_runner, u64 budget, size_t thread_count, u64 slice = smp_slice);
+
+}
@@ -0,0 +1,236 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <catch.hpp>
+#include "common/common_types.hpp"
+#include "stamina/block_cache.hpp"
+#include "stamina/cpu_state.hpp"
+#include "stamina/interpreter.hpp"
+#include "stamina/memory.hpp"
+#include "stamina/smp.hpp"
+#include "stamina/test_program.hpp"
+
+#if defined(STAMINA_HAS_X64_JIT)
+    #include "stamina/x64/jit.hpp"
+#endif
+
+using namespace stamina;
+using namespace stamina::test;
+
+namespace {
+
+constexpr u32 counter = 0x1000;
+constexpr u32 core_count = 0x1008;
+
+// Every core adds 1000 to the counter. Core 0 waits for the others and halts with the total.
+const std::string counter_program =
+    "    li r3, 0x1000\n"
+    "    li r10, 0x1004\n"
+    "    li r2, 1000\n"
+    "    li r4, retry\n"
+    "    li r5, next\n"
+    "    li r9, done\n"
+    "retry:\n"
+    "    ldc r1, r3, 0\n"
+    "    addi r1, r1, 1\n"
+    "    stc r1, r3, 0\n"
+    "    mov r8, r5\n"
+    "    mf r8, r4\n"
+    "    rbra r8\n"
+    "next:\n"
+    "    addi r2, r2, -1\n"
+    "    cmpi/eq r2, 0\n"
+    "    mov r8, r4\n"
+    "    mt r8, r9\n"
+    "    rbra r8\n"
+    "done:\n"
+    "    li r4, finish\n"
+    "    li r5, joined\n"
+    "finish:\n"
+    "    ldc r1, r10, 0\n"
+    "    addi r1, r1, 1\n"
+    "    stc r1, r10, 0\n"
+    "    mov r8, r5\n"
+    "    mf r8, r4\n"
+    "    rbra r8\n"
+    "joined:\n"
+    "    li r7, 0x1008\n"
+    "    ld r7, r7, 0\n"
+    "    li r4, park\n"
+    "    li r5, wait\n"
+    "    li r11, exit\n"
+    "    mfrc r6, r4\n"
+    "    cmpi/eq r6, 0\n"
+    "    mov r8, r4\n"
+    "    mt r8, r5\n"
+    "    rbra r8\n"
+    "park:\n"
+    "    rbra r4\n"
+    "wait:\n"
+    "    ld r1, r10, 0\n"
+    "    cmp/eq r1, r7\n"
+    "    mov r8, r5\n"
+    "    mt r8, r11\n"
+    "    rbra r8\n"
+    "exit:\n"
+    "    ld r1, r3, 0\n"
+    "    mtoc r15, r1\n";
+
+CoreRunnerFactory threaded() {
+    return [](size_t) { return CoreRunner{&interpret}; };
+}
+
+CoreRunnerFactory cached() {
+    return [](size_t) {
+        auto cache = std::make_shared<BlockCache>();
+        return CoreRunner{[cache](CpuState& state, Memory& memory, u64 budget) { return interpret_cached(state, memory, *cache, budget); }};
+    };
+}
+
+#if defined(STAMINA_HAS_X64_JIT)
+CoreRunnerFactory jit() {
+    return [](size_t) {
+        auto jit = std::make_shared<x64::Jit>(1024 * 1024);
+        REQUIRE(jit->valid());
+        return CoreRunner{[jit](CpuState& state, Memory& memory, u64 budget) { return jit->run(state, memory, budget); }};
+    };
+}
+#endif
+
+}
+
+TEST_CASE("smp: exclusive increments are not lost", "[stamina]") {
+    std::vector<CoreRunnerFactory> engines{threaded(), cached()};
+#if defined(STAMINA_HAS_X64_JIT)
+    engines.push_back(jit());
+#endif
+
+    for (const CoreRunnerFactory& engine : engines) {
+        for (const u32 count : {1u, 4u}) {
+            Memory memory{ram_size};
+            CpuState boot;
+            load_program(memory, boot, counter_program);
+            REQUIRE(memory.write(core_count, count));
+
+            std::vector<CpuState> cores = make_cores(boot, count);
+            REQUIRE(cores.back().control(ControlRegister::CoreId) == count - 1);
+            const SmpResult result = run_smp(cores, memory, engine, UINT64_MAX);
+            REQUIRE(result.reason == StopReason::Halted);
+            REQUIRE(result.core == 0);
+            REQUIRE(cores[0].control(ControlRegister::Halt) == 1000 * count);
+        }
+    }
+}
+
+TEST_CASE("smp: stc fails if the word changed since ldc", "[stamina]") {
+    const std::string program =
+        "    li r3, 0x1000\n"
+        "    ldc r1, r3, 0\n"
+        "    movi r2, 7\n"
+        "    stc r2, r3, 0\n";
+
+    for (const u32 intervening : {5u, 0u}) {
+        Memory memory{ram_size};
+        CpuState state;
+        load_program(memory, state, program);
+        REQUIRE(interpret(state, memory, 3) == StopReason::BudgetExhausted);
+        REQUIRE(state.monitor_valid);
+
+        // Another core writing the word breaks the reservation unless it writes back the same value
+        REQUIRE(memory.write(counter, intervening));
+        REQUIRE(interpret(state, memory, 1) == StopReason::BudgetExhausted);
+        REQUIRE(!state.monitor_valid);
+        u32 word = 0;
+        REQUIRE(memory.read(counter, word));
+        if (intervening == 0) {
+            REQUIRE(state.t);
+            REQUIRE(word == 7);
+        } else {
+            REQUIRE(!state.t);
+            REQUIRE(word == 5);
+        }
+    }
+}
+
+TEST_CASE("smp: a fault stops every core", "[stamina]") {
+    const std::string program =
+        "    li r4, spin\n"
+        "    li r5, store\n"
+        "    li r2, 0x100000\n"
+        "    mfrc r1, r4\n"
+        "    cmpi/eq r1, 2\n"
+        "    mt r4, r5\n"
+        "spin:\n"
+        "    rbra r4\n"
+        "store:\n"
+        "    st r1, r2, 0\n";
+
+    Memory memory{ram_size};
+    CpuState boot;
+    load_program(memory, boot, program);
+    std::vector<CpuState> cores = make_cores(boot, 4);
+    const SmpResult result = run_smp(cores, memory, threaded(), UINT64_MAX);
+    REQUIRE(result.reason == StopReason::MemoryFault);
+    REQUIRE(result.core == 2);
+    REQUIRE(cores[2].control(ControlRegister::FaultAddress) == 0x100000);
+}
+
+TEST_CASE("smp: many cores share a few threads", "[stamina]") {
+    std::vector<CoreRunnerFactory> engines{threaded(), cached()};
+#if defined(STAMINA_HAS_X64_JIT)
+    engines.push_back(jit());
+#endif
+
+    for (const CoreRunnerFactory& engine : engines) {
+        for (const size_t threads : {size_t{1}, size_t{3}}) {
+            constexpr u32 count = 8;
+            Memory memory{ram_size};
+            CpuState boot;
+            load_program(memory, boot, counter_program);
+            REQUIRE(memory.write(core_count, count));
+
+            // Short slices, so that cores holding a reservation are often switched out
+            std::atomic<size_t> runners = 0;
+            const CoreRunnerFactory counted = [&](size_t core) {
+                runners++;
+                return engine(core);
+            };
+            std::vector<CpuState> cores = make_cores(boot, count);
+            const SmpResult result = run_smp_pooled(cores, memory, counted, UINT64_MAX, threads, 97);
+            REQUIRE(result.reason == StopReason::Halted);
+            REQUIRE(result.core == 0);
+            REQUIRE(cores[0].control(ControlRegister::Halt) == 1000 * count);
+            REQUIRE(runners == count);
+        }
+    }
+
+    // Cores spin, unless started at the store
+    const std::string program =
+        "    movi r4, 4\n"
+        "    rbra r4\n"
+        "    li r2, 0x100000\n"
+        "    st r2, r2, 0\n";
+    Memory memory{ram_size};
+    CpuState boot;
+    load_program(memory, boot, program);
+
+    // Out of budget, every core ran as far as it may
+    std::vector<CpuState> cores = make_cores(boot, 5);
+    SmpResult result = run_smp_pooled(cores, memory, threaded(), 1000, 2, 64);
+    REQUIRE(result.reason == StopReason::BudgetExhausted);
+    for (const CpuState& core : cores) {
+        REQUIRE(core.retired == 1000);
+    }
+
+    // A fault stops every core
+    cores = make_cores(boot, 5);
+    cores[3].pc = 8;
+    result = run_smp_pooled(cores, memory, threaded(), UINT64_MAX, 2, 64);
+    REQUIRE(result.reason == StopReason::MemoryFault);
+    REQUIRE(result.core == 3);
+    REQUIRE(cores[3].control(ControlRegister::FaultAddress) == 0x100000);
+}
@@ -0,0 +1,29 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#pragma once
+
+#include "stamina/cpu_state.hpp"
+#include "stamina/memory.hpp"
+
+namespace stamina {
+
+// A machine state to return to, for running many short scenarios from one starting point.
+// Restoring costs time in proportion to the pages written since and the pages of code decoded
+// since, and code caches see the code it changes; see Memory::snapshot.
+struct Snapshot {
+    CpuState state;
+    MemorySnapshot memory;
+};
+
+inline Snapshot take_snapshot(const CpuState& state, Memory& memory) {
+    return Snapshot{state, memory.snapshot()};
+}
+
+inline void restore_snapshot(const Snapshot& snapshot, CpuState& state, Memory& memory) {
+    state = snapshot.state;
+    memory.restore(snapshot.memory);
+}
+
+}
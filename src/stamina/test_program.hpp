@@ -0,0 +1,32 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#pragma once
+
+#include <cstring>
+#include <string>
+#include <catch.hpp>
+#include "common/common_types.hpp"
+#include "smasm/snippet_assembler.hpp"
+#include "stamina/cpu_state.hpp"
+#include "stamina/memory.hpp"
+
+// Running assembled snippets in the unit tests.
+
+namespace stamina::test {
+
+// RAM of the machines the tests run programs on
+inline constexpr u32 ram_size = 64 * 1024;
+
+// Assembles source to address zero and points state at it, with the stack at the top of memory.
+inline void load_program(Memory& memory, CpuState& state, const std::string& source) {
+    SnippetAssembler assembler;
+    const auto& result = assembler.assemble(source);
+    REQUIRE(result.ok());
+    std::memcpy(memory.bytes().data(), result.words.data(), result.words.size() * 4);
+    state.pc = 0;
+    state.gpr[reg_sp] = memory.size();
+}
+
+}
@@ -0,0 +1,225 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#include <bit>
+#include <chrono>
+#include "common/assert.hpp"
+#include "stamina/mmu.hpp"
+#include "stamina/semantics.hpp"
+#include "stamina/trace.hpp"
+
+namespace stamina {
+
+TraceRing::TraceRing(size_t capacity) : slots(std::bit_ceil(std::max<size_t>(capacity, 2 * publish_interval))), mask(slots.size() - 1) {}
+
+void TraceRing::publish() {
+    head_published = head;
+    published.store(head, std::memory_order_release);
+}
+
+void TraceRing::wait_for_space() {
+    // The consumer cannot see what has not been published
+    publish();
+    while ((tail_seen = tail.load(std::memory_order_acquire)) == head - slots.size()) {
+        std::this_thread::yield();
+    }
+}
+
+std::pair<std::span<const u64>, std::span<const u64>> TraceRing::available() const {
+    const u64 begin = tail.load(std::memory_order_relaxed);
+    const u64 end = published.load(std::memory_order_acquire);
+    const size_t first = static_cast<size_t>(begin & mask);
+    const size_t count = static_cast<size_t>(end - begin);
+    const size_t until_wrap = std::min(count, slots.size() - first);
+    return {std::span{slots}.subspan(first, until_wrap), std::span{slots}.subspan(0, count - until_wrap)};
+}
+
+void TraceRing::consume(size_t count) {
+    tail.store(tail.load(std::memory_order_relaxed) + count, std::memory_order_release);
+}
+
+TraceWriter::TraceWriter(const std::filesystem::path& path, size_t core_count, bool deltas, size_t ring_size) : with_deltas(deltas) {
+    for (size_t i = 0; i < core_count; i++) {
+        rings.push_back(std::make_unique<TraceRing>(ring_size));
+    }
+
+    file = std::fopen(path.string().c_str(), "wb");
+    if (!file) {
+        return;
+    }
+    const TraceFileHeader header{trace_magic, trace_version, deltas ? trace_flag_deltas : 0, 0};
+    if (std::fwrite(&header, sizeof(header), 1, file) != 1) {
+        failed = true;
+    }
+    thread = std::thread{[this] { run(); }};
+}
+
+TraceWriter::~TraceWriter() {
+    if (!file) {
+        return;
+    }
+    stopping.store(true, std::memory_order_release);
+    thread.join();
+    std::fclose(file);
+}
+
+void TraceWriter::run() {
+    while (true) {
+        // Everything published before stopping was set is seen by the drain after it
+        const bool last = stopping.load(std::memory_order_acquire);
+        if (!drain() && !last) {
+            std::this_thread::sleep_for(std::chrono::microseconds{200});
+        }
+        if (last) {
+            break;
+        }
+    }
+    if (std::fflush(file) != 0) {
+        failed = true;
+    }
+}
+
+bool TraceWriter::drain() {
+    const size_t slots_per_entry = with_deltas ? 2 : 1;
+    bool any = false;
+    for (size_t core = 0; core < rings.size(); core++) {
+        TraceRing& ring = *rings[core];
+        const auto [first, second] = ring.available();
+        const size_t count = first.size() + second.size();
+        if (count == 0) {
+            continue;
+        }
+        any = true;
+
+        const TraceChunkHeader header{static_cast<u32>(core), static_cast<u32>(count / slots_per_entry)};
+        bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1;
+        ok = ok && std::fwrite(first.data(), sizeof(u64), first.size(), file) == first.size();
+        ok = ok && (second.empty() || std::fwrite(second.data(), sizeof(u64), second.size(), file) == second.size());
+        if (!ok) {
+            failed = true;
+        }
+        // Keep consuming after a failure so that the cores do not wait forever
+        ring.consume(count);
+    }
+    return any;
+}
+
+namespace {
+
+// Guest address an instruction accesses, given the registers before it executes
+template <Opcode op>
+FORCE_INLINE u32 access_address(const CpuState& s, const Operands& o) {
+    if constexpr (op == Opcode::POP) {
+        return s.gpr[reg_sp];
+    } else if constexpr (op == Opcode::PUSH) {
+        return s.gpr[reg_sp] - 4;
+    } else if constexpr (info(op).category == Category::Memory) {
+        return s.gpr[o.rs] + (info(op).format == Format::I ? o.imm : s.gpr[o.rt]);
+    } else {
+        return 0;
+    }
+}
+
+}
+
+StopReason interpret_traced(CpuState& state, Memory& memory, TraceRing& ring, bool deltas, u64 budget) {
+    StopReason reason = StopReason::BudgetExhausted;
+    for (; budget > 0; budget--) {
+        u32 word;
+        if (!fetch_virtual(state, memory, state.pc, word)) [[unlikely]] {
+            state.control(ControlRegister::FaultAddress) = state.pc;
+            reason = StopReason::MemoryFault;
+            break;
+        }
+        ring.push(TraceRecord{state.pc, word});
+
+        Step step;
+        u32 rd = 0;
+        u32 address = 0;
+        switch (opcode_decode_table[word >> 24]) {
+#define INSTRUCTION(name, ...)                                                                   \
+        case static_cast<u8>(Opcode::name): {                                                    \
+            const Operands o = extract_operands<Opcode::name>(word);                             \
+            rd = o.rd;                                                                           \
+            address = access_address<Opcode::name>(state, o);                                    \
+            step = execute<Opcode::name>(state, memory, o);                                      \
+            break;                                                                               \
+        }
+#define COMPAREINST(name, cond, ...) INSTRUCTION(name##_##cond)
+#include "common/instructions.inc"
+#undef INSTRUCTION
+#undef COMPAREINST
+        default:
+            step = Step::Continue;
+            reason = StopReason::InvalidInstruction;
+            break;
+        }
+        if (deltas) {
+            ring.push(TraceDelta{state.gpr[rd], address});
+        }
+        ring.end_entry();
+
+        if (reason == StopReason::InvalidInstruction) {
+            break;
+        }
+        if (step != Step::MemoryFault) {
+            count_instruction(state, static_cast<Opcode>(opcode_decode_table[word >> 24]));
+        }
+        if (step != Step::Continue) [[unlikely]] {
+            state.retired += step != Step::MemoryFault;
+            reason = stop_reason(step);
+            break;
+        }
+        state.retired++;
+    }
+    ring.publish();
+    return reason;
+}
+
+TraceParser::TraceParser(std::span<const u8> file) : file(file) {
+    TraceFileHeader header;
+    if (file.size() < sizeof(header)) {
+        return;
+    }
+    std::memcpy(&header, file.data(), sizeof(header));
+    if (header.magic != trace_magic || header.version != trace_version) {
+        return;
+    }
+    flags = header.flags;
+    offset = sizeof(header);
+    is_valid = true;
+}
+
+std::optional<TraceEntry> TraceParser::next() {
+    if (!is_valid) {
+        return std::nullopt;
+    }
+    while (remaining == 0) {
+        TraceChunkHeader header;
+        if (file.size() - offset < sizeof(header)) {
+            return std::nullopt;
+        }
+        std::memcpy(&header, file.data() + offset, sizeof(header));
+        offset += sizeof(header);
+        core = header.core;
+        remaining = header.count;
+    }
+
+    const size_t entry_size = sizeof(TraceRecord) + (deltas() ? sizeof(TraceDelta) : 0);
+    if (file.size() - offset < entry_size) {
+        return std::nullopt;
+    }
+    TraceEntry entry{core, {}, std::nullopt};
+    std::memcpy(&entry.record, file.data() + offset, sizeof(TraceRecord));
+    if (deltas()) {
+        TraceDelta delta;
+        std::memcpy(&delta, file.data() + offset + sizeof(TraceRecord), sizeof(TraceDelta));
+        entry.delta = delta;
+    }
+    offset += entry_size;
+    remaining--;
+    return entry;
+}
+
+}
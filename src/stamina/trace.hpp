@@ -0,0 +1,168 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#pragma once
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <span>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "common/common_types.hpp"
+#include "common/macros.hpp"
+#include "stamina/cpu_state.hpp"
+#include "stamina/memory.hpp"
+
+// Binary instruction traces.
+//
+// A traced core writes a TraceRecord for every instruction it attempts into its own TraceRing.
+// With deltas, each record is followed by a TraceDelta holding the value of the rd field's register
+// after the instruction and the address the instruction accessed, if any. A TraceWriter thread
+// drains the rings into a file; formatting is left to smtrace.
+//
+// The file is a TraceFileHeader followed by chunks. Each chunk is a TraceChunkHeader and then
+// count entries of one core, every entry being a record or, with deltas, a record and its delta.
+// Everything is little-endian.
+
+namespace stamina {
+
+struct TraceRecord {
+    u32 pc;
+    u32 word;
+};
+
+struct TraceDelta {
+    u32 value;
+    u32 address;
+};
+
+inline constexpr u32 trace_magic = 0x4352544D; // "MTRC"
+inline constexpr u32 trace_version = 1;
+inline constexpr u32 trace_flag_deltas = 1 << 0;
+
+struct TraceFileHeader {
+    u32 magic;
+    u32 version;
+    u32 flags;
+    u32 reserved;
+};
+
+struct TraceChunkHeader {
+    u32 core;
+    u32 count;
+};
+
+// Lock-free ring of 8-byte slots with one producing and one consuming thread. The producer makes
+// slots visible in batches, so an entry is never split between chunks.
+struct TraceRing final {
+public:
+    explicit TraceRing(size_t capacity);
+
+    TraceRing(const TraceRing&) = delete;
+    TraceRing& operator=(const TraceRing&) = delete;
+
+    // Producer. Waits for the consumer while the ring is full.
+    template <typename T>
+    FORCE_INLINE void push(const T& entry) {
+        static_assert(sizeof(T) == sizeof(u64));
+        if (head - tail_seen == slots.size()) [[unlikely]] {
+            wait_for_space();
+        }
+        std::memcpy(&slots[head & mask], &entry, sizeof(u64));
+        head++;
+    }
+    // Producer: makes everything pushed so far visible once an entry is complete.
+    FORCE_INLINE void end_entry() {
+        if (head - head_published >= publish_interval) [[unlikely]] {
+            publish();
+        }
+    }
+    void publish();
+
+    // Consumer: the slots visible to it, in at most two pieces, and releasing them once used.
+    std::pair<std::span<const u64>, std::span<const u64>> available() const;
+    void consume(size_t count);
+
+private:
+    void wait_for_space();
+
+    static constexpr u64 publish_interval = 256;
+
+    std::vector<u64> slots;
+    u64 mask;
+
+    // Producer-owned
+    u64 head = 0;
+    u64 head_published = 0;
+    u64 tail_seen = 0;
+
+    alignas(64) std::atomic<u64> published{0};
+    alignas(64) std::atomic<u64> tail{0};
+};
+
+// Owns one ring per core and a thread that writes them to a trace file until destroyed.
+struct TraceWriter final {
+public:
+    static constexpr size_t default_ring_size = 1 << 16;
+
+    TraceWriter(const std::filesystem::path& path, size_t core_count, bool deltas, size_t ring_size = default_ring_size);
+    // Drains what the cores have published and closes the file.
+    ~TraceWriter();
+
+    TraceWriter(const TraceWriter&) = delete;
+    TraceWriter& operator=(const TraceWriter&) = delete;
+
+    // False if the file could not be created or written.
+    bool valid() const { return file && !failed.load(); }
+    bool deltas() const { return with_deltas; }
+    TraceRing& ring(size_t core) { return *rings[core]; }
+
+private:
+    void run();
+    bool drain();
+
+    std::FILE* file = nullptr;
+    bool with_deltas;
+    std::vector<std::unique_ptr<TraceRing>> rings;
+    std::atomic<bool> stopping = false;
+    std::atomic<bool> failed = false;
+    std::thread thread;
+};
+
+// As interpret, also tracing every instruction into ring. Ends by publishing what it pushed.
+StopReason interpret_traced(CpuState& state, Memory& memory, TraceRing& ring, bool deltas, u64 budget);
+
+struct TraceEntry {
+    u32 core;
+    TraceRecord record;
+    std::optional<TraceDelta> delta;
+};
+
+// Walks the entries of a trace file in a mapped buffer without copying it.
+struct TraceParser final {
+public:
+    explicit TraceParser(std::span<const u8> file);
+
+    // False if the header is not a supported trace.
+    bool valid() const { return is_valid; }
+    bool deltas() const { return flags & trace_flag_deltas; }
+
+    // The next entry, or nothing at the end of the file or at a truncated chunk.
+    std::optional<TraceEntry> next();
+
+private:
+    std::span<const u8> file;
+    size_t offset = 0;
+    u32 flags = 0;
+    bool is_valid = false;
+    u32 core = 0;
+    u32 remaining = 0;
+};
+
+}
@@ -0,0 +1,139 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <vector>
+#include <catch.hpp>
+#include <unistd.h>
+#include "common/common_types.hpp"
+#include "common/mapped_file.hpp"
+#include "smasm/snippet_assembler.hpp"
+#include "stamina/cpu_state.hpp"
+#include "stamina/interpreter.hpp"
+#include "stamina/memory.hpp"
+#include "stamina/trace.hpp"
+
+using namespace stamina;
+
+namespace {
+
+const std::string program =
+    "    li r1, 0x1000\n"
+    "    movi r2, 3\n"
+    "loop:\n"
+    "    st r2, r1, 4\n"
+    "    addi r2, r2, -1\n"
+    "    cmpi/eq r2, 0\n"
+    "    li r3, loop\n"
+    "    li r4, done\n"
+    "    mt r3, r4\n"
+    "    rbra r3\n"
+    "done:\n"
+    "    mtoc r15, r2\n";
+
+struct TempPath {
+    std::filesystem::path path = std::filesystem::temp_directory_path() / ("stamina-trace-" + std::to_string(getpid()) + ".bin");
+    ~TempPath() { std::filesystem::remove(path); }
+};
+
+std::vector<TraceEntry> trace_program(bool deltas, size_t ring_size, CpuState& state) {
+    SnippetAssembler assembler;
+    const auto& result = assembler.assemble(program);
+    REQUIRE(result.ok());
+    Memory memory{64 * 1024};
+    std::memcpy(memory.bytes().data(), result.words.data(), result.words.size() * 4);
+
+    const TempPath temp;
+    {
+        TraceWriter writer{temp.path, 1, deltas, ring_size};
+        REQUIRE(writer.valid());
+        REQUIRE(interpret_traced(state, memory, writer.ring(0), deltas, 1000) == StopReason::Halted);
+    }
+
+    const auto file = MappedFile::open(temp.path);
+    REQUIRE(file);
+    TraceParser parser{file->bytes()};
+    REQUIRE(parser.valid());
+    REQUIRE(parser.deltas() == deltas);
+    std::vector<TraceEntry> entries;
+    while (const auto entry = parser.next()) {
+        entries.push_back(*entry);
+    }
+    return entries;
+}
+
+}
+
+TEST_CASE("trace: records every instruction", "[stamina]") {
+    for (const size_t ring_size : {size_t{2}, TraceWriter::default_ring_size}) {
+        CpuState reference;
+        Memory memory{64 * 1024};
+        SnippetAssembler assembler;
+        const auto& result = assembler.assemble(program);
+        REQUIRE(result.ok());
+        std::memcpy(memory.bytes().data(), result.words.data(), result.words.size() * 4);
+        REQUIRE(interpret_switch(reference, memory, 1000) == StopReason::Halted);
+
+        CpuState state;
+        const std::vector<TraceEntry> entries = trace_program(false, ring_size, state);
+        REQUIRE(state.gpr == reference.gpr);
+        REQUIRE(entries.size() == reference.retired);
+        for (const TraceEntry& entry : entries) {
+            REQUIRE(entry.core == 0);
+            REQUIRE(!entry.delta);
+            u32 word = 0;
+            REQUIRE(memory.read(entry.record.pc, word));
+            REQUIRE(entry.record.word == word);
+        }
+        REQUIRE(entries.front().record.pc == 0);
+        REQUIRE(entries.back().record.pc == (result.words.size() - 1) * 4);
+    }
+}
+
+TEST_CASE("trace: deltas hold results and addresses", "[stamina]") {
+    CpuState state;
+    const std::vector<TraceEntry> entries = trace_program(true, TraceWriter::default_ring_size, state);
+
+    std::vector<u32> counter;
+    std::vector<u32> stores;
+    for (const TraceEntry& entry : entries) {
+        REQUIRE(entry.delta);
+        switch (static_cast<Opcode>(opcode_decode_table[entry.record.word >> 24])) {
+        case Opcode::ADDI:
+            counter.push_back(entry.delta->value);
+            break;
+        case Opcode::ST:
+            stores.push_back(entry.delta->address);
+            break;
+        default:
+            break;
+        }
+    }
+    REQUIRE(counter == std::vector<u32>{2, 1, 0});
+    REQUIRE(stores == std::vector<u32>{0x1004, 0x1004, 0x1004});
+}
+
+TEST_CASE("trace: truncated files end early", "[stamina]") {
+    std::vector<u8> file(sizeof(TraceFileHeader) + sizeof(TraceChunkHeader) + sizeof(TraceRecord) + 3);
+    const TraceFileHeader header{trace_magic, trace_version, 0, 0};
+    const TraceChunkHeader chunk{2, 2};
+    const TraceRecord record{0x10, 0x12345678};
+    std::memcpy(file.data(), &header, sizeof(header));
+    std::memcpy(file.data() + sizeof(header), &chunk, sizeof(chunk));
+    std::memcpy(file.data() + sizeof(header) + sizeof(chunk), &record, sizeof(record));
+
+    TraceParser parser{file};
+    REQUIRE(parser.valid());
+    const auto entry = parser.next();
+    REQUIRE(entry);
+    REQUIRE(entry->core == 2);
+    REQUIRE(entry->record.pc == 0x10);
+    REQUIRE(entry->record.word == 0x12345678);
+    REQUIRE(!parser.next());
+
+    file[0] = 0;
+    REQUIRE(!TraceParser{file}.valid());
+}
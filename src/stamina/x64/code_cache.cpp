@@ -0,0 +1,37 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#include <sys/mman.h>
+#include "common/assert.hpp"
+#include "stamina/x64/code_cache.hpp"
+
+namespace stamina::x64 {
+
+CodeCache::CodeCache(size_t capacity) {
+    void* const addr = mmap(nullptr, capacity, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+        return;
+    }
+    this->base = static_cast<u8*>(addr);
+    this->capacity = capacity;
+    this->cursor = base;
+}
+
+CodeCache::~CodeCache() {
+    if (base) {
+        munmap(base, capacity);
+    }
+}
+
+void CodeCache::commit(u8* new_cursor) {
+    ASSERT(new_cursor >= cursor && new_cursor <= end());
+    cursor = new_cursor;
+}
+
+void CodeCache::reset(u8* mark) {
+    ASSERT(mark >= base && mark <= cursor);
+    cursor = mark;
+}
+
+}
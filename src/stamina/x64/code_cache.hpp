@@ -0,0 +1,39 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#pragma once
+
+#include "common/common_types.hpp"
+
+namespace stamina::x64 {
+
+// A fixed-size region of executable memory that host code is emitted into.
+// Allocation is a bump pointer; space is only reclaimed by resetting to a mark.
+struct CodeCache final {
+public:
+    explicit CodeCache(size_t capacity);
+    ~CodeCache();
+
+    CodeCache(const CodeCache&) = delete;
+    CodeCache& operator=(const CodeCache&) = delete;
+
+    bool valid() const { return base != nullptr; }
+
+    u8* begin() const { return base; }
+    u8* end() const { return base + capacity; }
+    u8* free_begin() const { return cursor; }
+    size_t used() const { return static_cast<size_t>(cursor - base); }
+
+    // Marks [free_begin(), new_cursor) as allocated.
+    void commit(u8* new_cursor);
+    // Frees everything allocated after mark.
+    void reset(u8* mark);
+
+private:
+    u8* base = nullptr;
+    size_t capacity = 0;
+    u8* cursor = nullptr;
+};
+
+}
@@ -0,0 +1,387 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#include <cstdint>
+#include <cstring>
+#include "common/assert.hpp"
+#include "stamina/x64/emitter.hpp"
+
+namespace stamina::x64 {
+
+namespace {
+
+constexpr u8 code(Reg reg) {
+    return static_cast<u8>(reg);
+}
+
+constexpr bool fits_s8(s64 value) {
+    return value >= -128 && value <= 127;
+}
+
+}
+
+void Emitter::byte(u8 value) {
+    if (cursor == end) [[unlikely]] {
+        overflow = true;
+        return;
+    }
+    *cursor++ = value;
+}
+
+void Emitter::dword(u32 value) {
+    for (int i = 0; i < 4; i++) {
+        byte(static_cast<u8>(value >> (i * 8)));
+    }
+}
+
+void Emitter::qword(u64 value) {
+    dword(static_cast<u32>(value));
+    dword(static_cast<u32>(value >> 32));
+}
+
+void Emitter::rex(bool w, u8 reg, u8 index, u8 base, bool force) {
+    const u8 value = 0x40 | (w << 3) | ((reg >> 3) << 2) | ((index >> 3) << 1) | (base >> 3);
+    if (value != 0x40 || force) {
+        byte(value);
+    }
+}
+
+void Emitter::modrm(u8 reg, const Mem& m) {
+    const u8 base = code(m.base) & 7;
+    // [rbp] and [r13] have no disp-less encoding
+    const u8 mod = m.disp == 0 && base != 5 ? 0b00 : fits_s8(m.disp) ? 0b01 : 0b10;
+
+    if (m.has_index) {
+        ASSERT(m.index != Reg::rsp);
+        byte((mod << 6) | ((reg & 7) << 3) | 0b100);
+        byte(((code(m.index) & 7) << 3) | base);
+    } else if (base == 4) {
+        // [rsp] and [r12] require a SIB byte
+        byte((mod << 6) | ((reg & 7) << 3) | 0b100);
+        byte(0x24);
+    } else {
+        byte((mod << 6) | ((reg & 7) << 3) | base);
+    }
+
+    if (mod == 0b01) {
+        byte(static_cast<u8>(m.disp));
+    } else if (mod == 0b10) {
+        dword(static_cast<u32>(m.disp));
+    }
+}
+
+void Emitter::op_rm(std::initializer_list<u8> opcode, u8 reg, const Mem& m, bool w, bool byte_reg) {
+    rex(w, reg, m.has_index ? code(m.index) : 0, code(m.base), byte_reg && reg >= 4);
+    for (const u8 b : opcode) {
+        byte(b);
+    }
+    modrm(reg, m);
+}
+
+void Emitter::op_rr(std::initializer_list<u8> opcode, u8 reg, Reg rm, bool w, bool byte_reg) {
+    rex(w, reg, 0, code(rm), byte_reg && (reg >= 4 || code(rm) >= 4));
+    for (const u8 b : opcode) {
+        byte(b);
+    }
+    byte(0xC0 | ((reg & 7) << 3) | (code(rm) & 7));
+}
+
+void Emitter::rel32(const u8* target) {
+    dword(static_cast<u32>(target - (cursor + 4)));
+}
+
+void Emitter::rel32(Label& label) {
+    if (label.target) {
+        rel32(label.target);
+        return;
+    }
+    label.fixups.push_back(cursor);
+    dword(0);
+}
+
+void Emitter::patch_rel32(u8* next_instruction, const u8* target) {
+    const s32 displacement = static_cast<s32>(target - next_instruction);
+    std::memcpy(next_instruction - 4, &displacement, sizeof(displacement));
+}
+
+void Emitter::bind(Label& label) {
+    label.target = cursor;
+    if (overflow) {
+        return;
+    }
+    for (u8* fixup : label.fixups) {
+        patch_rel32(fixup + 4, cursor);
+    }
+    label.fixups.clear();
+}
+
+void Emitter::align(size_t alignment) {
+    while (reinterpret_cast<uintptr_t>(cursor) % alignment != 0 && !overflow) {
+        int3();
+    }
+}
+
+void Emitter::mov(Reg dst, Reg src) {
+    op_rr({0x89}, code(src), dst);
+}
+
+void Emitter::mov(Reg dst, const Mem& src) {
+    op_rm({0x8B}, code(dst), src);
+}
+
+void Emitter::mov(const Mem& dst, Reg src) {
+    op_rm({0x89}, code(src), dst);
+}
+
+void Emitter::mov(const Mem& dst, u32 imm) {
+    op_rm({0xC7}, 0, dst);
+    dword(imm);
+}
+
+void Emitter::mov(Reg dst, u32 imm) {
+    rex(false, 0, 0, code(dst));
+    byte(0xB8 + (code(dst) & 7));
+    dword(imm);
+}
+
+void Emitter::mov64(Reg dst, Reg src) {
+    op_rr({0x89}, code(src), dst, true);
+}
+
+void Emitter::mov64(Reg dst, const Mem& src) {
+    op_rm({0x8B}, code(dst), src, true);
+}
+
+void Emitter::mov64(const Mem& dst, Reg src) {
+    op_rm({0x89}, code(src), dst, true);
+}
+
+void Emitter::mov64(Reg dst, u64 imm) {
+    if (imm <= 0xFFFFFFFF) {
+        mov(dst, static_cast<u32>(imm));
+        return;
+    }
+    rex(true, 0, 0, code(dst));
+    byte(0xB8 + (code(dst) & 7));
+    qword(imm);
+}
+
+void Emitter::movzx8(Reg dst, const Mem& src) {
+    op_rm({0x0F, 0xB6}, code(dst), src);
+}
+
+void Emitter::movzx16(Reg dst, const Mem& src) {
+    op_rm({0x0F, 0xB7}, code(dst), src);
+}
+
+void Emitter::movzx8(Reg dst, Reg src) {
+    op_rr({0x0F, 0xB6}, code(dst), src, false, true);
+}
+
+void Emitter::mov8(const Mem& dst, Reg src) {
+    op_rm({0x88}, code(src), dst, false, true);
+}
+
+void Emitter::mov8(const Mem& dst, u8 imm) {
+    op_rm({0xC6}, 0, dst);
+    byte(imm);
+}
+
+void Emitter::mov16(const Mem& dst, Reg src) {
+    byte(0x66);
+    op_rm({0x89}, code(src), dst);
+}
+
+void Emitter::lea(Reg dst, const Mem& src) {
+    op_rm({0x8D}, code(dst), src);
+}
+
+void Emitter::lea64(Reg dst, const Mem& src) {
+    op_rm({0x8D}, code(dst), src, true);
+}
+
+void Emitter::lea64(Reg dst, Label& label) {
+    rex(true, code(dst), 0, 0);
+    byte(0x8D);
+    byte(((code(dst) & 7) << 3) | 0b101);
+    rel32(label);
+}
+
+void Emitter::alu(Alu op, Reg dst, Reg src) {
+    op_rr({static_cast<u8>(static_cast<u8>(op) * 8 + 1)}, code(src), dst);
+}
+
+void Emitter::alu(Alu op, Reg dst, const Mem& src) {
+    op_rm({static_cast<u8>(static_cast<u8>(op) * 8 + 3)}, code(dst), src);
+}
+
+void Emitter::alu(Alu op, Reg dst, u32 imm) {
+    if (fits_s8(static_cast<s32>(imm))) {
+        op_rr({0x83}, static_cast<u8>(op), dst);
+        byte(static_cast<u8>(imm));
+    } else {
+        op_rr({0x81}, static_cast<u8>(op), dst);
+        dword(imm);
+    }
+}
+
+void Emitter::alu(Alu op, const Mem& dst, u32 imm) {
+    if (fits_s8(static_cast<s32>(imm))) {
+        op_rm({0x83}, static_cast<u8>(op), dst);
+        byte(static_cast<u8>(imm));
+    } else {
+        op_rm({0x81}, static_cast<u8>(op), dst);
+        dword(imm);
+    }
+}
+
+void Emitter::alu64(Alu op, Reg dst, u32 imm) {
+    if (fits_s8(static_cast<s32>(imm))) {
+        op_rr({0x83}, static_cast<u8>(op), dst, true);
+        byte(static_cast<u8>(imm));
+    } else {
+        op_rr({0x81}, static_cast<u8>(op), dst, true);
+        dword(imm);
+    }
+}
+
+void Emitter::alu64(Alu op, const Mem& dst, u32 imm) {
+    if (fits_s8(static_cast<s32>(imm))) {
+        op_rm({0x83}, static_cast<u8>(op), dst, true);
+        byte(static_cast<u8>(imm));
+    } else {
+        op_rm({0x81}, static_cast<u8>(op), dst, true);
+        dword(imm);
+    }
+}
+
+void Emitter::alu64(Alu op, Reg dst, Reg src) {
+    op_rr({static_cast<u8>(static_cast<u8>(op) * 8 + 1)}, code(src), dst, true);
+}
+
+void Emitter::imul(Reg dst, Reg src) {
+    op_rr({0x0F, 0xAF}, code(dst), src);
+}
+
+void Emitter::imul(Reg dst, const Mem& src) {
+    op_rm({0x0F, 0xAF}, code(dst), src);
+}
+
+void Emitter::imul(Reg dst, Reg src, u32 imm) {
+    if (fits_s8(static_cast<s32>(imm))) {
+        op_rr({0x6B}, code(dst), src);
+        byte(static_cast<u8>(imm));
+    } else {
+        op_rr({0x69}, code(dst), src);
+        dword(imm);
+    }
+}
+
+void Emitter::not_(Reg reg) {
+    op_rr({0xF7}, 2, reg);
+}
+
+void Emitter::shift(Shift op, Reg reg, u8 amount) {
+    op_rr({0xC1}, static_cast<u8>(op), reg);
+    byte(amount);
+}
+
+void Emitter::shift_cl(Shift op, Reg reg) {
+    op_rr({0xD3}, static_cast<u8>(op), reg);
+}
+
+void Emitter::shift64(Shift op, Reg reg, u8 amount) {
+    op_rr({0xC1}, static_cast<u8>(op), reg, true);
+    byte(amount);
+}
+
+void Emitter::shld(Reg dst, Reg src, u8 amount) {
+    op_rr({0x0F, 0xA4}, code(src), dst);
+    byte(amount);
+}
+
+void Emitter::shrd(Reg dst, Reg src, u8 amount) {
+    op_rr({0x0F, 0xAC}, code(src), dst);
+    byte(amount);
+}
+
+void Emitter::test(Reg a, Reg b) {
+    op_rr({0x85}, code(b), a);
+}
+
+void Emitter::test8(const Mem& m, u8 imm) {
+    op_rm({0xF6}, 0, m);
+    byte(imm);
+}
+
+void Emitter::cmp8(const Mem& m, u8 imm) {
+    op_rm({0x80}, 7, m);
+    byte(imm);
+}
+
+void Emitter::setcc(Cond cond, Reg dst) {
+    op_rr({0x0F, static_cast<u8>(0x90 + static_cast<u8>(cond))}, 0, dst, false, true);
+}
+
+void Emitter::setcc(Cond cond, const Mem& dst) {
+    op_rm({0x0F, static_cast<u8>(0x90 + static_cast<u8>(cond))}, 0, dst);
+}
+
+void Emitter::cmov(Cond cond, Reg dst, Reg src) {
+    op_rr({0x0F, static_cast<u8>(0x40 + static_cast<u8>(cond))}, code(dst), src);
+}
+
+void Emitter::cmov(Cond cond, Reg dst, const Mem& src) {
+    op_rm({0x0F, static_cast<u8>(0x40 + static_cast<u8>(cond))}, code(dst), src);
+}
+
+void Emitter::jmp(Label& label) {
+    byte(0xE9);
+    rel32(label);
+}
+
+void Emitter::jmp(const u8* target) {
+    byte(0xE9);
+    rel32(target);
+}
+
+void Emitter::jcc(Cond cond, Label& label) {
+    byte(0x0F);
+    byte(0x80 + static_cast<u8>(cond));
+    rel32(label);
+}
+
+void Emitter::jcc(Cond cond, const u8* target) {
+    byte(0x0F);
+    byte(0x80 + static_cast<u8>(cond));
+    rel32(target);
+}
+
+void Emitter::jmp(Reg target) {
+    op_rr({0xFF}, 4, target);
+}
+
+void Emitter::call(Reg target) {
+    op_rr({0xFF}, 2, target);
+}
+
+void Emitter::push(Reg reg) {
+    rex(false, 0, 0, code(reg));
+    byte(0x50 + (code(reg) & 7));
+}
+
+void Emitter::pop(Reg reg) {
+    rex(false, 0, 0, code(reg));
+    byte(0x58 + (code(reg) & 7));
+}
+
+void Emitter::ret() {
+    byte(0xC3);
+}
+
+void Emitter::int3() {
+    byte(0xCC);
+}
+
+}
@@ -0,0 +1,153 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#pragma once
+
+#include <initializer_list>
+#include <vector>
+#include "common/common_types.hpp"
+
+// A minimal x86-64 assembler covering only what the JIT emits.
+
+namespace stamina::x64 {
+
+enum class Reg : u8 {
+    rax, rcx, rdx, rbx, rsp, rbp, rsi, rdi,
+    r8, r9, r10, r11, r12, r13, r14, r15,
+};
+
+// Condition codes in x86 encoding order.
+enum class Cond : u8 {
+    O, NO, B, AE, E, NE, BE, A, S, NS, P, NP, L, GE, LE, G,
+};
+
+inline constexpr Cond invert(Cond cond) {
+    return static_cast<Cond>(static_cast<u8>(cond) ^ 1);
+}
+
+// Memory operand [base + index + disp]
+struct Mem {
+    Reg base;
+    s32 disp = 0;
+    bool has_index = false;
+    Reg index = Reg::rax;
+
+    Mem(Reg base, s32 disp) : base(base), disp(disp) {}
+    Mem(Reg base, Reg index, s32 disp) : base(base), disp(disp), has_index(true), index(index) {}
+};
+
+// A position in the code stream that jumps can target before it is bound.
+struct Label {
+    u8* target = nullptr;
+    std::vector<u8*> fixups;
+};
+
+enum class Alu : u8 {
+    Add = 0,
+    Or = 1,
+    And = 4,
+    Sub = 5,
+    Xor = 6,
+    Cmp = 7,
+};
+
+enum class Shift : u8 {
+    Rol = 0,
+    Ror = 1,
+    Shl = 4,
+    Shr = 5,
+    Sar = 7,
+};
+
+// Writes machine code into [begin, end). Emission past the end sets overflowed() and discards the bytes.
+struct Emitter final {
+public:
+    Emitter(u8* begin, u8* end) : begin(begin), end(end), cursor(begin) {}
+
+    u8* position() const { return cursor; }
+    size_t size() const { return static_cast<size_t>(cursor - begin); }
+    bool overflowed() const { return overflow; }
+
+    void bind(Label& label);
+    // Pads with int3 up to a multiple of alignment.
+    void align(size_t alignment);
+
+    // Data movement
+    void mov(Reg dst, Reg src);                  // 32-bit
+    void mov(Reg dst, const Mem& src);           // 32-bit
+    void mov(const Mem& dst, Reg src);           // 32-bit
+    void mov(const Mem& dst, u32 imm);           // 32-bit
+    void mov(Reg dst, u32 imm);                  // 32-bit, zero-extends
+    void mov64(Reg dst, Reg src);
+    void mov64(Reg dst, const Mem& src);
+    void mov64(const Mem& dst, Reg src);
+    void mov64(Reg dst, u64 imm);
+    void movzx8(Reg dst, const Mem& src);
+    void movzx16(Reg dst, const Mem& src);
+    void movzx8(Reg dst, Reg src);
+    void mov8(const Mem& dst, Reg src);
+    void mov8(const Mem& dst, u8 imm);
+    void mov16(const Mem& dst, Reg src);
+    void lea(Reg dst, const Mem& src);           // 32-bit result
+    void lea64(Reg dst, const Mem& src);
+    void lea64(Reg dst, Label& label);           // RIP-relative
+
+    // Arithmetic, 32-bit unless suffixed
+    void alu(Alu op, Reg dst, Reg src);
+    void alu(Alu op, Reg dst, const Mem& src);
+    void alu(Alu op, Reg dst, u32 imm);
+    void alu(Alu op, const Mem& dst, u32 imm);
+    void alu64(Alu op, Reg dst, u32 imm);
+    void alu64(Alu op, const Mem& dst, u32 imm);
+    void alu64(Alu op, Reg dst, Reg src);
+    void imul(Reg dst, Reg src);
+    void imul(Reg dst, const Mem& src);
+    void imul(Reg dst, Reg src, u32 imm);
+    void not_(Reg reg);
+    void shift(Shift op, Reg reg, u8 amount);
+    void shift_cl(Shift op, Reg reg);
+    void shift64(Shift op, Reg reg, u8 amount);
+    void shld(Reg dst, Reg src, u8 amount);
+    void shrd(Reg dst, Reg src, u8 amount);
+    void test(Reg a, Reg b);
+    void test8(const Mem& m, u8 imm);
+    void cmp8(const Mem& m, u8 imm);
+    void setcc(Cond cond, Reg dst);
+    void setcc(Cond cond, const Mem& dst);
+    void cmov(Cond cond, Reg dst, Reg src);
+    void cmov(Cond cond, Reg dst, const Mem& src);
+
+    // Control flow
+    void jmp(Label& label);
+    void jmp(const u8* target);
+    void jcc(Cond cond, Label& label);
+    void jcc(Cond cond, const u8* target);
+    void jmp(Reg target);
+    void call(Reg target);
+    void push(Reg reg);
+    void pop(Reg reg);
+    void ret();
+    void int3();
+
+    // Rewrites the rel32 of a jmp or jcc ending at next_instruction.
+    static void patch_rel32(u8* next_instruction, const u8* target);
+
+private:
+    void byte(u8 value);
+    void dword(u32 value);
+    void qword(u64 value);
+    void rex(bool w, u8 reg, u8 index, u8 base, bool force = false);
+    void modrm(u8 reg, const Mem& m);
+    void op_rm(std::initializer_list<u8> opcode, u8 reg, const Mem& m, bool w = false, bool byte_reg = false);
+    void op_rr(std::initializer_list<u8> opcode, u8 reg, Reg rm, bool w = false, bool byte_reg = false);
+    void rel32(const u8* target);
+    void rel32(Label& label);
+
+    u8* begin;
+    u8* end;
+    u8* cursor;
+    bool overflow = false;
+};
+
+}
@@ -0,0 +1,1382 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <utility>
+#include <vector>
+#include <fmt/format.h>
+#include "common/assert.hpp"
+#include "stamina/interpreter.hpp"
+#include "stamina/ir/ir.hpp"
+#include "stamina/ir/passes.hpp"
+#include "stamina/mmu.hpp"
+#include "stamina/semantics.hpp"
+#include "stamina/x64/emitter.hpp"
+#include "stamina/x64/jit.hpp"
+
+#if !defined(STAMINA_HAS_FASTMEM)
+    #error "the x86-64 recompiler needs host-mapped guest memory"
+#endif
+
+namespace stamina::x64 {
+
+static_assert(static_cast<u32>(Step::Continue) == static_cast<u32>(JitExit::Continue));
+static_assert(static_cast<u32>(Step::Halt) == static_cast<u32>(JitExit::Halt));
+static_assert(static_cast<u32>(Step::MemoryFault) == static_cast<u32>(JitExit::MemoryFault));
+static_assert(static_cast<u32>(Step::Wait) == static_cast<u32>(JitExit::Wait));
+static_assert(static_cast<u32>(Step::Submit) == static_cast<u32>(JitExit::Submit));
+
+namespace {
+
+// Fixed host registers while translated code runs
+constexpr Reg state_reg = Reg::rbx;
+constexpr Reg guest_base_reg = Reg::rbp;
+constexpr Reg context_reg = Reg::r12;
+
+Mem gpr(u32 index) {
+    return Mem{state_reg, static_cast<s32>(offsetof(CpuState, gpr) + index * 4)};
+}
+
+Mem cr(u32 index) {
+    return Mem{state_reg, static_cast<s32>(offsetof(CpuState, cr) + index * 4)};
+}
+
+Mem ur(u32 index) {
+    return Mem{state_reg, static_cast<s32>(offsetof(CpuState, ur) + index * 4)};
+}
+
+Mem pc_mem() {
+    return Mem{state_reg, static_cast<s32>(offsetof(CpuState, pc))};
+}
+
+Mem t_mem() {
+    return Mem{state_reg, static_cast<s32>(offsetof(CpuState, t))};
+}
+
+Mem context(size_t offset) {
+    return Mem{context_reg, static_cast<s32>(offset)};
+}
+
+Mem tlb_field(Reg index, size_t field) {
+    return Mem{state_reg, index, static_cast<s32>(offsetof(CpuState, tlb) + field)};
+}
+
+// TLB misses from translated code. On a fault these set FaultAddress; load_slow then sets bit 32 of
+// its result and store_slow returns nonzero.
+u64 load_slow(CpuState* state, const Memory* memory, u32 address, u32 size) {
+    bool ok;
+    u32 value = 0;
+    if (size == 4) {
+        ok = read_virtual(*state, *memory, address, value);
+    } else if (size == 2) {
+        u16 half;
+        ok = read_virtual(*state, *memory, address, half);
+        value = half;
+    } else {
+        u8 byte;
+        ok = read_virtual(*state, *memory, address, byte);
+        value = byte;
+    }
+    if (!ok) {
+        state->control(ControlRegister::FaultAddress) = address;
+        return u64{1} << 32;
+    }
+    return value;
+}
+
+u32 store_slow(CpuState* state, Memory* memory, u32 address, u32 value, u32 size) {
+    bool ok;
+    if (size == 4) {
+        ok = write_virtual(*state, *memory, address, value);
+    } else if (size == 2) {
+        ok = write_virtual(*state, *memory, address, static_cast<u16>(value));
+    } else {
+        ok = write_virtual(*state, *memory, address, static_cast<u8>(value));
+    }
+    if (!ok) {
+        state->control(ControlRegister::FaultAddress) = address;
+        return 1;
+    }
+    return 0;
+}
+
+// Returns the shadow call stack does not predict
+void shadow_return(ShadowCallStack* stack, u32 target) {
+    stack->ret(target);
+}
+
+constexpr Cond compare_condition(ir::Op op) {
+    switch (op) {
+    case ir::Op::CmpEq:
+        return Cond::E;
+    case ir::Op::CmpLo:
+        return Cond::B;
+    case ir::Op::CmpLs:
+        return Cond::BE;
+    case ir::Op::CmpLt:
+        return Cond::L;
+    default:
+        return Cond::LE;
+    }
+}
+
+// Where each IR value lives while the block runs. Constants are rematerialized at each use;
+// other values get a host register, or a spill slot in the JitContext if none is free.
+struct Locations {
+    struct Location {
+        enum class Kind : u8 {
+            None,
+            Constant,
+            Register,
+            Spill,
+        };
+        Kind kind = Kind::None;
+        Reg reg = Reg::rax;
+        u32 value = 0;
+    };
+
+    const ir::Block& block;
+    std::vector<Location> at;
+    std::vector<u32> uses;
+
+    explicit Locations(const ir::Block& block);
+
+    bool used(size_t v) const { return uses[v] > 0; }
+    bool is_constant(ir::Value v) const { return at[v].kind == Location::Kind::Constant; }
+    u32 constant(ir::Value v) const { return at[v].value; }
+
+    Mem spill(ir::Value v) const {
+        return context(offsetof(JitContext, spill) + at[v].value * 4);
+    }
+
+    void load(Emitter& e, Reg dst, ir::Value v) const {
+        const Location& l = at[v];
+        switch (l.kind) {
+        case Location::Kind::Constant:
+            e.mov(dst, l.value);
+            break;
+        case Location::Kind::Register:
+            if (l.reg != dst) {
+                e.mov(dst, l.reg);
+            }
+            break;
+        case Location::Kind::Spill:
+            e.mov(dst, spill(v));
+            break;
+        case Location::Kind::None:
+            UNREACHABLE();
+        }
+    }
+
+    void store(Emitter& e, ir::Value v, Reg src) const {
+        const Location& l = at[v];
+        if (l.kind == Location::Kind::Register) {
+            e.mov(l.reg, src);
+        } else {
+            ASSERT(l.kind == Location::Kind::Spill);
+            e.mov(spill(v), src);
+        }
+    }
+
+    // dst = dst <op> v
+    void alu(Emitter& e, Alu op, Reg dst, ir::Value v) const {
+        const Location& l = at[v];
+        switch (l.kind) {
+        case Location::Kind::Constant:
+            e.alu(op, dst, l.value);
+            break;
+        case Location::Kind::Register:
+            e.alu(op, dst, l.reg);
+            break;
+        case Location::Kind::Spill:
+            e.alu(op, dst, spill(v));
+            break;
+        case Location::Kind::None:
+            UNREACHABLE();
+        }
+    }
+
+    // Writes v to the guest state at dst.
+    void write(Emitter& e, const Mem& dst, ir::Value v) const {
+        const Location& l = at[v];
+        if (l.kind == Location::Kind::Constant) {
+            e.mov(dst, l.value);
+        } else if (l.kind == Location::Kind::Register) {
+            e.mov(dst, l.reg);
+        } else {
+            load(e, Reg::rax, v);
+            e.mov(dst, Reg::rax);
+        }
+    }
+};
+
+Locations::Locations(const ir::Block& block) : block(block), at(block.insts.size()), uses(block.insts.size()) {
+    // Registers free for values; rax, rcx and rdx are scratch. Only the callee-saved ones survive handler calls.
+    static constexpr std::array caller_saved{Reg::rsi, Reg::rdi, Reg::r8, Reg::r9, Reg::r10, Reg::r11};
+    static constexpr std::array callee_saved{Reg::r13, Reg::r14, Reg::r15};
+
+    const size_t end = block.insts.size();
+    std::vector<size_t> last_use(end, 0);
+    std::vector<size_t> calls;
+    for (size_t i = 0; i < end; i++) {
+        const ir::Inst& inst = block.insts[i];
+        for (const ir::Value arg : inst.args) {
+            if (arg != ir::no_value) {
+                uses[arg]++;
+                last_use[arg] = i;
+            }
+        }
+        if (inst.op == ir::Op::CallHandler) {
+            calls.push_back(i);
+        }
+    }
+    if (block.exit_target != ir::no_value) {
+        uses[block.exit_target]++;
+        last_use[block.exit_target] = end;
+    }
+
+    struct Active {
+        size_t last_use;
+        Location location;
+    };
+    std::vector<Active> active;
+    std::array<bool, 16> register_busy{};
+    std::array<bool, JitContext::spill_slots> slot_busy{};
+
+    for (size_t i = 0; i < end; i++) {
+        // A result may reuse the location of an argument that dies here: arguments are read before results are written
+        std::erase_if(active, [&](const Active& a) {
+            if (a.last_use > i) {
+                return false;
+            }
+            if (a.location.kind == Location::Kind::Register) {
+                register_busy[static_cast<size_t>(a.location.reg)] = false;
+            } else {
+                slot_busy[a.location.value] = false;
+            }
+            return true;
+        });
+
+        const ir::Inst& inst = block.insts[i];
+        if (!ir::has_value(inst.op) || !used(i)) {
+            continue;
+        }
+        if (inst.op == ir::Op::Const) {
+            at[i] = Location{Location::Kind::Constant, Reg::rax, inst.imm};
+            continue;
+        }
+
+        const bool crosses_call = std::any_of(calls.begin(), calls.end(), [&](size_t c) { return c > i && c < last_use[i]; });
+        const auto take = [&](const auto& pool) -> std::optional<Location> {
+            for (const Reg reg : pool) {
+                if (!register_busy[static_cast<size_t>(reg)]) {
+                    register_busy[static_cast<size_t>(reg)] = true;
+                    return Location{Location::Kind::Register, reg, 0};
+                }
+            }
+            return std::nullopt;
+        };
+
+        std::optional<Location> location = crosses_call ? std::nullopt : take(caller_saved);
+        if (!location) {
+            location = take(callee_saved);
+        }
+        if (!location) {
+            const auto slot = std::find(slot_busy.begin(), slot_busy.end(), false);
+            ASSERT_MSG(slot != slot_busy.end(), "out of spill slots");
+            *slot = true;
+            location = Location{Location::Kind::Spill, Reg::rax, static_cast<u32>(slot - slot_busy.begin())};
+        }
+        at[i] = *location;
+        active.push_back(Active{last_use[i], *location});
+    }
+}
+
+// Emits the pure operation or register write at index i. Clobbers rax, rcx and rdx.
+// Memory accesses and handler calls are emitted by Jit::compile.
+void emit_inst(Emitter& e, const Locations& l, const ir::Inst& inst, ir::Value i) {
+    using ir::Op;
+    auto [a, b, c] = inst.args;
+
+    // Compute straight into the result's register unless that would overwrite the second argument first
+    const bool in_register = l.at[i].kind == Locations::Location::Kind::Register;
+    const auto aliases = [&](ir::Value v) {
+        return v != ir::no_value && l.at[v].kind == Locations::Location::Kind::Register && l.at[v].reg == l.at[i].reg;
+    };
+    const bool commutative = inst.op == Op::Add || inst.op == Op::Mul || inst.op == Op::And || inst.op == Op::Or || inst.op == Op::Xor;
+    if (in_register && commutative && aliases(b)) {
+        std::swap(a, b);
+    }
+    const Reg dst = in_register && !aliases(b) ? l.at[i].reg : Reg::rax;
+    const auto finish = [&] {
+        if (dst == Reg::rax) {
+            l.store(e, i, Reg::rax);
+        }
+    };
+
+    switch (inst.op) {
+    case Op::Nop:
+    case Op::Const:
+        return;
+    case Op::Load:
+    case Op::Store:
+    case Op::CallHandler:
+        UNREACHABLE();
+
+    case Op::GetReg:
+    case Op::GetCr:
+    case Op::GetUr:
+        e.mov(dst, inst.op == Op::GetReg ? gpr(inst.index) : inst.op == Op::GetCr ? cr(inst.index) : ur(inst.index));
+        finish();
+        return;
+    case Op::GetT:
+        e.movzx8(dst, t_mem());
+        finish();
+        return;
+
+    case Op::Add:
+    case Op::Sub:
+    case Op::And:
+    case Op::Or:
+    case Op::Xor: {
+        const Alu alu = inst.op == Op::Add ? Alu::Add : inst.op == Op::Sub ? Alu::Sub : inst.op == Op::And ? Alu::And : inst.op == Op::Or ? Alu::Or : Alu::Xor;
+        l.load(e, dst, a);
+        l.alu(e, alu, dst, b);
+        finish();
+        return;
+    }
+    case Op::Mul:
+        if (l.is_constant(b)) {
+            l.load(e, Reg::rcx, a);
+            e.imul(dst, Reg::rcx, l.constant(b));
+        } else {
+            l.load(e, Reg::rcx, b);
+            l.load(e, dst, a);
+            e.imul(dst, Reg::rcx);
+        }
+        finish();
+        return;
+    case Op::Not:
+        l.load(e, dst, a);
+        e.not_(dst);
+        finish();
+        return;
+    case Op::Shl:
+    case Op::Lshr:
+    case Op::Ashr:
+    case Op::Ror: {
+        constexpr Shift shifts[] = {Shift::Shl, Shift::Shr, Shift::Sar, Shift::Ror};
+        const Shift shift = shifts[static_cast<size_t>(inst.op) - static_cast<size_t>(Op::Shl)];
+        if (l.is_constant(b)) {
+            l.load(e, dst, a);
+            e.shift(shift, dst, static_cast<u8>(l.constant(b) & 31));
+        } else {
+            // x86 masks the count to five bits, as the IR does
+            l.load(e, Reg::rcx, b);
+            l.load(e, dst, a);
+            e.shift_cl(shift, dst);
+        }
+        finish();
+        return;
+    }
+    case Op::CmpEq:
+    case Op::CmpLo:
+    case Op::CmpLs:
+    case Op::CmpLt:
+    case Op::CmpLe:
+        l.load(e, Reg::rax, a);
+        l.alu(e, Alu::Cmp, Reg::rax, b);
+        e.setcc(compare_condition(inst.op), Reg::rax);
+        e.movzx8(dst, Reg::rax);
+        finish();
+        return;
+    case Op::Select:
+        if (l.is_constant(a)) {
+            l.load(e, Reg::rax, l.constant(a) != 0 ? b : c);
+        } else {
+            l.load(e, Reg::rax, c);
+            l.load(e, Reg::rcx, b);
+            l.load(e, Reg::rdx, a);
+            e.test(Reg::rdx, Reg::rdx);
+            e.cmov(Cond::NE, Reg::rax, Reg::rcx);
+        }
+        l.store(e, i, Reg::rax);
+        return;
+
+    case Op::SetReg:
+        l.write(e, gpr(inst.index), a);
+        return;
+    case Op::SetUr:
+        l.write(e, ur(inst.index), a);
+        return;
+    case Op::SetT:
+        if (l.is_constant(a)) {
+            e.mov8(t_mem(), static_cast<u8>(l.constant(a) != 0));
+        } else {
+            l.load(e, Reg::rax, a);
+            e.mov8(t_mem(), Reg::rax);
+        }
+        return;
+    }
+    UNREACHABLE();
+}
+
+}
+
+Jit::Jit(size_t code_cache_size, const ir::Options& options, const Tiering& tiering)
+    : cache(code_cache_size), options(options), tiering(tiering), interpreter(options) {
+    flush_lookup_tables();
+    if (cache.valid()) {
+        emit_prelude();
+        for (u32 i = 0; i < tiering.workers; i++) {
+            workers.emplace_back([this] { translation_worker(); });
+        }
+    }
+}
+
+Jit::~Jit() {
+    {
+        const std::lock_guard lock{queue_mutex};
+        stopping = true;
+    }
+    queue_changed.notify_all();
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    for (Translation* translation = finished.load(); translation;) {
+        delete std::exchange(translation, translation->next);
+    }
+}
+
+void Jit::emit_prelude() {
+    Emitter e{cache.free_begin(), cache.end()};
+
+    // u32 enter(JitContext* context, const u8* code)
+    enter = reinterpret_cast<EntryFn>(e.position());
+    for (const Reg reg : {Reg::rbx, Reg::rbp, Reg::r12, Reg::r13, Reg::r14, Reg::r15}) {
+        e.push(reg);
+    }
+    // Keep the stack 16-byte aligned for handler calls
+    e.alu64(Alu::Sub, Reg::rsp, 8);
+    e.mov64(context_reg, Reg::rdi);
+    e.mov64(state_reg, context(offsetof(JitContext, state)));
+    e.mov64(guest_base_reg, context(offsetof(JitContext, guest_base)));
+    e.jmp(Reg::rsi);
+
+    // Translated code jumps here with the JitExit in eax
+    exit = e.position();
+    e.alu64(Alu::Add, Reg::rsp, 8);
+    for (const Reg reg : {Reg::r15, Reg::r14, Reg::r13, Reg::r12, Reg::rbp, Reg::rbx}) {
+        e.pop(reg);
+    }
+    e.ret();
+
+    dispatcher_exit = e.position();
+    e.mov(Reg::rax, static_cast<u32>(JitExit::Continue));
+    e.jmp(exit);
+
+    ASSERT(!e.overflowed());
+    cache.commit(e.position());
+    prelude_end = e.position();
+}
+
+// Links are patched to their targets when the block is installed
+void Jit::emit_link(Emitter& e, u32 target, std::vector<LinkSite>& exits) {
+    e.jmp(dispatcher_exit);
+    exits.push_back(LinkSite{target, e.position()});
+}
+
+// Jumps to the translation of the guest PC in eax, or to the dispatcher if the jump table misses.
+void Jit::emit_indirect_exit(Emitter& e) {
+    static_assert(sizeof(JumpTableEntry) == 16 && offsetof(JumpTableEntry, code) == 8);
+    constexpr u32 index_mask = (fast_lookup_size - 1) << 4;
+
+    // The table is indexed by (pc >> 2) % fast_lookup_size, scaled by the entry size
+    e.mov(Reg::rcx, Reg::rax);
+    e.shift(Shift::Shl, Reg::rcx, 2);
+    e.alu(Alu::And, Reg::rcx, index_mask);
+    e.mov64(Reg::rdx, reinterpret_cast<u64>(jump_table.data()));
+    e.alu(Alu::Cmp, Reg::rax, Mem{Reg::rdx, Reg::rcx, 0});
+    e.jcc(Cond::NE, dispatcher_exit);
+    e.mov64(Reg::rcx, Mem{Reg::rdx, Reg::rcx, 8});
+    e.jmp(Reg::rcx);
+}
+
+// Records that the block returns to return_pc through return_site. Preserves eax.
+void Jit::emit_return_stack_push(Emitter& e, Label& return_site, u32 return_pc) {
+    const s32 top = static_cast<s32>(offsetof(ReturnStack, top));
+    const s32 entries = static_cast<s32>(offsetof(ReturnStack, entries));
+
+    e.mov64(Reg::rdx, reinterpret_cast<u64>(&return_stack));
+    e.mov(Reg::rcx, Mem{Reg::rdx, top});
+    e.alu(Alu::Add, Reg::rcx, 1);
+    e.alu(Alu::And, Reg::rcx, return_stack_size - 1);
+    e.mov(Mem{Reg::rdx, top}, Reg::rcx);
+    e.shift(Shift::Shl, Reg::rcx, 4);
+    e.mov(Mem{Reg::rdx, Reg::rcx, entries}, return_pc);
+    e.lea64(Reg::rsi, return_site);
+    e.mov64(Mem{Reg::rdx, Reg::rcx, entries + 8}, Reg::rsi);
+}
+
+// Pushes a frame for a call from the block to the guest PC in eax onto the shadow call stack, as
+// ShadowCallStack::call does. Preserves eax.
+void Jit::emit_shadow_call(Emitter& e, u32 return_pc) {
+    const s32 frames = static_cast<s32>(offsetof(ShadowCallStack, frames));
+    const s32 depth = static_cast<s32>(offsetof(ShadowCallStack, depth));
+    Label unrecorded;
+    Label detached;
+
+    e.mov64(Reg::rdx, Mem{state_reg, static_cast<s32>(offsetof(CpuState, call_stack))});
+    e.alu64(Alu::Cmp, Reg::rdx, 0);
+    e.jcc(Cond::E, detached);
+    e.mov64(Reg::rcx, Mem{Reg::rdx, depth});
+    e.alu64(Alu::Cmp, Reg::rcx, ShadowCallStack::max_depth);
+    e.jcc(Cond::AE, unrecorded);
+    e.shift64(Shift::Shl, Reg::rcx, 3);
+    e.mov(Mem{Reg::rdx, Reg::rcx, frames + static_cast<s32>(offsetof(ShadowCallStack::Frame, target))}, Reg::rax);
+    e.mov(Mem{Reg::rdx, Reg::rcx, frames + static_cast<s32>(offsetof(ShadowCallStack::Frame, return_address))}, return_pc);
+    e.bind(unrecorded);
+    e.alu64(Alu::Add, Mem{Reg::rdx, depth}, 1);
+    e.bind(detached);
+}
+
+// Pops the innermost shadow call stack frame if it returns to the guest PC in eax, and otherwise
+// calls ShadowCallStack::ret. Preserves eax.
+void Jit::emit_shadow_return(Emitter& e) {
+    const s32 frames = static_cast<s32>(offsetof(ShadowCallStack, frames));
+    const s32 depth = static_cast<s32>(offsetof(ShadowCallStack, depth));
+    Label slow;
+    Label done;
+
+    e.mov64(Reg::rdx, Mem{state_reg, static_cast<s32>(offsetof(CpuState, call_stack))});
+    e.alu64(Alu::Cmp, Reg::rdx, 0);
+    e.jcc(Cond::E, done);
+    // Unsigned, so an empty stack also takes the slow path
+    e.mov64(Reg::rcx, Mem{Reg::rdx, depth});
+    e.alu64(Alu::Sub, Reg::rcx, 1);
+    e.alu64(Alu::Cmp, Reg::rcx, ShadowCallStack::max_depth);
+    e.jcc(Cond::AE, slow);
+    e.mov64(Reg::rsi, Reg::rcx);
+    e.shift64(Shift::Shl, Reg::rsi, 3);
+    e.alu(Alu::Cmp, Reg::rax, Mem{Reg::rdx, Reg::rsi, frames + static_cast<s32>(offsetof(ShadowCallStack::Frame, return_address))});
+    e.jcc(Cond::NE, slow);
+    e.mov64(Mem{Reg::rdx, depth}, Reg::rcx);
+    e.jmp(done);
+
+    // shadow_return(ShadowCallStack*, u32 target); two pushes keep the stack aligned for the call
+    e.bind(slow);
+    e.push(Reg::rax);
+    e.push(Reg::rax);
+    e.mov64(Reg::rdi, Reg::rdx);
+    e.mov(Reg::rsi, Reg::rax);
+    e.mov64(Reg::rax, reinterpret_cast<u64>(&shadow_return));
+    e.call(Reg::rax);
+    e.pop(Reg::rax);
+    e.pop(Reg::rax);
+    e.bind(done);
+}
+
+// Pops the return address stack and jumps to its return site if it predicted the guest PC in eax.
+// Mispredictions fall back to the jump table.
+void Jit::emit_return_stack_pop(Emitter& e) {
+    const s32 top = static_cast<s32>(offsetof(ReturnStack, top));
+    const s32 entries = static_cast<s32>(offsetof(ReturnStack, entries));
+    Label mispredicted;
+
+    e.mov64(Reg::rdx, reinterpret_cast<u64>(&return_stack));
+    e.mov(Reg::rcx, Mem{Reg::rdx, top});
+    e.lea(Reg::rsi, Mem{Reg::rcx, -1});
+    e.alu(Alu::And, Reg::rsi, return_stack_size - 1);
+    e.mov(Mem{Reg::rdx, top}, Reg::rsi);
+    e.shift(Shift::Shl, Reg::rcx, 4);
+    e.alu(Alu::Cmp, Reg::rax, Mem{Reg::rdx, Reg::rcx, entries});
+    e.jcc(Cond::NE, mispredicted);
+    e.mov64(Reg::rcx, Mem{Reg::rdx, Reg::rcx, entries + 8});
+    e.jmp(Reg::rcx);
+
+    e.bind(mispredicted);
+    emit_indirect_exit(e);
+}
+
+const u8* Jit::compile(JitBlock& jit_block, const ir::Block& ir, bool paging, std::vector<fastmem::Fixup>& new_fixups) {
+    const DecodedBlock& block = jit_block.decoded;
+    std::vector<LinkSite>& exits = jit_block.exits;
+    const Locations locations{ir};
+
+    Emitter e{cache.free_begin(), cache.end()};
+    e.align(16);
+    const u8* const code = e.position();
+    const u32 length = ir.guest_length;
+    exits.clear();
+
+    // Handler calls jump to their stub with the Step in eax. Memory accesses get there through the
+    // fault handler from the access at site, with the guest address in ecx.
+    struct Stub {
+        Label label;
+        u32 unretired;
+        const u8* site = nullptr;
+        u32 pc = 0;
+    };
+    std::vector<Stub> fault_stubs;
+    fault_stubs.reserve(length);
+
+    // Stores outside translated code leave the block after their instruction if they recorded a
+    // code write, as the rest of the block and the blocks linked from it may be stale
+    struct CodeWriteExit {
+        Label label;
+        u32 unretired;
+        u32 next_pc;
+    };
+    std::vector<CodeWriteExit> code_write_exits;
+    code_write_exits.reserve(length);
+    const auto emit_code_write_check = [&](const ir::Inst& inst) {
+        code_write_exits.push_back(CodeWriteExit{{}, length - inst.guest_index - 1u, ir.pc_of(inst) + 4});
+        e.mov64(Reg::rcx, context(offsetof(JitContext, code_writes)));
+        e.mov64(Reg::rcx, Mem{Reg::rcx, 0});
+        e.mov64(Reg::rdx, context(offsetof(JitContext, code_writes_seen)));
+        e.alu64(Alu::Cmp, Reg::rcx, Reg::rdx);
+        e.jcc(Cond::NE, code_write_exits.back().label);
+    };
+
+    // With paging, accesses probe the TLB inline and call into the MMU out of line on a miss
+    struct SlowAccess {
+        Label slow;
+        Label done;
+        const ir::Inst* inst;
+        Reg dst;
+        bool store;
+    };
+    std::vector<SlowAccess> slow_accesses;
+    slow_accesses.reserve(ir.insts.size());
+    // With the virtual address in ecx, returns the host address of its physical address. Clobbers eax and edx.
+    const auto emit_tlb_lookup = [&](const ir::Inst& inst, Reg dst, bool store) {
+        static_assert(sizeof(TlbEntry) == 16);
+        slow_accesses.push_back(SlowAccess{{}, {}, &inst, dst, store});
+        e.mov(Reg::rdx, Reg::rcx);
+        e.shift(Shift::Shr, Reg::rdx, page_bits - 4);
+        e.alu(Alu::And, Reg::rdx, (tlb_size - 1) << 4);
+        e.mov(Reg::rax, Reg::rcx);
+        e.alu(Alu::And, Reg::rax, page_mask | (inst.imm - 1));
+        e.alu(Alu::Cmp, Reg::rax, tlb_field(Reg::rdx, store ? offsetof(TlbEntry, write_tag) : offsetof(TlbEntry, read_tag)));
+        e.jcc(Cond::NE, slow_accesses.back().slow);
+        e.mov(Reg::rdx, tlb_field(Reg::rdx, offsetof(TlbEntry, offset)));
+        e.alu(Alu::Add, Reg::rdx, Reg::rcx);
+        return Mem{guest_base_reg, Reg::rdx, 0};
+    };
+    Label budget_exhausted;
+    Label return_site;
+
+    // Charge the whole block up front
+    e.alu64(Alu::Sub, context(offsetof(JitContext, cycles_remaining)), length);
+    e.jcc(Cond::L, budget_exhausted);
+#if defined(STAMINA_HAS_INSTRUCTION_COUNTS)
+    e.mov64(Reg::rcx, reinterpret_cast<u64>(&jit_block.executions));
+    e.alu64(Alu::Add, Mem{Reg::rcx, 0}, 1);
+#endif
+
+    for (size_t i = 0; i < ir.insts.size(); i++) {
+        const ir::Inst& inst = ir.insts[i];
+        if (ir::is_pure(inst.op) && !locations.used(i)) {
+            continue;
+        }
+
+        switch (inst.op) {
+        case ir::Op::Load: {
+            const Reg dst = locations.at[i].kind == Locations::Location::Kind::Register ? locations.at[i].reg : Reg::rax;
+            locations.load(e, Reg::rcx, inst.args[0]);
+            const Mem address = paging ? emit_tlb_lookup(inst, dst, false) : Mem{guest_base_reg, Reg::rcx, 0};
+            fault_stubs.push_back(Stub{{}, length - inst.guest_index, e.position(), ir.pc_of(inst)});
+            if (inst.imm == 4) {
+                e.mov(dst, address);
+            } else if (inst.imm == 2) {
+                e.movzx16(dst, address);
+            } else {
+                e.movzx8(dst, address);
+            }
+            if (paging) {
+                e.bind(slow_accesses.back().done);
+            }
+            if (dst == Reg::rax && locations.used(i)) {
+                locations.store(e, static_cast<ir::Value>(i), Reg::rax);
+            }
+            break;
+        }
+        case ir::Op::Store: {
+            locations.load(e, Reg::rcx, inst.args[0]);
+            const Mem address = paging ? emit_tlb_lookup(inst, Reg::rax, true) : Mem{guest_base_reg, Reg::rcx, 0};
+            locations.load(e, Reg::rax, inst.args[1]);
+            fault_stubs.push_back(Stub{{}, length - inst.guest_index, e.position(), ir.pc_of(inst)});
+            if (inst.imm == 4) {
+                e.mov(address, Reg::rax);
+            } else if (inst.imm == 2) {
+                e.mov16(address, Reg::rax);
+            } else {
+                e.mov8(address, Reg::rax);
+            }
+            if (paging) {
+                e.bind(slow_accesses.back().done);
+            }
+            break;
+        }
+        case ir::Op::CallHandler:
+            // Step handler(CpuState&, Memory&, const MicroOp&)
+            e.mov(pc_mem(), ir.pc_of(inst));
+            e.mov64(Reg::rdi, state_reg);
+            e.mov64(Reg::rsi, context(offsetof(JitContext, memory)));
+            e.mov64(Reg::rdx, reinterpret_cast<u64>(inst.micro_op));
+            e.mov64(Reg::rax, reinterpret_cast<u64>(inst.micro_op->handler));
+            e.call(Reg::rax);
+            e.test(Reg::rax, Reg::rax);
+            fault_stubs.push_back(Stub{{}, length - inst.guest_index});
+            e.jcc(Cond::NE, fault_stubs.back().label);
+            if (writes_memory(inst.micro_op->opcode)) {
+                emit_code_write_check(inst);
+            }
+            break;
+        default:
+            emit_inst(e, locations, inst, static_cast<ir::Value>(i));
+            break;
+        }
+    }
+
+    const bool is_call = ir.exit_kind == ir::ExitKind::Call;
+    const u32 return_pc = block.end_pc();
+    if (ir.exit_kind == ir::ExitKind::Dispatch) {
+        e.mov(pc_mem(), locations.constant(ir.exit_target));
+        e.jmp(dispatcher_exit);
+    } else if (locations.is_constant(ir.exit_target)) {
+        const u32 target = locations.constant(ir.exit_target);
+        e.mov(pc_mem(), target);
+        if (is_call) {
+            if (options.shadow_calls) {
+                e.mov(Reg::rax, target);
+                emit_shadow_call(e, return_pc);
+            }
+            emit_return_stack_push(e, return_site, return_pc);
+        }
+        emit_link(e, target, exits);
+    } else {
+        locations.load(e, Reg::rax, ir.exit_target);
+        e.mov(pc_mem(), Reg::rax);
+        if (is_call) {
+            if (options.shadow_calls) {
+                emit_shadow_call(e, return_pc);
+            }
+            emit_return_stack_push(e, return_site, return_pc);
+        }
+        if (ir.exit_kind == ir::ExitKind::Return) {
+            if (options.shadow_calls) {
+                emit_shadow_return(e);
+            }
+            emit_return_stack_pop(e);
+        } else {
+            emit_indirect_exit(e);
+        }
+    }
+    if (is_call) {
+        e.bind(return_site);
+        e.mov(pc_mem(), return_pc);
+        emit_link(e, return_pc, exits);
+    }
+
+    // Out-of-line exits
+    e.bind(budget_exhausted);
+    e.alu64(Alu::Add, context(offsetof(JitContext, cycles_remaining)), length);
+    e.mov(pc_mem(), block.start_pc);
+    e.mov(Reg::rax, static_cast<u32>(JitExit::Budget));
+    e.jmp(exit);
+
+    // Caller-saved registers that may hold values; six pushes keep the stack aligned for the call
+    static constexpr std::array saved{Reg::rsi, Reg::rdi, Reg::r8, Reg::r9, Reg::r10, Reg::r11};
+    for (SlowAccess& access : slow_accesses) {
+        const ir::Inst& inst = *access.inst;
+        e.bind(access.slow);
+        for (const Reg reg : saved) {
+            e.push(reg);
+        }
+        if (access.store) {
+            // store_slow(CpuState*, Memory*, u32 address, u32 value, u32 size)
+            locations.load(e, Reg::rax, inst.args[1]);
+            e.mov(Reg::rdx, Reg::rcx);
+            e.mov(Reg::rcx, Reg::rax);
+            e.mov(Reg::r8, inst.imm);
+            e.mov64(Reg::rax, reinterpret_cast<u64>(&store_slow));
+        } else {
+            // load_slow(CpuState*, const Memory*, u32 address, u32 size)
+            e.mov(Reg::rdx, Reg::rcx);
+            e.mov(Reg::rcx, inst.imm);
+            e.mov64(Reg::rax, reinterpret_cast<u64>(&load_slow));
+        }
+        e.mov64(Reg::rdi, state_reg);
+        e.mov64(Reg::rsi, context(offsetof(JitContext, memory)));
+        e.call(Reg::rax);
+        for (auto reg = saved.rbegin(); reg != saved.rend(); ++reg) {
+            e.pop(*reg);
+        }
+
+        Label fault;
+        if (access.store) {
+            e.test(Reg::rax, Reg::rax);
+        } else {
+            e.mov64(Reg::rdx, Reg::rax);
+            e.shift64(Shift::Shr, Reg::rdx, 32);
+            e.test(Reg::rdx, Reg::rdx);
+        }
+        e.jcc(Cond::NE, fault);
+        if (!access.store && access.dst != Reg::rax) {
+            e.mov(access.dst, Reg::rax);
+        }
+        if (access.store) {
+            emit_code_write_check(inst);
+        }
+        e.jmp(access.done);
+
+        e.bind(fault);
+        e.mov(pc_mem(), ir.pc_of(inst));
+        e.mov(Reg::rax, static_cast<u32>(JitExit::MemoryFault));
+        e.mov(context(offsetof(JitContext, unretired)), length - inst.guest_index);
+        e.jmp(exit);
+    }
+
+    for (CodeWriteExit& code_write_exit : code_write_exits) {
+        e.bind(code_write_exit.label);
+        e.mov(pc_mem(), code_write_exit.next_pc);
+        e.mov(context(offsetof(JitContext, unretired)), code_write_exit.unretired);
+        e.mov(Reg::rax, static_cast<u32>(JitExit::CodeWrite));
+        e.jmp(exit);
+    }
+
+    std::vector<fastmem::Fixup> block_fixups;
+    for (Stub& stub : fault_stubs) {
+        if (stub.site) {
+            block_fixups.push_back(fastmem::Fixup{reinterpret_cast<uintptr_t>(stub.site), reinterpret_cast<uintptr_t>(e.position())});
+            e.mov(cr(static_cast<u32>(ControlRegister::FaultAddress)), Reg::rcx);
+            e.mov(pc_mem(), stub.pc);
+            e.mov(Reg::rax, static_cast<u32>(JitExit::MemoryFault));
+        } else {
+            e.bind(stub.label);
+        }
+        e.mov(context(offsetof(JitContext, unretired)), stub.unretired);
+        e.jmp(exit);
+    }
+
+    if (e.overflowed()) {
+        return nullptr;
+    }
+    cache.commit(e.position());
+    new_fixups.insert(new_fixups.end(), block_fixups.begin(), block_fixups.end());
+    return code;
+}
+
+void Jit::link(const JitBlock& block) {
+    for (const LinkSite& site : block.exits) {
+        incoming_links[site.target].push_back(site.jump_end);
+        if (const auto iter = blocks.find(site.target); iter != blocks.end()) {
+            Emitter::patch_rel32(site.jump_end, iter->second->code);
+        }
+    }
+    if (const auto iter = incoming_links.find(block.decoded.start_pc); iter != incoming_links.end()) {
+        for (u8* jump_end : iter->second) {
+            Emitter::patch_rel32(jump_end, block.code);
+        }
+    }
+}
+
+void Jit::unlink(const JitBlock& block) {
+    if (const auto iter = incoming_links.find(block.decoded.start_pc); iter != incoming_links.end()) {
+        for (u8* jump_end : iter->second) {
+            Emitter::patch_rel32(jump_end, dispatcher_exit);
+        }
+    }
+    for (const LinkSite& site : block.exits) {
+        auto& sites = incoming_links[site.target];
+        sites.erase(std::find(sites.begin(), sites.end(), site.jump_end));
+    }
+}
+
+void Jit::flush_lookup_tables() {
+    fast_lookup.fill(nullptr);
+    jump_table.fill(JumpTableEntry{no_pc, nullptr});
+    return_stack.entries.fill(JumpTableEntry{no_pc, nullptr});
+    return_stack.top = 0;
+}
+
+const JitBlock* Jit::get_slow(const CpuState& state, const Memory& memory, u32 pc) {
+    if (state.mmu_generation != generation) {
+        // Blocks were translated under a different translation
+        clear();
+        generation = state.mmu_generation;
+    }
+    if (!code_writes.up_to_date(memory)) {
+        code_writes.sync(
+            memory, [&](u32 address, u32 size) { state.paging() ? clear() : invalidate(address, size); }, [&] { clear(); });
+    }
+    if (finished.load(std::memory_order_relaxed)) {
+        install_translations();
+    }
+
+    const JitBlock* result;
+    if (const auto iter = blocks.find(pc); iter != blocks.end()) {
+        result = iter->second.get();
+    } else if (!hot(pc)) {
+        return nullptr;
+    } else if (!workers.empty()) {
+        queue_translation(state, memory, pc);
+        return nullptr;
+    } else {
+        result = translate(state, memory, pc);
+        if (!result) {
+            return nullptr;
+        }
+    }
+    fast_lookup[(pc >> 2) % fast_lookup_size] = result;
+    jump_table[(pc >> 2) % fast_lookup_size] = JumpTableEntry{pc, result->code};
+    return result;
+}
+
+bool Jit::hot(u32 pc) {
+    if (tiering.threshold == 0 && tiering.workers == 0) {
+        return true;
+    }
+    auto [iter, inserted] = heat.try_emplace(pc, 0);
+    u32& count = iter.value();
+    if (count == queued) {
+        return false;
+    }
+    if (count < tiering.threshold) {
+        count++;
+        return false;
+    }
+    return true;
+}
+
+const JitBlock* Jit::translate(const CpuState& state, const Memory& memory, u32 pc) {
+    protect_block(state, memory, pc);
+    auto block = std::make_unique<JitBlock>(JitBlock{decode_block(state, memory, pc), nullptr, {}});
+    if (block->decoded.ops.empty()) {
+        return nullptr;
+    }
+
+    ir::Block ir = ir::translate(block->decoded);
+    const std::lock_guard lock{compile_mutex};
+    ir::optimize(ir, options, stats);
+    block->code = compile(*block, ir, state.paging(), fixups.fixups);
+    if (!block->code) {
+        // The code cache is full: start again from an empty cache
+        clear_locked();
+        block->code = compile(*block, ir, state.paging(), fixups.fixups);
+        ASSERT_MSG(block->code, "block does not fit in an empty code cache");
+    }
+    return install(std::move(block), memory.id());
+}
+
+const JitBlock* Jit::install(std::unique_ptr<JitBlock> block, u64 memory_id) {
+    heat.erase(block->decoded.start_pc);
+    const JitBlock* result = blocks.emplace(block->decoded.start_pc, std::move(block)).first->second.get();
+    code_writes.add(memory_id, result->decoded);
+    link(*result);
+    return result;
+}
+
+void Jit::queue_translation(const CpuState& state, const Memory& memory, u32 pc) {
+    protect_block(state, memory, pc);
+    auto block = std::make_unique<JitBlock>(JitBlock{decode_block(state, memory, pc), nullptr, {}});
+    if (block->decoded.ops.empty()) {
+        return;
+    }
+    heat[pc] = queued;
+    in_flight[epoch]++;
+    {
+        const std::lock_guard lock{queue_mutex};
+        queue.push_back(std::make_unique<Translation>(Translation{std::move(block), memory.id(), state.paging(), epoch, nullptr, {}, nullptr}));
+        outstanding++;
+    }
+    queue_changed.notify_one();
+}
+
+void Jit::translation_worker() {
+    while (true) {
+        std::unique_ptr<Translation> translation;
+        {
+            std::unique_lock lock{queue_mutex};
+            queue_changed.wait(lock, [this] { return stopping || !queue.empty(); });
+            if (stopping) {
+                return;
+            }
+            translation = std::move(queue.front());
+            queue.pop_front();
+        }
+
+        ir::Stats block_stats;
+        ir::Block ir = ir::translate(translation->block->decoded);
+        ir::optimize(ir, options, block_stats);
+        {
+            const std::lock_guard lock{compile_mutex};
+            stats += block_stats;
+            translation->code = compile(*translation->block, ir, translation->paging, translation->fixups);
+        }
+
+        Translation* const published = translation.release();
+        published->next = finished.load(std::memory_order_relaxed);
+        while (!finished.compare_exchange_weak(published->next, published, std::memory_order_release, std::memory_order_relaxed)) {
+        }
+
+        {
+            const std::lock_guard lock{queue_mutex};
+            outstanding--;
+        }
+        queue_changed.notify_all();
+    }
+}
+
+bool Jit::stale(const Translation& translation) const {
+    if (translation.epoch < cleared_epoch) {
+        return true;
+    }
+    const DecodedBlock& block = translation.block->decoded;
+    return std::any_of(invalidations.begin(), invalidations.end(), [&](const Invalidation& invalidation) {
+        return invalidation.epoch > translation.epoch && block.start_pc < invalidation.end && invalidation.address < u64{block.end_pc()};
+    });
+}
+
+void Jit::install_translations() {
+    // Oldest first, which is close to the order the code was emitted in
+    std::vector<std::unique_ptr<Translation>> arrived;
+    for (Translation* translation = finished.exchange(nullptr, std::memory_order_acquire); translation; translation = translation->next) {
+        arrived.emplace_back(translation);
+    }
+    std::reverse(arrived.begin(), arrived.end());
+
+    for (const auto& translation : arrived) {
+        const u32 pc = translation->block->decoded.start_pc;
+        if (const auto iter = in_flight.find(translation->epoch); --iter->second == 0) {
+            in_flight.erase(iter);
+        }
+
+        if (stale(*translation)) {
+            if (translation->epoch >= cleared_epoch) {
+                // Let the block warm up again
+                heat.erase(pc);
+            }
+            continue;
+        }
+        if (!translation->code) {
+            // The code cache is full. What is still to come was emitted into the same cache and
+            // becomes stale; start again from an empty cache and let the blocks warm up again.
+            clear();
+            continue;
+        }
+        if (blocks.contains(pc)) {
+            continue;
+        }
+        if (!translation->fixups.empty()) {
+            const auto later = [](const fastmem::Fixup& a, const fastmem::Fixup& b) { return a.fault < b.fault; };
+            const auto at = std::upper_bound(fixups.fixups.begin(), fixups.fixups.end(), translation->fixups.front(), later);
+            fixups.fixups.insert(at, translation->fixups.begin(), translation->fixups.end());
+        }
+        translation->block->code = translation->code;
+        install(std::move(translation->block), translation->memory);
+    }
+
+    // Invalidations matter only to translations of blocks decoded before them
+    if (in_flight.empty()) {
+        invalidations.clear();
+    } else {
+        const u64 oldest = in_flight.begin()->first;
+        std::erase_if(invalidations, [&](const Invalidation& invalidation) { return invalidation.epoch <= oldest; });
+    }
+}
+
+void Jit::finish_translations() {
+    {
+        std::unique_lock lock{queue_mutex};
+        queue_changed.wait(lock, [this] { return outstanding == 0; });
+    }
+    install_translations();
+}
+
+void Jit::invalidate(u32 address, u32 size) {
+    const u64 end = u64{address} + size;
+    const auto overlaps = [&](const DecodedBlock& block) { return block.start_pc < end && address < u64{block.end_pc()}; };
+
+    epoch++;
+    if (!in_flight.empty()) {
+        invalidations.push_back(Invalidation{epoch, address, end});
+    }
+    interpreter.invalidate(address, size);
+
+    bool any = false;
+    for (const u32 pc : code_writes.blocks_on(address, size)) {
+        const auto iter = blocks.find(pc);
+        if (iter == blocks.end() || !overlaps(iter->second->decoded)) {
+            continue;
+        }
+        const DecodedBlock& block = iter->second->decoded;
+        const size_t index = (block.start_pc >> 2) % fast_lookup_size;
+        if (fast_lookup[index] == iter->second.get()) {
+            fast_lookup[index] = nullptr;
+            jump_table[index] = JumpTableEntry{no_pc, nullptr};
+        }
+        unlink(*iter->second);
+        code_writes.remove(block);
+#if defined(STAMINA_HAS_INSTRUCTION_COUNTS)
+        count_block(*iter->second, pending_counts);
+#endif
+        blocks.erase(iter);
+        any = true;
+    }
+
+    if (any) {
+        // Return sites of erased blocks are no longer unlinked when their targets go away
+        return_stack.entries.fill(JumpTableEntry{no_pc, nullptr});
+    }
+}
+
+void Jit::forget(const Memory& memory) {
+    code_writes.forget(memory);
+    interpreter.forget(memory);
+}
+
+void Jit::clear() {
+    const std::lock_guard lock{compile_mutex};
+    clear_locked();
+}
+
+void Jit::clear_locked() {
+    // Code emitted for translations still to come may be overwritten
+    cleared_epoch = ++epoch;
+    invalidations.clear();
+#if defined(STAMINA_HAS_INSTRUCTION_COUNTS)
+    for (auto& [pc, block] : blocks) {
+        count_block(*block, pending_counts);
+    }
+#endif
+    flush_lookup_tables();
+    blocks.clear();
+    code_writes.clear();
+    incoming_links.clear();
+    fixups.fixups.clear();
+    heat.clear();
+    interpreter.clear();
+    cache.reset(prelude_end);
+}
+
+size_t Jit::code_size() const {
+    const std::lock_guard lock{compile_mutex};
+    return cache.used();
+}
+
+ir::Stats Jit::ir_stats() const {
+    const std::lock_guard lock{compile_mutex};
+    return stats;
+}
+
+StopReason Jit::run(CpuState& state, Memory& memory, u64 budget) {
+    return execute(state, memory, budget, false);
+}
+
+StopReason Jit::run_block(CpuState& state, Memory& memory, u64 budget) {
+    return execute(state, memory, budget, true);
+}
+
+StopReason Jit::execute(CpuState& state, Memory& memory, u64 budget, bool single_block) {
+    const StopReason reason = dispatch(state, memory, budget, single_block);
+#if defined(STAMINA_HAS_INSTRUCTION_COUNTS)
+    count_blocks(state);
+#endif
+    return reason;
+}
+
+#if defined(STAMINA_HAS_INSTRUCTION_COUNTS)
+
+void Jit::count_block(JitBlock& block, InstructionCounts& counts) {
+    const u64 executions = block.executions - block.counted;
+    if (executions == 0) {
+        return;
+    }
+    for (const Opcode opcode : block.decoded.opcodes) {
+        counts[opcode] += executions;
+    }
+    block.counted = block.executions;
+}
+
+void Jit::uncount_fault(const CpuState& state, const Memory& memory, u32 unretired) {
+    // The block was counted whole, but the faulting instruction and those after it did not retire
+    const DecodedBlock rest = decode_block(state, memory, state.pc);
+    for (u32 i = 0; i < unretired && i < rest.opcodes.size(); i++) {
+        pending_counts[rest.opcodes[i]]--;
+    }
+}
+
+void Jit::count_blocks(CpuState& state) {
+    for (auto& [pc, block] : blocks) {
+        count_block(*block, state.counts);
+    }
+    state.counts += pending_counts;
+    pending_counts = {};
+}
+
+#endif
+
+StopReason Jit::dispatch(CpuState& state, Memory& memory, u64 budget, bool single_block) {
+    JitContext context{&state, &memory, memory.host_base(), 0, 0, memory.code_write_counter(), 0, {}};
+    const fastmem::ScopedFixupTable scoped_fixups{&fixups};
+
+    while (budget > 0) {
+        // Read before the lookup brings the blocks up to date, so that no later write goes unnoticed
+        context.code_writes_seen = memory.code_write_count();
+        const JitBlock* block = get(state, memory, state.pc);
+        if (!block) [[unlikely]] {
+            // Not translated yet, or not decodable
+            const u64 retired = state.retired;
+            const StopReason reason = interpret_block(state, memory, budget);
+            budget -= state.retired - retired;
+            if (reason != StopReason::BudgetExhausted || single_block) {
+                return reason;
+            }
+            continue;
+        }
+
+        u64 cycles = std::min<u64>(budget, INT64_MAX);
+        if (single_block) {
+            cycles = std::min<u64>(cycles, block->decoded.ops.size());
+        }
+        context.cycles_remaining = static_cast<s64>(cycles);
+        dispatches++;
+        // Overwritten by a fault in translated code, which may turn out to be a code write
+        const u32 fault_address = state.control(ControlRegister::FaultAddress);
+        const auto reason = static_cast<JitExit>(enter(&context, block->code));
+        u64 executed = cycles - static_cast<u64>(context.cycles_remaining);
+
+        switch (reason) {
+        case JitExit::Continue:
+            state.retired += executed;
+            budget -= executed;
+            if (single_block) {
+                return StopReason::BudgetExhausted;
+            }
+            break;
+        case JitExit::Budget:
+            // The block at state.pc does not fit in what is left; finish the budget in the interpreter
+            state.retired += executed;
+            budget -= executed;
+            if (single_block && executed > 0) {
+                return StopReason::BudgetExhausted;
+            }
+            return interpret(state, memory, budget);
+        case JitExit::Halt:
+        case JitExit::Wait:
+        case JitExit::Submit:
+            // The instruction that stopped the core retires
+            state.retired += executed - (context.unretired - 1);
+            return stop_reason(static_cast<Step>(reason));
+        case JitExit::CodeWrite:
+            state.retired += executed - context.unretired;
+            budget -= executed - context.unretired;
+#if defined(STAMINA_HAS_INSTRUCTION_COUNTS)
+            for (size_t i = block->decoded.opcodes.size() - context.unretired; i < block->decoded.opcodes.size(); i++) {
+                pending_counts[block->decoded.opcodes[i]]--;
+            }
+#endif
+            if (single_block) {
+                return StopReason::BudgetExhausted;
+            }
+            break;
+        case JitExit::MemoryFault: {
+            state.retired += executed - context.unretired;
+            budget -= executed - context.unretired;
+#if defined(STAMINA_HAS_INSTRUCTION_COUNTS)
+            uncount_fault(state, memory, context.unretired);
+#endif
+            // Stores to pages holding code fault too. The interpreter completes them, recording the
+            // write, and the blocks it overwrote are dropped before the next one runs.
+            state.control(ControlRegister::FaultAddress) = fault_address;
+            const StopReason retried = interpret(state, memory, 1);
+            if (retried != StopReason::BudgetExhausted) {
+                return retried;
+            }
+            budget--;
+            if (single_block) {
+                return StopReason::BudgetExhausted;
+            }
+            break;
+        }
+        }
+    }
+    return StopReason::BudgetExhausted;
+}
+
+StopReason Jit::interpret_block(CpuState& state, Memory& memory, u64 budget) {
+    const DecodedBlock* block = interpreter.get(state, memory, state.pc);
+    if (!block) {
+        // Let the interpreter report the fetch fault or invalid instruction
+        return interpret(state, memory, 1);
+    }
+    interpreted_blocks++;
+    return interpret_cached(state, memory, interpreter, std::min<u64>(budget, block->ops.size()));
+}
+
+StopReason run_lockstep(Jit& jit, CpuState& state, Memory& memory, u64 budget, std::optional<Divergence>& divergence) {
+    CpuState reference = state;
+    Memory reference_memory = memory;
+    divergence.reset();
+
+    while (budget > 0) {
+        const u32 pc = state.pc;
+        const u64 retired = state.retired;
+        const DecodedBlock block = decode_block(state, memory, pc);
+
+        const StopReason reason = jit.run_block(state, memory, budget);
+        const u64 executed = state.retired - retired;
+        // A faulting instruction does not retire but must still be attempted by the reference
+        const bool faulted = reason == StopReason::MemoryFault || reason == StopReason::InvalidInstruction;
+        const StopReason expected = interpret(reference, reference_memory, executed + (faulted ? 1 : 0));
+
+        std::string description;
+        if (reason != expected) {
+            description += fmt::format("stop reason: jit {} interpreter {}\n", static_cast<int>(reason), static_cast<int>(expected));
+        }
+        if (state.pc != reference.pc) {
+            description += fmt::format("pc: jit {:08x} interpreter {:08x}\n", state.pc, reference.pc);
+        }
+        for (size_t i = 0; i < num_gprs; i++) {
+            if (state.gpr[i] != reference.gpr[i]) {
+                description += fmt::format("r{}: jit {:08x} interpreter {:08x}\n", i, state.gpr[i], reference.gpr[i]);
+            }
+        }
+        if (state.t != reference.t) {
+            description += fmt::format("t: jit {} interpreter {}\n", state.t, reference.t);
+        }
+        if (state.cr != reference.cr || state.ur != reference.ur) {
+            description += "control or user registers differ\n";
+        }
+        if (state.monitor_valid != reference.monitor_valid || state.monitor_address != reference.monitor_address ||
+            state.monitor_value != reference.monitor_value) {
+            description += "exclusive monitor differs\n";
+        }
+        if (state.retired != reference.retired) {
+            description += fmt::format("retired: jit {} interpreter {}\n", state.retired, reference.retired);
+        }
+
+        // Comparing all of memory is slow, so only do it after blocks that can store
+        const bool stores = std::any_of(block.ops.begin(), block.ops.end(), [](const MicroOp& op) { return writes_memory(op.opcode); });
+        if (stores && std::memcmp(std::as_const(memory).bytes().data(), std::as_const(reference_memory).bytes().data(), memory.size()) != 0) {
+            description += "memory differs\n";
+        }
+
+        if (!description.empty()) {
+            divergence = Divergence{pc, std::move(description)};
+            return reason;
+        }
+        if (reason != StopReason::BudgetExhausted) {
+            return reason;
+        }
+        budget -= executed;
+    }
+    return StopReason::BudgetExhausted;
+}
+
+}
@@ -0,0 +1,301 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+#include <tsl/robin_map.h>
+#include "common/common_types.hpp"
+#include "common/macros.hpp"
+#include "stamina/block_cache.hpp"
+#include "stamina/cpu_state.hpp"
+#include "stamina/fastmem.hpp"
+#include "stamina/ir/passes.hpp"
+#include "stamina/memory.hpp"
+#include "stamina/x64/code_cache.hpp"
+#include "stamina/x64/emitter.hpp"
+
+namespace stamina::x64 {
+
+// State shared between the dispatcher and translated code for one call into the code cache.
+struct JitContext {
+    CpuState* state;
+    Memory* memory;
+    u8* guest_base;
+    // Decremented by each block on entry; a block that does not fit exits without executing.
+    s64 cycles_remaining;
+    // Instructions of the exiting block that were charged but not retired.
+    u32 unretired;
+    // Memory::code_write_counter, and its value when the dispatcher entered translated code. Stores
+    // made by handlers exit once it moves on.
+    const std::atomic<u64>* code_writes;
+    u64 code_writes_seen;
+
+    // Home of IR values that did not get a host register
+    static constexpr size_t spill_slots = 32;
+    std::array<u32, spill_slots> spill;
+};
+
+// Why translated code returned to the dispatcher. All but Budget and CodeWrite share values with Step.
+enum class JitExit : u32 {
+    Continue = 0,
+    Halt = 1,
+    MemoryFault = 2,
+    Wait = 3,
+    Submit = 4,
+    Budget = 5,
+    // A store outside translated code recorded a code write; the rest of the block did not run.
+    CodeWrite = 6,
+};
+
+// A direct jump out of a block to the block at target. The jump goes back to the dispatcher until
+// that block is translated, and again after it is invalidated.
+struct LinkSite {
+    u32 target;
+    u8* jump_end;
+};
+
+// A decoded block and the host code translated from it.
+struct JitBlock {
+    DecodedBlock decoded;
+    const u8* code;
+    std::vector<LinkSite> exits;
+#if defined(STAMINA_HAS_INSTRUCTION_COUNTS)
+    // Times translated code entered the block, and how many of those are in the instruction counts
+    u64 executions = 0;
+    u64 counted = 0;
+#endif
+};
+
+// When blocks are translated. By default every block is translated on its first execution.
+struct Tiering {
+    // Times a block runs in the block cache interpreter before it is translated
+    u32 threshold = 0;
+    // Threads translating in the background while the block goes on running in the interpreter.
+    // With none, blocks are translated on the thread running the guest.
+    u32 workers = 0;
+};
+
+// Translates decoded blocks to x86-64 through the IR. Instructions without an IR translation call
+// their MicroOp handler, so every instruction is supported. Loads and stores access guest memory
+// directly through its host mapping; a fault resumes at a stub that reports it. With paging enabled
+// they first probe the TLB inline and call into the MMU on a miss. Blocks are translated under the
+// current address translation and all dropped when it changes. Code writes recorded by Memory drop
+// the blocks they overlap on the next return to the dispatcher. An inline store that hits a
+// protected page faults out of the block, and a store made by a handler or a TLB miss leaves the
+// block after its instruction once Memory has recorded any code write since the dispatcher entered
+// translated code,// so neither the rest of the block nor a linked block is run stale. A JIT may run
+// several memories in turn if they hold the same code where it has blocks; see CodeWriteTracker.
+//
+// Exits to a target that is constant within the block are chained directly to the next block.
+// Other exits probe the jump table inline, and RET first checks a return address stack filled by
+// RCALL and ROCALL. Only misses return to the dispatcher. With ir::Options::shadow_calls, calls and
+// returns also maintain the profiler's shadow call stack inline.
+//
+// With Tiering, blocks start out in the block cache interpreter and are translated once they have
+// run threshold times. Translated code reaches blocks that are not translated yet through the
+// dispatcher, which runs them in the interpreter and links them in once translated.
+//
+// Background workers lower blocks to IR in parallel and take turns emitting into the code cache.
+// They push finished translations onto a lock-free list, which the dispatcher takes whole on its
+// next miss, so the thread running the guest never waits for them. Invalidations are numbered by
+// epoch, and a translation of a block decoded before an invalidation of its range is dropped when
+// it arrives. Each invalidation is kept only until every translation older than it has arrived.
+// Epochs do not reclaim code: the code of invalidated blocks and dropped translations stays in the
+// code cache, which is only reclaimed whole, when it fills and every block is cleared.
+struct Jit final {
+public:
+    static constexpr size_t default_code_cache_size = 64 * 1024 * 1024;
+
+    explicit Jit(size_t code_cache_size = default_code_cache_size, const ir::Options& options = {}, const Tiering& tiering = {});
+    ~Jit();
+
+    Jit(const Jit&) = delete;
+    Jit& operator=(const Jit&) = delete;
+
+    // False if executable memory could not be allocated.
+    bool valid() const { return cache.valid(); }
+
+    // Executes at most budget instructions starting at state.pc. Behaves identically to interpret.
+    StopReason run(CpuState& state, Memory& memory, u64 budget);
+
+    // Executes the block at state.pc, or as much of it as budget allows.
+    StopReason run_block(CpuState& state, Memory& memory, u64 budget);
+
+    // Drops every block overlapping [address, address + size), including translations in progress.
+    void invalidate(u32 address, u32 size);
+    void clear();
+    // Forgets memory, which the JIT will not run with again.
+    void forget(const Memory& memory);
+
+    // Waits for the background translations queued so far and makes them available to run.
+    void finish_translations();
+
+    size_t block_count() const { return blocks.size(); }
+    size_t code_size() const;
+    // Number of times the dispatcher has entered translated code.
+    u64 dispatch_count() const { return dispatches; }
+    // Number of blocks the dispatcher has run in the interpreter.
+    u64 interpreted_count() const { return interpreted_blocks; }
+    ir::Stats ir_stats() const;
+
+private:
+    using EntryFn = u32 (*)(JitContext* context, const u8* code);
+
+    // Guest PC to host code, read by translated code. Empty entries hold an unaligned PC.
+    struct JumpTableEntry {
+        u32 pc;
+        const u8* code;
+    };
+    static constexpr u32 no_pc = 1;
+
+    static constexpr size_t return_stack_size = 16;
+    struct ReturnStack {
+        std::array<JumpTableEntry, return_stack_size> entries;
+        u32 top;
+    };
+
+    // A block being translated in the background, and what came of it.
+    struct Translation {
+        std::unique_ptr<JitBlock> block;
+        // Memory::id of the memory the block was decoded from
+        u64 memory;
+        bool paging;
+        // epoch when the block was decoded
+        u64 epoch;
+        const u8* code = nullptr;
+        std::vector<fastmem::Fixup> fixups;
+        // Next on the list of finished translations
+        Translation* next = nullptr;
+    };
+
+    struct Invalidation {
+        u64 epoch;
+        u32 address;
+        u64 end;
+    };
+
+    StopReason execute(CpuState& state, Memory& memory, u64 budget, bool single_block);
+    StopReason dispatch(CpuState& state, Memory& memory, u64 budget, bool single_block);
+    // Runs the block at state.pc in the interpreter.
+    StopReason interpret_block(CpuState& state, Memory& memory, u64 budget);
+#if defined(STAMINA_HAS_INSTRUCTION_COUNTS)
+    // Adds the executions of block since it was last counted to counts.
+    static void count_block(JitBlock& block, InstructionCounts& counts);
+    void count_blocks(CpuState& state);
+    void uncount_fault(const CpuState& state, const Memory& memory, u32 unretired);
+#endif
+
+    FORCE_INLINE const JitBlock* get(const CpuState& state, const Memory& memory, u32 pc) {
+        const JitBlock* block = fast_lookup[(pc >> 2) % fast_lookup_size];
+        if (block && block->decoded.start_pc == pc && state.mmu_generation == generation && code_writes.up_to_date(memory)) [[likely]] {
+            return block;
+        }
+        return get_slow(state, memory, pc);
+    }
+    const JitBlock* get_slow(const CpuState& state, const Memory& memory, u32 pc);
+    // Whether the untranslated block at pc has run often enough to translate, counting this execution.
+    bool hot(u32 pc);
+    const JitBlock* translate(const CpuState& state, const Memory& memory, u32 pc);
+    void queue_translation(const CpuState& state, const Memory& memory, u32 pc);
+    void install_translations();
+    bool stale(const Translation& translation) const;
+    const JitBlock* install(std::unique_ptr<JitBlock> block, u64 memory_id);
+    void translation_worker();
+
+    void emit_prelude();
+    // Emits ir, translated from jit_block, with compile_mutex held. Appends the fault recovery
+    // entries of the new code to new_fixups. Returns nullptr if the code cache is full.
+    const u8* compile(JitBlock& jit_block, const ir::Block& ir, bool paging, std::vector<fastmem::Fixup>& new_fixups);
+    void emit_link(Emitter& e, u32 target, std::vector<LinkSite>& exits);
+    void emit_indirect_exit(Emitter& e);
+    void emit_return_stack_push(Emitter& e, Label& return_site, u32 return_pc);
+    void emit_return_stack_pop(Emitter& e);
+    void emit_shadow_call(Emitter& e, u32 return_pc);
+    void emit_shadow_return(Emitter& e);
+
+    // clear with compile_mutex held
+    void clear_locked();
+    void link(const JitBlock& block);
+    void unlink(const JitBlock& block);
+    void flush_lookup_tables();
+
+    CodeCache cache;
+    EntryFn enter = nullptr;
+    const u8* exit = nullptr;
+    // Returns to the dispatcher with state.pc already written
+    const u8* dispatcher_exit = nullptr;
+    u8* prelude_end = nullptr;
+
+    static constexpr size_t fast_lookup_size = 4096;
+    std::array<const JitBlock*, fast_lookup_size> fast_lookup{};
+    std::array<JumpTableEntry, fast_lookup_size> jump_table;
+    ReturnStack return_stack;
+
+    tsl::robin_map<u32, std::unique_ptr<JitBlock>> blocks;
+    // CpuState::mmu_generation the blocks were translated under
+    u32 generation = 0;
+    CodeWriteTracker code_writes;
+    // Link sites by target PC, including those still pointing at dispatcher_exit
+    tsl::robin_map<u32, std::vector<u8*>> incoming_links;
+
+    ir::Options options;
+    ir::Stats stats;
+    u64 dispatches = 0;
+
+    Tiering tiering;
+    // Executions of blocks not yet translated; queued marks those waiting for the background thread
+    static constexpr u32 queued = UINT32_MAX;
+    tsl::robin_map<u32, u32> heat;
+    BlockCache interpreter;
+    u64 interpreted_blocks = 0;
+
+    // Held while emitting into the code cache, which the workers share, and while updating stats
+    mutable std::mutex compile_mutex;
+    // Guards the queue, outstanding and stopping
+    std::mutex queue_mutex;
+    std::condition_variable queue_changed;
+    std::deque<std::unique_ptr<Translation>> queue;
+    // Queued or in progress
+    size_t outstanding = 0;
+    bool stopping = false;
+    // Finished translations, most recent first
+    std::atomic<Translation*> finished = nullptr;
+    std::vector<std::thread> workers;
+
+    // Bumped by each invalidation and clear
+    u64 epoch = 0;
+    // Translations of blocks decoded before this are dropped
+    u64 cleared_epoch = 0;
+    std::vector<Invalidation> invalidations;
+    // Epochs of translations that have not arrived, and how many of each
+    std::map<u64, size_t> in_flight;
+#if defined(STAMINA_HAS_INSTRUCTION_COUNTS)
+    // Instructions of dropped blocks, and corrections for blocks left early, not yet in CpuState::counts
+    InstructionCounts pending_counts;
+#endif
+    // Fault recovery for the guest memory accesses in the code cache
+    fastmem::FixupTable fixups;
+};
+
+struct Divergence {
+    u32 block_pc;
+    std::string description;
+};
+
+// Runs the JIT and the reference interpreter side by side on separate copies of the machine,
+// comparing architectural state after every block. Stops at the first divergence.
+StopReason run_lockstep(Jit& jit, CpuState& state, Memory& memory, u64 budget, std::optional<Divergence>& divergence);
+
+}
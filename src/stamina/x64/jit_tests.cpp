@@ -0,0 +1,455 @@
+// This file is part of the stamina project.
+// Copyright (c) 2020 MerryMage
+// SPDX-License-Identifier: 0BSD
+
+#include <algorithm>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <catch.hpp>
+#include "common/common_types.hpp"
+#include "common/instruction.hpp"
+#include "stamina/cpu_state.hpp"
+#include "stamina/interpreter.hpp"
+#include "stamina/memory.hpp"
+#include "stamina/test_program.hpp"
+#include "stamina/x64/jit.hpp"
+
+using namespace stamina;
+using namespace stamina::test;
+
+namespace {
+
+// Touches every inline translation as well as the handler fallbacks.
+const std::string mixed_program =
+    "    li r1, 0x89ABCDEF\n"
+    "    movi r2, -5\n"
+    "    addi r3, r1, 100\n"
+    "    multi r4, r2, -3\n"
+    "    slti r5, r2, 1\n"
+    "    sltiu r6, r2, 1\n"
+    "    pcaddi r7, 8\n"
+    "    add r3, r3, r2\n"
+    "    mult r4, r4, r1\n"
+    "    slt r5, r1, r2\n"
+    "    sltu r6, r1, r2\n"
+    "    sub r7, r7, r1\n"
+    "    pcadd r8, r2\n"
+    "    andi r9, r1, 0xF0F0\n"
+    "    ori r10, r1, 0x1234\n"
+    "    xori r11, r1, 0xFFFF\n"
+    "    nandi r12, r1, 0xFF\n"
+    "    and r9, r9, r1\n"
+    "    or r10, r10, r2\n"
+    "    xor r11, r11, r2\n"
+    "    nand r12, r12, r2\n"
+    "    cmpi/lt r2, 0\n"
+    "    mti r13, 77\n"
+    "    mft r13, 88\n"
+    "    cmp/lo r1, r2\n"
+    "    mt r13, r1\n"
+    "    mf r13, r2\n"
+    "    movl r9, 0xBEEF\n"
+    "    movu r9, 0xDEAD\n"
+    "    mov r10, r9\n"
+    "    mtou r3, r10\n"
+    "    mfru r11, r3\n"
+    "    mfrc r12, r1\n"
+    "    lsl r3, r1, 7\n"
+    "    lsr r4, r1, 9\n"
+    "    asr r5, r1, 11\n"
+    "    ror r6, r1, 13\n"
+    "    movi r0, 35\n"
+    "    rlsl r7, r1, r0\n"
+    "    rlsr r8, r1, r0\n"
+    "    rasr r9, r1, r0\n"
+    "    rror r10, r1, r0\n"
+    "    flsl r11, r1, r2, 12\n"
+    "    flsr r12, r1, r2, 12\n"
+    "    divi r3, r2, 2\n"
+    "    rem r4, r1, r2\n"
+    "    popcnt r5, r1\n"
+    "    clo r6, r1\n"
+    "    plo r8, r1\n"
+    "    li r13, function\n"
+    "    rcall r13\n"
+    "    mtoc r15, r0\n"
+    "function:\n"
+    "    li r0, buffer\n"
+    "    st r1, r0, 0\n"
+    "    ldh r2, r0, 2\n"
+    "    push r2\n"
+    "    pop r3\n"
+    "    ldc r4, r0, 0\n"
+    "    stc r5, r0, 0\n"
+    "    movi r0, 3\n"
+    "    ret\n"
+    "buffer: @word 0\n";
+
+const std::string sum_program =
+    "    movi r1, 0\n"
+    "    movi r2, 100\n"
+    "    li r3, loop\n"
+    "    li r4, done\n"
+    "loop:\n"
+    "    add r1, r1, r2\n"
+    "    addi r2, r2, -1\n"
+    "    cmpi/eq r2, 0\n"
+    "    mov r5, r3\n"
+    "    mt r5, r4\n"
+    "    rbra r5\n"
+    "done:\n"
+    "    mtoc r15, r1\n";
+
+}
+
+TEST_CASE("jit: matches the interpreter", "[stamina]") {
+    for (const auto& source : {mixed_program, sum_program}) {
+        for (const u64 budget : {u64{1}, u64{5}, u64{1000}}) {
+            Memory reference_memory{ram_size};
+            CpuState reference;
+            load_program(reference_memory, reference, source);
+
+            Memory memory{ram_size};
+            CpuState state;
+            load_program(memory, state, source);
+            x64::Jit jit{1024 * 1024};
+            REQUIRE(jit.valid());
+
+            StopReason expected, actual;
+            do {
+                expected = interpret(reference, reference_memory, budget);
+                actual = jit.run(state, memory, budget);
+                REQUIRE(actual == expected);
+                REQUIRE(state.pc == reference.pc);
+                REQUIRE(state.gpr == reference.gpr);
+                REQUIRE(state.t == reference.t);
+                REQUIRE(state.ur == reference.ur);
+                REQUIRE(state.retired == reference.retired);
+            } while (expected == StopReason::BudgetExhausted);
+
+            REQUIRE(actual == StopReason::Halted);
+            REQUIRE(state.control(ControlRegister::Halt) == reference.control(ControlRegister::Halt));
+            REQUIRE(std::memcmp(memory.bytes().data(), reference_memory.bytes().data(), ram_size) == 0);
+        }
+    }
+}
+
+TEST_CASE("jit: lockstep finds no divergence", "[stamina]") {
+    Memory memory{ram_size};
+    CpuState state;
+    load_program(memory, state, mixed_program);
+    x64::Jit jit{1024 * 1024};
+
+    std::optional<x64::Divergence> divergence;
+    REQUIRE(x64::run_lockstep(jit, state, memory, 1000, divergence) == StopReason::Halted);
+    REQUIRE(!divergence);
+    REQUIRE(state.control(ControlRegister::Halt) == 3);
+
+    // Shift immediates the assembler would reject
+    const u32 shifts[] = {
+        encode(Instruction{Opcode::MOVI, 1, 0, 0, -16}),
+        encode(Instruction{Opcode::LSL, 2, 1, 0, 33}),
+        encode(Instruction{Opcode::LSR, 3, 1, 0, 36}),
+        encode(Instruction{Opcode::ASR, 4, 1, 0, 0xFFFF}),
+        encode(Instruction{Opcode::ROR, 5, 1, 0, 40}),
+    };
+    std::memcpy(memory.bytes().data(), shifts, sizeof(shifts));
+    jit.clear();
+    state.pc = 0;
+    REQUIRE(x64::run_lockstep(jit, state, memory, 5, divergence) == StopReason::BudgetExhausted);
+    REQUIRE(!divergence);
+    REQUIRE(state.gpr[4] == 0xFFFFFFFF);
+}
+
+TEST_CASE("jit: faults", "[stamina]") {
+    Memory memory{ram_size};
+    CpuState state;
+    load_program(memory, state, "li r1, 0x100000\nld r2, r1, 0\n");
+    x64::Jit jit{1024 * 1024};
+
+    REQUIRE(jit.run(state, memory, 1000) == StopReason::MemoryFault);
+    REQUIRE(state.pc == 8);
+    REQUIRE(state.control(ControlRegister::FaultAddress) == 0x100000);
+    REQUIRE(state.retired == 2);
+
+    // A store that straddles the end of RAM changes nothing
+    state = CpuState{};
+    jit.clear();
+    load_program(memory, state, "li r1, 0xFFFF\nmovi r2, -1\nst r2, r1, 0\nmtoc r15, r1\n");
+    REQUIRE(jit.run(state, memory, 1000) == StopReason::MemoryFault);
+    REQUIRE(state.pc == 12);
+    REQUIRE(state.control(ControlRegister::FaultAddress) == ram_size - 1);
+    REQUIRE(state.retired == 3);
+    REQUIRE(memory.bytes()[ram_size - 1] == 0);
+
+    state = CpuState{};
+    jit.clear();
+    std::memset(memory.bytes().data(), 0xFF, 4);
+    REQUIRE(jit.run(state, memory, 1000) == StopReason::InvalidInstruction);
+    REQUIRE(state.pc == 0);
+    REQUIRE(state.retired == 0);
+}
+
+TEST_CASE("jit: a full code cache is flushed", "[stamina]") {
+    Memory memory{ram_size};
+    CpuState state;
+    load_program(memory, state, sum_program);
+    // Stopping every seven instructions compiles blocks at many entry points, more than fit in 640 bytes
+    x64::Jit jit{640};
+    REQUIRE(jit.valid());
+
+    StopReason reason;
+    size_t most_blocks = 0;
+    do {
+        reason = jit.run(state, memory, 7);
+        most_blocks = std::max(most_blocks, jit.block_count());
+    } while (reason == StopReason::BudgetExhausted);
+
+    REQUIRE(reason == StopReason::Halted);
+    REQUIRE(state.control(ControlRegister::Halt) == 5050);
+    REQUIRE(state.retired == 4 + 100 * 6 + 1);
+    REQUIRE(jit.block_count() < most_blocks);
+}
+
+TEST_CASE("jit: linked blocks stay out of the dispatcher", "[stamina]") {
+    const std::string call_program =
+        "    movi r1, 1000\n"
+        "    movi r2, 0\n"
+        "    li r3, function\n"
+        "    li r5, loop\n"
+        "loop:\n"
+        "    rcall r3\n"
+        "    addi r1, r1, -1\n"
+        "    cmpi/eq r1, 0\n"
+        "    pcaddi r4, 12\n"
+        "    mf r4, r5\n"
+        "    robra r4, r0\n"
+        "    mtoc r15, r2\n"
+        "function:\n"
+        "    push r1\n"
+        "    add r2, r2, r1\n"
+        "    pop r1\n"
+        "    ret\n";
+
+    for (const auto& source : {sum_program, call_program}) {
+        Memory reference_memory{ram_size};
+        CpuState reference;
+        load_program(reference_memory, reference, source);
+
+        Memory memory{ram_size};
+        CpuState state;
+        load_program(memory, state, source);
+        x64::Jit jit{1024 * 1024};
+
+        REQUIRE(interpret(reference, reference_memory, 1'000'000) == StopReason::Halted);
+        REQUIRE(jit.run(state, memory, 1'000'000) == StopReason::Halted);
+        REQUIRE(state.gpr == reference.gpr);
+        REQUIRE(state.retired == reference.retired);
+        REQUIRE(state.control(ControlRegister::Halt) == reference.control(ControlRegister::Halt));
+        // Once per block on first execution, and not again
+        REQUIRE(jit.dispatch_count() <= jit.block_count() + 1);
+    }
+}
+
+TEST_CASE("jit: invalidation unlinks blocks", "[stamina]") {
+    Memory memory{ram_size};
+    CpuState state;
+    load_program(memory, state,
+        "    movi r1, 1\n"
+        "    pcaddi r2, 8\n"
+        "    rbra r2\n"
+        "    movi r3, 7\n"
+        "    mtoc r15, r3\n"
+        "    movi r3, 9\n");
+    x64::Jit jit{1024 * 1024};
+
+    REQUIRE(jit.run(state, memory, 100) == StopReason::Halted);
+    REQUIRE(state.control(ControlRegister::Halt) == 7);
+
+    // Replace the first instruction at the target of the linked branch
+    std::memcpy(memory.bytes().data() + 12, memory.bytes().data() + 20, 4);
+    jit.invalidate(12, 4);
+    REQUIRE(jit.block_count() == 1);
+
+    state = CpuState{};
+    REQUIRE(jit.run(state, memory, 100) == StopReason::Halted);
+    REQUIRE(state.control(ControlRegister::Halt) == 9);
+}
+
+#if defined(STAMINA_HAS_FASTMEM)
+TEST_CASE("jit: code writes invalidate blocks", "[stamina]") {
+    // Patches a block that has already run, then the instruction after the store in its own block
+    const std::string source =
+        "    li r5, target\n"
+        "    rcall r5\n"
+        "    li r1, template\n"
+        "    ld r2, r1, 0\n"
+        "    st r2, r5, 0\n"
+        "    rcall r5\n"
+        "    li r1, template2\n"
+        "    ld r2, r1, 0\n"
+        "    pcaddi r6, 8\n"
+        "    st r2, r6, 0\n"
+        "    movi r4, 1\n"
+        "    add r3, r3, r4\n"
+        "    mtoc r15, r3\n"
+        "target:\n"
+        "    movi r3, 7\n"
+        "    ret\n"
+        "template:\n"
+        "    movi r3, 9\n"
+        "template2:\n"
+        "    movi r4, 2\n";
+
+    for (const x64::Tiering tiering : {x64::Tiering{}, x64::Tiering{1, 0}, x64::Tiering{0, 1}}) {
+        for (const u64 budget : {u64{1}, u64{7}, u64{1000}}) {
+            Memory memory{ram_size};
+            CpuState state;
+            load_program(memory, state, source);
+            x64::Jit jit{1024 * 1024, {}, tiering};
+            REQUIRE(jit.valid());
+
+            while (jit.run(state, memory, budget) == StopReason::BudgetExhausted) {
+            }
+            REQUIRE(state.control(ControlRegister::Halt) == 11);
+            REQUIRE(state.retired == 17);
+        }
+    }
+}
+
+TEST_CASE("jit: handler stores that write code leave the block", "[stamina]") {
+    // PUSH and STC patch the next instruction in their own block, then a block reached through a link
+    const auto same_block = [](const std::string& setup, const std::string& store) {
+        return "    li r1, template\n"
+               "    ld r2, r1, 0\n" +
+               setup + store +
+               "patch:\n"
+               "    movi r3, 7\n"
+               "patch_end:\n"
+               "    mtoc r15, r3\n"
+               "template:\n"
+               "    movi r3, 9\n";
+    };
+    const auto linked_block = [](const std::string& setup, const std::string& store) {
+        return "    li r5, patch\n"
+               "    rcall r5\n"
+               "    li r1, template\n"
+               "    ld r2, r1, 0\n" +
+               setup + store +
+               "    rcall r5\n"
+               "    mtoc r15, r3\n"
+               "patch:\n"
+               "    movi r3, 7\n"
+               "patch_end:\n"
+               "    ret\n"
+               "template:\n"
+               "    movi r3, 9\n";
+    };
+    const std::string push_setup = "    li r15, patch_end\n";
+    const std::string push = "    push r2\n";
+    const std::string stc_setup = "    li r6, patch\n    ldc r4, r6, 0\n";
+    const std::string stc = "    stc r2, r6, 0\n";
+
+    for (const auto& source : {same_block(push_setup, push), same_block(stc_setup, stc), linked_block(push_setup, push), linked_block(stc_setup, stc)}) {
+        for (const x64::Tiering tiering : {x64::Tiering{}, x64::Tiering{1, 0}, x64::Tiering{0, 1}}) {
+            Memory reference_memory{ram_size};
+            CpuState reference;
+            load_program(reference_memory, reference, source);
+            REQUIRE(interpret(reference, reference_memory, 1000) == StopReason::Halted);
+            REQUIRE(reference.control(ControlRegister::Halt) == 9);
+
+            Memory memory{ram_size};
+            CpuState state;
+            load_program(memory, state, source);
+            x64::Jit jit{1024 * 1024, {}, tiering};
+            REQUIRE(jit.valid());
+            REQUIRE(jit.run(state, memory, 1000) == StopReason::Halted);
+            REQUIRE(state.control(ControlRegister::Halt) == 9);
+            REQUIRE(state.retired == reference.retired);
+        }
+    }
+}
+#endif
+
+TEST_CASE("jit: tiered translation", "[stamina]") {
+    for (const x64::Tiering tiering : {x64::Tiering{10, 0}, x64::Tiering{10, 2}, x64::Tiering{0, 1}}) {
+        for (const auto& source : {mixed_program, sum_program}) {
+            for (const u64 budget : {u64{1}, u64{5}, u64{1000}}) {
+                Memory reference_memory{ram_size};
+                CpuState reference;
+                load_program(reference_memory, reference, source);
+
+                Memory memory{ram_size};
+                CpuState state;
+                load_program(memory, state, source);
+                x64::Jit jit{1024 * 1024, {}, tiering};
+                REQUIRE(jit.valid());
+
+                StopReason expected, actual;
+                do {
+                    expected = interpret(reference, reference_memory, budget);
+                    actual = jit.run(state, memory, budget);
+                    REQUIRE(actual == expected);
+                    REQUIRE(state.pc == reference.pc);
+                    REQUIRE(state.gpr == reference.gpr);
+                    REQUIRE(state.retired == reference.retired);
+                } while (expected == StopReason::BudgetExhausted);
+                REQUIRE(std::memcmp(memory.bytes().data(), reference_memory.bytes().data(), ram_size) == 0);
+            }
+        }
+    }
+
+    // Only the loop runs often enough to be translated
+    Memory memory{ram_size};
+    CpuState state;
+    load_program(memory, state, sum_program);
+    x64::Jit jit{1024 * 1024, {}, x64::Tiering{10, 0}};
+    REQUIRE(jit.run(state, memory, 1000) == StopReason::Halted);
+    REQUIRE(state.control(ControlRegister::Halt) == 5050);
+    REQUIRE(jit.block_count() == 1);
+    REQUIRE(jit.interpreted_count() == 1 + 10 + 1);
+}
+
+TEST_CASE("jit: background translations are dropped by invalidation", "[stamina]") {
+    Memory memory{ram_size};
+    CpuState state;
+    load_program(memory, state, sum_program);
+    x64::Jit jit{1024 * 1024, {}, x64::Tiering{0, 1}};
+
+    // The first block is queued for translation and interpreted meanwhile
+    REQUIRE(jit.run_block(state, memory, 1000) == StopReason::BudgetExhausted);
+    REQUIRE(jit.interpreted_count() == 1);
+    jit.invalidate(0, 4);
+    jit.finish_translations();
+    REQUIRE(jit.block_count() == 0);
+
+    const u32 loop_pc = state.pc;
+    REQUIRE(jit.run_block(state, memory, 1000) == StopReason::BudgetExhausted);
+    jit.finish_translations();
+    REQUIRE(jit.block_count() == 1);
+
+    // The translation is used from now on
+    REQUIRE(state.pc == loop_pc);
+    REQUIRE(jit.run(state, memory, 1000) == StopReason::Halted);
+    REQUIRE(state.control(ControlRegister::Halt) == 5050);
+    REQUIRE(jit.interpreted_count() == 3);
+}
+
+TEST_CASE("jit: background workers fill and flush the code cache", "[stamina]") {
+    Memory memory{ram_size};
+    CpuState state;
+    load_program(memory, state, sum_program);
+    x64::Jit jit{640, {}, x64::Tiering{0, 2}};
+    REQUIRE(jit.valid());
+
+    StopReason reason;
+    do {
+        reason = jit.run(state, memory, 7);
+        jit.finish_translations();
+    } while (reason == StopReason::BudgetExhausted);
+
+    REQUIRE(reason == StopReason::Halted);
+    REQUIRE(state.control(ControlRegister::Halt) == 5050);
+    REQUIRE(state.retired == 4 + 100 * 6 + 1);
+}
@@ -3,4 +3,5 @@
 // SPDX-License-Identifier: 0BSD
 
 #define CATCH_CONFIG_MAIN
+#define CATCH_CONFIG_NO_POSIX_SIGNALS
 #include <catch.hpp>